@@ -1,6 +1,7 @@
 #include <admin.h>
 #include <ctap.h>
 #include <fs.h>
+#include <latency.h>
 #include <oath.h>
 #include <openpgp.h>
 #include <pin.h>
@@ -11,11 +12,11 @@
 #define SN_FILE "sn"
 #define CFG_FILE "admin_cfg"
 
-static pin_t pin = {.min_length = 6, .max_length = PIN_MAX_LENGTH, .is_validated = 0, .path = "admin-pin"};
+static __card_local pin_t pin = {.min_length = 6, .max_length = PIN_MAX_LENGTH, .is_validated = 0, .path = "admin-pin"};
 
 static const admin_device_config_t default_cfg = {.led_normally_on = 1};
 
-static admin_device_config_t current_config;
+static __card_local admin_device_config_t current_config;
 
 __attribute__((weak)) int admin_vendor_specific(const CAPDU *capdu, RAPDU *rapdu) { return 0; }
 
@@ -93,6 +94,18 @@ static int admin_read_flash_cap(const CAPDU *capdu, RAPDU *rapdu) {
   return 0;
 }
 
+// The export may be longer than Le, the rest is fetched with GET RESPONSE
+static int admin_latency(const CAPDU *capdu, RAPDU *rapdu) {
+  if (P2 != 0x00) EXCEPT(SW_WRONG_P1P2);
+  if (P1 == ADMIN_P1_LATENCY_READ)
+    LL = latency_export(RDATA);
+  else if (P1 == ADMIN_P1_LATENCY_RESET)
+    latency_reset();
+  else
+    EXCEPT(SW_WRONG_P1P2);
+  return 0;
+}
+
 void fill_sn(uint8_t *buf) {
   int err = read_file(SN_FILE, buf, 0, 4);
   if (err != 4) memset(buf, 0, 4);
@@ -121,21 +134,29 @@ int admin_process_apdu(const CAPDU *capdu, RAPDU *rapdu) {
 #endif
 
   switch (INS) {
+#ifdef CANOKEY_WITH_FIDO
   case ADMIN_INS_WRITE_FIDO_PRIVATE_KEY:
     ret = ctap_install_private_key(capdu, rapdu);
     break;
   case ADMIN_INS_WRITE_FIDO_CERT:
     ret = ctap_install_cert(capdu, rapdu);
     break;
+#endif
+#ifdef CANOKEY_WITH_OPENPGP
   case ADMIN_INS_RESET_OPENPGP:
     ret = openpgp_install(1);
     break;
+#endif
+#ifdef CANOKEY_WITH_PIV
   case ADMIN_INS_RESET_PIV:
     ret = piv_install(1);
     break;
+#endif
+#ifdef CANOKEY_WITH_OATH
   case ADMIN_INS_RESET_OATH:
     ret = oath_install(1);
     break;
+#endif
   case ADMIN_INS_CHANGE_PIN:
     ret = admin_change_pin(capdu, rapdu);
     break;
@@ -148,6 +169,9 @@ int admin_process_apdu(const CAPDU *capdu, RAPDU *rapdu) {
   case ADMIN_INS_READ_FLASH_CAP:
     ret = admin_read_flash_cap(capdu, rapdu);
     break;
+  case ADMIN_INS_LATENCY:
+    ret = admin_latency(capdu, rapdu);
+    break;
   case ADMIN_INS_VENDOR_SPECIFIC:
     ret = admin_vendor_specific(capdu, rapdu);
     break;
@@ -2,6 +2,7 @@
 #include "cose-key.h"
 #include "ctap-errors.h"
 #include <cbor.h>
+#include <crypto_offload.h>
 #include <ctap.h>
 
 #define CHECK_PARSER_RET(ret)                                                                                          \
@@ -43,7 +44,7 @@ uint8_t parse_rp(uint8_t *rpIdHash, CborValue *val) {
       CHECK_CBOR_RET(ret);
       domain[DOMAIN_NAME_MAX_SIZE - 1] = 0;
       DBG_MSG("rpId: %s\n", domain);
-      sha256_raw((uint8_t *)domain, len, rpIdHash);
+      crypto_sha256_raw((uint8_t *)domain, len, rpIdHash);
     }
 
     ret = cbor_value_advance(&map);
@@ -589,7 +590,7 @@ uint8_t parse_get_assertion(CborParser *parser, CTAP_getAssertion *ga, const uin
       CHECK_CBOR_RET(ret);
       domain[DOMAIN_NAME_MAX_SIZE - 1] = 0;
       DBG_MSG("rpId: %s; hash: ", domain);
-      sha256_raw((uint8_t *)domain, len, ga->rpIdHash);
+      crypto_sha256_raw((uint8_t *)domain, len, ga->rpIdHash);
       PRINT_HEX(ga->rpIdHash, SHA256_DIGEST_LENGTH);
       ga->parsedParams |= PARAM_rpId;
       break;
@@ -4,17 +4,17 @@
 #include "ctap-parser.h"
 #include "secret.h"
 #include "u2f.h"
-#include <aes.h>
 #include <block-cipher.h>
 #include <cbor.h>
 #include <common.h>
+#include <crypto_offload.h>
 #include <ctap.h>
 #include <ctaphid.h>
 #include <device.h>
-#include <ecc.h>
-#include <hmac.h>
+#include <latency.h>
 #include <memzero.h>
 #include <rand.h>
+#include <scratch.h>
 
 #define CHECK_PARSER_RET(ret)                                                                                          \
   do {                                                                                                                 \
@@ -35,6 +35,16 @@
       *resp_len = 1;                                                                                                   \
   } while (0)
 
+// The encoding of a response is traced from its first item to the end of the command, whether it fails or not. The
+// signature and the file reads made in between show up nested in it.
+#define ENCODE_BEGIN()                                                                                                 \
+  do {                                                                                                                 \
+    if (!encoding) {                                                                                                   \
+      TRACE_BEGIN(CTAP_ENCODE);                                                                                        \
+      encoding = 1;                                                                                                    \
+    }                                                                                                                  \
+  } while (0)
+
 #ifdef TEST
 #define WAIT()                                                                                                         \
   do {                                                                                                                 \
@@ -56,20 +66,116 @@
   } while (0)
 #endif
 
-static const uint8_t aaguid[] = {0x24, 0x4e, 0xb2, 0x9e, 0xe0, 0x90, 0x4e, 0x49,
-                                 0x81, 0xfe, 0x1f, 0x20, 0xf8, 0xd3, 0xb8, 0xf4};
-// pin related
-static uint8_t key_agreement_pri_key[ECC_KEY_SIZE];
-static uint8_t pin_token[PIN_TOKEN_SIZE];
-static uint8_t consecutive_pin_counter;
-// assertion related
-static uint8_t credential_list[MAX_RK_NUM], credential_numbers, credential_idx, last_cmd;
+#define AAGUID 0x24, 0x4e, 0xb2, 0x9e, 0xe0, 0x90, 0x4e, 0x49, 0x81, 0xfe, 0x1f, 0x20, 0xf8, 0xd3, 0xb8, 0xf4
+static const uint8_t aaguid[] = {AAGUID};
+
+// Pre-encoded CBOR of the constant parts of the responses, copied by encode_template instead of being encoded item
+// by item. The varying values are encoded by tinycbor in between, or patched into a slot at the end of a template.
+// The lengths below 24 are encoded in the initial byte, 24 and 25 announce a length of 1 and 2 bytes that follows.
+#define CBOR_UINT16 0x19
+#define CBOR_NEGATIVE(n) (0x20 | (-1 - (n)))
+#define CBOR_BYTES(n) (0x40 | (n))
+#define CBOR_TEXT(n) (0x60 | (n))
+#define CBOR_ARRAY(n) (0x80 | (n))
+#define CBOR_MAP(n) (0xA0 | (n))
+#define CBOR_FALSE 0xF4
+#define CBOR_TRUE 0xF5
+
+_Static_assert(MAX_CTAP_BUFSIZE > 0xFF && MAX_CTAP_BUFSIZE <= 0xFFFF, "maxMsgSize is encoded in 2 bytes");
+
+// clang-format off
+// versions, extensions, aaguid and options, ending with the slot of clientPin
+static const uint8_t get_info_head[] = {
+    CBOR_MAP(6),
+    RESP_versions, CBOR_ARRAY(2),
+    CBOR_TEXT(8), 'F', 'I', 'D', 'O', '_', '2', '_', '0',
+    CBOR_TEXT(6), 'U', '2', 'F', '_', 'V', '2',
+    RESP_extensions, CBOR_ARRAY(1),
+    CBOR_TEXT(11), 'h', 'm', 'a', 'c', '-', 's', 'e', 'c', 'r', 'e', 't',
+    RESP_aaguid, CBOR_BYTES(16), AAGUID,
+    RESP_options, CBOR_MAP(1),
+    CBOR_TEXT(9), 'c', 'l', 'i', 'e', 'n', 't', 'P', 'i', 'n', CBOR_FALSE};
+// max message length and pin protocols
+static const uint8_t get_info_tail[] = {
+    RESP_maxMsgSize, CBOR_UINT16, HI(MAX_CTAP_BUFSIZE), LO(MAX_CTAP_BUFSIZE),
+    RESP_pinProtocols, CBOR_ARRAY(1), 1};
+static const uint8_t make_credential_fmt[] = {RESP_fmt, CBOR_TEXT(6), 'p', 'a', 'c', 'k', 'e', 'd'};
+// followed by the signature
+static const uint8_t make_credential_att_stmt[] = {
+    RESP_attStmt, CBOR_MAP(3),
+    CBOR_TEXT(3), 'a', 'l', 'g', CBOR_NEGATIVE(COSE_ALG_ES256),
+    CBOR_TEXT(3), 's', 'i', 'g'};
+// followed by the certificate, ending with the slot of its length
+static const uint8_t make_credential_x5c[] = {CBOR_TEXT(3), 'x', '5', 'c', CBOR_ARRAY(1), CBOR_BYTES(25), 0, 0};
+// followed by the credential id
+static const uint8_t get_assertion_credential_head[] = {RESP_credential, CBOR_MAP(2), CBOR_TEXT(2), 'i', 'd'};
+static const uint8_t get_assertion_credential_tail[] = {
+    CBOR_TEXT(4), 't', 'y', 'p', 'e',
+    CBOR_TEXT(10), 'p', 'u', 'b', 'l', 'i', 'c', '-', 'k', 'e', 'y'};
+// followed by the encrypted output
+static const uint8_t hmac_secret_extension[] = {
+    CBOR_MAP(1), CBOR_TEXT(11), 'h', 'm', 'a', 'c', '-', 's', 'e', 'c', 'r', 'e', 't'};
+// clang-format on
+
+// tinycbor has no API to write encoded bytes as they are. The three functions below are the only ones using the fields
+// of CborEncoder, whose meaning they rely on: the write position, the end of the buffer (NULL once it is exhausted) and
+// the number of items left in the container plus one.
+_Static_assert(TINYCBOR_VERSION_MAJOR == 0 && (TINYCBOR_VERSION_MINOR == 5 || TINYCBOR_VERSION_MINOR == 6),
+               "check encoder_position, encoder_room and encoder_advance against the CborEncoder of this tinycbor");
+
+static uint8_t *encoder_position(const CborEncoder *encoder) { return encoder->data.ptr; }
+
+static size_t encoder_room(const CborEncoder *encoder) {
+  return encoder->end == NULL ? 0 : (size_t)(encoder->end - encoder->data.ptr);
+}
 
-uint8_t ctap_install(uint8_t reset) {
-  consecutive_pin_counter = 3;
+// Take len bytes written at encoder_position, which add this many items to the container of encoder
+static void encoder_advance(CborEncoder *encoder, size_t len, size_t items) {
+  encoder->data.ptr += len;
+  encoder->remaining = encoder->remaining > items ? encoder->remaining - items : 0;
+}
+
+/**
+ * Copy a template into the response.
+ *
+ * @param items the number of items it adds to the container of encoder, as tinycbor counts them to close the container
+ */
+static CborError encode_template(CborEncoder *encoder, const uint8_t *template, size_t len, size_t items) {
+  if (encoder_room(encoder) < len) return CborErrorOutOfMemory;
+  memcpy(encoder_position(encoder), template, len);
+  encoder_advance(encoder, len, items);
+  return CborNoError;
+}
+
+// pin related
+static __card_local uint8_t key_agreement_pri_key[ECC_KEY_SIZE];
+static __card_local uint8_t pin_token[PIN_TOKEN_SIZE];
+static __card_local uint8_t consecutive_pin_counter;
+// assertion related, the state kept for GET NEXT ASSERTION lives in the persistent scratch region
+typedef struct {
+  CTAP_getAssertion ga;
+  uint8_t credential_list[MAX_RK_NUM];
+} CTAP_assertionState;
+static __card_local uint8_t credential_numbers, credential_idx, last_cmd;
+static __card_local uint8_t encoding; // see ENCODE_BEGIN
+
+void ctap_poweroff(void) {
   credential_numbers = 0;
   credential_idx = 0;
   last_cmd = 0xff;
+  scratch_release(APPLET_FIDO);
+}
+
+void ctap_reset_state(void) {
+  ctap_poweroff();
+  consecutive_pin_counter = 3;
+  memzero(key_agreement_pri_key, sizeof(key_agreement_pri_key));
+  memzero(pin_token, sizeof(pin_token));
+}
+
+uint8_t ctap_install(uint8_t reset) {
+  consecutive_pin_counter = 3;
+  ctap_poweroff();
   if (!reset && get_file_size(CTAP_CERT_FILE) >= 0) return 0;
   uint8_t kh_key[KH_KEY_SIZE] = {0};
   if (write_file(CTAP_CERT_FILE, NULL, 0, 0, 0) < 0) return CTAP2_ERR_UNHANDLED_REQUEST;
@@ -138,9 +244,9 @@ static void build_cose_key(uint8_t *data, uint8_t ecdh) {
 }
 
 static uint8_t get_shared_secret(uint8_t *pub_key) {
-  int ret = ecdh_decrypt(ECC_SECP256R1, key_agreement_pri_key, pub_key, pub_key);
+  int ret = crypto_ecdh_decrypt(ECC_SECP256R1, key_agreement_pri_key, pub_key, pub_key);
   if (ret < 0) return 1;
-  sha256_raw(pub_key, ECC_KEY_SIZE, pub_key);
+  crypto_sha256_raw(pub_key, ECC_KEY_SIZE, pub_key);
   return 0;
 }
 
@@ -199,12 +305,15 @@ static uint8_t ctap_make_credential(CborEncoder *encoder, uint8_t *params, size_
   CTAP_makeCredential mc;
   // CBOR of {"hmac-secret": true}
   const uint8_t hmacExt[] = {0xA1, 0x6B, 0x68, 0x6D, 0x61, 0x63, 0x2D, 0x73, 0x65, 0x63, 0x72, 0x65, 0x74, 0xF5};
+  TRACE_BEGIN(CTAP_PARSE);
   int ret = parse_make_credential(&parser, &mc, params, len);
+  TRACE_END(CTAP_PARSE);
   CHECK_PARSER_RET(ret);
 
   uint8_t data_buf[sizeof(CTAP_authData)];
   if (mc.excludeListSize > 0) {
     for (size_t i = 0; i < mc.excludeListSize; ++i) {
+      device_yield();
       uint8_t pri_key[ECC_KEY_SIZE];
       parse_credential_descriptor(&mc.excludeList, data_buf); // save credential id in data_buf
       CredentialId *kh = (CredentialId *)data_buf;
@@ -234,21 +343,20 @@ static uint8_t ctap_make_credential(CborEncoder *encoder, uint8_t *params, size_
         return CTAP2_ERR_PIN_NOT_SET;
     }
     if ((mc.parsedParams & PARAM_pinProtocol) == 0) return CTAP2_ERR_PIN_AUTH_INVALID;
-    hmac_sha256(pin_token, PIN_TOKEN_SIZE, mc.clientDataHash, sizeof(mc.clientDataHash), params);
+    crypto_hmac_sha256(pin_token, PIN_TOKEN_SIZE, mc.clientDataHash, sizeof(mc.clientDataHash), params);
     if (memcmp(params, mc.pinAuth, PIN_AUTH_SIZE) != 0) return CTAP2_ERR_PIN_AUTH_INVALID;
   }
 
   WAIT();
 
   // build response
+  ENCODE_BEGIN();
   CborEncoder map;
   ret = cbor_encoder_create_map(encoder, &map, 3);
   CHECK_CBOR_RET(ret);
 
   // fmt
-  ret = cbor_encode_int(&map, RESP_fmt);
-  CHECK_CBOR_RET(ret);
-  ret = cbor_encode_text_stringz(&map, "packed");
+  ret = encode_template(&map, make_credential_fmt, sizeof(make_credential_fmt), 2);
   CHECK_CBOR_RET(ret);
 
   // auth data
@@ -268,6 +376,7 @@ static uint8_t ctap_make_credential(CborEncoder *encoder, uint8_t *params, size_
     if (size < 0) return CTAP2_ERR_UNHANDLED_REQUEST;
     size_t nRk = size / sizeof(CTAP_residentKey), i;
     for (i = 0; i != nRk; ++i) {
+      device_yield();
       size = read_file(RK_FILE, &rk, i * sizeof(CTAP_residentKey), sizeof(CTAP_residentKey));
       if (size < 0) return CTAP2_ERR_UNHANDLED_REQUEST;
       if (memcmp(mc.rpIdHash, rk.credential_id.rpIdHash, SHA256_DIGEST_LENGTH) == 0 &&
@@ -288,53 +397,34 @@ static uint8_t ctap_make_credential(CborEncoder *encoder, uint8_t *params, size_
   //   sig: bytes (ASN.1),
   //   x5c: [ attestnCert: bytes, * (caCert: bytes) ]
   // }
-  ret = cbor_encode_int(&map, RESP_attStmt);
-  CHECK_CBOR_RET(ret);
-  CborEncoder att_map;
-  ret = cbor_encoder_create_map(&map, &att_map, 3);
+  // the key and the map of the statement count as one item, the signature as the other
+  ret = encode_template(&map, make_credential_att_stmt, sizeof(make_credential_att_stmt), 1);
   CHECK_CBOR_RET(ret);
   {
-    // alg (ECC secp256r1)
-    ret = cbor_encode_text_stringz(&att_map, "alg");
-    CHECK_CBOR_RET(ret);
-    ret = cbor_encode_int(&att_map, COSE_ALG_ES256);
-    CHECK_CBOR_RET(ret);
-
     // sig (asn.1)
-    ret = cbor_encode_text_stringz(&att_map, "sig");
-    CHECK_CBOR_RET(ret);
-    sha256_init();
-    sha256_update(data_buf, len);
-    sha256_update(mc.clientDataHash, sizeof(mc.clientDataHash));
-    sha256_final(data_buf);
+    crypto_sha256_init();
+    crypto_sha256_update(data_buf, len);
+    crypto_sha256_update(mc.clientDataHash, sizeof(mc.clientDataHash));
+    crypto_sha256_final(data_buf);
     len = sign_with_device_key(data_buf, data_buf);
-    ret = cbor_encode_byte_string(&att_map, data_buf, len);
+    ret = cbor_encode_byte_string(&map, data_buf, len);
     CHECK_CBOR_RET(ret);
 
     // cert (is an array)
-    ret = cbor_encode_text_stringz(&att_map, "x5c");
-    CHECK_CBOR_RET(ret);
-    CborEncoder x5carr;
-    ret = cbor_encoder_create_array(&att_map, &x5carr, 1);
-    CHECK_CBOR_RET(ret);
-    {
-      // to save RAM, generate an empty cert first, then fill it manually
-      ret = cbor_encode_byte_string(&x5carr, NULL, 0);
-      CHECK_CBOR_RET(ret);
-      uint8_t *ptr = x5carr.data.ptr - 1;
-      ret = get_cert(ptr + 3);
-      if (ret < 0) return CTAP2_ERR_UNHANDLED_REQUEST;
-      *ptr++ = 0x59;
-      *ptr++ = HI(ret);
-      *ptr++ = LO(ret);
-      x5carr.data.ptr = ptr + ret;
-    }
-    ret = cbor_encoder_close_container(&att_map, &x5carr);
+    ret = encode_template(&map, make_credential_x5c, sizeof(make_credential_x5c), 0);
     CHECK_CBOR_RET(ret);
+    // to save RAM, read the cert into the response, then fill its length
+    ret = get_file_size(CTAP_CERT_FILE);
+    if (ret < 0) return CTAP2_ERR_UNHANDLED_REQUEST;
+    if (encoder_room(&map) < (size_t)ret) return CTAP2_ERR_INVALID_CBOR;
+    uint8_t *cert = encoder_position(&map);
+    ret = get_cert(cert);
+    if (ret < 0) return CTAP2_ERR_UNHANDLED_REQUEST;
+    cert[-2] = HI(ret);
+    cert[-1] = LO(ret);
+    encoder_advance(&map, ret, 0);
     // att done
   }
-  ret = cbor_encoder_close_container(&map, &att_map);
-  CHECK_CBOR_RET(ret);
 
   ret = cbor_encoder_close_container(encoder, &map);
   CHECK_CBOR_RET(ret);
@@ -343,47 +433,56 @@ static uint8_t ctap_make_credential(CborEncoder *encoder, uint8_t *params, size_
 }
 
 static uint8_t ctap_get_assertion(CborEncoder *encoder, uint8_t *params, size_t len) {
-  static CTAP_getAssertion ga;
   CborParser parser;
   int ret;
   uint8_t pinAuth[SHA256_DIGEST_LENGTH];
+  CTAP_assertionState *state;
   if (credential_idx == 0) {
-    ret = parse_get_assertion(&parser, &ga, params, len);
+    state = scratch_persist(APPLET_FIDO, sizeof(CTAP_assertionState));
+    if (state == NULL) return CTAP2_ERR_UNHANDLED_REQUEST;
+    TRACE_BEGIN(CTAP_PARSE);
+    ret = parse_get_assertion(&parser, &state->ga, params, len);
+    TRACE_END(CTAP_PARSE);
     CHECK_PARSER_RET(ret);
+  } else {
+    state = scratch_persisted(APPLET_FIDO);
+    if (state == NULL) return CTAP2_ERR_NOT_ALLOWED;
   }
+  CTAP_getAssertion *ga = &state->ga;
 
-  if (ga.parsedParams & PARAM_pinAuth) {
-    if (ga.pinAuthLength == 0) {
+  if (ga->parsedParams & PARAM_pinAuth) {
+    if (ga->pinAuthLength == 0) {
       WAIT();
       if (has_pin())
         return CTAP2_ERR_PIN_INVALID;
       else
         return CTAP2_ERR_PIN_NOT_SET;
     }
-    if ((ga.parsedParams & PARAM_pinProtocol) == 0) return CTAP2_ERR_PIN_AUTH_INVALID;
-    hmac_sha256(pin_token, PIN_TOKEN_SIZE, ga.clientDataHash, sizeof(ga.clientDataHash), pinAuth);
+    if ((ga->parsedParams & PARAM_pinProtocol) == 0) return CTAP2_ERR_PIN_AUTH_INVALID;
+    crypto_hmac_sha256(pin_token, PIN_TOKEN_SIZE, ga->clientDataHash, sizeof(ga->clientDataHash), pinAuth);
 #ifndef FUZZ
-    if (memcmp(pinAuth, ga.pinAuth, PIN_AUTH_SIZE) != 0) return CTAP2_ERR_PIN_AUTH_INVALID;
+    if (memcmp(pinAuth, ga->pinAuth, PIN_AUTH_SIZE) != 0) return CTAP2_ERR_PIN_AUTH_INVALID;
 #endif
   }
 
   uint8_t data_buf[sizeof(CTAP_authData)], pri_key[ECC_KEY_SIZE];
   CTAP_residentKey rk;
-  if (ga.allowListSize > 0) {
+  if (ga->allowListSize > 0) {
     size_t i;
-    for (i = 0; i < ga.allowListSize; ++i) {
-      parse_credential_descriptor(&ga.allowList, (uint8_t *)&rk.credential_id);
+    for (i = 0; i < ga->allowListSize; ++i) {
+      device_yield();
+      parse_credential_descriptor(&ga->allowList, (uint8_t *)&rk.credential_id);
       // compare rpId first
-      if (memcmp(rk.credential_id.rpIdHash, ga.rpIdHash, sizeof(rk.credential_id.rpIdHash)) != 0) goto next;
+      if (memcmp(rk.credential_id.rpIdHash, ga->rpIdHash, sizeof(rk.credential_id.rpIdHash)) != 0) goto next;
       // then verify key handle and get private key
       int err = verify_key_handle(&rk.credential_id, pri_key);
       if (err < 0) return CTAP2_ERR_UNHANDLED_REQUEST;
       if (err == 0) break; // only process one support credential
     next:
-      ret = cbor_value_advance(&ga.allowList);
+      ret = cbor_value_advance(&ga->allowList);
       CHECK_CBOR_RET(ret);
     }
-    if (i == ga.allowListSize) return CTAP2_ERR_NO_CREDENTIALS;
+    if (i == ga->allowListSize) return CTAP2_ERR_NO_CREDENTIALS;
   } else {
     int size;
     if (credential_idx == 0) {
@@ -392,16 +491,17 @@ static uint8_t ctap_get_assertion(CborEncoder *encoder, uint8_t *params, size_t
       size_t nRk = size / sizeof(CTAP_residentKey);
       credential_numbers = 0;
       for (size_t i = 0; i != nRk; ++i) {
+        device_yield();
         size = read_file(RK_FILE, &rk, i * sizeof(CTAP_residentKey), sizeof(CTAP_residentKey));
         if (size < 0) return CTAP2_ERR_UNHANDLED_REQUEST;
-        if (memcmp(ga.rpIdHash, rk.credential_id.rpIdHash, SHA256_DIGEST_LENGTH) == 0)
-          credential_list[credential_numbers++] = i;
+        if (memcmp(ga->rpIdHash, rk.credential_id.rpIdHash, SHA256_DIGEST_LENGTH) == 0)
+          state->credential_list[credential_numbers++] = i;
       }
       if (credential_numbers == 0) return CTAP2_ERR_NO_CREDENTIALS;
     }
     // fetch rk and get private key
-    size =
-        read_file(RK_FILE, &rk, credential_list[credential_idx] * sizeof(CTAP_residentKey), sizeof(CTAP_residentKey));
+    size = read_file(RK_FILE, &rk, state->credential_list[credential_idx] * sizeof(CTAP_residentKey),
+                     sizeof(CTAP_residentKey));
     if (size < 0) return CTAP2_ERR_UNHANDLED_REQUEST;
     int err = verify_key_handle(&rk.credential_id, pri_key);
     if (err != 0) return CTAP2_ERR_UNHANDLED_REQUEST;
@@ -409,47 +509,44 @@ static uint8_t ctap_get_assertion(CborEncoder *encoder, uint8_t *params, size_t
 
   uint8_t extensionBuffer[79], extensionSize = 0;
   uint8_t iv[16] = {0};
-  block_cipher_config cfg = {.block_size = 16, .mode = CBC, .iv = iv, .encrypt = aes256_enc, .decrypt = aes256_dec};
-  if (ga.parsedParams & PARAM_hmacSecret) {
-    ret = get_shared_secret(ga.hmacSecretKeyAgreement);
+  block_cipher_config cfg = {
+      .block_size = 16, .mode = CBC, .iv = iv, .encrypt = crypto_aes256_enc, .decrypt = crypto_aes256_dec};
+  if (ga->parsedParams & PARAM_hmacSecret) {
+    ret = get_shared_secret(ga->hmacSecretKeyAgreement);
     CHECK_PARSER_RET(ret);
     uint8_t hmac_buf[SHA256_DIGEST_LENGTH];
-    hmac_sha256(ga.hmacSecretKeyAgreement, SHARED_SECRET_SIZE, ga.hmacSecretSaltEnc, ga.hmacSecretSaltLen, hmac_buf);
-    if (memcmp(hmac_buf, ga.hmacSecretSaltAuth, HMAC_SECRET_SALT_AUTH_SIZE) != 0) return CTAP2_ERR_EXTENSION_FIRST;
-    cfg.key = ga.hmacSecretKeyAgreement;
-    cfg.in_size = ga.hmacSecretSaltLen;
-    cfg.in = ga.hmacSecretSaltEnc;
-    cfg.out = ga.hmacSecretSaltEnc;
+    crypto_hmac_sha256(ga->hmacSecretKeyAgreement, SHARED_SECRET_SIZE, ga->hmacSecretSaltEnc, ga->hmacSecretSaltLen,
+                       hmac_buf);
+    if (memcmp(hmac_buf, ga->hmacSecretSaltAuth, HMAC_SECRET_SALT_AUTH_SIZE) != 0) return CTAP2_ERR_EXTENSION_FIRST;
+    cfg.key = ga->hmacSecretKeyAgreement;
+    cfg.in_size = ga->hmacSecretSaltLen;
+    cfg.in = ga->hmacSecretSaltEnc;
+    cfg.out = ga->hmacSecretSaltEnc;
     block_cipher_dec(&cfg);
   }
 
-  if (ga.uv) return CTAP2_ERR_UNSUPPORTED_OPTION;
-  if (ga.up) WAIT();
+  if (ga->uv) return CTAP2_ERR_UNSUPPORTED_OPTION;
+  if (ga->up) WAIT();
 
-  if (ga.parsedParams & PARAM_hmacSecret) {
-    ret = make_hmac_secret_output(rk.credential_id.nonce, ga.hmacSecretSaltEnc, ga.hmacSecretSaltLen,
-                                  ga.hmacSecretSaltEnc);
+  if (ga->parsedParams & PARAM_hmacSecret) {
+    ret = make_hmac_secret_output(rk.credential_id.nonce, ga->hmacSecretSaltEnc, ga->hmacSecretSaltLen,
+                                  ga->hmacSecretSaltEnc);
     if (ret) return ret;
     DBG_MSG("hmac-secret(plain): ");
-    PRINT_HEX(ga.hmacSecretSaltEnc, ga.hmacSecretSaltLen);
-    cfg.key = ga.hmacSecretKeyAgreement;
-    cfg.in_size = ga.hmacSecretSaltLen;
-    cfg.in = ga.hmacSecretSaltEnc;
-    cfg.out = ga.hmacSecretSaltEnc;
+    PRINT_HEX(ga->hmacSecretSaltEnc, ga->hmacSecretSaltLen);
+    cfg.key = ga->hmacSecretKeyAgreement;
+    cfg.in_size = ga->hmacSecretSaltLen;
+    cfg.in = ga->hmacSecretSaltEnc;
+    cfg.out = ga->hmacSecretSaltEnc;
     block_cipher_enc(&cfg);
-    memzero(ga.hmacSecretKeyAgreement, sizeof(ga.hmacSecretKeyAgreement));
+    memzero(ga->hmacSecretKeyAgreement, sizeof(ga->hmacSecretKeyAgreement));
 
     CborEncoder extensionEncoder;
-    CborEncoder map;
     // build extensions
     cbor_encoder_init(&extensionEncoder, extensionBuffer, sizeof(extensionBuffer), 0);
-    ret = cbor_encoder_create_map(&extensionEncoder, &map, 1);
+    ret = encode_template(&extensionEncoder, hmac_secret_extension, sizeof(hmac_secret_extension), 1);
     CHECK_CBOR_RET(ret);
-    ret = cbor_encode_text_stringz(&map, "hmac-secret");
-    CHECK_CBOR_RET(ret);
-    ret = cbor_encode_byte_string(&map, ga.hmacSecretSaltEnc, ga.hmacSecretSaltLen);
-    CHECK_CBOR_RET(ret);
-    ret = cbor_encoder_close_container(&extensionEncoder, &map);
+    ret = cbor_encode_byte_string(&extensionEncoder, ga->hmacSecretSaltEnc, ga->hmacSecretSaltLen);
     CHECK_CBOR_RET(ret);
 
     extensionSize = cbor_encoder_get_buffer_size(&extensionEncoder, extensionBuffer);
@@ -457,34 +554,27 @@ static uint8_t ctap_get_assertion(CborEncoder *encoder, uint8_t *params, size_t
   }
 
   // build response
+  ENCODE_BEGIN();
   CborEncoder map, sub_map;
   uint8_t map_items = 3;
-  if (ga.allowListSize == 0) ++map_items;
+  if (ga->allowListSize == 0) ++map_items;
   if (credential_idx == 0 && credential_numbers > 1) ++map_items;
   ret = cbor_encoder_create_map(encoder, &map, map_items);
   CHECK_CBOR_RET(ret);
 
-  // build credential id
-  ret = cbor_encode_int(&map, RESP_credential);
-  CHECK_CBOR_RET(ret);
-  ret = cbor_encoder_create_map(&map, &sub_map, 2);
-  CHECK_CBOR_RET(ret);
-  ret = cbor_encode_text_stringz(&sub_map, "id");
-  CHECK_CBOR_RET(ret);
-  ret = cbor_encode_byte_string(&sub_map, (const uint8_t *)&rk.credential_id, sizeof(CredentialId));
+  // build credential id, the key and the descriptor count as one item, the id as the other
+  ret = encode_template(&map, get_assertion_credential_head, sizeof(get_assertion_credential_head), 1);
   CHECK_CBOR_RET(ret);
-  ret = cbor_encode_text_stringz(&sub_map, "type");
+  ret = cbor_encode_byte_string(&map, (const uint8_t *)&rk.credential_id, sizeof(CredentialId));
   CHECK_CBOR_RET(ret);
-  ret = cbor_encode_text_stringz(&sub_map, "public-key");
-  CHECK_CBOR_RET(ret);
-  ret = cbor_encoder_close_container(&map, &sub_map);
+  ret = encode_template(&map, get_assertion_credential_tail, sizeof(get_assertion_credential_tail), 0);
   CHECK_CBOR_RET(ret);
 
   // auth data
   len = sizeof(data_buf);
-  uint8_t flags = ((ga.parsedParams & PARAM_hmacSecret) ? FLAGS_ED : 0) |
-                  (has_pin() && (ga.parsedParams & PARAM_pinAuth) > 0 ? FLAGS_UV : 0) | (ga.up ? FLAGS_UP : 0);
-  ret = ctap_make_auth_data(ga.rpIdHash, data_buf, flags, extensionSize, extensionBuffer, &len);
+  uint8_t flags = ((ga->parsedParams & PARAM_hmacSecret) ? FLAGS_ED : 0) |
+                  (has_pin() && (ga->parsedParams & PARAM_pinAuth) > 0 ? FLAGS_UV : 0) | (ga->up ? FLAGS_UP : 0);
+  ret = ctap_make_auth_data(ga->rpIdHash, data_buf, flags, extensionSize, extensionBuffer, &len);
   if (ret != 0) return ret;
   ret = cbor_encode_int(&map, RESP_authData);
   CHECK_CBOR_RET(ret);
@@ -494,16 +584,16 @@ static uint8_t ctap_get_assertion(CborEncoder *encoder, uint8_t *params, size_t
   // signature
   ret = cbor_encode_int(&map, RESP_signature);
   CHECK_CBOR_RET(ret);
-  sha256_init();
-  sha256_update(data_buf, len);
-  sha256_update(ga.clientDataHash, sizeof(ga.clientDataHash));
-  sha256_final(data_buf);
+  crypto_sha256_init();
+  crypto_sha256_update(data_buf, len);
+  crypto_sha256_update(ga->clientDataHash, sizeof(ga->clientDataHash));
+  crypto_sha256_final(data_buf);
   len = sign_with_private_key(pri_key, data_buf, data_buf);
   ret = cbor_encode_byte_string(&map, data_buf, len);
   CHECK_CBOR_RET(ret);
 
   // user
-  if (ga.allowListSize == 0) {
+  if (ga->allowListSize == 0) {
     ret = cbor_encode_int(&map, RESP_publicKeyCredentialUserEntity);
     CHECK_CBOR_RET(ret);
     ret = cbor_encoder_create_map(&map, &sub_map, credential_numbers > 1 ? 4 : 1);
@@ -542,6 +632,8 @@ static uint8_t ctap_get_assertion(CborEncoder *encoder, uint8_t *params, size_t
 
   memzero(pri_key, sizeof(pri_key));
   ++credential_idx;
+  // the allow list refers to the request, only the resident keys are iterated by GET NEXT ASSERTION
+  if (ga->allowListSize > 0 || credential_idx >= credential_numbers) scratch_release(APPLET_FIDO);
 
   return 0;
 }
@@ -555,75 +647,11 @@ static uint8_t ctap_get_next_assertion(CborEncoder *encoder) {
 static uint8_t ctap_get_info(CborEncoder *encoder) {
   // https://fidoalliance.org/specs/fido-v2.0-ps-20190130/fido-client-to-authenticator-protocol-v2.0-ps-20190130.html#authenticatorGetInfo
   // Currently, we respond versions, aaguid, pin protocol.
-  CborEncoder map;
-  int ret = cbor_encoder_create_map(encoder, &map, 6);
-  CHECK_CBOR_RET(ret);
-
-  // versions
-  ret = cbor_encode_int(&map, RESP_versions);
-  CHECK_CBOR_RET(ret);
-  CborEncoder array;
-  ret = cbor_encoder_create_array(&map, &array, 2);
-  CHECK_CBOR_RET(ret);
-  {
-    ret = cbor_encode_text_stringz(&array, "FIDO_2_0");
-    CHECK_CBOR_RET(ret);
-    ret = cbor_encode_text_stringz(&array, "U2F_V2");
-    CHECK_CBOR_RET(ret);
-  }
-  ret = cbor_encoder_close_container(&map, &array);
+  ENCODE_BEGIN();
+  int ret = encode_template(encoder, get_info_head, sizeof(get_info_head), 1);
   CHECK_CBOR_RET(ret);
-
-  // extensions
-  ret = cbor_encode_int(&map, RESP_extensions);
-  CHECK_CBOR_RET(ret);
-  ret = cbor_encoder_create_array(&map, &array, 1);
-  CHECK_CBOR_RET(ret);
-  {
-    ret = cbor_encode_text_stringz(&array, "hmac-secret");
-    CHECK_CBOR_RET(ret);
-  }
-  ret = cbor_encoder_close_container(&map, &array);
-  CHECK_CBOR_RET(ret);
-
-  // aaguid
-  ret = cbor_encode_int(&map, RESP_aaguid);
-  CHECK_CBOR_RET(ret);
-  ret = cbor_encode_byte_string(&map, aaguid, sizeof(aaguid));
-  CHECK_CBOR_RET(ret);
-
-  // options
-  ret = cbor_encode_int(&map, RESP_options);
-  CHECK_CBOR_RET(ret);
-  CborEncoder option_map;
-  ret = cbor_encoder_create_map(&map, &option_map, 1);
-  CHECK_CBOR_RET(ret);
-  ret = cbor_encode_text_stringz(&option_map, "clientPin");
-  CHECK_CBOR_RET(ret);
-  ret = cbor_encode_boolean(&option_map, has_pin() > 0);
-  CHECK_CBOR_RET(ret);
-  ret = cbor_encoder_close_container(&map, &option_map);
-  CHECK_CBOR_RET(ret);
-
-  // max message length
-  ret = cbor_encode_int(&map, RESP_maxMsgSize);
-  CHECK_CBOR_RET(ret);
-  ret = cbor_encode_int(&map, MAX_CTAP_BUFSIZE);
-  CHECK_CBOR_RET(ret);
-
-  // pin protocol
-  ret = cbor_encode_int(&map, RESP_pinProtocols);
-  CHECK_CBOR_RET(ret);
-  ret = cbor_encoder_create_array(&map, &array, 1);
-  CHECK_CBOR_RET(ret);
-  {
-    ret = cbor_encode_int(&array, 1);
-    CHECK_CBOR_RET(ret);
-  }
-  ret = cbor_encoder_close_container(&map, &array);
-  CHECK_CBOR_RET(ret);
-
-  ret = cbor_encoder_close_container(encoder, &map);
+  encoder_position(encoder)[-1] = has_pin() > 0 ? CBOR_TRUE : CBOR_FALSE;
+  ret = encode_template(encoder, get_info_tail, sizeof(get_info_tail), 0);
   CHECK_CBOR_RET(ret);
   return 0;
 }
@@ -631,17 +659,21 @@ static uint8_t ctap_get_info(CborEncoder *encoder) {
 static uint8_t ctap_client_pin(CborEncoder *encoder, const uint8_t *params, size_t len) {
   CborParser parser;
   CTAP_clientPin cp;
+  TRACE_BEGIN(CTAP_PARSE);
   int ret = parse_client_pin(&parser, &cp, params, len);
+  TRACE_END(CTAP_PARSE);
   CHECK_PARSER_RET(ret);
 
   CborEncoder map, key_map;
   uint8_t iv[16], hmac_buf[80], i;
   memzero(iv, sizeof(iv));
-  block_cipher_config cfg = {.block_size = 16, .mode = CBC, .iv = iv, .encrypt = aes256_enc, .decrypt = aes256_dec};
+  block_cipher_config cfg = {
+      .block_size = 16, .mode = CBC, .iv = iv, .encrypt = crypto_aes256_enc, .decrypt = crypto_aes256_dec};
   uint8_t *ptr;
   int err, retries = 0;
   switch (cp.subCommand) {
   case CP_cmdGetRetries:
+    ENCODE_BEGIN();
     ret = cbor_encoder_create_map(encoder, &map, 1);
     CHECK_CBOR_RET(ret);
     ret = cbor_encode_int(&map, RESP_retries);
@@ -653,6 +685,7 @@ static uint8_t ctap_client_pin(CborEncoder *encoder, const uint8_t *params, size
     break;
 
   case CP_cmdGetKeyAgreement:
+    ENCODE_BEGIN();
     ret = cbor_encoder_create_map(encoder, &map, 1);
     CHECK_CBOR_RET(ret);
     ret = cbor_encode_int(&map, RESP_keyAgreement);
@@ -660,11 +693,12 @@ static uint8_t ctap_client_pin(CborEncoder *encoder, const uint8_t *params, size
     // to save RAM, generate an empty key first, then fill it manually
     ret = cbor_encoder_create_map(&map, &key_map, 0);
     CHECK_CBOR_RET(ret);
-    ptr = key_map.data.ptr - 1;
-    ret = ecc_generate(ECC_SECP256R1, key_agreement_pri_key, ptr);
+    if (encoder_room(&key_map) < MAX_COSE_KEY_SIZE - 1) return CTAP2_ERR_INVALID_CBOR;
+    ptr = encoder_position(&key_map) - 1;
+    ret = crypto_ecc_generate(ECC_SECP256R1, key_agreement_pri_key, ptr);
     if (ret < 0) return CTAP2_ERR_UNHANDLED_REQUEST;
     build_cose_key(ptr, 1);
-    key_map.data.ptr = ptr + MAX_COSE_KEY_SIZE;
+    encoder_advance(&key_map, MAX_COSE_KEY_SIZE - 1, 0);
     ret = cbor_encoder_close_container(&map, &key_map);
     CHECK_CBOR_RET(ret);
     ret = cbor_encoder_close_container(encoder, &map);
@@ -677,7 +711,7 @@ static uint8_t ctap_client_pin(CborEncoder *encoder, const uint8_t *params, size
     if (err > 0) return CTAP2_ERR_PIN_AUTH_INVALID;
     ret = get_shared_secret(cp.keyAgreement);
     CHECK_PARSER_RET(ret);
-    hmac_sha256(cp.keyAgreement, SHARED_SECRET_SIZE, cp.newPinEnc, sizeof(cp.newPinEnc), hmac_buf);
+    crypto_hmac_sha256(cp.keyAgreement, SHARED_SECRET_SIZE, cp.newPinEnc, sizeof(cp.newPinEnc), hmac_buf);
 #ifndef FUZZ
     if (memcmp(hmac_buf, cp.pinAuth, PIN_AUTH_SIZE) != 0) return CTAP2_ERR_PIN_AUTH_INVALID;
 #endif
@@ -708,7 +742,8 @@ static uint8_t ctap_client_pin(CborEncoder *encoder, const uint8_t *params, size
     CHECK_PARSER_RET(ret);
     memcpy(hmac_buf, cp.newPinEnc, sizeof(cp.newPinEnc));
     memcpy(hmac_buf + sizeof(cp.newPinEnc), cp.pinHashEnc, sizeof(cp.pinHashEnc));
-    hmac_sha256(cp.keyAgreement, SHARED_SECRET_SIZE, hmac_buf, sizeof(cp.newPinEnc) + sizeof(cp.pinHashEnc), hmac_buf);
+    crypto_hmac_sha256(cp.keyAgreement, SHARED_SECRET_SIZE, hmac_buf, sizeof(cp.newPinEnc) + sizeof(cp.pinHashEnc),
+                       hmac_buf);
 #ifndef FUZZ
     if (memcmp(hmac_buf, cp.pinAuth, PIN_AUTH_SIZE) != 0) return CTAP2_ERR_PIN_AUTH_INVALID;
 #endif
@@ -780,6 +815,7 @@ static uint8_t ctap_client_pin(CborEncoder *encoder, const uint8_t *params, size
     cfg.in = pin_token;
     cfg.out = hmac_buf;
     block_cipher_enc(&cfg);
+    ENCODE_BEGIN();
     ret = cbor_encoder_create_map(encoder, &map, 1);
     CHECK_CBOR_RET(ret);
     ret = cbor_encode_int(&map, RESP_pinToken);
@@ -796,10 +832,15 @@ static uint8_t ctap_client_pin(CborEncoder *encoder, const uint8_t *params, size
 
 int ctap_process_cbor(uint8_t *req, size_t req_len, uint8_t *resp, size_t *resp_len) {
   if (req_len-- == 0) return -1;
+  uint32_t start = device_get_tick();
+  TRACE_BEGIN(CTAP_CBOR);
   CborEncoder encoder;
   cbor_encoder_init(&encoder, resp + 1, *resp_len - 1, 0);
 
   uint8_t cmd = *req++;
+  size_t mark = scratch_begin();
+  // only GET NEXT ASSERTION continues from the previous command
+  if (cmd != CTAP_GET_NEXT_ASSERTION) scratch_release(APPLET_FIDO);
   switch (cmd) {
   case CTAP_MAKE_CREDENTIAL:
     DBG_MSG("-----------------MC-------------------\n");
@@ -837,7 +878,14 @@ int ctap_process_cbor(uint8_t *req, size_t req_len, uint8_t *resp, size_t *resp_
     *resp_len = 1;
     break;
   }
+  scratch_end(mark);
   last_cmd = cmd;
+  if (encoding) {
+    TRACE_END(CTAP_ENCODE);
+    encoding = 0;
+  }
+  TRACE_END(CTAP_CBOR);
+  latency_record(LATENCY_APPLET_CTAP2, cmd, device_get_tick() - start);
   return 0;
 }
 
@@ -1,8 +1,7 @@
 #include "secret.h"
 #include <apdu.h>
-#include <ecc.h>
+#include <crypto_offload.h>
 #include <fs.h>
-#include <hmac.h>
 #include <memzero.h>
 #include <rand.h>
 
@@ -38,12 +37,17 @@ int generate_key_handle(CredentialId *kh, uint8_t *pubkey) {
   if (ret < 0) return ret;
   do {
     random_buffer(kh->nonce, sizeof(kh->nonce));
+    TRACE_BEGIN(HMAC_SHA256);
     // private key = hmac-sha256(device private key, nonce), stored in pubkey[0:32)
-    hmac_sha256(pubkey, KH_KEY_SIZE, kh->nonce, sizeof(kh->nonce), pubkey);
+    crypto_hmac_sha256(pubkey, KH_KEY_SIZE, kh->nonce, sizeof(kh->nonce), pubkey);
     // tag = left(hmac-sha256(private key, rpIdHash or appid), 16), stored in pubkey[32, 64)
-    hmac_sha256(pubkey, KH_KEY_SIZE, kh->rpIdHash, sizeof(kh->rpIdHash), pubkey + KH_KEY_SIZE);
+    crypto_hmac_sha256(pubkey, KH_KEY_SIZE, kh->rpIdHash, sizeof(kh->rpIdHash), pubkey + KH_KEY_SIZE);
+    TRACE_END(HMAC_SHA256);
     memcpy(kh->tag, pubkey + KH_KEY_SIZE, sizeof(kh->tag));
-  } while (ecc_get_public_key(ECC_SECP256R1, pubkey, pubkey) < 0);
+    TRACE_BEGIN(ECC_PUBKEY);
+    ret = crypto_ecc_get_public_key(ECC_SECP256R1, pubkey, pubkey);
+    TRACE_END(ECC_PUBKEY);
+  } while (ret < 0);
   return 0;
 }
 
@@ -51,10 +55,12 @@ int verify_key_handle(const CredentialId *kh, uint8_t *pri_key) {
   uint8_t kh_key[KH_KEY_SIZE];
   int ret = read_kh_key(kh_key);
   if (ret < 0) return ret;
+  TRACE_BEGIN(HMAC_SHA256);
   // get private key
-  hmac_sha256(kh_key, KH_KEY_SIZE, kh->nonce, sizeof(kh->nonce), pri_key);
+  crypto_hmac_sha256(kh_key, KH_KEY_SIZE, kh->nonce, sizeof(kh->nonce), pri_key);
   // get tag, store in kh_key, which should be verified first outside of this function
-  hmac_sha256(pri_key, KH_KEY_SIZE, kh->rpIdHash, sizeof(kh->rpIdHash), kh_key);
+  crypto_hmac_sha256(pri_key, KH_KEY_SIZE, kh->rpIdHash, sizeof(kh->rpIdHash), kh_key);
+  TRACE_END(HMAC_SHA256);
   if (memcmp(kh_key, kh->tag, sizeof(kh->tag)) == 0) {
     memzero(kh_key, sizeof(kh_key));
     return 0;
@@ -67,13 +73,17 @@ size_t sign_with_device_key(const uint8_t *digest, uint8_t *sig) {
   uint8_t key[32];
   int ret = read_pri_key(key);
   if (ret < 0) return ret;
-  ecdsa_sign(ECC_SECP256R1, key, digest, sig);
+  TRACE_BEGIN(ECDSA_SIGN);
+  crypto_ecdsa_sign(ECC_SECP256R1, key, digest, sig);
+  TRACE_END(ECDSA_SIGN);
   memzero(key, sizeof(key));
   return ecdsa_sig2ansi(sig, sig);
 }
 
 size_t sign_with_private_key(const uint8_t *key, const uint8_t *digest, uint8_t *sig) {
-  ecdsa_sign(ECC_SECP256R1, key, digest, sig);
+  TRACE_BEGIN(ECDSA_SIGN);
+  crypto_ecdsa_sign(ECC_SECP256R1, key, digest, sig);
+  TRACE_END(ECDSA_SIGN);
   return ecdsa_sig2ansi(sig, sig);
 }
 
@@ -89,7 +99,9 @@ int set_pin(uint8_t *buf, uint8_t length) {
   if (length == 0) {
     err = write_attr(CTAP_CERT_FILE, PIN_ATTR, NULL, 0);
   } else {
-    sha256_raw(buf, length, buf);
+    TRACE_BEGIN(SHA256);
+    crypto_sha256_raw(buf, length, buf);
+    TRACE_END(SHA256);
     err = write_attr(CTAP_CERT_FILE, PIN_ATTR, buf, PIN_HASH_SIZE);
   }
   if (err < 0) return err;
@@ -120,8 +132,10 @@ int make_hmac_secret_output(uint8_t *nonce, uint8_t *salt, uint8_t len, uint8_t
   int err = read_he_key(hmac_buf);
   if (err < 0) return err;
 
-  hmac_sha256(hmac_buf, HE_KEY_SIZE, nonce, CREDENTIAL_NONCE_SIZE, hmac_buf);
-  hmac_sha256(hmac_buf, HE_KEY_SIZE, salt, 32, output);
-  if (len == 64) hmac_sha256(hmac_buf, HE_KEY_SIZE, salt + 32, 32, output + 32);
+  TRACE_BEGIN(HMAC_SHA256);
+  crypto_hmac_sha256(hmac_buf, HE_KEY_SIZE, nonce, CREDENTIAL_NONCE_SIZE, hmac_buf);
+  crypto_hmac_sha256(hmac_buf, HE_KEY_SIZE, salt, 32, output);
+  if (len == 64) crypto_hmac_sha256(hmac_buf, HE_KEY_SIZE, salt + 32, 32, output + 32);
+  TRACE_END(HMAC_SHA256);
   return 0;
 }
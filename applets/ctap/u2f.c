@@ -1,10 +1,9 @@
 #include "u2f.h"
 #include <apdu.h>
+#include <crypto_offload.h>
 #include <device.h>
-#include <ecc.h>
 #include <fs.h>
 #include <memzero.h>
-#include <sha.h>
 #include <string.h>
 
 #include "ctap-internal.h"
@@ -33,10 +32,10 @@ int u2f_register(const CAPDU *capdu, RAPDU *rapdu) {
   if (err < 0) return err;
 
   // there are overlaps between req and resp
-  sha256_init();
-  sha256_update((uint8_t[]){0x00}, 1);
-  sha256_update(req->appId, U2F_APPID_SIZE);
-  sha256_update(req->chal, U2F_CHAL_SIZE);
+  crypto_sha256_init();
+  crypto_sha256_update((uint8_t[]){0x00}, 1);
+  crypto_sha256_update(req->appId, U2F_APPID_SIZE);
+  crypto_sha256_update(req->chal, U2F_CHAL_SIZE);
 
   // build response
   // REGISTER ID (1)
@@ -52,9 +51,9 @@ int u2f_register(const CAPDU *capdu, RAPDU *rapdu) {
   int cert_len = read_file(CTAP_CERT_FILE, resp->keyHandleCertSig + sizeof(CredentialId), 0, U2F_MAX_ATT_CERT_SIZE);
   if (cert_len < 0) return cert_len;
   // SIG (var)
-  sha256_update((const uint8_t *)&kh, sizeof(CredentialId));
-  sha256_update((const uint8_t *)&resp->pubKey, U2F_EC_PUB_KEY_SIZE + 1);
-  sha256_final(digest);
+  crypto_sha256_update((const uint8_t *)&kh, sizeof(CredentialId));
+  crypto_sha256_update((const uint8_t *)&resp->pubKey, U2F_EC_PUB_KEY_SIZE + 1);
+  crypto_sha256_final(digest);
   size_t signature_len = sign_with_device_key(digest, resp->keyHandleCertSig + sizeof(CredentialId) + cert_len);
   LL = 67 + sizeof(CredentialId) + cert_len + signature_len;
 
@@ -89,12 +88,12 @@ int u2f_authenticate(const CAPDU *capdu, RAPDU *rapdu) {
   err = ctap_make_auth_data(req->appId, (uint8_t *)&auth_data, flags, 0, NULL, &len);
   if (err) EXCEPT(SW_CONDITIONS_NOT_SATISFIED);
 
-  sha256_init();
-  sha256_update((const uint8_t *)&auth_data, U2F_APPID_SIZE + 1 + sizeof(auth_data.signCount));
-  sha256_update(req->chal, U2F_CHAL_SIZE);
-  sha256_final(req->appId);
+  crypto_sha256_init();
+  crypto_sha256_update((const uint8_t *)&auth_data, U2F_APPID_SIZE + 1 + sizeof(auth_data.signCount));
+  crypto_sha256_update(req->chal, U2F_CHAL_SIZE);
+  crypto_sha256_final(req->appId);
   memcpy(resp, &auth_data.flags, 1 + sizeof(auth_data.signCount));
-  ecdsa_sign(ECC_SECP256R1, priv_key, req->appId, resp->sig);
+  crypto_ecdsa_sign(ECC_SECP256R1, priv_key, req->appId, resp->sig);
   memzero(priv_key, sizeof(priv_key));
   size_t signature_len = ecdsa_sig2ansi(resp->sig, resp->sig);
   LL = signature_len + 5;
@@ -1,6 +1,7 @@
 #include <apdu.h>
+#include <crypto_offload.h>
+#include <device.h>
 #include <fs.h>
-#include <hmac.h>
 #include <oath.h>
 #include <stdio.h>
 #include <string.h>
@@ -14,7 +15,7 @@ static enum {
   REMAINING_LIST,
 } oath_remaining_type;
 
-static uint8_t challenge[MAX_CHALLENGE_LEN], challenge_len, record_idx;
+static __card_local uint8_t challenge[MAX_CHALLENGE_LEN], challenge_len, record_idx;
 
 void oath_poweroff(void) { oath_remaining_type = REMAINING_NONE; }
 
@@ -186,10 +187,10 @@ static int oath_increase_counter(OATH_RECORD *record) {
 static uint8_t *oath_digest(OATH_RECORD *record, uint8_t buffer[SHA256_DIGEST_LENGTH]) {
   uint8_t digest_length;
   if ((record->key[0] & OATH_ALG_MASK) == OATH_ALG_SHA1) {
-    hmac_sha1(record->key + 2, record->key_len - 2, challenge, challenge_len, buffer);
+    crypto_hmac_sha1(record->key + 2, record->key_len - 2, challenge, challenge_len, buffer);
     digest_length = SHA1_DIGEST_LENGTH;
   } else {
-    hmac_sha256(record->key + 2, record->key_len - 2, challenge, challenge_len, buffer);
+    crypto_hmac_sha256(record->key + 2, record->key_len - 2, challenge, challenge_len, buffer);
     digest_length = SHA256_DIGEST_LENGTH;
   }
 
@@ -339,6 +340,7 @@ static int oath_calculate_all(const CAPDU *capdu, RAPDU *rapdu) {
   OATH_RECORD record;
   size_t nRecords = size / sizeof(OATH_RECORD), off_out = 0;
   while (off_out < LE) {
+    device_yield();
     if (record_idx >= nRecords) {
       oath_remaining_type = REMAINING_NONE;
       break;
@@ -1,12 +1,12 @@
 #include "key.h"
 #include <common.h>
-#include <ecc.h>
-#include <ed25519.h>
+#include <crypto_offload.h>
+#include <device.h>
 #include <memzero.h>
 #include <openpgp.h>
 #include <pin.h>
 #include <rand.h>
-#include <rsa.h>
+#include <scratch.h>
 
 #define SWAP(x, y, T)                                                                                                  \
   do {                                                                                                                 \
@@ -112,10 +112,10 @@ static const uint8_t extended_capabilities[] = {
 static const ed25519_public_key gx = {9};
 // clang-format on
 
-static uint8_t pw1_mode, current_occurrence, state;
-static pin_t pw1 = {.min_length = 6, .max_length = MAX_PIN_LENGTH, .is_validated = 0, .path = "pgp-pw1"};
-static pin_t pw3 = {.min_length = 8, .max_length = MAX_PIN_LENGTH, .is_validated = 0, .path = "pgp-pw3"};
-static pin_t rc = {.min_length = 8, .max_length = MAX_PIN_LENGTH, .is_validated = 0, .path = "pgp-rc"};
+static __card_local uint8_t pw1_mode, current_occurrence, state;
+static __card_local pin_t pw1 = {.min_length = 6, .max_length = MAX_PIN_LENGTH, .is_validated = 0, .path = "pgp-pw1"};
+static __card_local pin_t pw3 = {.min_length = 8, .max_length = MAX_PIN_LENGTH, .is_validated = 0, .path = "pgp-pw3"};
+static __card_local pin_t rc = {.min_length = 8, .max_length = MAX_PIN_LENGTH, .is_validated = 0, .path = "pgp-rc"};
 
 #define PW1_MODE81_ON() pw1_mode |= 1u
 #define PW1_MODE81_OFF() pw1_mode &= 0XFEu
@@ -546,22 +546,25 @@ static int openpgp_generate_asymmetric_key_pair(const CAPDU *capdu, RAPDU *rapdu
   uint8_t attr[MAX_ATTR_LENGTH];
   int attr_len = openpgp_key_get_attributes(key_path, attr);
   if (attr_len < 0) return -1;
-  uint8_t key[sizeof(rsa_key_t)];
+  uint8_t *key = scratch_alloc(sizeof(rsa_key_t));
+  if (key == NULL) return -1;
   if (P1 == 0x80) {
     uint16_t key_len;
 #ifndef FUZZ
     ASSERT_ADMIN();
 #endif
+    // the generation takes seconds and does not return in between, let the background tasks run right before it
+    device_yield();
     if (attr[0] == KEY_TYPE_RSA) {
       key_len = sizeof(rsa_key_t);
-      if (rsa_generate_key((rsa_key_t *)key) < 0) {
-        memzero(key, sizeof(key));
+      if (crypto_rsa_generate_key((rsa_key_t *)key) < 0) {
+        memzero(key, sizeof(rsa_key_t));
         return -1;
       }
     } else if (attr_len == sizeof(p256r1_attr)) {
       key_len = ECC_KEY_SIZE + ECC_PUB_KEY_SIZE;
-      if (ecc_generate(ECC_SECP256R1, key, key + ECC_KEY_SIZE) < 0) {
-        memzero(key, sizeof(key));
+      if (crypto_ecc_generate(ECC_SECP256R1, key, key + ECC_KEY_SIZE) < 0) {
+        memzero(key, sizeof(rsa_key_t));
         return -1;
       }
     } else if (attr_len == sizeof(ed25519_attr) || attr_len == sizeof(cv25519_attr)) {
@@ -571,35 +574,36 @@ static int openpgp_generate_asymmetric_key_pair(const CAPDU *capdu, RAPDU *rapdu
       key[31] &= 127;
       key[31] |= 64;
       if (attr_len == sizeof(ed25519_attr))
-        ed25519_publickey(key, key + ED_KEY_SIZE);
+        crypto_ed25519_publickey(key, key + ED_KEY_SIZE);
       else
-        curve25519_scalarmult(key + ED_KEY_SIZE, key, gx);
+        crypto_curve25519_scalarmult(key + ED_KEY_SIZE, key, gx);
     } else
       return -1;
+    device_yield();
     if (openpgp_key_set_key(key_path, key, key_len) < 0) {
-      memzero(key, sizeof(key));
+      memzero(key, sizeof(rsa_key_t));
       return -1;
     }
     if (openpgp_key_set_status(key_path, KEY_GENERATED) < 0) {
-      memzero(key, sizeof(key));
+      memzero(key, sizeof(rsa_key_t));
       return -1;
     }
   } else if (P1 == 0x81) {
     int status = openpgp_key_get_status(key_path);
     if (status < 0) {
-      memzero(key, sizeof(key));
+      memzero(key, sizeof(rsa_key_t));
       return -1;
     }
     if (status == KEY_NOT_PRESENT) {
-      memzero(key, sizeof(key));
+      memzero(key, sizeof(rsa_key_t));
       EXCEPT(SW_REFERENCE_DATA_NOT_FOUND);
     }
-    if (openpgp_key_get_key(key_path, &key, sizeof(key)) < 0) {
-      memzero(key, sizeof(key));
+    if (openpgp_key_get_key(key_path, key, sizeof(rsa_key_t)) < 0) {
+      memzero(key, sizeof(rsa_key_t));
       return -1;
     }
   } else {
-    memzero(key, sizeof(key));
+    memzero(key, sizeof(rsa_key_t));
     EXCEPT(SW_WRONG_P1P2);
   }
 
@@ -632,11 +636,11 @@ static int openpgp_generate_asymmetric_key_pair(const CAPDU *capdu, RAPDU *rapdu
     memcpy(RDATA + 5, key + ED_KEY_SIZE, ED_PUB_KEY_SIZE);
     LL = ECC_PUB_KEY_SIZE + 6;
   } else {
-    memzero(key, sizeof(key));
+    memzero(key, sizeof(rsa_key_t));
     return -1;
   }
 
-  memzero(key, sizeof(key));
+  memzero(key, sizeof(rsa_key_t));
   if (P1 == 0x80 && strcmp(key_path, SIG_KEY_PATH) == 0) return reset_sig_counter();
   return 0;
 }
@@ -657,16 +661,17 @@ static int openpgp_compute_digital_signature(const CAPDU *capdu, RAPDU *rapdu) {
   if (attr_len < 0) return -1;
   if (attr[0] == KEY_TYPE_RSA) {
     if (LC > 102) EXCEPT(SW_WRONG_LENGTH);
-    rsa_key_t key;
-    if (openpgp_key_get_key(SIG_KEY_PATH, &key, sizeof(key)) < 0) {
-      memzero(&key, sizeof(key));
+    rsa_key_t *key = scratch_alloc(sizeof(rsa_key_t));
+    if (key == NULL) return -1;
+    if (openpgp_key_get_key(SIG_KEY_PATH, key, sizeof(rsa_key_t)) < 0) {
+      memzero(key, sizeof(rsa_key_t));
       return -1;
     }
-    if (rsa_sign_pkcs_v15(&key, DATA, LC, RDATA) < 0) {
-      memzero(&key, sizeof(key));
+    if (crypto_rsa_sign_pkcs_v15(key, DATA, LC, RDATA) < 0) {
+      memzero(key, sizeof(rsa_key_t));
       return -1;
     }
-    memzero(&key, sizeof(key));
+    memzero(key, sizeof(rsa_key_t));
     LL = N_LENGTH;
   } else if (attr[0] == KEY_TYPE_ECDSA && attr_len == sizeof(p256r1_attr)) {
     if (LC != 32) EXCEPT(SW_WRONG_LENGTH);
@@ -675,7 +680,7 @@ static int openpgp_compute_digital_signature(const CAPDU *capdu, RAPDU *rapdu) {
       memzero(key, sizeof(key));
       return -1;
     }
-    if (ecdsa_sign(ECC_SECP256R1, key, DATA, RDATA) < 0) {
+    if (crypto_ecdsa_sign(ECC_SECP256R1, key, DATA, RDATA) < 0) {
       memzero(key, sizeof(key));
       return -1;
     }
@@ -688,7 +693,7 @@ static int openpgp_compute_digital_signature(const CAPDU *capdu, RAPDU *rapdu) {
       memzero(key, sizeof(key));
       return -1;
     }
-    ed25519_sign(DATA, LC, key, key + ED_KEY_SIZE, sig);
+    crypto_ed25519_sign(DATA, LC, key, key + ED_KEY_SIZE, sig);
     memzero(key, sizeof(key));
     memcpy(RDATA, sig, ED_KEY_SIZE * 2);
     LL = ED_KEY_SIZE * 2;
@@ -714,17 +719,18 @@ static int openpgp_decipher(const CAPDU *capdu, RAPDU *rapdu) {
   int attr_len = openpgp_key_get_attributes(DEC_KEY_PATH, attr);
   if (attr_len < 0) return -1;
   if (attr[0] == KEY_TYPE_RSA) {
-    rsa_key_t key;
-    if (openpgp_key_get_key(DEC_KEY_PATH, &key, sizeof(key)) < 0) {
-      memzero(&key, sizeof(key));
+    rsa_key_t *key = scratch_alloc(sizeof(rsa_key_t));
+    if (key == NULL) return -1;
+    if (openpgp_key_get_key(DEC_KEY_PATH, key, sizeof(rsa_key_t)) < 0) {
+      memzero(key, sizeof(rsa_key_t));
       return -1;
     }
     size_t olen;
-    if (rsa_decrypt_pkcs_v15(&key, DATA + 1, &olen, RDATA) < 0) {
-      memzero(&key, sizeof(key));
+    if (crypto_rsa_decrypt_pkcs_v15(key, DATA + 1, &olen, RDATA) < 0) {
+      memzero(key, sizeof(rsa_key_t));
       return -1;
     }
-    memzero(&key, sizeof(key));
+    memzero(key, sizeof(rsa_key_t));
     LL = olen;
   } else if (attr[0] == KEY_TYPE_ECDH) {
     if (DATA[0] != 0xA6 || DATA[2] != 0x7F || DATA[3] != 0x49 || DATA[5] != 0x86) EXCEPT(SW_WRONG_DATA);
@@ -736,7 +742,7 @@ static int openpgp_decipher(const CAPDU *capdu, RAPDU *rapdu) {
         return -1;
       }
       RDATA[0] = 0x04;
-      if (ecdh_decrypt(ECC_SECP256R1, key, DATA + 8, RDATA + 1) < 0) {
+      if (crypto_ecdh_decrypt(ECC_SECP256R1, key, DATA + 8, RDATA + 1) < 0) {
         memzero(key, sizeof(key));
         return -1;
       }
@@ -749,7 +755,7 @@ static int openpgp_decipher(const CAPDU *capdu, RAPDU *rapdu) {
         memzero(key, sizeof(key));
         return -1;
       }
-      curve25519_scalarmult(RDATA, key, DATA + 7);
+      crypto_curve25519_scalarmult(RDATA, key, DATA + 7);
       memzero(key, sizeof(key));
       LL = ED_PUB_KEY_SIZE;
     } else
@@ -945,7 +951,8 @@ static int openpgp_import_key(const CAPDU *capdu, RAPDU *rapdu) {
   p += length_size;
 
   const uint8_t *data_tag = p + template_len;
-  uint8_t key[sizeof(rsa_key_t)];
+  uint8_t *key = scratch_alloc(sizeof(rsa_key_t));
+  if (key == NULL) return -1;
   uint16_t key_len;
 
   if (attr[0] == KEY_TYPE_RSA) {
@@ -979,7 +986,7 @@ static int openpgp_import_key(const CAPDU *capdu, RAPDU *rapdu) {
     memcpy(((rsa_key_t *)key)->q + (PQ_LENGTH - q_len), p, q_len);
 
     if (rsa_complete_key((rsa_key_t *)key) < 0) {
-      memzero(key, sizeof(key));
+      memzero(key, sizeof(rsa_key_t));
       return -1;
     }
   } else {
@@ -1000,37 +1007,37 @@ static int openpgp_import_key(const CAPDU *capdu, RAPDU *rapdu) {
     if ((attr[0] == KEY_TYPE_ECDSA && attr_len == sizeof(p256r1_attr)) ||
         (attr[0] == KEY_TYPE_ECDH && attr_len == sizeof(p256r1_attr))) {
       if (!ecc_verify_private_key(ECC_SECP256R1, key)) {
-        memzero(key, sizeof(key));
+        memzero(key, sizeof(rsa_key_t));
         EXCEPT(SW_WRONG_DATA);
       }
-      if (ecc_get_public_key(ECC_SECP256R1, key, key + ECC_KEY_SIZE) < 0) {
-        memzero(key, sizeof(key));
+      if (crypto_ecc_get_public_key(ECC_SECP256R1, key, key + ECC_KEY_SIZE) < 0) {
+        memzero(key, sizeof(rsa_key_t));
         return -1;
       }
       key_len += ECC_PUB_KEY_SIZE;
     } else if (attr[0] == KEY_TYPE_ED25519) {
-      ed25519_publickey(key, key + ED_KEY_SIZE);
+      crypto_ed25519_publickey(key, key + ED_KEY_SIZE);
       key_len += ED_PUB_KEY_SIZE;
     } else if (attr[0] == KEY_TYPE_ECDH && attr_len == sizeof(cv25519_attr)) {
       for (int i = 0; i < 16; ++i)
         SWAP(key[31 - i], key[i], uint8_t);
-      curve25519_scalarmult(key + ED_KEY_SIZE, key, gx);
+      crypto_curve25519_scalarmult(key + ED_KEY_SIZE, key, gx);
       key_len += ED_PUB_KEY_SIZE;
     } else {
-      memzero(key, sizeof(key));
+      memzero(key, sizeof(rsa_key_t));
       return -1;
     }
   }
 
   if (openpgp_key_set_key(key_path, key, key_len) < 0) {
-    memzero(key, sizeof(key));
+    memzero(key, sizeof(rsa_key_t));
     return -1;
   }
   if (openpgp_key_set_status(key_path, KEY_IMPORTED) < 0) {
-    memzero(key, sizeof(key));
+    memzero(key, sizeof(rsa_key_t));
     return -1;
   }
-  memzero(key, sizeof(key));
+  memzero(key, sizeof(rsa_key_t));
 
   if (strcmp(key_path, SIG_KEY_PATH) == 0) return reset_sig_counter();
   return 0;
@@ -1049,16 +1056,17 @@ static int openpgp_internal_authenticate(const CAPDU *capdu, RAPDU *rapdu) {
   if (attr_len < 0) return -1;
   if (attr[0] == KEY_TYPE_RSA) {
     if (LC > 102) EXCEPT(SW_WRONG_LENGTH);
-    rsa_key_t key;
-    if (openpgp_key_get_key(AUT_KEY_PATH, &key, sizeof(key)) < 0) {
-      memzero(&key, sizeof(key));
+    rsa_key_t *key = scratch_alloc(sizeof(rsa_key_t));
+    if (key == NULL) return -1;
+    if (openpgp_key_get_key(AUT_KEY_PATH, key, sizeof(rsa_key_t)) < 0) {
+      memzero(key, sizeof(rsa_key_t));
       return -1;
     }
-    if (rsa_sign_pkcs_v15(&key, DATA, LC, RDATA) < 0) {
-      memzero(&key, sizeof(key));
+    if (crypto_rsa_sign_pkcs_v15(key, DATA, LC, RDATA) < 0) {
+      memzero(key, sizeof(rsa_key_t));
       return -1;
     }
-    memzero(&key, sizeof(key));
+    memzero(key, sizeof(rsa_key_t));
     LL = N_LENGTH;
   } else if (attr[0] == KEY_TYPE_ECDSA && attr_len == sizeof(p256r1_attr)) {
     if (LC != 32) EXCEPT(SW_WRONG_LENGTH);
@@ -1067,7 +1075,7 @@ static int openpgp_internal_authenticate(const CAPDU *capdu, RAPDU *rapdu) {
       memzero(key, sizeof(key));
       return -1;
     }
-    if (ecdsa_sign(ECC_SECP256R1, key, DATA, RDATA) < 0) {
+    if (crypto_ecdsa_sign(ECC_SECP256R1, key, DATA, RDATA) < 0) {
       memzero(key, sizeof(key));
       return -1;
     }
@@ -1079,7 +1087,7 @@ static int openpgp_internal_authenticate(const CAPDU *capdu, RAPDU *rapdu) {
       memzero(key, sizeof(key));
       return -1;
     }
-    ed25519_sign(DATA, LC, key, key + ED_KEY_SIZE, sig);
+    crypto_ed25519_sign(DATA, LC, key, key + ED_KEY_SIZE, sig);
     memzero(key, sizeof(key));
     memcpy(RDATA, sig, ED_KEY_SIZE * 2);
     LL = ED_KEY_SIZE * 2;
@@ -1168,6 +1176,8 @@ int openpgp_process_apdu(const CAPDU *capdu, RAPDU *rapdu) {
     }
   }
 
+  // the working memory of the command, e.g. an RSA key, is freed when it is done
+  size_t mark = scratch_begin();
   int ret;
   switch (INS) {
   case OPENPGP_INS_SELECT:
@@ -1219,6 +1229,7 @@ int openpgp_process_apdu(const CAPDU *capdu, RAPDU *rapdu) {
   default:
     EXCEPT(SW_INS_NOT_SUPPORTED);
   }
+  scratch_end(mark);
 
   if (ret < 0) EXCEPT(SW_UNABLE_TO_PROCESS);
   return 0;
@@ -1,11 +1,11 @@
 #include <common.h>
-#include <des.h>
-#include <ecc.h>
+#include <crypto_offload.h>
+#include <device.h>
 #include <memzero.h>
 #include <pin.h>
 #include <piv.h>
 #include <rand.h>
-#include <rsa.h>
+#include <scratch.h>
 
 // data object path
 #define PIV_AUTH_CERT_PATH "piv-pauc"
@@ -56,11 +56,11 @@
 static const uint8_t rid[] = {0xA0, 0x00, 0x00, 0x03, 0x08};
 static const uint8_t pix[] = {0x00, 0x00, 0x10, 0x00, 0x01, 0x00};
 static const uint8_t pin_policy[] = {0x40, 0x10};
-static uint8_t auth_ctx[LENGTH_AUTH_STATE];
-static uint8_t in_admin_status;
+static __card_local uint8_t auth_ctx[LENGTH_AUTH_STATE];
+static __card_local uint8_t in_admin_status;
 
-static pin_t pin = {.min_length = 8, .max_length = 8, .is_validated = 0, .path = "piv-pin"};
-static pin_t puk = {.min_length = 8, .max_length = 8, .is_validated = 0, .path = "piv-puk"};
+static __card_local pin_t pin = {.min_length = 8, .max_length = 8, .is_validated = 0, .path = "piv-pin"};
+static __card_local pin_t puk = {.min_length = 8, .max_length = 8, .is_validated = 0, .path = "piv-puk"};
 
 static void authenticate_reset(void) {
   auth_ctx[OFFSET_AUTH_STATE] = AUTH_STATE_NONE;
@@ -336,13 +336,14 @@ static int piv_general_authenticate(const CAPDU *capdu, RAPDU *rapdu) {
     if (P2 == 0x9D) pin.is_validated = 0;
 
     if (alg == ALG_RSA_2048) {
-      rsa_key_t key;
-      if (read_file(key_path, &key, 0, sizeof(rsa_key_t)) < 0) return -1;
-      if (rsa_private(&key, DATA + pos[IDX_CHALLENGE], RDATA + 8) < 0) {
-        memzero(&key, sizeof(key));
+      rsa_key_t *key = scratch_alloc(sizeof(rsa_key_t));
+      if (key == NULL) return -1;
+      if (read_file(key_path, key, 0, sizeof(rsa_key_t)) < 0) return -1;
+      if (crypto_rsa_private(key, DATA + pos[IDX_CHALLENGE], RDATA + 8) < 0) {
+        memzero(key, sizeof(rsa_key_t));
         return -1;
       }
-      memzero(&key, sizeof(key));
+      memzero(key, sizeof(rsa_key_t));
 
       RDATA[0] = 0x7C;
       RDATA[1] = 0x82;
@@ -356,7 +357,7 @@ static int piv_general_authenticate(const CAPDU *capdu, RAPDU *rapdu) {
     } else if (alg == ALG_ECC_256) {
       uint8_t key[ECC_KEY_SIZE];
       if (read_file(key_path, key, 0, sizeof(key)) < 0) return -1;
-      if (ecdsa_sign(ECC_SECP256R1, key, DATA + pos[IDX_CHALLENGE], RDATA + 4) < 0) {
+      if (crypto_ecdsa_sign(ECC_SECP256R1, key, DATA + pos[IDX_CHALLENGE], RDATA + 4) < 0) {
         memzero(key, sizeof(key));
         return -1;
       }
@@ -398,7 +399,7 @@ static int piv_general_authenticate(const CAPDU *capdu, RAPDU *rapdu) {
     if (alg == ALG_TDEA_3KEY) {
       uint8_t key[24];
       if (read_file(key_path, key, 0, 24) < 0) return -1;
-      if (tdes_enc(RDATA + 4, auth_ctx + OFFSET_AUTH_CHALLENGE, key) < 0) {
+      if (crypto_tdes_enc(RDATA + 4, auth_ctx + OFFSET_AUTH_CHALLENGE, key) < 0) {
         memzero(key, sizeof(key));
         return -1;
       }
@@ -452,7 +453,7 @@ static int piv_general_authenticate(const CAPDU *capdu, RAPDU *rapdu) {
     if (alg == ALG_TDEA_3KEY) {
       uint8_t key[24];
       if (read_file(key_path, key, 0, 24) < 0) return -1;
-      if (tdes_enc(auth_ctx + OFFSET_AUTH_CHALLENGE, RDATA + 4, key) < 0) {
+      if (crypto_tdes_enc(auth_ctx + OFFSET_AUTH_CHALLENGE, RDATA + 4, key) < 0) {
         memzero(key, sizeof(key));
         return -1;
       }
@@ -491,7 +492,7 @@ static int piv_general_authenticate(const CAPDU *capdu, RAPDU *rapdu) {
     if (alg == ALG_TDEA_3KEY) {
       uint8_t key[24];
       if (read_file(key_path, key, 0, 24) < 0) return -1;
-      if (tdes_enc(DATA + pos[IDX_CHALLENGE], RDATA + 4, key) < 0) {
+      if (crypto_tdes_enc(DATA + pos[IDX_CHALLENGE], RDATA + 4, key) < 0) {
         memzero(key, sizeof(key));
         return -1;
       }
@@ -519,7 +520,7 @@ static int piv_general_authenticate(const CAPDU *capdu, RAPDU *rapdu) {
     if (P2 == 0x9D) pin.is_validated = 0;
     uint8_t key[ECC_KEY_SIZE];
     if (read_file(key_path, key, 0, ECC_KEY_SIZE) < 0) return -1;
-    if (ecdh_decrypt(ECC_SECP256R1, key, DATA + pos[IDX_EXP] + 1, RDATA + 4) < 0) {
+    if (crypto_ecdh_decrypt(ECC_SECP256R1, key, DATA + pos[IDX_EXP] + 1, RDATA + 4) < 0) {
       memzero(key, sizeof(key));
       return -1;
     }
@@ -573,10 +574,14 @@ static int piv_generate_asymmetric_key_pair(const CAPDU *capdu, RAPDU *rapdu) {
   const char *key_path = get_key_path(P2);
   uint8_t alg = DATA[4];
   if (alg == ALG_RSA_2048) {
-    rsa_key_t key;
-    if (rsa_generate_key(&key) < 0) return -1;
-    if (write_file(key_path, &key, 0, sizeof(key), 1) < 0) {
-      memzero(&key, sizeof(key));
+    rsa_key_t *key = scratch_alloc(sizeof(rsa_key_t));
+    if (key == NULL) return -1;
+    // the generation takes seconds and does not return in between, let the background tasks run right before it
+    device_yield();
+    if (crypto_rsa_generate_key(key) < 0) return -1;
+    device_yield();
+    if (write_file(key_path, key, 0, sizeof(rsa_key_t), 1) < 0) {
+      memzero(key, sizeof(rsa_key_t));
       return -1;
     }
     RDATA[0] = 0x7F;
@@ -588,15 +593,17 @@ static int piv_generate_asymmetric_key_pair(const CAPDU *capdu, RAPDU *rapdu) {
     RDATA[6] = 0x82;
     RDATA[7] = HI(N_LENGTH);
     RDATA[8] = LO(N_LENGTH);
-    memcpy(RDATA + 9, key.n, N_LENGTH);
+    memcpy(RDATA + 9, key->n, N_LENGTH);
     RDATA[9 + N_LENGTH] = 0x82; // exponent
     RDATA[10 + N_LENGTH] = E_LENGTH;
-    memcpy(RDATA + 11 + N_LENGTH, key.e, E_LENGTH);
+    memcpy(RDATA + 11 + N_LENGTH, key->e, E_LENGTH);
     LL = 11 + N_LENGTH + E_LENGTH;
-    memzero(&key, sizeof(key));
+    memzero(key, sizeof(rsa_key_t));
   } else if (alg == ALG_ECC_256) {
     uint8_t key[ECC_KEY_SIZE + ECC_PUB_KEY_SIZE];
-    if (ecc_generate(ECC_SECP256R1, key, key + ECC_KEY_SIZE) < 0) return -1;
+    device_yield();
+    if (crypto_ecc_generate(ECC_SECP256R1, key, key + ECC_KEY_SIZE) < 0) return -1;
+    device_yield();
     if (write_file(key_path, key, 0, sizeof(key), 1) < 0) {
       memzero(key, sizeof(key));
       return -1;
@@ -644,10 +651,11 @@ static int piv_import_asymmetric_key(const CAPDU *capdu, RAPDU *rapdu) {
   uint8_t alg = P1;
   switch (alg) {
   case ALG_RSA_2048: {
-    rsa_key_t key;
-    memset(&key, 0, sizeof(key));
-    key.e[1] = 1;
-    key.e[3] = 1;
+    rsa_key_t *key = scratch_alloc(sizeof(rsa_key_t));
+    if (key == NULL) return -1;
+    memset(key, 0, sizeof(rsa_key_t));
+    key->e[1] = 1;
+    key->e[3] = 1;
     uint8_t *p = DATA;
     if (LC == 0) EXCEPT(SW_WRONG_LENGTH);
     if (*p++ != 0x01) EXCEPT(SW_WRONG_DATA);
@@ -657,23 +665,23 @@ static int piv_import_asymmetric_key(const CAPDU *capdu, RAPDU *rapdu) {
     if (fail) EXCEPT(SW_WRONG_LENGTH);
     if (p_len > PQ_LENGTH) EXCEPT(SW_WRONG_DATA);
     p += length_size;
-    memcpy(key.p + (PQ_LENGTH - p_len), p, p_len);
+    memcpy(key->p + (PQ_LENGTH - p_len), p, p_len);
     p += p_len;
     if (*p++ != 0x02) EXCEPT(SW_WRONG_DATA);
     int q_len = tlv_get_length_safe(p, LC - (p - DATA), &fail, &length_size);
     if (fail) EXCEPT(SW_WRONG_LENGTH);
     if (q_len > PQ_LENGTH) EXCEPT(SW_WRONG_DATA);
     p += length_size;
-    memcpy(key.q + (PQ_LENGTH - q_len), p, q_len);
-    if (rsa_complete_key(&key) < 0) {
-      memzero(&key, sizeof(key));
+    memcpy(key->q + (PQ_LENGTH - q_len), p, q_len);
+    if (rsa_complete_key(key) < 0) {
+      memzero(key, sizeof(rsa_key_t));
       return -1;
     }
-    if (write_file(key_path, &key, 0, sizeof(key), 1) < 0) {
-      memzero(&key, sizeof(key));
+    if (write_file(key_path, key, 0, sizeof(rsa_key_t), 1) < 0) {
+      memzero(key, sizeof(rsa_key_t));
       return -1;
     }
-    memzero(&key, sizeof(key));
+    memzero(key, sizeof(rsa_key_t));
     break;
   }
   case ALG_ECC_256: {
@@ -685,7 +693,7 @@ static int piv_import_asymmetric_key(const CAPDU *capdu, RAPDU *rapdu) {
       memzero(key, sizeof(key));
       EXCEPT(SW_WRONG_DATA);
     }
-    if (ecc_get_public_key(ECC_SECP256R1, key, key + ECC_KEY_SIZE) < 0) {
+    if (crypto_ecc_get_public_key(ECC_SECP256R1, key, key + ECC_KEY_SIZE) < 0) {
       memzero(key, sizeof(key));
       return -1;
     }
@@ -726,6 +734,8 @@ int piv_process_apdu(const CAPDU *capdu, RAPDU *rapdu) {
   SW = SW_NO_ERROR;
   if (CLA != 0x00) EXCEPT(SW_CLA_NOT_SUPPORTED);
 
+  // the working memory of the command, e.g. an RSA key, is freed when it is done
+  size_t mark = scratch_begin();
   int ret = 0;
   switch (INS) {
   case PIV_INS_SELECT:
@@ -770,6 +780,7 @@ int piv_process_apdu(const CAPDU *capdu, RAPDU *rapdu) {
   default:
     EXCEPT(SW_INS_NOT_SUPPORTED);
   }
+  scratch_end(mark);
 
   if (ret < 0) EXCEPT(SW_UNABLE_TO_PROCESS);
   return 0;
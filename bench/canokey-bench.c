@@ -0,0 +1,571 @@
+#include "fabrication.h"
+#include "u2f.h"
+#include <apdu.h>
+#include <bd/lfs_filebd.h>
+#include <bd/lfs_rambd.h>
+#include <cbor.h>
+#include <ctap.h>
+#include <des.h>
+#include <oath.h>
+#include <openpgp.h>
+#include <piv.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RP_ID "bench.canokeys.org"
+#define DEFAULT_LFS_PATH "/tmp/canokey-bench-lfs"
+
+// Key and ciphertext of the RSA decipher case in test/test_openpgp.c, the card cannot produce a ciphertext itself
+static const uint8_t rsa_dec_key[] =
+    "\x4D\x82\x01\x16\xB8\x00\x7F\x48\x08\x91\x04\x92\x81\x80\x93\x81\x80\x5F\x48\x82\x01\x04\x00\x01\x00"
+    "\x01\xD6\x2F\x32\x91\x59\x9E\x87\x36\xFC\x9C\x48\x54\xEF\x6D\xF8\xCF\x63\x37\x61\xF5\x22\x08\x58\x77"
+    "\x33\xF0\x03\x6C\x7B\xD4\x7F\x2F\x88\x4F\x29\x4B\x73\x37\xA8\x00\x66\xBB\xDB\xCD\xF1\xFA\x13\x40\x46"
+    "\x90\x29\xB7\x40\xEB\x6B\xD8\x3F\x5E\x66\xD3\xFF\x41\x92\x01\xEF\x6A\x44\x15\x07\xE3\x4A\xB8\xDC\x0D"
+    "\xB7\xBE\x86\xC4\x62\xBA\x78\x4F\x29\x0D\x68\x2D\x5D\xEF\xC6\xF7\x82\x06\xF0\x3D\xCC\x27\x58\xFD\xBD"
+    "\xE8\x0D\x24\x13\x09\xA7\x8D\x9F\x84\x85\x1D\xF2\xD5\x1C\xB1\x85\xC1\xC5\x62\x7B\xA8\x82\xBB\x3F\x58"
+    "\x8F\xD1\x01\x15\xD8\xE5\x6E\x4B\xEF\x39\x47\xF0\xD0\xDE\x3B\x57\xC6\x7C\x2E\x94\x01\x13\xB5\xA9\x98"
+    "\x8E\x36\x54\x8D\xB6\x08\xEF\x76\x7E\xFE\x96\xB7\xD8\x06\xA6\x61\x3F\x28\xA8\x9D\x89\x87\xE6\x27\x20"
+    "\x6F\x9F\x02\x47\xD7\x60\xEA\xAC\x5A\x95\x69\x0C\x22\x00\x89\xCA\x96\x09\xB6\xED\xFC\xFF\x5E\xDF\xD5"
+    "\x09\x89\x7F\x74\x9C\x0F\xEF\x91\x37\x2F\x72\x5F\x11\xFA\xF6\x27\x1E\x6B\x2F\x32\xF2\xB1\xD3\x64\x5B"
+    "\xB1\xB1\x9C\xB2\x60\xB8\xC4\xC6\x9A\x8A\xAC\x44\x86\xF1\x05\x8A\x9A\xF3\x45\xE8\x6D\x6E\x73\xDD\x56"
+    "\x05\xF2\x22\x17\x8A\x53\x61";
+static const uint8_t rsa_ciphertext[] =
+    "\x00\x7C\x45\xED\x54\x25\x8A\xEF\xF7\x8A\x7A\x56\xB7\x6A\x80\x7F\x24\x7F\x93\x47\x98\x93\x36\xE4\x44"
+    "\x58\x1B\x3C\xEF\x98\x7B\x48\x69\xF9\x2C\x26\x9E\x91\xCD\x4C\x0E\x2A\x43\xE3\xEE\xE6\x9C\x79\xB5\xF2"
+    "\x94\x04\x41\x33\x9A\x76\xDA\xDD\x50\x16\x16\x68\x7B\x6F\x68\xF9\x6F\xB3\xB9\x1D\x1D\xDF\xC3\xC8\xA6"
+    "\xAF\x28\xB8\x24\x7E\x11\x16\x88\xD0\xD9\x84\x5F\xEF\x3F\x92\x32\xB2\xEA\xBD\x35\x5D\xEA\xC2\x93\x96"
+    "\x94\x42\x85\xE2\x39\xE5\x5B\x52\x4D\x60\xB8\xEA\x6F\xA3\xF6\xA8\xE3\xB1\x7C\xAA\xEF\x77\xC5\xBC\xD5"
+    "\x19\xEF\x1B\x27\x28\x08\x9C\x8E\x47\xC6\x7F\xF3\xF1\x0D\x52\x3F\xF3\x1F\x8A\x65\x96\x01\x7B\xE3\x9A"
+    "\x1F\xD0\xAF\xE7\x31\xD0\x68\x4F\x00\x09\x4E\xA8\x89\xF4\x8E\x75\x6E\x74\xEE\x53\xFE\x09\xBB\x42\x48"
+    "\x07\xD0\xF1\x0A\x6B\x84\xFD\x70\x28\xDA\x30\x11\xD4\x69\xA9\x0B\xE8\x97\x9E\x0B\x57\x52\xAE\xAB\xFA"
+    "\x23\x83\x4E\x4F\xDC\x9A\xDB\xD7\xF7\x2E\xF2\x12\x3E\x34\x41\xA4\xF8\x9E\x84\x49\x7B\xCF\x7A\x17\x09"
+    "\x92\xC4\xCE\x22\x5E\x3C\x17\x60\xCB\xB5\x9C\x79\x04\xB8\x62\x33\xA2\xCA\x1C\xCB\xE1\x12\x21\xBE\x59"
+    "\xB6\x73\xC0\xAE\xB9\x95\x97";
+
+static const uint8_t pgp_rsa2k_attr[] = {0x01, 0x08, 0x00, 0x00, 0x20, 0x00};
+static const uint8_t pgp_p256_ecdsa_attr[] = {0x13, 0x2A, 0x86, 0x48, 0xCE, 0x3D, 0x03, 0x01, 0x07};
+static const uint8_t pgp_p256_ecdh_attr[] = {0x12, 0x2A, 0x86, 0x48, 0xCE, 0x3D, 0x03, 0x01, 0x07};
+static const uint8_t pgp_ed25519_attr[] = {0x16, 0x2B, 0x06, 0x01, 0x04, 0x01, 0xDA, 0x47, 0x0F, 0x01};
+static const uint8_t pgp_cv25519_attr[] = {0x12, 0x2B, 0x06, 0x01, 0x04, 0x01, 0x97, 0x55, 0x01, 0x05, 0x01};
+
+static int iterations = 100, accounts = 16;
+static const char *lfs_path = DEFAULT_LFS_PATH;
+static const char *bd_name;
+static FILE *results;
+static uint64_t *samples;
+
+static uint8_t c_buf[APDU_BUFFER_SIZE], r_buf[APDU_BUFFER_SIZE];
+static CAPDU capdu = {.data = c_buf};
+static RAPDU rapdu = {.data = r_buf};
+
+// State carried from the setup of a case to its timed part
+static uint8_t client_data_hash[32];
+static uint8_t cbor_req[512], cbor_resp[APDU_BUFFER_SIZE];
+static size_t cbor_req_len, cbor_resp_len;
+static U2F_AUTHENTICATE_REQ u2f_auth_req;
+static const uint8_t *timed_data;
+static uint16_t timed_lc;
+static uint8_t timed_p1, timed_p2;
+
+static uint64_t now_ns(void) {
+  struct timespec spec;
+  clock_gettime(CLOCK_MONOTONIC, &spec);
+  return (uint64_t)spec.tv_sec * 1000000000ull + spec.tv_nsec;
+}
+
+static int compare_samples(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+static double percentile_us(int p) { return samples[(iterations - 1) * p / 100] / 1e3; }
+
+// Times run() over the iterations, prepare() runs untimed before each of them
+static int measure(const char *name, const char *param, int (*prepare)(void), int (*run)(void)) {
+  uint64_t total = 0;
+  for (int i = 0; i < iterations; ++i) {
+    if (prepare != NULL && prepare() < 0) {
+      fprintf(stderr, "%s (%s) on %s: preparation failed at iteration %d\n", name, param, bd_name, i);
+      return -1;
+    }
+    uint64_t start = now_ns();
+    int ret = run();
+    samples[i] = now_ns() - start;
+    if (ret < 0) {
+      fprintf(stderr, "%s (%s) on %s: failed at iteration %d\n", name, param, bd_name, i);
+      return -1;
+    }
+    total += samples[i];
+  }
+  qsort(samples, iterations, sizeof(samples[0]), compare_samples);
+  fprintf(results,
+          "{\"bench\":\"%s\",\"bd\":\"%s\",\"param\":\"%s\",\"iterations\":%d,\"ops_per_sec\":%.1f,"
+          "\"p50_us\":%.1f,\"p90_us\":%.1f,\"p99_us\":%.1f,\"max_us\":%.1f}\n",
+          name, bd_name, param, iterations, iterations * 1e9 / total, percentile_us(50), percentile_us(90),
+          percentile_us(99), samples[iterations - 1] / 1e3);
+  fflush(results);
+  return 0;
+}
+
+// Only OATH looks at Le, it pages the responses by it
+static uint16_t transmit(int (*process)(const CAPDU *, RAPDU *), uint8_t ins, uint8_t p1, uint8_t p2,
+                         const void *data, uint16_t lc) {
+  capdu.cla = 0x00;
+  capdu.ins = ins;
+  capdu.p1 = p1;
+  capdu.p2 = p2;
+  capdu.lc = lc;
+  capdu.le = 0x100;
+  if (lc > 0) memcpy(c_buf, data, lc);
+  process(&capdu, &rapdu);
+  return rapdu.sw;
+}
+
+static int expect_ok(uint16_t sw) {
+  if (sw == SW_NO_ERROR) return 0;
+  fprintf(stderr, "unexpected SW %04X\n", sw);
+  return -1;
+}
+
+/*
+ * OATH
+ */
+
+static int oath_setup(void) {
+  uint8_t put[2 + MAX_NAME_LEN + 2 + 22];
+  for (int i = 0; i < accounts; ++i) {
+    int name_len = snprintf((char *)put + 2, MAX_NAME_LEN, "bench-%d", i);
+    put[0] = OATH_TAG_NAME;
+    put[1] = name_len;
+    uint8_t off = 2 + name_len;
+    put[off++] = OATH_TAG_KEY;
+    put[off++] = 22;
+    put[off++] = OATH_TYPE_TOTP | OATH_ALG_SHA1;
+    put[off++] = 6;
+    for (int j = 0; j < 20; ++j)
+      put[off++] = i + j;
+    if (expect_ok(transmit(oath_process_apdu, OATH_INS_PUT, 0x00, 0x00, put, off)) < 0) return -1;
+  }
+  return 0;
+}
+
+static int oath_calculate_all(void) {
+  static const uint8_t challenge[] = {OATH_TAG_CHALLENGE, 8, 0x00, 0x00, 0x00, 0x00, 0x03, 0x5A, 0x2B, 0x1C};
+  uint16_t sw = transmit(oath_process_apdu, OATH_INS_CALCULATE_ALL, 0x00, 0x00, challenge, sizeof(challenge));
+  while (sw == 0x61FF)
+    sw = transmit(oath_process_apdu, OATH_INS_SEND_REMAINING, 0x00, 0x00, NULL, 0);
+  return expect_ok(sw);
+}
+
+static int bench_oath(void) {
+  char param[32];
+  snprintf(param, sizeof(param), "accounts=%d", accounts);
+  if (oath_setup() < 0) return -1;
+  return measure("oath_calculate_all", param, NULL, oath_calculate_all);
+}
+
+/*
+ * CTAP2 and U2F
+ */
+
+static void build_make_credential(bool rk) {
+  CborEncoder encoder, map, sub, array, param;
+  cbor_req[0] = CTAP_MAKE_CREDENTIAL;
+  cbor_encoder_init(&encoder, cbor_req + 1, sizeof(cbor_req) - 1, 0);
+  cbor_encoder_create_map(&encoder, &map, 5);
+
+  cbor_encode_int(&map, MC_clientDataHash);
+  cbor_encode_byte_string(&map, client_data_hash, sizeof(client_data_hash));
+
+  cbor_encode_int(&map, MC_rp);
+  cbor_encoder_create_map(&map, &sub, 1);
+  cbor_encode_text_stringz(&sub, "id");
+  cbor_encode_text_stringz(&sub, RP_ID);
+  cbor_encoder_close_container(&map, &sub);
+
+  cbor_encode_int(&map, MC_user);
+  cbor_encoder_create_map(&map, &sub, 2);
+  cbor_encode_text_stringz(&sub, "id");
+  cbor_encode_byte_string(&sub, (const uint8_t *)"bench-user", 10);
+  cbor_encode_text_stringz(&sub, "name");
+  cbor_encode_text_stringz(&sub, "bench");
+  cbor_encoder_close_container(&map, &sub);
+
+  cbor_encode_int(&map, MC_pubKeyCredParams);
+  cbor_encoder_create_array(&map, &array, 1);
+  cbor_encoder_create_map(&array, &param, 2);
+  cbor_encode_text_stringz(&param, "alg");
+  cbor_encode_int(&param, -7); // ES256
+  cbor_encode_text_stringz(&param, "type");
+  cbor_encode_text_stringz(&param, "public-key");
+  cbor_encoder_close_container(&array, &param);
+  cbor_encoder_close_container(&map, &array);
+
+  cbor_encode_int(&map, MC_options);
+  cbor_encoder_create_map(&map, &sub, 1);
+  cbor_encode_text_stringz(&sub, "rk");
+  cbor_encode_boolean(&sub, rk);
+  cbor_encoder_close_container(&map, &sub);
+
+  cbor_encoder_close_container(&encoder, &map);
+  cbor_req_len = 1 + cbor_encoder_get_buffer_size(&encoder, cbor_req + 1);
+}
+
+// Without rk the credential is named by the credential id in the allow list
+static void build_get_assertion(const uint8_t *credential_id) {
+  CborEncoder encoder, map, array, cred;
+  cbor_req[0] = CTAP_GET_ASSERTION;
+  cbor_encoder_init(&encoder, cbor_req + 1, sizeof(cbor_req) - 1, 0);
+  cbor_encoder_create_map(&encoder, &map, credential_id ? 3 : 2);
+
+  cbor_encode_int(&map, GA_rpId);
+  cbor_encode_text_stringz(&map, RP_ID);
+  cbor_encode_int(&map, GA_clientDataHash);
+  cbor_encode_byte_string(&map, client_data_hash, sizeof(client_data_hash));
+
+  if (credential_id) {
+    cbor_encode_int(&map, GA_allowList);
+    cbor_encoder_create_array(&map, &array, 1);
+    cbor_encoder_create_map(&array, &cred, 2);
+    cbor_encode_text_stringz(&cred, "id");
+    cbor_encode_byte_string(&cred, credential_id, sizeof(CredentialId));
+    cbor_encode_text_stringz(&cred, "type");
+    cbor_encode_text_stringz(&cred, "public-key");
+    cbor_encoder_close_container(&array, &cred);
+    cbor_encoder_close_container(&map, &array);
+  }
+
+  cbor_encoder_close_container(&encoder, &map);
+  cbor_req_len = 1 + cbor_encoder_get_buffer_size(&encoder, cbor_req + 1);
+}
+
+static int ctap_run(void) {
+  cbor_resp_len = sizeof(cbor_resp);
+  if (ctap_process_cbor(cbor_req, cbor_req_len, cbor_resp, &cbor_resp_len) < 0) return -1;
+  if (cbor_resp[0] != 0) {
+    fprintf(stderr, "CTAP status %02X\n", cbor_resp[0]);
+    return -1;
+  }
+  return 0;
+}
+
+// Takes the credential id out of the authData (0x02) of the last makeCredential response
+static int save_credential_id(uint8_t *credential_id) {
+  CborParser parser;
+  CborValue it, map;
+  size_t map_length;
+  uint8_t auth_data[sizeof(CTAP_authData)];
+
+  if (cbor_parser_init(cbor_resp + 1, cbor_resp_len - 1, 0, &parser, &it) != CborNoError) return -1;
+  if (cbor_value_get_map_length(&it, &map_length) != CborNoError) return -1;
+  if (cbor_value_enter_container(&it, &map) != CborNoError) return -1;
+  for (size_t i = 0; i < map_length; ++i) {
+    int key;
+    if (cbor_value_get_int_checked(&map, &key) != CborNoError) return -1;
+    if (cbor_value_advance(&map) != CborNoError) return -1;
+    if (key == 0x02) {
+      size_t len = sizeof(auth_data);
+      if (cbor_value_copy_byte_string(&map, auth_data, &len, NULL) != CborNoError) return -1;
+      // rpIdHash (32), flags (1), signCount (4), aaguid (16), credentialIdLength (2)
+      if (len < 55 + sizeof(CredentialId) || (auth_data[53] << 8 | auth_data[54]) != sizeof(CredentialId)) return -1;
+      memcpy(credential_id, auth_data + 55, sizeof(CredentialId));
+      return 0;
+    }
+    if (cbor_value_advance(&map) != CborNoError) return -1;
+  }
+  return -1;
+}
+
+static int u2f_sign(void) {
+  return expect_ok(transmit(ctap_process_apdu, U2F_AUTHENTICATE, U2F_AUTH_ENFORCE, 0x00, &u2f_auth_req,
+                            sizeof(u2f_auth_req)));
+}
+
+static int bench_ctap(void) {
+  uint8_t credential_id[sizeof(CredentialId)];
+  memset(client_data_hash, 0xCD, sizeof(client_data_hash));
+
+  build_make_credential(false);
+  if (measure("ctap2_make_credential", "rk=false", NULL, ctap_run) < 0) return -1;
+  if (save_credential_id(credential_id) < 0) return -1;
+  build_get_assertion(credential_id);
+  if (measure("ctap2_get_assertion", "rk=false", NULL, ctap_run) < 0) return -1;
+
+  // the same user id keeps overwriting one resident key
+  build_make_credential(true);
+  if (measure("ctap2_make_credential", "rk=true", NULL, ctap_run) < 0) return -1;
+  build_get_assertion(NULL);
+  if (measure("ctap2_get_assertion", "rk=true", NULL, ctap_run) < 0) return -1;
+
+  U2F_REGISTER_REQ reg;
+  memset(reg.chal, 0x11, sizeof(reg.chal));
+  memset(reg.appId, 0x22, sizeof(reg.appId));
+  if (expect_ok(transmit(ctap_process_apdu, U2F_REGISTER, 0x00, 0x00, &reg, sizeof(reg))) < 0) return -1;
+  memset(u2f_auth_req.chal, 0x33, sizeof(u2f_auth_req.chal));
+  memcpy(u2f_auth_req.appId, reg.appId, sizeof(reg.appId));
+  u2f_auth_req.keyHandleLen = sizeof(CredentialId);
+  memcpy(u2f_auth_req.keyHandle, ((U2F_REGISTER_RESP *)r_buf)->keyHandleCertSig, sizeof(CredentialId));
+  return measure("u2f_authenticate", "", NULL, u2f_sign);
+}
+
+/*
+ * PIV
+ */
+
+#define PIV_ALG_TDEA_3KEY 0x03
+#define PIV_ALG_RSA_2048 0x07
+#define PIV_ALG_ECC_256 0x11
+
+static int piv_verify_pin(void) {
+  return expect_ok(transmit(piv_process_apdu, PIV_INS_VERIFY, 0x00, 0x80, "123456\xFF\xFF", 8));
+}
+
+static int piv_general_authenticate(void) {
+  return expect_ok(transmit(piv_process_apdu, PIV_INS_GENERAL_AUTHENTICATE, timed_p1, timed_p2, timed_data, timed_lc));
+}
+
+// Mutual authentication with the default management key
+static int piv_admin_authenticate(void) {
+  static const uint8_t key[] = {1, 2, 3, 4, 5, 6, 7, 8, 1, 2, 3, 4, 5, 6, 7, 8, 1, 2, 3, 4, 5, 6, 7, 8};
+  uint8_t response[12] = {0x7C, 0x0A, 0x82, 0x08};
+  if (expect_ok(transmit(piv_process_apdu, PIV_INS_GENERAL_AUTHENTICATE, PIV_ALG_TDEA_3KEY, 0x9B,
+                         "\x7C\x02\x81\x00", 4)) < 0)
+    return -1;
+  tdes_enc(r_buf + 4, response + 4, key);
+  return expect_ok(
+      transmit(piv_process_apdu, PIV_INS_GENERAL_AUTHENTICATE, PIV_ALG_TDEA_3KEY, 0x9B, response, sizeof(response)));
+}
+
+static int piv_generate(uint8_t key_ref, uint8_t alg) {
+  uint8_t data[] = {0xAC, 0x03, 0x80, 0x01, alg};
+  return expect_ok(transmit(piv_process_apdu, PIV_INS_GENERATE_ASYMMETRIC_KEY_PAIR, 0x00, key_ref, data, sizeof(data)));
+}
+
+static int bench_piv(void) {
+  uint8_t ecc_sign[] = {0x7C, 0x24, 0x82, 0x00, 0x81, 0x20};
+  uint8_t rsa_sign[4 + 4 + 4 + 256] = {0x7C, 0x82, 0x01, 0x06, 0x82, 0x00, 0x81, 0x82, 0x01, 0x00};
+  uint8_t ecdh[6 + 65] = {0x7C, 0x45, 0x82, 0x00, 0x85, 0x41};
+  uint8_t ecc_sign_data[sizeof(ecc_sign) + 32];
+
+  if (piv_admin_authenticate() < 0 || piv_verify_pin() < 0) return -1;
+
+  memcpy(ecc_sign_data, ecc_sign, sizeof(ecc_sign));
+  memset(ecc_sign_data + sizeof(ecc_sign), 0x5A, 32);
+  // the leading zero keeps the challenge below the modulus
+  memset(rsa_sign + 10, 0x5A, 256);
+  rsa_sign[10] = 0x00;
+
+  if (piv_generate(0x9C, PIV_ALG_RSA_2048) < 0 || piv_generate(0x9D, PIV_ALG_RSA_2048) < 0) return -1;
+  timed_p1 = PIV_ALG_RSA_2048;
+  timed_data = rsa_sign;
+  timed_lc = 10 + 256;
+  timed_p2 = 0x9C;
+  if (measure("piv_sign", "rsa2048", NULL, piv_general_authenticate) < 0) return -1;
+  // the PIN has to be verified again after every use of the key management key
+  timed_p2 = 0x9D;
+  if (measure("piv_decipher", "rsa2048", piv_verify_pin, piv_general_authenticate) < 0) return -1;
+
+  if (piv_generate(0x9C, PIV_ALG_ECC_256) < 0 || piv_generate(0x9D, PIV_ALG_ECC_256) < 0) return -1;
+  // agree with the card's own public key, any point on the curve does
+  memcpy(ecdh + 6, r_buf + 5, 65);
+  if (piv_verify_pin() < 0) return -1;
+  timed_p1 = PIV_ALG_ECC_256;
+  timed_data = ecc_sign_data;
+  timed_lc = sizeof(ecc_sign_data);
+  timed_p2 = 0x9C;
+  if (measure("piv_sign", "ecc256", NULL, piv_general_authenticate) < 0) return -1;
+  timed_data = ecdh;
+  timed_lc = sizeof(ecdh);
+  timed_p2 = 0x9D;
+  return measure("piv_decipher", "ecc256", piv_verify_pin, piv_general_authenticate);
+}
+
+/*
+ * OpenPGP
+ */
+
+static int openpgp_verify_pw1_sign(void) {
+  return expect_ok(transmit(openpgp_process_apdu, OPENPGP_INS_VERIFY, 0x00, 0x81, "123456", 6));
+}
+
+static int openpgp_pso(void) {
+  return expect_ok(transmit(openpgp_process_apdu, OPENPGP_INS_PSO, timed_p1, timed_p2, timed_data, timed_lc));
+}
+
+static int openpgp_get_data(void) {
+  return expect_ok(
+      transmit(openpgp_process_apdu, OPENPGP_INS_GET_DATA, 0x00, TAG_APPLICATION_RELATED_DATA, NULL, 0));
+}
+
+// Sets the algorithm of a key and generates it, crt is B6 for the signature key and B8 for the decryption key
+static int openpgp_generate(uint8_t attr_tag, const uint8_t *attr, uint16_t attr_len, uint8_t crt) {
+  uint8_t data[] = {crt, 0x00};
+  if (expect_ok(transmit(openpgp_process_apdu, OPENPGP_INS_PUT_DATA, 0x00, attr_tag, attr, attr_len)) < 0) return -1;
+  return expect_ok(
+      transmit(openpgp_process_apdu, OPENPGP_INS_GENERATE_ASYMMETRIC_KEY_PAIR, 0x80, 0x00, data, sizeof(data)));
+}
+
+static int bench_openpgp_sign(const char *param, const uint8_t *attr, uint16_t attr_len) {
+  static uint8_t digest[32];
+  memset(digest, 0xA5, sizeof(digest));
+  if (openpgp_generate(TAG_ALGORITHM_ATTRIBUTES_SIG, attr, attr_len, 0xB6) < 0) return -1;
+  timed_p1 = 0x9E;
+  timed_p2 = 0x9A;
+  timed_data = digest;
+  timed_lc = sizeof(digest);
+  return measure("openpgp_sign", param, openpgp_verify_pw1_sign, openpgp_pso);
+}
+
+static int bench_openpgp(void) {
+  uint8_t ecdh_p256[7 + 65] = {0xA6, 0x46, 0x7F, 0x49, 0x43, 0x86, 0x41};
+  uint8_t ecdh_x25519[7 + 32] = {0xA6, 0x25, 0x7F, 0x49, 0x22, 0x86, 0x20};
+
+  if (expect_ok(transmit(openpgp_process_apdu, OPENPGP_INS_VERIFY, 0x00, 0x83, "12345678", 8)) < 0) return -1;
+  if (expect_ok(transmit(openpgp_process_apdu, OPENPGP_INS_VERIFY, 0x00, 0x82, "123456", 6)) < 0) return -1;
+
+  if (measure("openpgp_get_data", "6E", NULL, openpgp_get_data) < 0) return -1;
+
+  if (bench_openpgp_sign("rsa2048", pgp_rsa2k_attr, sizeof(pgp_rsa2k_attr)) < 0) return -1;
+  if (bench_openpgp_sign("p256", pgp_p256_ecdsa_attr, sizeof(pgp_p256_ecdsa_attr)) < 0) return -1;
+  if (bench_openpgp_sign("ed25519", pgp_ed25519_attr, sizeof(pgp_ed25519_attr)) < 0) return -1;
+
+  timed_p1 = 0x80;
+  timed_p2 = 0x86;
+  if (expect_ok(transmit(openpgp_process_apdu, OPENPGP_INS_PUT_DATA, 0x00, TAG_ALGORITHM_ATTRIBUTES_DEC,
+                         pgp_rsa2k_attr, sizeof(pgp_rsa2k_attr))) < 0)
+    return -1;
+  if (expect_ok(transmit(openpgp_process_apdu, OPENPGP_INS_IMPORT_KEY, 0x3F, 0xFF, rsa_dec_key,
+                         sizeof(rsa_dec_key) - 1)) < 0)
+    return -1;
+  timed_data = rsa_ciphertext;
+  timed_lc = sizeof(rsa_ciphertext) - 1;
+  if (measure("openpgp_decipher", "rsa2048", NULL, openpgp_pso) < 0) return -1;
+
+  // agree with the card's own public key, any point on the curve does
+  if (openpgp_generate(TAG_ALGORITHM_ATTRIBUTES_DEC, pgp_p256_ecdh_attr, sizeof(pgp_p256_ecdh_attr), 0xB8) < 0)
+    return -1;
+  memcpy(ecdh_p256 + 7, r_buf + 5, 65);
+  timed_data = ecdh_p256;
+  timed_lc = sizeof(ecdh_p256);
+  if (measure("openpgp_decipher", "p256", NULL, openpgp_pso) < 0) return -1;
+
+  if (openpgp_generate(TAG_ALGORITHM_ATTRIBUTES_DEC, pgp_cv25519_attr, sizeof(pgp_cv25519_attr), 0xB8) < 0)
+    return -1;
+  memcpy(ecdh_x25519 + 7, r_buf + 5, 32);
+  timed_data = ecdh_x25519;
+  timed_lc = sizeof(ecdh_x25519);
+  return measure("openpgp_decipher", "cv25519", NULL, openpgp_pso);
+}
+
+/*
+ * Block devices
+ */
+
+// Each block device gets a fresh card on its own thread, see __card_local
+static void *run_suite(void *arg) {
+  const char *name = arg;
+  struct lfs_config cfg;
+  lfs_rambd_t rambd;
+
+  bd_name = name;
+  memset(&cfg, 0, sizeof(cfg));
+  if (strcmp(name, "file") == 0) {
+    unlink(lfs_path);
+    card_fabrication_procedure(lfs_path);
+  } else {
+    // the geometry of the file block device in fabrication.c
+    cfg.context = &rambd;
+    cfg.read = &lfs_rambd_read;
+    cfg.prog = &lfs_rambd_prog;
+    cfg.erase = &lfs_rambd_erase;
+    cfg.sync = &lfs_rambd_sync;
+    cfg.read_size = 1;
+    cfg.prog_size = 512;
+    cfg.block_size = 512;
+    cfg.block_count = 256;
+    cfg.block_cycles = 50000;
+    cfg.cache_size = 512;
+    cfg.lookahead_size = 16;
+    if (lfs_rambd_create(&cfg) < 0) return (void *)1;
+    card_fabrication_procedure_with_config(&cfg);
+  }
+
+  int ret = bench_oath();
+  if (ret == 0) ret = bench_ctap();
+  if (ret == 0) ret = bench_piv();
+  if (ret == 0) ret = bench_openpgp();
+
+  if (strcmp(name, "ram") == 0) lfs_rambd_destroy(&cfg);
+  return ret == 0 ? NULL : (void *)1;
+}
+
+static void usage(const char *argv0) {
+  fprintf(stderr,
+          "Usage: %s [-b file|ram] [-n iterations] [-a accounts] [-f lfs file] [-o output] [-v]\n"
+          "Prints one JSON object per case, all block devices are measured if -b is not given\n",
+          argv0);
+}
+
+int main(int argc, char *argv[]) {
+  const char *only_bd = NULL, *output = NULL;
+  int verbose = 0, opt;
+  while ((opt = getopt(argc, argv, "b:n:a:f:o:vh")) != -1) {
+    switch (opt) {
+    case 'b':
+      only_bd = optarg;
+      break;
+    case 'n':
+      iterations = atoi(optarg);
+      break;
+    case 'a':
+      accounts = atoi(optarg);
+      break;
+    case 'f':
+      lfs_path = optarg;
+      break;
+    case 'o':
+      output = optarg;
+      break;
+    case 'v':
+      verbose = 1;
+      break;
+    default:
+      usage(argv[0]);
+      return opt == 'h' ? 0 : 1;
+    }
+  }
+  if (iterations <= 0 || accounts <= 0 ||
+      (only_bd && strcmp(only_bd, "file") != 0 && strcmp(only_bd, "ram") != 0)) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  results = output ? fopen(output, "w") : fdopen(dup(STDOUT_FILENO), "w");
+  if (results == NULL) {
+    perror("output");
+    return 1;
+  }
+  // debug messages of the applets go to stdout, keep them out of the results unless asked for
+  if (!verbose) freopen("/dev/null", "w", stdout);
+  samples = calloc(iterations, sizeof(samples[0]));
+
+  static const char *block_devices[] = {"file", "ram"};
+  int ret = 0;
+  for (size_t i = 0; i < sizeof(block_devices) / sizeof(block_devices[0]) && ret == 0; ++i) {
+    if (only_bd && strcmp(only_bd, block_devices[i]) != 0) continue;
+    pthread_t thread;
+    void *thread_ret;
+    if (pthread_create(&thread, NULL, run_suite, (void *)block_devices[i]) != 0) return 1;
+    pthread_join(thread, &thread_ret);
+    ret = thread_ret != NULL;
+  }
+
+  free(samples);
+  fclose(results);
+  return ret;
+}
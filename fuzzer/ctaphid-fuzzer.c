@@ -0,0 +1,53 @@
+// Feeds sequences of HID reports through the CTAPHID framing (init and continuation frames, channels, timeouts)
+#include <stdint.h>
+#include <string.h>
+
+#include <libhfuzz/libhfuzz.h>
+
+#include "ctaphid.h"
+#include "dummy.h"
+#include "fuzz-card.h"
+
+// An input is a sequence of steps. A step whose first byte has bit 7 set carries a report of HID_RPT_SIZE bytes for
+// the OUT endpoint, any other first byte advances the virtual clock by that many times 10 ms, which is enough to reach
+// the message timeout. CTAPHID_Loop runs after every step.
+#define STEP_REPORT 0x80
+#define CLOCK_UNIT 10
+
+static uint8_t fuzz_send_report(USBD_HandleTypeDef *pdev, uint8_t *report, uint16_t len) {
+  UNUSED(pdev);
+  UNUSED(report);
+  UNUSED(len);
+  // the host reads every report at once
+  CTAPHID_InEvent();
+  return 0;
+}
+
+int LLVMFuzzerInitialize(int *argc, char ***argv) {
+  UNUSED(argc);
+  UNUSED(argv);
+  fuzz_card_init();
+  return 0;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *buf, size_t len) {
+  fuzz_card_restore();
+  CTAPHID_Init(fuzz_send_report);
+
+  uint8_t report[HID_RPT_SIZE];
+  while (len > 0) {
+    uint8_t step = *buf++;
+    --len;
+    if (step & STEP_REPORT) {
+      if (len < HID_RPT_SIZE) break;
+      memcpy(report, buf, HID_RPT_SIZE);
+      buf += HID_RPT_SIZE;
+      len -= HID_RPT_SIZE;
+      CTAPHID_OutEvent(report);
+    } else {
+      virt_clock_advance(step * CLOCK_UNIT);
+    }
+    CTAPHID_Loop(0);
+  }
+  return 0;
+}
@@ -0,0 +1,64 @@
+#include "fuzz-card.h"
+#include "admin.h"
+#include "ccid.h"
+#include "ctap.h"
+#include "dummy.h"
+#include "fabrication.h"
+#include "oath.h"
+#include "openpgp.h"
+#include "piv.h"
+#include <bd/lfs_rambd.h>
+#include <fs.h>
+#include <scratch.h>
+#include <stdlib.h>
+#include <string.h>
+
+// the virtual clock starts here for every input
+#define FUZZ_CLOCK_START 1000
+
+static struct lfs_config cfg;
+static lfs_rambd_t bd;
+static uint8_t *snapshot;
+static size_t flash_size;
+
+void fuzz_card_init(void) {
+  // same geometry as the file backed card of the virt-card targets
+  cfg.context = &bd;
+  cfg.read = &lfs_rambd_read;
+  cfg.prog = &lfs_rambd_prog;
+  cfg.erase = &lfs_rambd_erase;
+  cfg.sync = &lfs_rambd_sync;
+  cfg.read_size = 1;
+  cfg.prog_size = 512;
+  cfg.block_size = 512;
+  cfg.block_count = 256;
+  cfg.block_cycles = 50000;
+  cfg.cache_size = 512;
+  cfg.lookahead_size = 16;
+  if (lfs_rambd_create(&cfg) < 0) abort();
+  flash_size = cfg.block_size * cfg.block_count;
+
+  virt_clock_simulate(FUZZ_CLOCK_START);
+  CCID_Init();
+  card_fabrication_procedure_with_config(&cfg);
+  snapshot = malloc(flash_size);
+  memcpy(snapshot, bd.buffer, flash_size);
+}
+
+void fuzz_card_restore(void) {
+  fs_deinit();
+  memcpy(bd.buffer, snapshot, flash_size);
+  fs_init(&cfg);
+
+  // the RAM state of the applets is not part of the flash image
+  apdu_reset_channels();
+  piv_poweroff();
+  ctap_reset_state();
+  oath_poweroff();
+  admin_install(); // reloads the config cached in RAM, the files exist already
+  openpgp_poweroff();
+  scratch_reset();
+  CCID_Init();
+  virt_clock_simulate(FUZZ_CLOCK_START);
+  srand(0);
+}
@@ -0,0 +1,13 @@
+#ifndef CANOKEY_CORE_FUZZER_FUZZ_CARD_H
+#define CANOKEY_CORE_FUZZER_FUZZ_CARD_H
+
+/**
+ * The fuzzed card lives in RAM. Its flash image is taken right after the fabrication and copied back by
+ * fuzz_card_restore, which also resets the RAM state of the applets and restarts the virtual clock, so that every
+ * input runs against the same card and a crash can be reproduced from the input alone.
+ * The transports are reset by the fuzz targets themselves.
+ */
+void fuzz_card_init(void);
+void fuzz_card_restore(void);
+
+#endif // CANOKEY_CORE_FUZZER_FUZZ_CARD_H
@@ -1,19 +1,15 @@
 
-#include <fcntl.h>
-#include <setjmp.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <sys/stat.h>
-#include <sys/types.h>
-#include <unistd.h>
+#include <string.h>
 
 #include <libhfuzz/libhfuzz.h>
 
 #include "admin.h"
 #include "ccid.h"
 #include "ctap.h"
-#include "fabrication.h"
+#include "fuzz-card.h"
 #include "oath.h"
 #include "openpgp.h"
 #include "piv.h"
@@ -24,43 +20,37 @@ applet_process_t *applets[] = {
     piv_process_apdu, ctap_process_apdu, oath_process_apdu, admin_process_apdu, openpgp_process_apdu,
 };
 
-extern ccid_bulkin_data_t bulkin_data[2];
-extern ccid_bulkout_data_t bulkout_data[2];
+extern __card_local ccid_bulkin_data_t bulkin_data[CCID_BUFFER_NUM];
+extern __card_local ccid_bulkout_data_t bulkout_data[CCID_BUFFER_NUM];
 static applet_process_t *process_func;
 
 int LLVMFuzzerInitialize(int *argc, char ***argv) {
-  static char lfs_root[64];
   process_func = NULL;
   if (*argc > 1) {
     int idx = atoi((*argv)[1]);
     if (idx >= 0 && idx < sizeof(applets) / sizeof(applets[0])) {
       process_func = applets[idx];
       printf("Applet %d Fuzzing Test\n", idx);
-      sprintf(lfs_root, "/tmp/fuzz_%d", idx);
     }
   }
-  if(!process_func){
-    printf("CCID Fuzzing Test\n");
-    sprintf(lfs_root, "/tmp/fuzz_ccid");
-  }
-  mkdir(lfs_root, 0777);
-  CCID_Init();
-  card_fabrication_procedure(lfs_root);
+  if (!process_func) printf("CCID Fuzzing Test\n");
+  fuzz_card_init();
   return 0;
 }
 
 int LLVMFuzzerTestOneInput(const uint8_t *buf, size_t len) {
+  fuzz_card_restore();
+
   if (!process_func) { // CCID Fuzzing Test
-    int Lun;
+    // the first byte used to select the buffer, it is kept so that the existing corpus stays valid
     if (len < 1 || buf[0] > 1) return 0;
-    Lun = buf[0];
     len--;
     buf++;
 
+    // PC_to_RDR_XfrBlock executes in the first buffer when called outside of CCID_Loop
     if (len > APDU_BUFFER_SIZE) len = APDU_BUFFER_SIZE;
-    memcpy(bulkout_data[Lun].abData, buf, len);
-    bulkout_data[Lun].dwLength = len;
-    // FIXME
+    memcpy(bulkout_data[0].abData, buf, len);
+    bulkout_data[0].dwLength = len;
     PC_to_RDR_XfrBlock();
 
   } else { // Applet Fuzzing Test
@@ -87,6 +77,7 @@ int LLVMFuzzerTestOneInput(const uint8_t *buf, size_t len) {
     PRINT_HEX(buf, len);
     capdu.le = MIN(capdu.le, APDU_BUFFER_SIZE);
     process_func(&capdu, &rapdu);
+    free((void *)capdu.data);
   }
   return 0;
 }
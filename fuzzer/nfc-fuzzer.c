@@ -0,0 +1,206 @@
+// Feeds sequences of ISO 14443-4 blocks and chip events through nfc_handler and nfc_loop, on top of a minimal
+// emulation of the FM11 register and FIFO protocol (see virt-card/fm11-nfc.c for the complete one)
+#include <stdint.h>
+#include <string.h>
+
+#include <libhfuzz/libhfuzz.h>
+
+#include "device.h"
+#include "dummy.h"
+#include "fuzz-card.h"
+#include "nfc.h"
+
+// An input is a sequence of steps, nfc_loop runs after every step and the frame sent by the card is read out:
+//   STEP_FRAME len data[len]  a frame from the reader, CRC included, fed through the FIFO
+//   STEP_ACTIVATE rats        the reader activates the card with this RATS parameter
+//   STEP_AUX_ERROR irq        a receive error reported in REG_AUX_IRQ
+//   STEP_FIELD_RESET          the card is reset by the field
+//   STEP_LATE_TIMER           the timer IRQ armed last arrives although it may have been cancelled
+//   anything else             advances the virtual clock by that many times 10 ms, expired timers fire
+enum { STEP_FRAME, STEP_ACTIVATE, STEP_AUX_ERROR, STEP_FIELD_RESET, STEP_LATE_TIMER };
+#define CLOCK_UNIT 10
+
+enum { SPI_NONE, SPI_REG_READ, SPI_REG_WRITE, SPI_FIFO_READ, SPI_FIFO_WRITE, SPI_EEPROM };
+
+static uint8_t regs[0x20], fifo[NFC_FIFO_SIZE], fifo_cnt;
+static uint8_t spi_mode, spi_first, spi_addr;
+static uint8_t tx_requested;
+
+static void (*timeout_callback)(void), (*last_callback)(void);
+static uint32_t timeout_deadline;
+
+/* ---------------------------------------------------------------- */
+/* FM11 chip                                                        */
+/* ---------------------------------------------------------------- */
+
+void fm_nss_low(void) {
+  spi_mode = SPI_NONE;
+  spi_first = 1;
+}
+
+void fm_nss_high(void) { spi_mode = SPI_NONE; }
+
+void fm_transmit(uint8_t *buf, uint8_t len) {
+  for (int i = 0; i < len; ++i) {
+    if (spi_first) {
+      spi_first = 0;
+      if (buf[i] == 0x80)
+        spi_mode = SPI_FIFO_WRITE;
+      else if (buf[i] == 0xA0)
+        spi_mode = SPI_FIFO_READ;
+      else if ((buf[i] & 0xE0) == 0x00)
+        spi_mode = SPI_REG_WRITE;
+      else if ((buf[i] & 0xE0) == 0x20)
+        spi_mode = SPI_REG_READ;
+      else
+        spi_mode = SPI_EEPROM; // the EEPROM plays no part in the framing
+      spi_addr = buf[i] & 0x1F;
+      continue;
+    }
+    if (spi_mode == SPI_REG_WRITE) {
+      if (spi_addr == REG_FIFO_FLUSH)
+        fifo_cnt = 0;
+      else if (spi_addr == REG_RF_TXEN && buf[i] == 0x55)
+        tx_requested = 1;
+      else
+        regs[spi_addr] = buf[i];
+      spi_addr = (spi_addr + 1) & 0x1F;
+    } else if (spi_mode == SPI_FIFO_WRITE && fifo_cnt < NFC_FIFO_SIZE) {
+      fifo[fifo_cnt++] = buf[i];
+    }
+  }
+}
+
+void fm_receive(uint8_t *buf, uint8_t len) {
+  for (int i = 0; i < len; ++i) {
+    if (spi_mode == SPI_REG_READ) {
+      if (spi_addr == REG_FIFO_WORDCNT) {
+        buf[i] = fifo_cnt;
+      } else {
+        buf[i] = regs[spi_addr];
+        // interrupt flags are cleared on read
+        if (spi_addr == REG_MAIN_IRQ || spi_addr == REG_FIFO_IRQ || spi_addr == REG_AUX_IRQ) regs[spi_addr] = 0;
+      }
+      spi_addr = (spi_addr + 1) & 0x1F;
+    } else if (spi_mode == SPI_FIFO_READ && fifo_cnt > 0) {
+      buf[i] = fifo[0];
+      memmove(fifo, fifo + 1, --fifo_cnt);
+    } else {
+      buf[i] = 0xFF;
+    }
+  }
+}
+
+// Every event is latched, only the ones left unmasked interrupt the MCU, as the firmware programs the masks
+static void raise_irq(uint8_t main_irq, uint8_t fifo_irq, uint8_t aux_irq) {
+  regs[REG_FIFO_IRQ] |= fifo_irq;
+  regs[REG_AUX_IRQ] |= aux_irq;
+  if (fifo_irq & ~regs[REG_FIFO_IRQ_MASK]) main_irq |= MAIN_IRQ_FIFO;
+  if (aux_irq & ~regs[REG_AUX_IRQ_MASK]) main_irq |= MAIN_IRQ_AUX;
+  regs[REG_MAIN_IRQ] |= main_irq;
+  if (main_irq & ~regs[REG_MAIN_IRQ_MASK]) nfc_handler();
+}
+
+// the frame fills the FIFO byte by byte, FIFO_IRQ_WATER_LEVEL is raised when less room than the level is left
+static void send_to_card(const uint8_t *frame, uint16_t len) {
+  for (uint16_t pos = 0; pos < len; ++pos) {
+    if (fifo_cnt == NFC_FIFO_SIZE) {
+      raise_irq(0, FIFO_IRQ_OVERFLOW, 0);
+      return;
+    }
+    fifo[fifo_cnt++] = frame[pos];
+    if (fifo_cnt == NFC_FIFO_SIZE - NFC_FIFO_WATER_LEVEL + 1) raise_irq(0, FIFO_IRQ_WATER_LEVEL, 0);
+  }
+  raise_irq(MAIN_IRQ_RX_DONE, 0, 0);
+}
+
+// the FIFO goes on air byte by byte, FIFO_IRQ_WATER_LEVEL is raised when fewer bytes than the level are left
+static void receive_from_card(void) {
+  if (!tx_requested) return;
+  tx_requested = 0;
+  while (fifo_cnt > 0) {
+    memmove(fifo, fifo + 1, --fifo_cnt);
+    if (fifo_cnt == NFC_FIFO_WATER_LEVEL - 1) raise_irq(0, FIFO_IRQ_WATER_LEVEL, 0);
+  }
+  raise_irq(MAIN_IRQ_TX_DONE, 0, 0);
+}
+
+/* ---------------------------------------------------------------- */
+/* Timer                                                            */
+/* ---------------------------------------------------------------- */
+
+void device_set_timeout(void (*callback)(void), uint16_t timeout) {
+  timeout_callback = callback;
+  timeout_deadline = device_get_tick() + timeout;
+  if (callback != NULL) last_callback = callback;
+}
+
+static void fire_timer(void (*callback)(void)) {
+  if (callback == NULL) return;
+  timeout_callback = NULL;
+  callback();
+  receive_from_card();
+}
+
+static void advance_clock(uint32_t ms) {
+  virt_clock_advance(ms);
+  // the callback may arm the timer again
+  while (timeout_callback != NULL && (int32_t)(device_get_tick() - timeout_deadline) >= 0)
+    fire_timer(timeout_callback);
+}
+
+/* ---------------------------------------------------------------- */
+/* Reader                                                           */
+/* ---------------------------------------------------------------- */
+
+int LLVMFuzzerInitialize(int *argc, char ***argv) {
+  UNUSED(argc);
+  UNUSED(argv);
+  fuzz_card_init();
+  return 0;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *buf, size_t len) {
+  fuzz_card_restore();
+  memset(regs, 0, sizeof(regs));
+  fifo_cnt = 0;
+  tx_requested = 0;
+  timeout_callback = last_callback = NULL;
+  set_nfc_state(1);
+  nfc_init();
+
+  while (len > 0) {
+    uint8_t step = *buf++;
+    --len;
+    switch (step) {
+    case STEP_FRAME:
+      if (len < 1 || len < 1 + (size_t)buf[0]) return 0;
+      send_to_card(buf + 1, buf[0]);
+      len -= 1 + buf[0];
+      buf += 1 + buf[0];
+      break;
+    case STEP_ACTIVATE:
+      if (len < 1) return 0;
+      regs[REG_RF_RATS] = *buf++;
+      --len;
+      raise_irq(MAIN_IRQ_RF_ON | MAIN_IRQ_ACTIVE, 0, 0);
+      break;
+    case STEP_AUX_ERROR:
+      if (len < 1) return 0;
+      raise_irq(0, 0, *buf++);
+      --len;
+      break;
+    case STEP_FIELD_RESET:
+      nfc_init();
+      break;
+    case STEP_LATE_TIMER:
+      fire_timer(last_callback);
+      break;
+    default:
+      advance_clock(step * CLOCK_UNIT);
+    }
+    nfc_loop();
+    receive_from_card();
+  }
+  return 0;
+}
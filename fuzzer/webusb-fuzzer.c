@@ -0,0 +1,66 @@
+// Feeds sequences of vendor control requests through the WebUSB command/response state machine
+#include <stdint.h>
+#include <string.h>
+
+#include <libhfuzz/libhfuzz.h>
+
+#include "fuzz-card.h"
+#include "webusb.h"
+
+// An input is a sequence of steps: bRequest, then wLength in little endian. The data stage of WEBUSB_REQ_CMD takes
+// the next wLength bytes of the input, and the data stage of the other requests is completed at once.
+// WebUSB_Loop runs after every step.
+#define STEP_HEADER_SIZE 3
+
+static USBD_HandleTypeDef usb_device;
+static uint8_t *rx_buffer;
+static uint16_t rx_size;
+
+USBD_StatusTypeDef USBD_LL_PrepareReceive(USBD_HandleTypeDef *pdev, uint8_t ep_addr, uint8_t *pbuf, uint16_t size) {
+  UNUSED(pdev);
+  if (ep_addr == 0) {
+    rx_buffer = pbuf;
+    rx_size = size;
+  }
+  return USBD_OK;
+}
+
+int LLVMFuzzerInitialize(int *argc, char ***argv) {
+  UNUSED(argc);
+  UNUSED(argv);
+  fuzz_card_init();
+  return 0;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *buf, size_t len) {
+  fuzz_card_restore();
+  USBD_WEBUSB_Init(&usb_device);
+
+  while (len >= STEP_HEADER_SIZE) {
+    USBD_SetupReqTypedef req = {
+        .bmRequest = 0xC1, // vendor request to the interface
+        .bRequest = buf[0],
+        .wValue = 0,
+        .wIndex = 1,
+        .wLength = buf[1] | (buf[2] << 8),
+    };
+    buf += STEP_HEADER_SIZE;
+    len -= STEP_HEADER_SIZE;
+    if (req.bRequest == WEBUSB_REQ_CMD) req.bmRequest = 0x41;
+
+    rx_buffer = NULL;
+    if (USBD_WEBUSB_Setup(&usb_device, &req) == USBD_OK) {
+      if (rx_buffer != NULL) {
+        if (len < rx_size) break;
+        memcpy(rx_buffer, buf, rx_size);
+        buf += rx_size;
+        len -= rx_size;
+        USBD_WEBUSB_RxReady(&usb_device);
+      } else {
+        USBD_WEBUSB_TxSent(&usb_device);
+      }
+    }
+    WebUSB_Loop();
+  }
+  return 0;
+}
@@ -14,12 +14,16 @@
 #define ADMIN_INS_READ_VERSION 0x31
 #define ADMIN_INS_CONFIG 0x40
 #define ADMIN_INS_READ_FLASH_CAP 0x41
+#define ADMIN_INS_LATENCY 0x42
 #define ADMIN_INS_SELECT 0xA4
 #define ADMIN_INS_VENDOR_SPECIFIC 0xFF
 
 #define ADMIN_P1_CFG_LED_ON 0x01
 #define ADMIN_P1_CFG_KBDIFACE 0x03
 
+#define ADMIN_P1_LATENCY_READ 0x00
+#define ADMIN_P1_LATENCY_RESET 0x01
+
 typedef struct {
     uint32_t reserved;
     uint32_t led_normally_on : 1;
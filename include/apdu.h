@@ -26,11 +26,14 @@ typedef struct {
 #define SW_WRONG_LENGTH 0x6700
 #define SW_UNABLE_TO_PROCESS 0x6900
 #define SW_SECURITY_STATUS_NOT_SATISFIED 0x6982
+#define SW_LOGICAL_CHANNEL_NOT_SUPPORTED 0x6881
+#define SW_LAST_COMMAND_EXPECTED 0x6883
 #define SW_AUTHENTICATION_BLOCKED 0x6983
 #define SW_DATA_INVALID 0x6984
 #define SW_CONDITIONS_NOT_SATISFIED 0x6985
 #define SW_COMMAND_NOT_ALLOWED 0x6986
 #define SW_WRONG_DATA 0x6A80
+#define SW_FUNCTION_NOT_SUPPORTED 0x6A81
 #define SW_FILE_NOT_FOUND 0x6A82
 #define SW_NOT_ENOUGH_SPACE 0x6A84
 #define SW_WRONG_P1P2 0x6A86
@@ -58,6 +61,24 @@ typedef struct {
     return 0;                                                                                                          \
   } while (0)
 
+// Logical channels, encoded in b1-b2 of the first interindustry CLA
+
+#define LOGICAL_CHANNEL_NUM 4
+#define CLA_CHANNEL_MASK 0x03
+#define INS_MANAGE_CHANNEL 0x70
+
+// Applets
+
+enum APPLET {
+  APPLET_NULL,
+  APPLET_PIV,
+  APPLET_FIDO,
+  APPLET_OATH,
+  APPLET_ADMIN,
+  APPLET_OPENPGP,
+  APPLET_ENUM_END,
+};
+
 // Chainings
 
 #define APDU_CHAINING_NOT_LAST_BLOCK 0x01
@@ -79,6 +100,12 @@ int build_capdu(CAPDU *capdu, const uint8_t *cmd, uint16_t len);
 int apdu_input(CAPDU_CHAINING *ex, const CAPDU *sh);
 int apdu_output(RAPDU_CHAINING *ex, RAPDU *sh);
 void applet_poweroff(void);
+/**
+ * Power off the applets and return the logical channels to their state at power on: only the basic channel is open
+ * and no applet is selected. For hosts keeping one card across power cycles, e.g. the fuzzers.
+ */
+void apdu_reset_channels(void);
+enum APPLET get_current_applet(uint8_t cla);
 void process_apdu(CAPDU *capdu, RAPDU *rapdu);
 
 #endif // CANOKEY_CORE__APDU_H
@@ -0,0 +1,26 @@
+#ifndef CANOKEY_CORE_INCLUDE_APDU_POOL_H
+#define CANOKEY_CORE_INCLUDE_APDU_POOL_H
+
+#include "common.h"
+
+// Number of APDU buffers shared by the transports and the chaining of process_apdu. Two cover a command over NFC,
+// or a CTAPHID message, that runs while a chained command or a long response holds the chaining buffer. A third
+// transport finding the pool empty fails its command: CTAPHID with ERR_CHANNEL_BUSY, WebUSB with a stall, chaining
+// with SW_UNABLE_TO_PROCESS and NFC leaves the block unanswered.
+#ifndef APDU_POOL_SIZE
+#define APDU_POOL_SIZE 2
+#endif
+
+// A buffer holds a full APDU, followed by the status word appended by the transports
+#define APDU_POOL_BUFFER_SIZE (APDU_BUFFER_SIZE + 2)
+
+/**
+ * Borrow a buffer of APDU_POOL_BUFFER_SIZE bytes. It may be called from an interrupt handler.
+ *
+ * @return NULL if all buffers are in use
+ */
+uint8_t *apdu_pool_acquire(void);
+void apdu_pool_release(uint8_t *buf);
+uint8_t apdu_pool_available(void);
+
+#endif // CANOKEY_CORE_INCLUDE_APDU_POOL_H
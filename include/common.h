@@ -12,15 +12,32 @@
 #ifdef DEBUG_OUTPUT
 #include <crypto-util.h>
 #include <stdio.h>
+#ifdef DEBUG_LOG_RING
+// formatted later by debug_log_flush from the main loop
+#include <debug_log.h>
+#define DBG_MSG(format, ...) debug_log_msg(DEBUG_LOG_DBG, __func__, __LINE__, format, ##__VA_ARGS__)
+#define ERR_MSG(format, ...) debug_log_msg(DEBUG_LOG_ERR, __func__, __LINE__, format, ##__VA_ARGS__)
+#define PRINT_HEX(...) debug_log_hex(__VA_ARGS__)
+#else
 #define DBG_MSG(format, ...) printf("[DBG] %s(%d): " format, __func__, __LINE__, ##__VA_ARGS__)
 #define ERR_MSG(format, ...) printf("[ERR] %s(%d): " format, __func__, __LINE__, ##__VA_ARGS__)
 #define PRINT_HEX(...) print_hex(__VA_ARGS__)
+#endif
 #else
 #define DBG_MSG(...)
 #define ERR_MSG(...)
 #define PRINT_HEX(...)
 #endif
 
+#ifdef ENABLE_TRACE
+#include <trace.h>
+#define TRACE_BEGIN(id) trace_record(TRACE_##id, TRACE_PHASE_BEGIN)
+#define TRACE_END(id) trace_record(TRACE_##id, TRACE_PHASE_END)
+#else
+#define TRACE_BEGIN(id)
+#define TRACE_END(id)
+#endif
+
 #if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
 #define htobe32(x) (x)
 #define htobe16(x) (x)
@@ -42,6 +59,14 @@
 #define __weak __attribute__((weak))
 #define __packed __attribute__((packed))
 
+// Mutable state of the card. Virtual cards keep one copy per thread, so one process can run a card on each thread,
+// unless HOST_THREADS is defined to drive a single card from several threads.
+#if defined(TEST) && !defined(HOST_THREADS)
+#define __card_local _Thread_local
+#else
+#define __card_local
+#endif
+
 // get length of tlv with bounds checking
 uint16_t tlv_get_length_safe(const uint8_t *data, const size_t len, int *fail, size_t *length_size);
 
@@ -0,0 +1,53 @@
+#ifndef CANOKEY_CORE_INCLUDE_CRYPTO_OFFLOAD_H
+#define CANOKEY_CORE_INCLUDE_CRYPTO_OFFLOAD_H
+
+#include <aes.h>
+#include <des.h>
+#include <ecc.h>
+#include <ed25519.h>
+#include <hmac.h>
+#include <rsa.h>
+#include <sha.h>
+
+// Cryptographic primitives used by the applets. Each one is a weak symbol calling the software implementation of
+// canokey-crypto, a port with a crypto engine overrides the ones it accelerates. An override may still call the
+// software implementation, e.g. for a curve the engine does not support.
+//
+// The overrides are independent: the software HMAC, the PKCS #1 v1.5 padding and the key generation keep using the
+// software hash and RSA, so offload them too if they matter.
+//
+// The software RSA key generation calls device_yield for every prime candidate it draws, so the keepalives, the
+// keyboard and the LED are served during the search. An engine searching the primes itself should do the same.
+//
+// The arguments and return values are those of canokey-crypto. The SHA-256 stream is not reentrant, as in
+// canokey-crypto: only one may be running at a time.
+
+void crypto_sha256_init(void);
+void crypto_sha256_update(const uint8_t *data, uint16_t len);
+void crypto_sha256_final(uint8_t digest[SHA256_DIGEST_LENGTH]);
+void crypto_sha256_raw(const uint8_t *data, size_t len, uint8_t digest[SHA256_DIGEST_LENGTH]);
+
+void crypto_hmac_sha1(const uint8_t *key, uint8_t keylen, const uint8_t *msg, uint32_t msglen, uint8_t *hmac);
+void crypto_hmac_sha256(const uint8_t *key, uint8_t keylen, const uint8_t *msg, uint32_t msglen, uint8_t *hmac);
+
+int crypto_aes256_enc(const uint8_t *in, uint8_t *out, const uint8_t *key);
+int crypto_aes256_dec(const uint8_t *in, uint8_t *out, const uint8_t *key);
+int crypto_tdes_enc(const uint8_t *in, uint8_t *out, const uint8_t *key);
+int crypto_tdes_dec(const uint8_t *in, uint8_t *out, const uint8_t *key);
+
+int crypto_ecc_generate(ECC_Curve curve, uint8_t *priv_key, uint8_t *pub_key);
+int crypto_ecc_get_public_key(ECC_Curve curve, const uint8_t *priv_key, uint8_t *pub_key);
+int crypto_ecdsa_sign(ECC_Curve curve, const uint8_t *priv_key, const uint8_t *digest, uint8_t *sig);
+int crypto_ecdh_decrypt(ECC_Curve curve, const uint8_t *priv_key, const uint8_t *receiver_pub_key, uint8_t *out);
+
+int crypto_rsa_generate_key(rsa_key_t *key);
+int crypto_rsa_private(const rsa_key_t *key, const uint8_t *input, uint8_t *output);
+int crypto_rsa_sign_pkcs_v15(const rsa_key_t *key, const uint8_t *data, size_t len, uint8_t *sig);
+int crypto_rsa_decrypt_pkcs_v15(const rsa_key_t *key, const uint8_t *in, size_t *olen, uint8_t *out);
+
+void crypto_ed25519_publickey(const ed25519_secret_key sk, ed25519_public_key pk);
+void crypto_ed25519_sign(const unsigned char *m, size_t mlen, const ed25519_secret_key sk, const ed25519_public_key pk,
+                         ed25519_signature rs);
+void crypto_curve25519_scalarmult(uint8_t *out, const uint8_t *secret, const uint8_t *basepoint);
+
+#endif // CANOKEY_CORE_INCLUDE_CRYPTO_OFFLOAD_H
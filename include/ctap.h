@@ -4,6 +4,17 @@
 #include <apdu.h>
 #include <stdint.h>
 
+/**
+ * Drop the state kept for GET NEXT ASSERTION, when the applet is deselected or powered off. The PIN failures counted
+ * since the card was started are kept, as deselecting the applet is no power cycle.
+ */
+void ctap_poweroff(void);
+/**
+ * Return the RAM state to the one at power on, which ctap_poweroff keeps the PIN token, the key agreement key and the
+ * PIN failures of.
+ * For hosts keeping one card across power cycles, e.g. the fuzzers.
+ */
+void ctap_reset_state(void);
 uint8_t ctap_install(uint8_t reset);
 int ctap_install_private_key(const CAPDU *capdu, RAPDU *rapdu);
 int ctap_install_cert(const CAPDU *capdu, RAPDU *rapdu);
@@ -0,0 +1,46 @@
+#ifndef CANOKEY_CORE_INCLUDE_DEBUG_LOG_H
+#define CANOKEY_CORE_INCLUDE_DEBUG_LOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Size of the ring holding the records that have not been printed yet
+#ifndef DEBUG_LOG_RING_SIZE
+#define DEBUG_LOG_RING_SIZE 4096
+#endif
+
+// Hex dumps are truncated to this many bytes, the original length is kept
+#ifndef DEBUG_LOG_HEX_MAX
+#define DEBUG_LOG_HEX_MAX 64
+#endif
+
+// Strings passed for %s are copied, up to this many bytes
+#ifndef DEBUG_LOG_STR_MAX
+#define DEBUG_LOG_STR_MAX 32
+#endif
+
+// Number of records printed by each debug_log_flush from the main loop
+#ifndef DEBUG_LOG_FLUSH_BATCH
+#define DEBUG_LOG_FLUSH_BATCH 4
+#endif
+
+#define DEBUG_LOG_DBG 0
+#define DEBUG_LOG_ERR 1
+#define DEBUG_LOG_HEX 2
+
+/**
+ * Store a message without formatting it. The format string and the function name must be string literals, as
+ * only their addresses are kept. The message is cut at %n, %lc and %ls, which cannot be recorded.
+ */
+void debug_log_msg(uint8_t level, const char *func, uint16_t line, const char *format, ...)
+    __attribute__((format(printf, 4, 5)));
+void debug_log_hex(const uint8_t *buf, size_t len);
+/**
+ * Format and print the oldest records
+ *
+ * @param max_records the max number of records to print
+ * @return the number of records printed
+ */
+uint16_t debug_log_flush(uint16_t max_records);
+
+#endif // CANOKEY_CORE_INCLUDE_DEBUG_LOG_H
@@ -11,6 +11,8 @@
 #define USER_PRESENCE_CANCEL 1
 #define USER_PRESENCE_TIMEOUT 2
 
+#define MAX_BACKGROUND_TASKS 6
+
 // functions should be implemented by device
 void device_delay(int ms);
 uint32_t device_get_tick(void);
@@ -38,6 +40,18 @@ void device_update_led(void);
  */
 void start_blinking(uint8_t sec);
 void stop_blinking(void);
+/**
+ * Register a task run by device_yield
+ * @param task the task, should return quickly and must not process commands
+ * @param period minimum interval between two runs, in ms
+ * @return 0 on success, -1 if the task table is full
+ */
+int device_add_background_task(void (*task)(void), uint16_t period);
+/**
+ * Let background tasks (CTAPHID keepalive, keyboard typing, LED, ...) run. Called by long running operations
+ * between their steps; a crypto backend may call it inside its own loops as well.
+ */
+void device_yield(void);
 void fm_read_reg(uint8_t reg, uint8_t *buf, uint8_t len);
 void fm_write_reg(uint8_t reg, uint8_t *buf, uint8_t len);
 void fm_read_eeprom(uint16_t addr, uint8_t *buf, uint8_t len);
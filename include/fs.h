@@ -4,6 +4,8 @@
 #include <lfs.h>
 
 int fs_init(struct lfs_config *cfg);
+// Releases the caches of the mounted filesystem, fs_init has to be called again before any other access
+int fs_deinit(void);
 int read_file(const char *path, void *buf, lfs_soff_t off, lfs_size_t len);
 int write_file(const char *path, const void *buf, lfs_soff_t off, lfs_size_t len, uint8_t trunc);
 int read_attr(const char *path, uint8_t attr, void *buf, lfs_size_t len);
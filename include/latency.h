@@ -0,0 +1,33 @@
+#ifndef CANOKEY_CORE_INCLUDE_LATENCY_H
+#define CANOKEY_CORE_INCLUDE_LATENCY_H
+
+#include "common.h"
+
+// Bucket 0 counts durations below 1ms, bucket i counts [2^(i-1), 2^i) ms and the last one everything beyond
+#ifndef LATENCY_BUCKET_NUM
+#define LATENCY_BUCKET_NUM 16
+#endif
+
+// Number of distinct (applet, command) pairs that can be tracked
+#ifndef LATENCY_ENTRY_NUM
+#define LATENCY_ENTRY_NUM 16
+#endif
+
+// Pseudo applet of the CTAP2 commands, whose codes collide with the U2F instructions
+#define LATENCY_APPLET_CTAP2 0xF0
+
+#define LATENCY_FORMAT_VERSION 1
+#define LATENCY_EXPORT_SIZE (4 + LATENCY_ENTRY_NUM * (2 + LATENCY_BUCKET_NUM * 2))
+
+void latency_record(uint8_t applet, uint8_t cmd, uint32_t duration);
+/**
+ * Export the histograms, in big endian:
+ * version (1), bucket num (1), dropped records (2), then for each entry in use:
+ * applet (1), command (1), bucket counters (2 * bucket num)
+ *
+ * @return length of the export
+ */
+uint16_t latency_export(uint8_t *buf);
+void latency_reset(void);
+
+#endif // CANOKEY_CORE_INCLUDE_LATENCY_H
@@ -37,6 +37,7 @@
 #define PCB_R_BLOCK 0x80
 #define PCB_S_BLOCK 0xC0
 #define PCB_I_CHAINING 0x10
+#define PCB_CID 0x08
 
 #define R_BLOCK_MASK 0xB2
 #define R_ACK 0xA2
@@ -44,6 +45,19 @@
 
 #define S_WTX 0xF2
 
+// Frame overhead of ISO 14443-4 blocks: PCB and CRC, CID and NAD are not used
+#define NFC_FRAME_OVERHEAD 3
+// Frame size for FSDI/FSCI = 2, used before the reader tells its FSD
+#define NFC_DEFAULT_FRAME_SIZE 32
+#define NFC_MAX_FRAME_SIZE 256
+// Size of the FIFO of the FM11 chip
+#define NFC_FIFO_SIZE 32
+// The FM11 raises FIFO_IRQ_WATER_LEVEL when fewer bytes than this are left in the FIFO when transmitting,
+// or when less room than this is left in the FIFO when receiving. The level is fixed by the chip.
+#define NFC_FIFO_WATER_LEVEL 8
+// FSCI of NFC_MAX_FRAME_SIZE. The FM11 serves the ATS from its EEPROM, which is provisioned by the platform.
+#define NFC_FSCI 8
+
 #define NFC_STATE_IDLE 0x00
 #define NFC_STATE_BUSY 0x01
 
@@ -0,0 +1,36 @@
+#ifndef CANOKEY_CORE_INCLUDE_RECORD_H
+#define CANOKEY_CORE_INCLUDE_RECORD_H
+
+#include <apdu.h>
+
+/*
+ * A record starts with RECORD_MAGIC and RECORD_VERSION. Then each command follows as a record_header_t and len bytes
+ * of the command. Integers are little endian.
+ */
+#define RECORD_MAGIC "CKRC"
+#define RECORD_VERSION 1
+
+enum RECORD_INTERFACE {
+  RECORD_APDU = 1,    // a command APDU given to process_apdu, in short or extended form
+  RECORD_CTAPHID = 2, // an output report of CTAPHID
+};
+
+typedef struct {
+  uint32_t timestamp; // in us
+  uint8_t interface;
+  uint16_t len;
+} __packed record_header_t;
+
+#ifdef ENABLE_RECORD
+void record_apdu(const CAPDU *capdu);
+void record_command(uint8_t interface, const uint8_t *data, uint16_t len);
+#else
+#define record_apdu(capdu)
+#define record_command(interface, data, len)
+#endif
+
+// Provided by the platform, a record is passed in several pieces. May be called from the USB interrupt.
+void record_write(const void *buf, uint16_t len);
+uint32_t record_timestamp(void);
+
+#endif // CANOKEY_CORE_INCLUDE_RECORD_H
@@ -0,0 +1,50 @@
+#ifndef CANOKEY_CORE_INCLUDE_SCRATCH_H
+#define CANOKEY_CORE_INCLUDE_SCRATCH_H
+
+#include "common.h"
+
+// Working memory shared by the commands, instead of a static or a stack frame for each applet
+#ifndef SCRATCH_SIZE
+#define SCRATCH_SIZE 1536
+#endif
+
+/**
+ * Open a frame for a command. Everything allocated after it is freed, and cleared, by scratch_end.
+ * Frames nest: a command may run inside another one, e.g. process_apdu while CTAP waits for the user.
+ *
+ * @return the mark to pass to scratch_end
+ */
+size_t scratch_begin(void);
+void scratch_end(size_t mark);
+
+/**
+ * Allocate from the current frame, aligned for any type and not cleared.
+ *
+ * @return NULL if the scratch memory is exhausted
+ */
+void *scratch_alloc(size_t size);
+
+/**
+ * Claim the persistent region, which keeps the state of one owner between commands, e.g. from GET ASSERTION to GET
+ * NEXT ASSERTION. The previous region, of any owner, is released first.
+ *
+ * @param owner an enum APPLET
+ * @return NULL if the scratch memory is exhausted
+ */
+void *scratch_persist(uint8_t owner, size_t size);
+
+/**
+ * @return the persistent region claimed by owner, or NULL if it has been released or claimed by another owner
+ */
+void *scratch_persisted(uint8_t owner);
+
+// Release and clear the persistent region if it belongs to owner
+void scratch_release(uint8_t owner);
+
+// Free and clear the frames and the persistent region, e.g. when the card is restored between fuzz inputs
+void scratch_reset(void);
+
+// Most bytes in use at once, to size SCRATCH_SIZE
+size_t scratch_peak(void);
+
+#endif // CANOKEY_CORE_INCLUDE_SCRATCH_H
@@ -0,0 +1,42 @@
+#ifndef CANOKEY_CORE_INCLUDE_TRACE_H
+#define CANOKEY_CORE_INCLUDE_TRACE_H
+
+#include <stdint.h>
+
+// Number of events kept, the oldest ones are overwritten
+#ifndef TRACE_RING_SIZE
+#define TRACE_RING_SIZE 4096
+#endif
+
+#define TRACE_PHASE_BEGIN 'B'
+#define TRACE_PHASE_END 'E'
+
+// Use TRACE_BEGIN(id) / TRACE_END(id) from common.h, without the TRACE_ prefix
+enum TRACE_ID {
+  TRACE_READ_FILE,
+  TRACE_WRITE_FILE,
+  TRACE_SHA256,
+  TRACE_HMAC_SHA256,
+  TRACE_ECC_PUBKEY,
+  TRACE_ECDSA_SIGN,
+  TRACE_CTAP_PARSE,
+  TRACE_CTAP_CBOR,
+  TRACE_CTAP_ENCODE,
+  TRACE_ID_END,
+};
+
+typedef struct {
+  uint32_t timestamp; // in us
+  uint8_t id;
+  uint8_t phase;
+} trace_event_t;
+
+void trace_record(uint8_t id, uint8_t phase);
+uint32_t trace_timestamp(void);
+uint32_t trace_count(void);
+// Events are numbered from the oldest one kept
+const trace_event_t *trace_get(uint32_t idx);
+const char *trace_name(uint8_t id);
+void trace_clear(void);
+
+#endif // CANOKEY_CORE_INCLUDE_TRACE_H
@@ -1,34 +1,80 @@
 #include "nfc.h"
 #include "apdu.h"
+#include "apdu_pool.h"
 #include "device.h"
 
 #define WTX_PERIOD 150
+// The reader extends its waiting time to WTXM * FWT, and FWT is capped at FWTmax (about 4.9s)
+#define WTX_MAX_DEADLINE 4800
+#define WTXM_MAX (WTX_MAX_DEADLINE / WTX_PERIOD)
+#define COST_TABLE_SIZE 16
 
-static volatile uint32_t state_spinlock;
-static volatile enum { TO_RECEIVE, TO_SEND } next_state;
-static uint8_t block_number, rx_frame_size, rx_frame_buf[32], tx_frame_buf[32];
-static uint8_t apdu_buffer[APDU_BUFFER_SIZE], inf_sending;
-static uint16_t apdu_buffer_rx_size, apdu_buffer_tx_size;
-static uint16_t apdu_buffer_sent, last_sent;
-static CAPDU apdu_cmd;
-static RAPDU apdu_resp;
+typedef struct {
+  uint8_t applet, ins, p1;
+  uint16_t cost; // in ms
+} command_cost_t;
+
+// Estimated durations of long commands. The table starts with the known expensive ones and learns from the
+// measured durations, so that the algorithm of the key in use is taken into account.
+static __card_local command_cost_t cost_table[COST_TABLE_SIZE] = {
+    {APPLET_OPENPGP, 0x2A, 0x9E, 1500},  // PSO: COMPUTE DIGITAL SIGNATURE
+    {APPLET_OPENPGP, 0x2A, 0x80, 1500},  // PSO: DECIPHER
+    {APPLET_OPENPGP, 0x88, 0x00, 1500},  // INTERNAL AUTHENTICATE
+    {APPLET_OPENPGP, 0x47, 0x80, 30000}, // GENERATE ASYMMETRIC KEY PAIR
+    {APPLET_PIV, 0x87, 0x07, 1500},      // GENERAL AUTHENTICATE with RSA 2048
+    {APPLET_PIV, 0x47, 0x00, 30000},     // GENERATE ASYMMETRIC KEY PAIR
+};
+static __card_local uint8_t cost_victim;
+static __card_local uint32_t cmd_start;
+static __card_local uint16_t cmd_cost;
+
+static __card_local volatile uint32_t state_spinlock;
+static __card_local volatile enum { TO_RECEIVE, TO_SEND } next_state;
+static __card_local uint8_t block_number, rx_frame_buf[NFC_MAX_FRAME_SIZE], tx_frame_buf[NFC_MAX_FRAME_SIZE];
+static __card_local uint8_t rx_overflow;
+static __card_local uint16_t rx_frame_size, rx_fifo_cnt; // bytes of the received frame read from the FIFO so far
+static __card_local volatile uint8_t tx_active;
+static __card_local uint16_t tx_frame_size, tx_fifo_cnt; // bytes of the transmitted frame written to the FIFO so far
+static __card_local uint16_t fsd;                        // the max frame size accepted by the reader
+// borrowed at the first block, kept in the field for retransmissions
+static __card_local uint8_t *apdu_buffer, inf_sending;
+static __card_local uint16_t apdu_buffer_rx_size, apdu_buffer_tx_size;
+static __card_local uint16_t apdu_buffer_sent, last_sent;
+static __card_local CAPDU apdu_cmd;
+static __card_local RAPDU apdu_resp;
+
+// FSDI/FSCI to frame size, RFU values are treated as the largest size we support
+static const uint16_t frame_size_table[] = {16, 24, 32, 40, 48, 64, 96, 128, 256};
+
+static uint16_t nfc_frame_size(uint8_t fsi) {
+  if (fsi >= sizeof(frame_size_table) / sizeof(frame_size_table[0])) return NFC_MAX_FRAME_SIZE;
+  return frame_size_table[fsi];
+}
 
 void nfc_init(void) {
   block_number = 1;
+  fsd = NFC_DEFAULT_FRAME_SIZE;
+  rx_fifo_cnt = 0;
+  rx_overflow = 0;
+  tx_active = 0;
   apdu_buffer_rx_size = 0;
   apdu_buffer_tx_size = 0;
   last_sent = 0;
   inf_sending = 0;
   state_spinlock = 0;
   next_state = TO_RECEIVE;
-  apdu_cmd.data = apdu_buffer;
-  apdu_resp.data = apdu_buffer;
+  apdu_pool_release(apdu_buffer);
+  apdu_buffer = NULL;
   fm_write_reg(REG_FIFO_FLUSH, &inf_sending, 1); // writing anything to this reg will flush FIFO buffer
+  // long frames are streamed through the FIFO, the other FIFO events are not used
+  uint8_t mask = (uint8_t)~FIFO_IRQ_WATER_LEVEL;
+  fm_write_reg(REG_FIFO_IRQ_MASK, &mask, 1);
 }
 
 static void nfc_error_handler(int code) {
   DBG_MSG("NFC Error %d\n", code);
   block_number = 1;
+  rx_fifo_cnt = 0;
   apdu_buffer_rx_size = 0;
   apdu_buffer_tx_size = 0;
   last_sent = 0;
@@ -36,7 +82,7 @@ static void nfc_error_handler(int code) {
 }
 
 static void do_nfc_send_frame(uint8_t prologue, uint8_t *data, uint8_t len) {
-  if (len > 29) return;
+  if (len > fsd - NFC_FRAME_OVERHEAD) return;
 
   tx_frame_buf[0] = prologue;
   if (data != NULL)
@@ -45,8 +91,12 @@ static void do_nfc_send_frame(uint8_t prologue, uint8_t *data, uint8_t len) {
   DBG_MSG("TX: ");
   PRINT_HEX(tx_frame_buf, len + 1);
 
+  // the rest of a long frame is written to the FIFO on FIFO_IRQ_WATER_LEVEL
   uint8_t val = 0x55;
-  fm_write_fifo(tx_frame_buf, len + 1);
+  tx_frame_size = len + 1;
+  tx_fifo_cnt = MIN(tx_frame_size, NFC_FIFO_SIZE);
+  tx_active = 1;
+  fm_write_fifo(tx_frame_buf, tx_fifo_cnt);
   fm_write_reg(REG_RF_TXEN, &val, 1);
 }
 
@@ -71,7 +121,7 @@ static void send_apdu_buffer(uint8_t resend) {
     nfc_error_handler(-2);
     return;
   }
-  if (last_sent > 29) last_sent = 29;
+  if (last_sent > fsd - NFC_FRAME_OVERHEAD) last_sent = fsd - NFC_FRAME_OVERHEAD;
   uint8_t prologue = block_number | 0x02;
   if (apdu_buffer_tx_size - apdu_buffer_sent > last_sent) prologue |= PCB_I_CHAINING;
   nfc_send_frame(prologue, apdu_buffer + apdu_buffer_sent, last_sent);
@@ -79,38 +129,91 @@ static void send_apdu_buffer(uint8_t resend) {
   if (apdu_buffer_tx_size == apdu_buffer_sent) inf_sending = 0;
 }
 
+static command_cost_t *find_command_cost(const CAPDU *capdu, uint8_t applet) {
+  for (int i = 0; i < COST_TABLE_SIZE; ++i)
+    if (cost_table[i].cost != 0 && cost_table[i].applet == applet && cost_table[i].ins == INS &&
+        cost_table[i].p1 == P1)
+      return &cost_table[i];
+  return NULL;
+}
+
+static void update_command_cost(const CAPDU *capdu, uint8_t applet, uint32_t duration) {
+  if (CLA & 0x10) return; // a block of command chaining says nothing about the command
+  if (duration > UINT16_MAX) duration = UINT16_MAX;
+  command_cost_t *entry = find_command_cost(capdu, applet);
+  if (entry == NULL) {
+    // short commands need no WTX at all
+    if (duration < WTX_PERIOD) return;
+    entry = &cost_table[cost_victim];
+    cost_victim = (cost_victim + 1) % COST_TABLE_SIZE;
+    entry->applet = applet;
+    entry->ins = INS;
+    entry->p1 = P1;
+    entry->cost = duration;
+  } else if (duration > entry->cost) {
+    // overestimating only delays error detection, underestimating costs more S-blocks
+    entry->cost = duration;
+  } else {
+    entry->cost = (entry->cost * 3 + duration) / 4;
+    if (entry->cost == 0) entry->cost = 1;
+  }
+}
+
+// Ask for enough time to finish the command with a single WTX if possible
+static uint8_t wtx_multiplier(void) {
+  uint32_t elapsed = device_get_tick() - cmd_start;
+  if (cmd_cost <= elapsed) return 1;
+  uint32_t wtxm = (cmd_cost - elapsed + WTX_PERIOD - 1) / WTX_PERIOD;
+  return wtxm > WTXM_MAX ? WTXM_MAX : wtxm;
+}
+
 static void send_wtx(void) {
+  uint16_t next_deadline = WTX_PERIOD;
   if (device_spinlock_lock(&state_spinlock, false) != 0) return;
   if (next_state == TO_SEND) {
-    uint8_t WTXM = 1;
+    uint8_t WTXM = wtx_multiplier();
     do_nfc_send_frame(S_WTX, &WTXM, 1);
     next_state = TO_RECEIVE;
+    next_deadline = WTXM * WTX_PERIOD;
   }
   device_spinlock_unlock(&state_spinlock);
-  device_set_timeout(send_wtx, WTX_PERIOD);
+  device_set_timeout(send_wtx, next_deadline);
 }
 
 void nfc_loop(void) {
   if (next_state == TO_RECEIVE) return;
 
   if ((rx_frame_buf[0] & PCB_MASK) == PCB_I_BLOCK) {
+    if (apdu_buffer == NULL) {
+      apdu_buffer = apdu_pool_acquire();
+      if (apdu_buffer == NULL) {
+        // the block is left unanswered, the reader sends it again when its FWT expires
+        nfc_error_handler(-6);
+        next_state = TO_RECEIVE;
+        return;
+      }
+      apdu_cmd.data = apdu_buffer;
+      apdu_resp.data = apdu_buffer;
+    }
     block_number ^= 1;
 
+    // at least NFC_FRAME_OVERHEAD bytes, see nfc_handler
+    uint16_t inf_size = rx_frame_size - NFC_FRAME_OVERHEAD;
     if (rx_frame_buf[0] & PCB_I_CHAINING) {
-      memcpy(apdu_buffer + apdu_buffer_rx_size, rx_frame_buf + 1, rx_frame_size - 3);
-      if (apdu_buffer_rx_size + rx_frame_size - 3 > APDU_BUFFER_SIZE) {
+      if (apdu_buffer_rx_size + inf_size > APDU_BUFFER_SIZE) {
         nfc_error_handler(-3);
         return;
       }
-      apdu_buffer_rx_size += rx_frame_size - 3;
+      memcpy(apdu_buffer + apdu_buffer_rx_size, rx_frame_buf + 1, inf_size);
+      apdu_buffer_rx_size += inf_size;
       nfc_send_frame(R_ACK | block_number, NULL, 0);
     } else {
-      memcpy(apdu_buffer + apdu_buffer_rx_size, rx_frame_buf + 1, rx_frame_size - 3);
-      if (apdu_buffer_rx_size + rx_frame_size - 3 > APDU_BUFFER_SIZE) {
+      if (apdu_buffer_rx_size + inf_size > APDU_BUFFER_SIZE) {
         nfc_error_handler(-4);
         return;
       }
-      apdu_buffer_rx_size += rx_frame_size - 3;
+      memcpy(apdu_buffer + apdu_buffer_rx_size, rx_frame_buf + 1, inf_size);
+      apdu_buffer_rx_size += inf_size;
 
       CAPDU *capdu = &apdu_cmd;
       RAPDU *rapdu = &apdu_resp;
@@ -119,9 +222,15 @@ void nfc_loop(void) {
         LL = 0;
         SW = SW_CHECKING_ERROR;
       } else {
+        // the first WTX is bounded by FWT, the estimate decides how long each WTX asks for
+        uint8_t applet = get_current_applet(CLA);
+        command_cost_t *entry = find_command_cost(capdu, applet);
+        cmd_cost = entry == NULL ? 0 : entry->cost;
+        cmd_start = device_get_tick();
         device_set_timeout(send_wtx, WTX_PERIOD);
         process_apdu(capdu, rapdu);
         device_set_timeout(NULL, 0);
+        update_command_cost(capdu, applet, device_get_tick() - cmd_start);
       }
 
       apdu_buffer_tx_size = LL + 2;
@@ -158,6 +267,28 @@ void nfc_loop(void) {
   }
 }
 
+static void nfc_fill_fifo(void) {
+  uint8_t cnt;
+  fm_read_reg(REG_FIFO_WORDCNT, &cnt, 1);
+  if (cnt >= NFC_FIFO_SIZE) return;
+  uint8_t len = MIN(tx_frame_size - tx_fifo_cnt, NFC_FIFO_SIZE - cnt);
+  fm_write_fifo(tx_frame_buf + tx_fifo_cnt, len);
+  tx_fifo_cnt += len;
+}
+
+static void nfc_drain_fifo(void) {
+  uint8_t cnt;
+  fm_read_reg(REG_FIFO_WORDCNT, &cnt, 1);
+  if (rx_fifo_cnt + cnt > sizeof(rx_frame_buf)) {
+    // the reader does not respect our FSC
+    fm_write_reg(REG_FIFO_FLUSH, &cnt, 1);
+    rx_overflow = 1;
+    return;
+  }
+  fm_read_fifo(rx_frame_buf + rx_fifo_cnt, cnt);
+  rx_fifo_cnt += cnt;
+}
+
 void nfc_handler(void) {
   uint8_t irq[3];
   fm_read_reg(REG_MAIN_IRQ, irq, sizeof(irq));
@@ -166,13 +297,36 @@ void nfc_handler(void) {
     return;
   }
 
+  if (irq[0] & MAIN_IRQ_ACTIVE) {
+    // the RATS parameter byte: FSDI in the high nibble, CID in the low nibble
+    uint8_t rats;
+    fm_read_reg(REG_RF_RATS, &rats, 1);
+    fsd = nfc_frame_size(rats >> 4);
+    DBG_MSG("FSD: %d\n", fsd);
+  }
+  if (irq[0] & MAIN_IRQ_TX_DONE) tx_active = 0;
+  if (irq[1] & FIFO_IRQ_WATER_LEVEL) {
+    if (tx_active) {
+      if (tx_fifo_cnt < tx_frame_size) nfc_fill_fifo();
+    } else
+      nfc_drain_fifo();
+  }
   if (irq[0] & MAIN_IRQ_RX_DONE) {
-    fm_read_reg(REG_FIFO_WORDCNT, &rx_frame_size, 1);
-    fm_read_fifo(rx_frame_buf, rx_frame_size);
-    DBG_MSG("RX: ");
-    PRINT_HEX(rx_frame_buf, rx_frame_size);
-    if (next_state == TO_SEND) DBG_MSG("Wrong State!\n");
-    next_state = TO_SEND;
+    nfc_drain_fifo();
+    rx_frame_size = rx_fifo_cnt;
+    rx_fifo_cnt = 0;
+    if (rx_overflow) {
+      rx_overflow = 0;
+      nfc_error_handler(-5);
+    } else if (rx_frame_size < NFC_FRAME_OVERHEAD || (rx_frame_buf[0] & PCB_CID)) {
+      // not a block, or a block with a CID, which the card does not support and has to ignore
+      DBG_MSG("Frame ignored\n");
+    } else {
+      DBG_MSG("RX: ");
+      PRINT_HEX(rx_frame_buf, rx_frame_size);
+      if (next_state == TO_SEND) DBG_MSG("Wrong State!\n");
+      next_state = TO_SEND;
+    }
   }
   if (irq[2] & AUX_IRQ_ERROR_MASK) {
     DBG_MSG("AUX: %02X\n", irq[2]);
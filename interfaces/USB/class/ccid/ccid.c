@@ -5,7 +5,14 @@
 #include <usb_device.h>
 #include <usbd_ccid.h>
 
-#define CCID_UpdateCommandStatus(cmd_status, icc_status) bulkin_data.bStatus = (cmd_status | icc_status)
+#define CCID_UpdateCommandStatus(cmd_status, icc_status) bulkin->bStatus = (cmd_status | icc_status)
+
+// Buffer states, a buffer is used in the order FREE -> RECEIVING -> READY -> EXECUTING -> SENDING -> FREE
+#define CCID_BUFFER_FREE 0
+#define CCID_BUFFER_RECEIVING 1
+#define CCID_BUFFER_READY 2
+#define CCID_BUFFER_EXECUTING 3
+#define CCID_BUFFER_SENDING 4
 
 static uint8_t CCID_CheckCommandParams(uint32_t param_type);
 
@@ -14,64 +21,127 @@ static uint8_t CCID_CheckCommandParams(uint32_t param_type);
 static const uint8_t atr_ccid[] = {0x3B, 0xF7, 0x11, 0x00, 0x00, 0x81, 0x31, 0xFE, 0x65,
                                    0x43, 0x61, 0x6E, 0x6F, 0x6B, 0x65, 0x79, 0x99};
 
-static empty_ccid_bulkin_data_t bulkin_time_extension;
-ccid_bulkin_data_t bulkin_data;
-ccid_bulkout_data_t bulkout_data;
-static uint16_t ab_data_length;
-static volatile uint8_t bulkout_state;
-static volatile uint8_t has_cmd;
-static volatile uint32_t send_data_spinlock;
-static CAPDU apdu_cmd;
-static RAPDU apdu_resp;
+static __card_local empty_ccid_bulkin_data_t bulkin_time_extension;
+static __card_local empty_ccid_bulkin_data_t bulkin_slot_busy;
+__card_local ccid_bulkin_data_t bulkin_data[CCID_BUFFER_NUM];
+__card_local ccid_bulkout_data_t bulkout_data[CCID_BUFFER_NUM];
+static __card_local ccid_bulkin_data_t *bulkin;   // response of the command being executed
+static __card_local ccid_bulkout_data_t *bulkout; // the command being executed
+static __card_local ccid_bulkout_data_t rejected_cmd;
+static __card_local volatile uint8_t buffer_state[CCID_BUFFER_NUM];
+static __card_local volatile uint8_t rx_idx;  // the buffer the bulk-out endpoint receives into
+static __card_local volatile uint8_t cmd_idx; // the next buffer to be executed
+static __card_local volatile uint8_t executing;
+static __card_local volatile uint8_t has_rejected_cmd;
+static __card_local volatile uint8_t abort_requested, abort_seq;
+static __card_local uint16_t ab_data_length;
+static __card_local volatile uint8_t bulkout_state;
+static __card_local volatile uint32_t send_data_spinlock;
+static __card_local CAPDU apdu_cmd;
+static __card_local RAPDU apdu_resp;
+
+static void CCID_UseBuffer(uint8_t idx) {
+  bulkin = &bulkin_data[idx];
+  bulkout = &bulkout_data[idx];
+  apdu_cmd.data = bulkin->abData;
+  apdu_resp.data = bulkin->abData;
+}
 
 uint8_t CCID_Init(void) {
   send_data_spinlock = 0;
   bulkout_state = CCID_STATE_IDLE;
-  has_cmd = 0;
-  bulkout_data.abData = bulkin_data.abData;
-  apdu_cmd.data = bulkin_data.abData;
-  apdu_resp.data = bulkin_data.abData;
+  rx_idx = 0;
+  cmd_idx = 0;
+  executing = 0;
+  has_rejected_cmd = 0;
+  abort_requested = 0;
+  for (int i = 0; i < CCID_BUFFER_NUM; ++i) {
+    buffer_state[i] = CCID_BUFFER_FREE;
+    bulkout_data[i].abData = bulkin_data[i].abData;
+  }
+  CCID_UseBuffer(0);
   return 0;
 }
 
+static void CCID_ReceiveDone(ccid_bulkout_data_t *out) {
+  bulkout_state = CCID_STATE_IDLE;
+  if (out == &rejected_cmd) {
+    has_rejected_cmd = 1;
+    return;
+  }
+  buffer_state[rx_idx] = CCID_BUFFER_READY;
+  rx_idx = (rx_idx + 1) % CCID_BUFFER_NUM;
+}
+
+static void CCID_ReceiveAbandon(ccid_bulkout_data_t *out) {
+  bulkout_state = CCID_STATE_IDLE;
+  if (out != &rejected_cmd) buffer_state[rx_idx] = CCID_BUFFER_FREE;
+}
+
 uint8_t CCID_OutEvent(uint8_t *data, uint8_t len) {
+  ccid_bulkout_data_t *out;
+
   switch (bulkout_state) {
   case CCID_STATE_IDLE:
-    if (len == 0)
-      bulkout_state = CCID_STATE_IDLE;
-    else if (len >= CCID_CMD_HEADER_SIZE) {
-      ab_data_length = len - CCID_CMD_HEADER_SIZE;
-      memcpy(&bulkout_data, data, CCID_CMD_HEADER_SIZE);
-      memcpy(bulkout_data.abData, data + CCID_CMD_HEADER_SIZE, ab_data_length);
-      bulkout_data.dwLength = letoh32(bulkout_data.dwLength);
-      bulkin_data.bSlot = bulkout_data.bSlot;
-      bulkin_data.bSeq = bulkout_data.bSeq;
-      if (ab_data_length == bulkout_data.dwLength)
-        has_cmd = 1;
-      else if (ab_data_length < bulkout_data.dwLength) {
-        if (bulkout_data.dwLength > ABDATA_SIZE)
-          bulkout_state = CCID_STATE_IDLE;
-        else
-          bulkout_state = CCID_STATE_RECEIVE_DATA;
-      } else
-        bulkout_state = CCID_STATE_IDLE;
+    if (len < CCID_CMD_HEADER_SIZE) break;
+    // Only one command may be pending on the slot (bMaxCCIDBusySlots), except PC_to_RDR_Abort.
+    // A command that arrives while the slot is busy or no buffer is free is answered with CMD_SLOT_BUSY.
+    if ((executing && data[0] != PC_TO_RDR_ABORT) || buffer_state[rx_idx] != CCID_BUFFER_FREE) {
+      out = &rejected_cmd;
+      bulkout_state = CCID_STATE_DISCARD_DATA;
+    } else {
+      out = &bulkout_data[rx_idx];
+      buffer_state[rx_idx] = CCID_BUFFER_RECEIVING;
+      bulkout_state = CCID_STATE_RECEIVE_DATA;
     }
+    ab_data_length = len - CCID_CMD_HEADER_SIZE;
+    memcpy(out, data, CCID_CMD_HEADER_SIZE);
+    out->dwLength = letoh32(out->dwLength);
+    if (out != &rejected_cmd) {
+      memcpy(out->abData, data + CCID_CMD_HEADER_SIZE, ab_data_length);
+      bulkin_data[rx_idx].bSlot = out->bSlot;
+      bulkin_data[rx_idx].bSeq = out->bSeq;
+    }
+    if (ab_data_length == out->dwLength)
+      CCID_ReceiveDone(out);
+    else if (ab_data_length > out->dwLength || (out != &rejected_cmd && out->dwLength > ABDATA_SIZE))
+      CCID_ReceiveAbandon(out);
     break;
 
   case CCID_STATE_RECEIVE_DATA:
-    if (ab_data_length + len < bulkout_data.dwLength) {
-      memcpy(bulkout_data.abData + ab_data_length, data, len);
+    out = &bulkout_data[rx_idx];
+    if (ab_data_length + len <= out->dwLength) {
+      memcpy(out->abData + ab_data_length, data, len);
+      ab_data_length += len;
+      if (ab_data_length == out->dwLength) CCID_ReceiveDone(out);
+    } else
+      CCID_ReceiveAbandon(out);
+    break;
+
+  case CCID_STATE_DISCARD_DATA:
+    if (ab_data_length + len <= rejected_cmd.dwLength) {
       ab_data_length += len;
-    } else if (ab_data_length + len == bulkout_data.dwLength) {
-      memcpy(bulkout_data.abData + ab_data_length, data, len);
-      bulkout_state = CCID_STATE_IDLE;
-      has_cmd = 1;
+      if (ab_data_length == rejected_cmd.dwLength) CCID_ReceiveDone(&rejected_cmd);
     } else
-      bulkout_state = CCID_STATE_IDLE;
+      CCID_ReceiveAbandon(&rejected_cmd);
+    break;
   }
   return 0;
 }
 
+void CCID_InEvent(const uint8_t *buf) {
+  for (int i = 0; i < CCID_BUFFER_NUM; ++i)
+    if (buf == (const uint8_t *)&bulkin_data[i] && buffer_state[i] == CCID_BUFFER_SENDING)
+      buffer_state[i] = CCID_BUFFER_FREE;
+}
+
+void CCID_Abort(uint8_t slot, uint8_t seq) {
+  if (slot >= CCID_NUMBER_OF_SLOTS) return;
+  // Commands are failed with CMD_ABORTED until the matching PC_to_RDR_Abort arrives
+  abort_seq = seq;
+  abort_requested = 1;
+}
+
 /**
  * @brief  PC_to_RDR_IccPowerOn
  *         PC_TO_RDR_ICCPOWERON message execution, apply voltage and get ATR
@@ -79,18 +149,18 @@ uint8_t CCID_OutEvent(uint8_t *data, uint8_t len) {
  * @retval uint8_t status of the command execution
  */
 static uint8_t PC_to_RDR_IccPowerOn(void) {
-  bulkin_data.dwLength = 0;
-  uint8_t error = CCID_CheckCommandParams(CHK_PARAM_SLOT | CHK_PARAM_DWLENGTH | CHK_PARAM_abRFU2);
+  bulkin->dwLength = 0;
+  uint8_t error = CCID_CheckCommandParams(CHK_PARAM_SLOT | CHK_PARAM_DWLENGTH | CHK_PARAM_abRFU2 | CHK_PARAM_ABORT);
   if (error != 0) return error;
 
-  uint8_t voltage = bulkout_data.bSpecific_0;
+  uint8_t voltage = bulkout->bSpecific_0;
   if (voltage != 0x00) {
     CCID_UpdateCommandStatus(BM_COMMAND_STATUS_FAILED, BM_ICC_PRESENT_ACTIVE);
     return SLOTERROR_BAD_POWERSELECT;
   }
 
-  memcpy(bulkin_data.abData, atr_ccid, sizeof(atr_ccid));
-  bulkin_data.dwLength = sizeof(atr_ccid);
+  memcpy(bulkin->abData, atr_ccid, sizeof(atr_ccid));
+  bulkin->dwLength = sizeof(atr_ccid);
   CCID_UpdateCommandStatus(BM_COMMAND_STATUS_NO_ERROR, BM_ICC_PRESENT_ACTIVE);
   return SLOT_NO_ERROR;
 }
@@ -102,7 +172,7 @@ static uint8_t PC_to_RDR_IccPowerOn(void) {
  * @retval uint8_t error: status of the command execution
  */
 static uint8_t PC_to_RDR_IccPowerOff(void) {
-  uint8_t error = CCID_CheckCommandParams(CHK_PARAM_SLOT | CHK_PARAM_abRFU3 | CHK_PARAM_DWLENGTH);
+  uint8_t error = CCID_CheckCommandParams(CHK_PARAM_SLOT | CHK_PARAM_abRFU3 | CHK_PARAM_DWLENGTH | CHK_PARAM_ABORT);
   if (error != 0) return error;
   applet_poweroff();
   CCID_UpdateCommandStatus(BM_COMMAND_STATUS_NO_ERROR, BM_ICC_PRESENT_INACTIVE);
@@ -116,7 +186,7 @@ static uint8_t PC_to_RDR_IccPowerOff(void) {
  * @retval uint8_t status of the command execution
  */
 static uint8_t PC_to_RDR_GetSlotStatus(void) {
-  uint8_t error = CCID_CheckCommandParams(CHK_PARAM_SLOT | CHK_PARAM_DWLENGTH | CHK_PARAM_abRFU3);
+  uint8_t error = CCID_CheckCommandParams(CHK_PARAM_SLOT | CHK_PARAM_DWLENGTH | CHK_PARAM_abRFU3 | CHK_PARAM_ABORT);
   if (error != 0) return error;
   CCID_UpdateCommandStatus(BM_COMMAND_STATUS_NO_ERROR, BM_ICC_PRESENT_ACTIVE);
   return SLOT_NO_ERROR;
@@ -130,16 +200,16 @@ static uint8_t PC_to_RDR_GetSlotStatus(void) {
  * @retval uint8_t status of the command execution
  */
 uint8_t PC_to_RDR_XfrBlock(void) {
-  uint8_t error = CCID_CheckCommandParams(CHK_PARAM_SLOT);
+  uint8_t error = CCID_CheckCommandParams(CHK_PARAM_SLOT | CHK_PARAM_ABORT);
   if (error != 0) return error;
 
   DBG_MSG("O: ");
-  PRINT_HEX(bulkout_data.abData, bulkout_data.dwLength);
+  PRINT_HEX(bulkout->abData, bulkout->dwLength);
 
   CAPDU *capdu = &apdu_cmd;
   RAPDU *rapdu = &apdu_resp;
 
-  if (build_capdu(&apdu_cmd, bulkout_data.abData, bulkout_data.dwLength) < 0) {
+  if (build_capdu(&apdu_cmd, bulkout->abData, bulkout->dwLength) < 0) {
     // abandon malformed apdu
     LL = 0;
     SW = SW_CHECKING_ERROR;
@@ -147,13 +217,31 @@ uint8_t PC_to_RDR_XfrBlock(void) {
     device_set_timeout(CCID_TimeExtensionLoop, TIME_EXTENSION_PERIOD);
     process_apdu(capdu, rapdu);
     device_set_timeout(NULL, 0);
+    // the host gave up on this command while it was being executed
+    error = CCID_CheckCommandParams(CHK_PARAM_ABORT);
+    if (error != 0) return error;
   }
 
-  bulkin_data.dwLength = LL + 2;
-  bulkin_data.abData[LL] = HI(SW);
-  bulkin_data.abData[LL + 1] = LO(SW);
+  bulkin->dwLength = LL + 2;
+  bulkin->abData[LL] = HI(SW);
+  bulkin->abData[LL + 1] = LO(SW);
   DBG_MSG("I: ");
-  PRINT_HEX(bulkin_data.abData, bulkin_data.dwLength);
+  PRINT_HEX(bulkin->abData, bulkin->dwLength);
+  CCID_UpdateCommandStatus(BM_COMMAND_STATUS_NO_ERROR, BM_ICC_PRESENT_ACTIVE);
+  return SLOT_NO_ERROR;
+}
+
+/**
+ * @brief  PC_to_RDR_Abort
+ *         Completes the abort sequence started by the ABORT class request
+ *         Response to this command message is the RDR_to_PC_SlotStatus
+ * @param  None
+ * @retval uint8_t status of the command execution
+ */
+static uint8_t PC_to_RDR_Abort(void) {
+  uint8_t error = CCID_CheckCommandParams(CHK_PARAM_SLOT | CHK_PARAM_DWLENGTH | CHK_PARAM_abRFU3);
+  if (error != 0) return error;
+  if (abort_requested && abort_seq == bulkout->bSeq) abort_requested = 0;
   CCID_UpdateCommandStatus(BM_COMMAND_STATUS_NO_ERROR, BM_ICC_PRESENT_ACTIVE);
   return SLOT_NO_ERROR;
 }
@@ -166,7 +254,7 @@ uint8_t PC_to_RDR_XfrBlock(void) {
  * @retval uint8_t status of the command execution
  */
 static uint8_t PC_to_RDR_GetParameters(void) {
-  uint8_t error = CCID_CheckCommandParams(CHK_PARAM_SLOT | CHK_PARAM_DWLENGTH | CHK_PARAM_abRFU3);
+  uint8_t error = CCID_CheckCommandParams(CHK_PARAM_SLOT | CHK_PARAM_DWLENGTH | CHK_PARAM_abRFU3 | CHK_PARAM_ABORT);
   if (error != 0) return error;
   CCID_UpdateCommandStatus(BM_COMMAND_STATUS_NO_ERROR, BM_ICC_PRESENT_ACTIVE);
   return SLOT_NO_ERROR;
@@ -180,9 +268,10 @@ static uint8_t PC_to_RDR_GetParameters(void) {
  * @retval None
  */
 static void RDR_to_PC_DataBlock(uint8_t errorCode) {
-  bulkin_data.bMessageType = RDR_TO_PC_DATABLOCK;
-  bulkin_data.bError = errorCode;
-  bulkin_data.bSpecific = 0;
+  bulkin->bMessageType = RDR_TO_PC_DATABLOCK;
+  if (errorCode != SLOT_NO_ERROR) bulkin->dwLength = 0;
+  bulkin->bError = errorCode;
+  bulkin->bSpecific = 0;
 }
 
 /**
@@ -194,10 +283,10 @@ static void RDR_to_PC_DataBlock(uint8_t errorCode) {
  * @retval None
  */
 static void RDR_to_PC_SlotStatus(uint8_t errorCode) {
-  bulkin_data.bMessageType = RDR_TO_PC_SLOTSTATUS;
-  bulkin_data.dwLength = 0;
-  bulkin_data.bError = errorCode;
-  bulkin_data.bSpecific = 0;
+  bulkin->bMessageType = RDR_TO_PC_SLOTSTATUS;
+  bulkin->dwLength = 0;
+  bulkin->bError = errorCode;
+  bulkin->bSpecific = 0;
 }
 
 /**
@@ -208,23 +297,23 @@ static void RDR_to_PC_SlotStatus(uint8_t errorCode) {
  * @retval None
  */
 static void RDR_to_PC_Parameters(uint8_t errorCode) {
-  bulkin_data.bMessageType = RDR_TO_PC_PARAMETERS;
-  bulkin_data.bError = errorCode;
+  bulkin->bMessageType = RDR_TO_PC_PARAMETERS;
+  bulkin->bError = errorCode;
 
   if (errorCode == SLOT_NO_ERROR)
-    bulkin_data.dwLength = 7;
+    bulkin->dwLength = 7;
   else
-    bulkin_data.dwLength = 0;
+    bulkin->dwLength = 0;
 
-  bulkin_data.abData[0] = 0x11; // Fi=372, Di=1
-  bulkin_data.abData[1] = 0x10; // Checksum: LRC, Convention: direct, ignored by CCID
-  bulkin_data.abData[2] = 0x00; // No extra guard time
-  bulkin_data.abData[3] = 0x15; // BWI = 1, CWI = 5
-  bulkin_data.abData[4] = 0x00; // Stopping the Clock is not allowed
-  bulkin_data.abData[5] = 0xFE; // IFSC = 0xFE
-  bulkin_data.abData[6] = 0x00; // NAD
+  bulkin->abData[0] = 0x11; // Fi=372, Di=1
+  bulkin->abData[1] = 0x10; // Checksum: LRC, Convention: direct, ignored by CCID
+  bulkin->abData[2] = 0x00; // No extra guard time
+  bulkin->abData[3] = 0x15; // BWI = 1, CWI = 5
+  bulkin->abData[4] = 0x00; // Stopping the Clock is not allowed
+  bulkin->abData[5] = 0xFE; // IFSC = 0xFE
+  bulkin->abData[6] = 0x00; // NAD
 
-  bulkin_data.bSpecific = 0x01;
+  bulkin->bSpecific = 0x01;
 }
 
 /**
@@ -237,46 +326,73 @@ static void RDR_to_PC_Parameters(uint8_t errorCode) {
  * @retval uint8_t status
  */
 static uint8_t CCID_CheckCommandParams(uint32_t param_type) {
-  bulkin_data.bStatus = BM_ICC_PRESENT_ACTIVE | BM_COMMAND_STATUS_NO_ERROR;
+  bulkin->bStatus = BM_ICC_PRESENT_ACTIVE | BM_COMMAND_STATUS_NO_ERROR;
   uint32_t parameter = param_type;
 
   if (parameter & CHK_PARAM_SLOT) {
-    if (bulkout_data.bSlot >= CCID_NUMBER_OF_SLOTS) {
+    if (bulkout->bSlot >= CCID_NUMBER_OF_SLOTS) {
       CCID_UpdateCommandStatus(BM_COMMAND_STATUS_FAILED, BM_ICC_NO_ICC_PRESENT);
       return SLOTERROR_BAD_SLOT;
     }
   }
 
   if (parameter & CHK_PARAM_DWLENGTH) {
-    if (bulkout_data.dwLength != 0) {
+    if (bulkout->dwLength != 0) {
       CCID_UpdateCommandStatus(BM_COMMAND_STATUS_FAILED, BM_ICC_PRESENT_ACTIVE);
       return SLOTERROR_BAD_LENTGH;
     }
   }
 
   if (parameter & CHK_PARAM_abRFU2) {
-    if ((bulkout_data.bSpecific_1 != 0) || (bulkout_data.bSpecific_2 != 0)) {
+    if ((bulkout->bSpecific_1 != 0) || (bulkout->bSpecific_2 != 0)) {
       CCID_UpdateCommandStatus(BM_COMMAND_STATUS_FAILED, BM_ICC_PRESENT_ACTIVE);
       return SLOTERROR_BAD_ABRFU_2B;
     }
   }
 
   if (parameter & CHK_PARAM_abRFU3) {
-    if ((bulkout_data.bSpecific_0 != 0) || (bulkout_data.bSpecific_1 != 0) || (bulkout_data.bSpecific_2 != 0)) {
+    if ((bulkout->bSpecific_0 != 0) || (bulkout->bSpecific_1 != 0) || (bulkout->bSpecific_2 != 0)) {
       CCID_UpdateCommandStatus(BM_COMMAND_STATUS_FAILED, BM_ICC_PRESENT_ACTIVE);
       return SLOTERROR_BAD_ABRFU_3B;
     }
   }
 
+  if (parameter & CHK_PARAM_ABORT) {
+    if (abort_requested) {
+      CCID_UpdateCommandStatus(BM_COMMAND_STATUS_FAILED, BM_ICC_PRESENT_ACTIVE);
+      return SLOTERROR_CMD_ABORTED;
+    }
+  }
+
   return 0;
 }
 
+static void CCID_SendSlotBusy(void) {
+  bulkin_slot_busy.bMessageType = RDR_TO_PC_SLOTSTATUS;
+  bulkin_slot_busy.dwLength = 0;
+  bulkin_slot_busy.bSlot = rejected_cmd.bSlot;
+  bulkin_slot_busy.bSeq = rejected_cmd.bSeq;
+  bulkin_slot_busy.bStatus = BM_COMMAND_STATUS_FAILED | BM_ICC_PRESENT_ACTIVE;
+  bulkin_slot_busy.bError = SLOTERROR_CMD_SLOT_BUSY;
+  bulkin_slot_busy.bSpecific = 0;
+  has_rejected_cmd = 0;
+  device_spinlock_lock(&send_data_spinlock, true);
+  CCID_Response_SendData(&usb_device, (uint8_t *)&bulkin_slot_busy, CCID_CMD_HEADER_SIZE, 0);
+  device_spinlock_unlock(&send_data_spinlock);
+}
+
 void CCID_Loop(void) {
-  if (!has_cmd) return;
-  has_cmd = 0;
+  if (has_rejected_cmd) CCID_SendSlotBusy();
+  if (buffer_state[cmd_idx] != CCID_BUFFER_READY) return;
+
+  uint8_t idx = cmd_idx;
+  cmd_idx = (cmd_idx + 1) % CCID_BUFFER_NUM;
+  buffer_state[idx] = CCID_BUFFER_EXECUTING;
+  executing = 1;
+  CCID_UseBuffer(idx);
 
   uint8_t errorCode;
-  switch (bulkout_data.bMessageType) {
+  switch (bulkout->bMessageType) {
   case PC_TO_RDR_ICCPOWERON:
     DBG_MSG("Slot power on\n");
     errorCode = PC_to_RDR_IccPowerOn();
@@ -301,15 +417,24 @@ void CCID_Loop(void) {
     errorCode = PC_to_RDR_GetParameters();
     RDR_to_PC_Parameters(errorCode);
     break;
+  case PC_TO_RDR_ABORT:
+    DBG_MSG("Slot abort\n");
+    errorCode = PC_to_RDR_Abort();
+    RDR_to_PC_SlotStatus(errorCode);
+    break;
   default:
     RDR_to_PC_SlotStatus(SLOTERROR_CMD_NOT_SUPPORTED);
     break;
   }
 
-  uint16_t len = bulkin_data.dwLength;
-  bulkin_data.dwLength = htole32(bulkin_data.dwLength);
+  uint16_t len = bulkin->dwLength;
+  bulkin->dwLength = htole32(bulkin->dwLength);
+  // the buffer stays in use until the IN transfer completes, see CCID_InEvent
+  buffer_state[idx] = CCID_BUFFER_SENDING;
+  executing = 0;
   device_spinlock_lock(&send_data_spinlock, true);
-  CCID_Response_SendData(&usb_device, (uint8_t *)&bulkin_data, len + CCID_CMD_HEADER_SIZE, 0);
+  if (CCID_Response_SendData(&usb_device, (uint8_t *)bulkin, len + CCID_CMD_HEADER_SIZE, 0) != USBD_OK)
+    buffer_state[idx] = CCID_BUFFER_FREE;
   device_spinlock_unlock(&send_data_spinlock);
 }
 
@@ -318,8 +443,8 @@ void CCID_TimeExtensionLoop(void) {
     DBG_MSG("send t-ext\r\n");
     bulkin_time_extension.bMessageType = RDR_TO_PC_DATABLOCK;
     bulkin_time_extension.dwLength = 0;
-    bulkin_time_extension.bSlot = bulkout_data.bSlot;
-    bulkin_time_extension.bSeq = bulkout_data.bSeq;
+    bulkin_time_extension.bSlot = bulkout->bSlot;
+    bulkin_time_extension.bSeq = bulkout->bSeq;
     bulkin_time_extension.bStatus = BM_COMMAND_STATUS_TIME_EXTN;
     bulkin_time_extension.bError = 1; // Request another 1 BTWs (5.7s)
     bulkin_time_extension.bSpecific = 0;
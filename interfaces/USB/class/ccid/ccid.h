@@ -8,6 +8,16 @@
 #define CCID_NUMBER_OF_SLOTS 1
 #define TIME_EXTENSION_PERIOD 1500
 
+// Number of bulk message buffers. With two or more buffers the next command is
+// received while the response to the previous one is still being transmitted.
+// Set it to 1 to save RAM at the cost of serializing the bulk endpoints.
+#ifndef CCID_BUFFER_NUM
+#define CCID_BUFFER_NUM 2
+#endif
+
+// Class-specific requests
+#define CCID_REQ_ABORT 0x01
+
 typedef struct {
   uint8_t bMessageType; /* Offset = 0*/
   uint32_t dwLength;    /* Offset = 1, The length field (dwLength) is the length
@@ -128,6 +138,8 @@ typedef enum {
 
 uint8_t CCID_Init(void);
 uint8_t CCID_OutEvent(uint8_t *data, uint8_t len);
+void CCID_InEvent(const uint8_t *buf);
+void CCID_Abort(uint8_t slot, uint8_t seq);
 void CCID_Loop(void);
 void CCID_TimeExtensionLoop(void);
 uint8_t PC_to_RDR_XfrBlock(void); // Exported for test purposes
@@ -4,11 +4,13 @@
 #include <usbd_ccid.h>
 #include <usbd_ctlreq.h>
 
-static uint8_t ccid_out_buf[64];
-static volatile uint8_t bulk_in_state;
+static __card_local uint8_t ccid_out_buf[64];
+static __card_local volatile uint8_t bulk_in_state;
+static const uint8_t *bulk_in_buf;
 
 uint8_t USBD_CCID_Init(USBD_HandleTypeDef *pdev) {
   bulk_in_state = CCID_STATE_IDLE;
+  bulk_in_buf = NULL;
   USBD_LL_OpenEP(pdev, EP_IN(ccid), USBD_EP_TYPE_BULK, EP_SIZE(ccid));
   USBD_LL_OpenEP(pdev, EP_OUT(ccid), USBD_EP_TYPE_BULK, EP_SIZE(ccid));
   CCID_Init();
@@ -23,6 +25,29 @@ uint8_t USBD_CCID_DataIn(USBD_HandleTypeDef *pdev) {
     USBD_LL_Transmit(pdev, addr, NULL, 0);
   } else {
     bulk_in_state = CCID_STATE_IDLE;
+    CCID_InEvent(bulk_in_buf);
+  }
+  return USBD_OK;
+}
+
+uint8_t USBD_CCID_Setup(USBD_HandleTypeDef *pdev, USBD_SetupReqTypedef *req) {
+  switch (req->bmRequest & USB_REQ_TYPE_MASK) {
+  case USB_REQ_TYPE_CLASS:
+    switch (req->bRequest) {
+    case CCID_REQ_ABORT:
+      // wValue: bSlot in the low byte, bSeq in the high byte
+      CCID_Abort(LO(req->wValue), HI(req->wValue));
+      break;
+
+    default:
+      USBD_CtlError(pdev, req);
+      return USBD_FAIL;
+    }
+    break;
+
+  default:
+    USBD_CtlError(pdev, req);
+    return USBD_FAIL;
   }
   return USBD_OK;
 }
@@ -41,18 +66,19 @@ uint8_t USBD_CCID_DataOut(USBD_HandleTypeDef *pdev) {
 
 uint8_t CCID_Response_SendData(USBD_HandleTypeDef *pdev, const uint8_t *buf, uint16_t len,
                                uint8_t is_time_extension_request) {
-  USBD_StatusTypeDef ret = USBD_OK;
+  USBD_StatusTypeDef ret = USBD_FAIL;
   if (pdev->dev_state == USBD_STATE_CONFIGURED) {
 #ifndef TEST
     while (bulk_in_state != CCID_STATE_IDLE)
       if (is_time_extension_request)
-        return ret;
+        return USBD_BUSY;
       else
         device_delay(1);
 #endif
     uint8_t addr = EP_OUT(ccid);
     uint8_t ep_size = EP_SIZE(ccid);
     bulk_in_state = len % ep_size == 0 ? CCID_STATE_DATA_IN_WITH_ZLP : CCID_STATE_DATA_IN;
+    bulk_in_buf = buf;
     ret = USBD_LL_Transmit(pdev, addr, buf, len);
   }
   return ret;
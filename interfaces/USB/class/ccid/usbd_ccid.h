@@ -10,8 +10,10 @@
 #define CCID_STATE_DATA_IN 2
 #define CCID_STATE_DATA_IN_WITH_ZLP 3
 #define CCID_STATE_PROCESS_DATA 4
+#define CCID_STATE_DISCARD_DATA 5
 
 uint8_t USBD_CCID_Init(USBD_HandleTypeDef *pdev);
+uint8_t USBD_CCID_Setup(USBD_HandleTypeDef *pdev, USBD_SetupReqTypedef *req);
 uint8_t USBD_CCID_DataIn(USBD_HandleTypeDef *pdev);
 uint8_t USBD_CCID_DataOut(USBD_HandleTypeDef *pdev);
 uint8_t CCID_Response_SendData(USBD_HandleTypeDef *pdev, const uint8_t *buf, uint16_t len,
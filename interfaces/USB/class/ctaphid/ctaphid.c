@@ -1,70 +1,149 @@
+#include <apdu_pool.h>
 #include <ctap.h>
 #include <ctaphid.h>
 #include <device.h>
 #include <rand.h>
+#include <record.h>
 #include <usb_device.h>
 #include <usbd_ctaphid.h>
 
-static CTAPHID_FRAME frame;
-static CTAPHID_Channel channel;
-static volatile uint8_t has_frame;
-static CAPDU apdu_cmd;
-static RAPDU apdu_resp;
-static uint8_t (*callback_send_report)(USBD_HandleTypeDef *pdev, uint8_t *report, uint16_t len);
+#define TX_RING_MASK (CTAPHID_TX_RING_SIZE - 1)
+#define TX_RING_COUNT() ((uint8_t)(tx_tail - tx_head))
+#define RX_RING_MASK (CTAPHID_RX_RING_SIZE - 1)
+#define RX_RING_COUNT() ((uint8_t)(rx_tail - rx_head))
 
-const uint16_t ISIZE = sizeof(frame.init.data);
-const uint16_t CSIZE = sizeof(frame.cont.data);
+// Incoming reports, rx_tail is only advanced by CTAPHID_OutEvent, rx_head only by the loop and the yield task.
+// rx_frame is the report being handled.
+static __card_local CTAPHID_FRAME rx_ring[CTAPHID_RX_RING_SIZE], rx_frame;
+static __card_local volatile uint8_t rx_head, rx_tail;
+// Outgoing reports are queued here and drained by the IN-complete callback. A slot is released only when the
+// transfer of its report has completed, so the endpoint may read it directly. tx_head is only advanced by
+// CTAPHID_InEvent, tx_tail only by CTAPHID_SendFrame.
+static __card_local CTAPHID_FRAME tx_ring[CTAPHID_TX_RING_SIZE];
+static __card_local volatile uint8_t tx_head, tx_tail, tx_busy, tx_kicking;
+static __card_local CTAPHID_Channel channel;
+static __card_local uint8_t is_executing;
+static __card_local uint32_t last_keepalive;
+#ifdef CANOKEY_WITH_FIDO
+static __card_local CAPDU apdu_cmd;
+static __card_local RAPDU apdu_resp;
+#endif
+static __card_local uint8_t (*callback_send_report)(USBD_HandleTypeDef *pdev, uint8_t *report, uint16_t len);
+
+const uint16_t ISIZE = sizeof(rx_frame.init.data);
+const uint16_t CSIZE = sizeof(rx_frame.cont.data);
 
 uint8_t CTAPHID_Init(uint8_t (*send_report)(USBD_HandleTypeDef *pdev, uint8_t *report, uint16_t len)) {
   callback_send_report = send_report;
   channel.state = CTAPHID_IDLE;
-  has_frame = 0;
+  apdu_pool_release(channel.data);
+  channel.data = NULL;
+  rx_head = rx_tail = 0;
+  is_executing = 0;
+  tx_head = tx_tail = 0;
+  tx_busy = tx_kicking = 0;
   return 0;
 }
 
 uint8_t CTAPHID_OutEvent(uint8_t *data) {
-  memcpy(&frame, data, sizeof(frame));
-  has_frame = 1;
+  // the report is not taken, the endpoint keeps it and holds off the host until there is room
+  if (RX_RING_COUNT() == CTAPHID_RX_RING_SIZE) return 1;
+  record_command(RECORD_CTAPHID, data, HID_RPT_SIZE);
+  memcpy(&rx_ring[rx_tail & RX_RING_MASK], data, sizeof(CTAPHID_FRAME));
+  ++rx_tail;
   return 0;
 }
 
-static void CTAPHID_SendFrame(void) { callback_send_report(&usb_device, (uint8_t *)&frame, sizeof(CTAPHID_FRAME)); }
+// Frees the oldest slot of the queue and takes the report held back by the endpoint, if any
+static void CTAPHID_ReleaseFrame(void) {
+  ++rx_head;
+  USBD_CTAPHID_ResumeReceive(&usb_device);
+}
+
+static uint8_t CTAPHID_PopFrame(void) {
+  if (rx_head == rx_tail) return 0;
+  memcpy(&rx_frame, &rx_ring[rx_head & RX_RING_MASK], sizeof(rx_frame));
+  CTAPHID_ReleaseFrame();
+  return 1;
+}
+
+static void CTAPHID_TxKick(void) {
+  // A transport may complete the transfer inside the send callback (e.g., virt-card), in which case
+  // CTAPHID_InEvent is re-entered and must not start another transfer itself.
+  do {
+    tx_kicking = 1;
+    while (!tx_busy && tx_head != tx_tail) {
+      tx_busy = 1;
+      if (callback_send_report(&usb_device, (uint8_t *)&tx_ring[tx_head & TX_RING_MASK], sizeof(CTAPHID_FRAME)) !=
+          USBD_OK) {
+        // not configured, drop the report
+        ++tx_head;
+        tx_busy = 0;
+      }
+    }
+    tx_kicking = 0;
+    // an IN-complete event may have arrived after the last check
+  } while (!tx_busy && tx_head != tx_tail);
+}
+
+uint8_t CTAPHID_InEvent(void) {
+  if (!tx_busy) return 0;
+  ++tx_head;
+  tx_busy = 0;
+  if (!tx_kicking) CTAPHID_TxKick();
+  return 0;
+}
+
+// Returns the next free slot of the ring, waiting for the IN endpoint if the ring is full
+static CTAPHID_FRAME *CTAPHID_AcquireFrame(void) {
+  while (TX_RING_COUNT() == CTAPHID_TX_RING_SIZE)
+    device_delay(1);
+  CTAPHID_FRAME *frame = &tx_ring[tx_tail & TX_RING_MASK];
+  memset(frame, 0, sizeof(CTAPHID_FRAME));
+  return frame;
+}
+
+static void CTAPHID_SendFrame(void) {
+  ++tx_tail;
+  if (!tx_busy) CTAPHID_TxKick();
+}
 
 static void CTAPHID_SendResponse(uint32_t cid, uint8_t cmd, uint8_t *data, uint16_t len) {
   uint16_t off = 0;
   size_t copied;
   uint8_t seq = 0;
 
-  memset(&frame, 0, sizeof(frame));
-  frame.cid = cid;
-  frame.type = TYPE_INIT;
-  frame.init.cmd |= cmd;
-  frame.init.bcnth = (uint8_t)((len >> 8) & 0xFF);
-  frame.init.bcntl = (uint8_t)(len & 0xFF);
+  CTAPHID_FRAME *frame = CTAPHID_AcquireFrame();
+  frame->cid = cid;
+  frame->type = TYPE_INIT;
+  frame->init.cmd |= cmd;
+  frame->init.bcnth = (uint8_t)((len >> 8) & 0xFF);
+  frame->init.bcntl = (uint8_t)(len & 0xFF);
 
   copied = MIN(len, ISIZE);
-  if(!data) return;
-  memcpy(frame.init.data, data, copied);
+  if (!data) return;
+  memcpy(frame->init.data, data, copied);
   CTAPHID_SendFrame();
   off += copied;
 
   while (len > off) {
-    memset(&frame.cont, 0, sizeof(frame.cont));
-    frame.cont.seq = (uint8_t)seq++;
+    frame = CTAPHID_AcquireFrame();
+    frame->cid = cid;
+    frame->cont.seq = (uint8_t)seq++;
     copied = MIN(len - off, CSIZE);
-    memcpy(frame.cont.data, data + off, copied);
+    memcpy(frame->cont.data, data + off, copied);
     CTAPHID_SendFrame();
     off += copied;
   }
 }
 
 static void CTAPHID_SendErrorResponse(uint32_t cid, uint8_t code) {
-  memset(&frame, 0, sizeof(frame));
-  frame.cid = cid;
-  frame.init.cmd = CTAPHID_ERROR;
-  frame.init.bcnth = 0;
-  frame.init.bcntl = 1;
-  frame.init.data[0] = code;
+  CTAPHID_FRAME *frame = CTAPHID_AcquireFrame();
+  frame->cid = cid;
+  frame->init.cmd = CTAPHID_ERROR;
+  frame->init.bcnth = 0;
+  frame->init.bcntl = 1;
+  frame->init.data[0] = code;
   CTAPHID_SendFrame();
 }
 
@@ -84,6 +163,7 @@ static void CTAPHID_Execute_Init(void) {
   CTAPHID_SendResponse(channel.cid, channel.cmd, (uint8_t *)resp, sizeof(CTAPHID_INIT_RESP));
 }
 
+#ifdef CANOKEY_WITH_FIDO
 static void CTAPHID_Execute_Msg(void) {
   CAPDU *capdu = &apdu_cmd;
   RAPDU *rapdu = &apdu_resp;
@@ -97,7 +177,10 @@ static void CTAPHID_Execute_Msg(void) {
   RDATA = channel.data;
   DBG_MSG("C: ");
   PRINT_HEX(channel.data, channel.bcnt_total);
+  is_executing = 1;
+  last_keepalive = device_get_tick();
   ctap_process_apdu(capdu, rapdu);
+  is_executing = 0;
   channel.data[LL] = HI(SW);
   channel.data[LL + 1] = LO(SW);
   DBG_MSG("R: ");
@@ -108,68 +191,95 @@ static void CTAPHID_Execute_Msg(void) {
 static void CTAPHID_Execute_Cbor(void) {
   DBG_MSG("C: ");
   PRINT_HEX(channel.data, channel.bcnt_total);
-  size_t len = sizeof(channel.data);
+  size_t len = MAX_CTAP_BUFSIZE;
+  is_executing = 1;
+  last_keepalive = device_get_tick();
   ctap_process_cbor(channel.data, channel.bcnt_total, channel.data, &len);
+  is_executing = 0;
   DBG_MSG("R: ");
   PRINT_HEX(channel.data, len);
   CTAPHID_SendResponse(channel.cid, channel.cmd, channel.data, len);
 }
+#endif
+
+static void CTAPHID_ReleaseBuffer(void) {
+  // the loop nested in a user presence check must not take the buffer of the message being executed
+  if (is_executing) return;
+  apdu_pool_release(channel.data);
+  channel.data = NULL;
+}
+
+uint32_t CTAPHID_NextDeadline(void) {
+  if (rx_head != rx_tail) return device_get_tick();
+  // the loop times the message out once the tick has passed the expiry
+  if (channel.state == CTAPHID_BUSY) return channel.expire == UINT32_MAX ? UINT32_MAX : channel.expire + 1;
+  return UINT32_MAX;
+}
 
 uint8_t CTAPHID_Loop(uint8_t wait_for_user) {
   if (channel.state == CTAPHID_BUSY && device_get_tick() > channel.expire) {
     channel.state = CTAPHID_IDLE;
+    CTAPHID_ReleaseBuffer();
     CTAPHID_SendErrorResponse(channel.cid, ERR_MSG_TIMEOUT);
     return LOOP_SUCCESS;
   }
 
-  if (!has_frame) return LOOP_SUCCESS;
-  has_frame = 0;
+  if (!CTAPHID_PopFrame()) return LOOP_SUCCESS;
 
-  if (frame.cid == 0 || (frame.cid == CID_BROADCAST && frame.init.cmd != CTAPHID_INIT)) {
-    CTAPHID_SendErrorResponse(frame.cid, ERR_INVALID_CID);
+  if (rx_frame.cid == 0 || (rx_frame.cid == CID_BROADCAST && rx_frame.init.cmd != CTAPHID_INIT)) {
+    CTAPHID_SendErrorResponse(rx_frame.cid, ERR_INVALID_CID);
     return LOOP_SUCCESS;
   }
-  if (channel.state == CTAPHID_BUSY && frame.cid != channel.cid) {
-    CTAPHID_SendErrorResponse(frame.cid, ERR_CHANNEL_BUSY);
+  if (channel.state == CTAPHID_BUSY && rx_frame.cid != channel.cid) {
+    CTAPHID_SendErrorResponse(rx_frame.cid, ERR_CHANNEL_BUSY);
     return LOOP_SUCCESS;
   }
 
-  channel.cid = frame.cid;
+  channel.cid = rx_frame.cid;
 
-  if (FRAME_TYPE(frame) == TYPE_INIT) {
-    if (!wait_for_user && channel.state == CTAPHID_BUSY && frame.init.cmd != CTAPHID_INIT) { // self abort is ok
+  if (FRAME_TYPE(rx_frame) == TYPE_INIT) {
+    if (!wait_for_user && channel.state == CTAPHID_BUSY && rx_frame.init.cmd != CTAPHID_INIT) { // self abort is ok
       channel.state = CTAPHID_IDLE;
+      CTAPHID_ReleaseBuffer();
       CTAPHID_SendErrorResponse(channel.cid, ERR_INVALID_SEQ);
       return LOOP_SUCCESS;
     }
-    channel.bcnt_total = (uint16_t)MSG_LEN(frame);
+    channel.bcnt_total = (uint16_t)MSG_LEN(rx_frame);
     if (channel.bcnt_total > MAX_CTAP_BUFSIZE) {
-      CTAPHID_SendErrorResponse(frame.cid, ERR_INVALID_LEN);
+      CTAPHID_SendErrorResponse(rx_frame.cid, ERR_INVALID_LEN);
+      return LOOP_SUCCESS;
+    }
+    if (channel.data == NULL) channel.data = apdu_pool_acquire();
+    if (channel.data == NULL) {
+      channel.state = CTAPHID_IDLE;
+      CTAPHID_SendErrorResponse(rx_frame.cid, ERR_CHANNEL_BUSY);
       return LOOP_SUCCESS;
     }
     uint16_t copied;
     channel.bcnt_current = copied = MIN(channel.bcnt_total, ISIZE);
     channel.state = CTAPHID_BUSY;
-    channel.cmd = frame.init.cmd;
+    channel.cmd = rx_frame.init.cmd;
     channel.seq = 0;
-    memcpy(channel.data, frame.init.data, copied);
+    memcpy(channel.data, rx_frame.init.data, copied);
     channel.expire = device_get_tick() + CTAPHID_TRANS_TIMEOUT;
-  } else if (FRAME_TYPE(frame) == TYPE_CONT) {
+  } else if (FRAME_TYPE(rx_frame) == TYPE_CONT) {
     if (channel.state == CTAPHID_IDLE) return 0; // ignore spurious continuation packet
-    if (FRAME_SEQ(frame) != channel.seq++) {
+    if (FRAME_SEQ(rx_frame) != channel.seq++) {
       channel.state = CTAPHID_IDLE;
+      CTAPHID_ReleaseBuffer();
       CTAPHID_SendErrorResponse(channel.cid, ERR_INVALID_SEQ);
       return LOOP_SUCCESS;
     }
     uint16_t copied;
     copied = MIN(channel.bcnt_total - channel.bcnt_current, CSIZE);
-    memcpy(channel.data + channel.bcnt_current, frame.cont.data, copied);
+    memcpy(channel.data + channel.bcnt_current, rx_frame.cont.data, copied);
     channel.bcnt_current += copied;
   }
 
   if (channel.bcnt_current == channel.bcnt_total) {
     channel.expire = UINT32_MAX;
     switch (channel.cmd) {
+#ifdef CANOKEY_WITH_FIDO
     case CTAPHID_MSG:
       DBG_MSG("MSG\n");
       if (wait_for_user)
@@ -188,6 +298,7 @@ uint8_t CTAPHID_Loop(uint8_t wait_for_user) {
       else
         CTAPHID_Execute_Cbor();
       break;
+#endif
     case CTAPHID_INIT:
       DBG_MSG("INIT\n");
       if (wait_for_user)
@@ -211,6 +322,8 @@ uint8_t CTAPHID_Loop(uint8_t wait_for_user) {
       break;
     case CTAPHID_CANCEL:
       DBG_MSG("CANCEL\n");
+      channel.state = CTAPHID_IDLE;
+      CTAPHID_ReleaseBuffer();
       return LOOP_CANCEL;
     default:
       DBG_MSG("Invalid CMD\n");
@@ -218,18 +331,36 @@ uint8_t CTAPHID_Loop(uint8_t wait_for_user) {
       break;
     }
     channel.state = CTAPHID_IDLE;
+    CTAPHID_ReleaseBuffer();
   }
 
   return LOOP_SUCCESS;
 }
 
+// Runs from device_yield while a command of any interface is being processed. Reports stay queued for
+// CTAPHID_Loop, unless a CTAPHID command is in flight: channel.data is then in use, so the messages are not
+// assembled but rejected, and the host retries later. A CANCEL is left to the loop nested in the user presence check.
+void CTAPHID_Yield(void) {
+  if (!is_executing) return;
+  if (device_get_tick() - last_keepalive >= KEEPALIVE_INTERVAL) {
+    last_keepalive = device_get_tick();
+    CTAPHID_SendKeepAlive(KEEPALIVE_STATUS_PROCESSING);
+  }
+  while (rx_head != rx_tail) {
+    const CTAPHID_FRAME *frame = &rx_ring[rx_head & RX_RING_MASK];
+    if (FRAME_TYPE(*frame) == TYPE_INIT && frame->init.cmd == CTAPHID_CANCEL) break;
+    if (FRAME_TYPE(*frame) == TYPE_INIT) CTAPHID_SendErrorResponse(frame->cid, ERR_CHANNEL_BUSY);
+    CTAPHID_ReleaseFrame();
+  }
+}
+
 void CTAPHID_SendKeepAlive(uint8_t status) {
-  memset(&frame, 0, sizeof(frame));
-  frame.cid = channel.cid;
-  frame.type = TYPE_INIT;
-  frame.init.cmd |= CTAPHID_KEEPALIVE;
-  frame.init.bcnth = 0;
-  frame.init.bcntl = 1;
-  frame.init.data[0] = status;
+  CTAPHID_FRAME *frame = CTAPHID_AcquireFrame();
+  frame->cid = channel.cid;
+  frame->type = TYPE_INIT;
+  frame->init.cmd |= CTAPHID_KEEPALIVE;
+  frame->init.bcnth = 0;
+  frame->init.bcntl = 1;
+  frame->init.data[0] = status;
   CTAPHID_SendFrame();
 }
@@ -88,12 +88,23 @@ typedef struct {
 
 #define KEEPALIVE_STATUS_PROCESSING 1
 #define KEEPALIVE_STATUS_UPNEEDED 2
+#define KEEPALIVE_INTERVAL 100 // in ms
 
 #define LOOP_SUCCESS 0x00
 #define LOOP_CANCEL 0x01
 
 #define MAX_CTAP_BUFSIZE 1280
 
+// Number of outgoing reports that can be queued for the IN endpoint, must be a power of 2
+#ifndef CTAPHID_TX_RING_SIZE
+#define CTAPHID_TX_RING_SIZE 8
+#endif
+
+// Number of incoming reports waiting for CTAPHID_Loop, e.g. while another interface runs a command, power of 2
+#ifndef CTAPHID_RX_RING_SIZE
+#define CTAPHID_RX_RING_SIZE 4
+#endif
+
 typedef struct {
   uint32_t cid;
   uint16_t bcnt_total;
@@ -102,14 +113,19 @@ typedef struct {
   uint8_t state;
   uint8_t cmd;
   uint8_t seq;
-  alignas(4) uint8_t data[MAX_CTAP_BUFSIZE];
+  uint8_t *data; // borrowed from the pool while a message is assembled and executed
 } CTAPHID_Channel;
 
 typedef struct _USBD_HandleTypeDef USBD_HandleTypeDef;
 
 uint8_t CTAPHID_Init(uint8_t (*send_report)(USBD_HandleTypeDef *pdev, uint8_t *report, uint16_t len));
+// Returns 1 if the queue is full and the report has not been taken, the transport then offers it again later
 uint8_t CTAPHID_OutEvent(uint8_t *data);
+uint8_t CTAPHID_InEvent(void);
 void CTAPHID_SendKeepAlive(uint8_t status);
 uint8_t CTAPHID_Loop(uint8_t wait_for_user);
+// Tick at which CTAPHID_Loop has to run even if no frame arrives, UINT32_MAX if there is none
+uint32_t CTAPHID_NextDeadline(void);
+void CTAPHID_Yield(void);
 
 #endif // __CTAPHID_H_INCLUDED__
@@ -4,7 +4,7 @@
 #include <usbd_ctaphid.h>
 #include <usbd_ctlreq.h>
 
-static USBD_CTAPHID_HandleTypeDef hid_handle;
+static __card_local USBD_CTAPHID_HandleTypeDef hid_handle;
 
 // clang-format off
 static const uint8_t report_desc[] = {
@@ -40,6 +40,7 @@ static const uint8_t USBD_CTAPHID_Desc[] = {
 
 uint8_t USBD_CTAPHID_Init(USBD_HandleTypeDef *pdev) {
   hid_handle.state = CTAPHID_IDLE;
+  hid_handle.rx_held = 0;
   USBD_LL_OpenEP(pdev, EP_IN(ctap_hid), USBD_EP_TYPE_INTR, EP_SIZE(ctap_hid));
   USBD_LL_OpenEP(pdev, EP_OUT(ctap_hid), USBD_EP_TYPE_INTR, EP_SIZE(ctap_hid));
   CTAPHID_Init(USBD_CTAPHID_SendReport);
@@ -90,25 +91,30 @@ uint8_t USBD_CTAPHID_Setup(USBD_HandleTypeDef *pdev, USBD_SetupReqTypedef *req)
 
 uint8_t USBD_CTAPHID_DataIn() {
   hid_handle.state = CTAPHID_IDLE;
-  return USBD_OK;
+  return CTAPHID_InEvent();
 }
 
 uint8_t USBD_CTAPHID_DataOut(USBD_HandleTypeDef *pdev) {
-  CTAPHID_OutEvent(hid_handle.report_buf);
+  // Interrupt OUT reports are not retried once ACKed. While CTAPHID has no room, the endpoint stays unprepared and
+  // NAKs the host, which keeps the next report until USBD_CTAPHID_ResumeReceive.
+  if (CTAPHID_OutEvent(hid_handle.report_buf) != 0) {
+    hid_handle.rx_held = 1;
+    return USBD_OK;
+  }
   USBD_LL_PrepareReceive(pdev, EP_OUT(ctap_hid), hid_handle.report_buf, USBD_CTAPHID_REPORT_BUF_SIZE);
   return USBD_OK;
 }
 
-uint8_t USBD_CTAPHID_SendReport(USBD_HandleTypeDef *pdev, uint8_t *report, uint16_t len) {
-  volatile CTAPHID_StateTypeDef *state = &hid_handle.state;
+void USBD_CTAPHID_ResumeReceive(USBD_HandleTypeDef *pdev) {
+  if (!hid_handle.rx_held) return;
+  hid_handle.rx_held = 0;
+  USBD_CTAPHID_DataOut(pdev);
+}
 
-  if (pdev->dev_state == USBD_STATE_CONFIGURED) {
-#ifndef TEST
-    while (*state != CTAPHID_IDLE)
-      device_delay(1);
-#endif
-    hid_handle.state = CTAPHID_BUSY;
-    USBD_LL_Transmit(pdev, EP_IN(ctap_hid), report, len);
-  }
+// Called by the CTAPHID transmit ring, which keeps at most one report in flight
+uint8_t USBD_CTAPHID_SendReport(USBD_HandleTypeDef *pdev, uint8_t *report, uint16_t len) {
+  if (pdev->dev_state != USBD_STATE_CONFIGURED) return USBD_FAIL;
+  hid_handle.state = CTAPHID_BUSY;
+  USBD_LL_Transmit(pdev, EP_IN(ctap_hid), report, len);
   return USBD_OK;
 }
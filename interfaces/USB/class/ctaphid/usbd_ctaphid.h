@@ -15,12 +15,15 @@ typedef struct {
   uint8_t report_buf[USBD_CTAPHID_REPORT_BUF_SIZE];
   uint32_t idle_state;
   CTAPHID_StateTypeDef state;
+  volatile uint8_t rx_held; // report_buf holds a report CTAPHID had no room for, the endpoint is not re-armed
 } USBD_CTAPHID_HandleTypeDef;
 
 uint8_t USBD_CTAPHID_Init(USBD_HandleTypeDef *pdev);
 uint8_t USBD_CTAPHID_Setup(USBD_HandleTypeDef *pdev, USBD_SetupReqTypedef *req);
 uint8_t USBD_CTAPHID_DataIn(void);
 uint8_t USBD_CTAPHID_DataOut(USBD_HandleTypeDef *pdev);
+// Called by CTAPHID once it has room for another report
+void USBD_CTAPHID_ResumeReceive(USBD_HandleTypeDef *pdev);
 uint8_t USBD_CTAPHID_SendReport(USBD_HandleTypeDef *pdev, uint8_t *report, uint16_t len);
 
 #endif /* __USB_CTAPHID_H */
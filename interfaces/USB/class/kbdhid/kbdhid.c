@@ -11,10 +11,10 @@ static enum {
   KBDHID_KeyDown,
   KBDHID_KeyUp,
 } state;
-static char key_sequence[10];
-static uint8_t key_seq_position;
-static keyboard_report_t report;
-static uint32_t last_sent;
+static __card_local char key_sequence[10];
+static __card_local uint8_t key_seq_position;
+static __card_local keyboard_report_t report;
+static __card_local uint32_t last_sent;
 
 static uint8_t ascii2keycode(char ch) {
   if ('1' <= ch && ch <= '9')
@@ -30,7 +30,12 @@ static uint8_t ascii2keycode(char ch) {
 }
 
 static void KBDHID_UserTouchHandle(void) {
-  if (oath_process_one_touch(key_sequence, sizeof(key_sequence)) < 0) {
+#ifdef CANOKEY_WITH_OATH
+  int ret = oath_process_one_touch(key_sequence, sizeof(key_sequence));
+#else
+  int ret = -1; // no OTP without the OATH applet
+#endif
+  if (ret < 0) {
     ERR_MSG("Failed to get the OTP code\n");
     memcpy(key_sequence, "error", 6);
   } else {
@@ -87,3 +92,8 @@ uint8_t KBDHID_Loop(void) {
   if (state != KBDHID_Idle) KBDHID_TypeKeySeq();
   return 0;
 }
+
+// Keeps typing an OTP already being sent, without starting a new one
+void KBDHID_Yield(void) {
+  if (state != KBDHID_Idle) KBDHID_TypeKeySeq();
+}
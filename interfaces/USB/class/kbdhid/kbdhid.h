@@ -5,5 +5,6 @@
 
 uint8_t KBDHID_Init(void);
 uint8_t KBDHID_Loop(void);
+void KBDHID_Yield(void);
 
 #endif // __KBDHID_H_INCLUDED__
@@ -4,7 +4,7 @@
 #include <usbd_ctlreq.h>
 #include <usbd_kbdhid.h>
 
-static USBD_KBDHID_HandleTypeDef hid_handle;
+static __card_local USBD_KBDHID_HandleTypeDef hid_handle;
 
 // clang-format off
 static const uint8_t report_desc[KBDHID_REPORT_DESC_SIZE] = {
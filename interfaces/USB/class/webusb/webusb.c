@@ -1,4 +1,5 @@
 #include <apdu.h>
+#include <apdu_pool.h>
 #include <webusb.h>
 
 enum {
@@ -8,17 +9,17 @@ enum {
   STATE_SENT_RESP = 2,
 };
 
-static uint8_t state, apdu_buffer[APDU_BUFFER_SIZE];
-static uint16_t apdu_buffer_size;
-static CAPDU apdu_cmd;
-static RAPDU apdu_resp;
+static __card_local uint8_t state, *apdu_buffer; // borrowed from the command until the response is read
+static __card_local uint16_t apdu_buffer_size;
+static __card_local CAPDU apdu_cmd;
+static __card_local RAPDU apdu_resp;
 
 uint8_t USBD_WEBUSB_Init(USBD_HandleTypeDef *pdev) {
   UNUSED(pdev);
 
   state = STATE_IDLE;
-  apdu_cmd.data = apdu_buffer;
-  apdu_resp.data = apdu_buffer;
+  apdu_pool_release(apdu_buffer);
+  apdu_buffer = NULL;
 
   return USBD_OK;
 }
@@ -31,6 +32,14 @@ uint8_t USBD_WEBUSB_Setup(USBD_HandleTypeDef *pdev, USBD_SetupReqTypedef *req) {
       USBD_CtlError(pdev, req);
       return USBD_FAIL;
     }
+    // a response that has not been read is dropped
+    if (apdu_buffer == NULL) apdu_buffer = apdu_pool_acquire();
+    if (apdu_buffer == NULL) {
+      USBD_CtlError(pdev, req);
+      return USBD_FAIL;
+    }
+    apdu_cmd.data = apdu_buffer;
+    apdu_resp.data = apdu_buffer;
     USBD_CtlPrepareRx(pdev, apdu_buffer, req->wLength);
     apdu_buffer_size = req->wLength;
     break;
@@ -86,7 +95,11 @@ void WebUSB_Loop(void) {
 uint8_t USBD_WEBUSB_TxSent(USBD_HandleTypeDef *pdev) {
   UNUSED(pdev);
 
-  if (state == STATE_SENT_RESP) state = STATE_IDLE;
+  if (state == STATE_SENT_RESP) {
+    state = STATE_IDLE;
+    apdu_pool_release(apdu_buffer);
+    apdu_buffer = NULL;
+  }
 
   return USBD_OK;
 }
@@ -351,7 +351,7 @@ static void USBD_SetAddress(USBD_HandleTypeDef *pdev, USBD_SetupReqTypedef *req)
  */
 static void USBD_SetConfig(USBD_HandleTypeDef *pdev, USBD_SetupReqTypedef *req) {
 
-  static uint8_t cfgidx;
+  static __card_local uint8_t cfgidx;
 
   cfgidx = (uint8_t)(req->wValue);
 
@@ -3,10 +3,10 @@
 #include <usbd_core.h>
 #include <usbd_desc.h>
 
-USBD_HandleTypeDef usb_device = {};
-IFACE_TABLE_t IFACE_TABLE;
-EP_TABLE_t EP_TABLE;
-EP_SIZE_TABLE_t EP_SIZE_TABLE;
+__card_local USBD_HandleTypeDef usb_device = {};
+__card_local IFACE_TABLE_t IFACE_TABLE;
+__card_local EP_TABLE_t EP_TABLE;
+__card_local EP_SIZE_TABLE_t EP_SIZE_TABLE;
 
 void usb_device_init(void) {
   usb_resources_alloc();
@@ -34,13 +34,13 @@ typedef struct {
 #define IS_ENABLED_IFACE(i) (i != 0xFF)
 
 /** USB device core handle. */
-extern USBD_HandleTypeDef usb_device;
+extern __card_local USBD_HandleTypeDef usb_device;
 /** USB interface number allocation table. */
-extern IFACE_TABLE_t IFACE_TABLE;
+extern __card_local IFACE_TABLE_t IFACE_TABLE;
 /** USB endpoint number allocation table. */
-extern EP_TABLE_t EP_TABLE;
+extern __card_local EP_TABLE_t EP_TABLE;
 /** USB endpoint size allocation table. */
-extern EP_SIZE_TABLE_t EP_SIZE_TABLE;
+extern __card_local EP_SIZE_TABLE_t EP_SIZE_TABLE;
 
 void usb_device_init(void);
 void usb_device_deinit(void);
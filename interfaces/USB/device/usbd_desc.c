@@ -207,7 +207,7 @@ static const uint8_t USBD_FS_IfDesc_CCID[] = {
     0x00,                         /* bInterval: Polling Interval */
 };
 
-static uint8_t USBD_FS_CfgDesc[USB_LEN_CFG_DESC +
+static __card_local uint8_t USBD_FS_CfgDesc[USB_LEN_CFG_DESC +
                               sizeof(USBD_FS_IfDesc_CCID) +
                               sizeof(USBD_FS_IfDesc_WEBUSB) +
                               sizeof(USBD_FS_IfDesc_KBDHID) +
@@ -361,7 +361,7 @@ void USBD_DescriptorInit(void) {
 }
 
 /* Internal string descriptor. */
-uint8_t USBD_StrDesc[USBD_MAX_STR_DESC_SIZ];
+__card_local uint8_t USBD_StrDesc[USBD_MAX_STR_DESC_SIZ];
 
 const uint8_t *USBD_DeviceDescriptor(USBD_SpeedTypeDef speed, uint16_t *length) {
   *length = sizeof(USBD_FS_DeviceDesc);
@@ -0,0 +1,218 @@
+#!/usr/bin/env python3
+"""Worst-case stack depth per entry point and static RAM per module.
+
+The objects have to be compiled by GCC with -fstack-usage -fcallgraph-info=su, which leaves a .su (the frame of
+every function) and a .ci (the call graph in VCG) next to every .o. The stack depth of an entry point is the
+deepest path of frames through the call graph. Frames of unknown size (functions outside of the scanned objects,
+e.g. libc) count as 0, and so do indirect calls; both are listed, as well as dynamic frames and recursion, so that
+the figure can be trusted only as far as these notes allow.
+
+Static RAM is the size of the .data and .bss symbols (thread-local ones included) reported by nm.
+
+The exit code is 1 if a budget is exceeded.
+"""
+
+import argparse
+import os
+import re
+import subprocess
+import sys
+
+INDIRECT_CALL = "__indirect_call"
+
+NODE_RE = re.compile(r'node: \{ title: "([^"]*)" label: "([^"]*)"')
+EDGE_RE = re.compile(r'edge: \{ sourcename: "([^"]*)" targetname: "([^"]*)"')
+
+
+class Function:
+    def __init__(self, title, name, location):
+        self.title = title
+        self.name = name
+        self.location = location
+        self.frame = None  # None for functions defined elsewhere
+        self.qualifier = ""
+        self.callees = set()
+
+
+def find_files(roots, suffix):
+    for root in roots:
+        for directory, _, files in os.walk(root):
+            for f in sorted(files):
+                if f.endswith(suffix):
+                    yield os.path.join(directory, f)
+
+
+def load_call_graph(roots):
+    frames = {}  # "file:line:col" -> (bytes, qualifier)
+    for path in find_files(roots, ".su"):
+        with open(path) as f:
+            for line in f:
+                fields = line.rstrip("\n").split("\t")
+                if len(fields) != 3:
+                    continue
+                location = fields[0].rsplit(":", 1)[0]
+                frames[location] = (int(fields[1]), fields[2])
+
+    functions = {}
+    for path in find_files(roots, ".ci"):
+        with open(path) as f:
+            for line in f:
+                m = NODE_RE.match(line)
+                if m:
+                    title, label = m.group(1), m.group(2).split("\\n")
+                    location = label[1] if len(label) > 1 else ""
+                    fn = functions.get(title)
+                    if fn is None:
+                        fn = functions[title] = Function(title, label[0], location)
+                    # callers only know the declaration, the frame comes with the definition
+                    if location in frames:
+                        frame, qualifier = frames[location]
+                        # a static inline function of a header is compiled into every translation unit using it
+                        if fn.frame is None or frame > fn.frame:
+                            fn.location, fn.frame, fn.qualifier = location, frame, qualifier
+                    continue
+                m = EDGE_RE.match(line)
+                if m:
+                    functions[m.group(1)].callees.add(m.group(2))
+    return functions
+
+
+class StackAnalysis:
+    def __init__(self, functions):
+        self.functions = functions
+        self.depth = {}
+        self.path = {}
+        self.unknown, self.indirect, self.dynamic, self.recursive = set(), set(), set(), set()
+
+    def visit(self, title, stack):
+        if title in self.depth:
+            return self.depth[title]
+        fn = self.functions.get(title)
+        if fn is None or fn.frame is None:
+            (self.indirect if title == INDIRECT_CALL else self.unknown).add(title)
+            self.depth[title], self.path[title] = 0, []
+            return 0
+        if "dynamic" in fn.qualifier and "bounded" not in fn.qualifier:
+            self.dynamic.add(fn.name)
+        stack.add(title)
+        deepest, deepest_path = 0, []
+        for callee in sorted(fn.callees):
+            if callee in stack:
+                self.recursive.add(fn.name)
+                continue
+            depth = self.visit(callee, stack)
+            if depth > deepest:
+                deepest, deepest_path = depth, self.path[callee]
+        stack.remove(title)
+        self.depth[title] = fn.frame + deepest
+        self.path[title] = [fn.name] + deepest_path
+        return self.depth[title]
+
+
+def load_static_ram(roots, nm):
+    modules = {}  # module -> [data, bss]
+    symbols = []
+    for path in find_files(roots, ".o"):
+        out = subprocess.run([nm, "--print-size", path], stdout=subprocess.PIPE, universal_newlines=True, check=True)
+        # objects of a CMake target live in CMakeFiles/<target>.dir/<source directory>
+        parts = os.path.dirname(path).split(os.sep)
+        targets = [i for i, p in enumerate(parts) if p.endswith(".dir")]
+        if targets:
+            target = parts[targets[-1]][:-len(".dir")]
+            module = "/".join(parts[targets[-1] + 1:]) or "."
+            if target != "canokey-core":
+                module = target + ":" + module
+        else:
+            module = os.path.dirname(path)
+        sizes = modules.setdefault(module, [0, 0])
+        for line in out.stdout.splitlines():
+            fields = line.split()
+            if len(fields) != 4:
+                continue
+            size, kind, name = int(fields[1], 16), fields[2], fields[3]
+            if kind in "dDgG":
+                sizes[0] += size
+            elif kind in "bBsSC":
+                sizes[1] += size
+            else:
+                continue
+            symbols.append((size, name, module))
+    return modules, symbols
+
+
+def parse_budgets(items):
+    budgets = {}
+    for item in items:
+        for budget in filter(None, item.split(";")):
+            name, _, size = budget.partition("=")
+            budgets[name] = int(size, 0)
+    return budgets
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("roots", nargs="+", help="directories with the .o, .su and .ci files")
+    parser.add_argument("--entry", action="append", default=[], help="entry point to report, may be repeated")
+    parser.add_argument("--stack-budget", action="append", default=[], metavar="ENTRY=BYTES",
+                        help="stack budget of an entry point, may be repeated or separated by ';'")
+    parser.add_argument("--static-budget", type=lambda x: int(x, 0), default=0,
+                        help="budget of .data and .bss in bytes, 0 for none")
+    parser.add_argument("--nm", default="nm", help="nm of the toolchain that built the objects")
+    parser.add_argument("--top", type=int, default=10, help="number of the largest static symbols to list")
+    args = parser.parse_args()
+
+    functions = load_call_graph(args.roots)
+    stack_budgets = parse_budgets(args.stack_budget)
+    entries = args.entry or ["process_apdu", "ctap_process_cbor", "CTAPHID_Loop", "nfc_loop"]
+    failed = False
+
+    print("Worst-case stack depth")
+    print("  %-24s %8s %8s  %s" % ("entry", "bytes", "budget", "deepest path"))
+    for entry in entries:
+        if entry not in functions or functions[entry].frame is None:
+            print("  %-24s %8s %8s" % (entry, "?", stack_budgets.get(entry, "-")))
+            print("    not found, is it compiled with -fstack-usage -fcallgraph-info=su?")
+            failed |= entry in stack_budgets
+            continue
+        analysis = StackAnalysis(functions)
+        depth = analysis.visit(entry, set())
+        budget = stack_budgets.get(entry)
+        over = budget is not None and depth > budget
+        failed |= over
+        print("  %-24s %8d %8s  %s%s" % (entry, depth, budget if budget is not None else "-",
+                                         " > ".join(analysis.path[entry]), "  OVER BUDGET" if over else ""))
+        if analysis.dynamic:
+            print("    dynamic frames: " + ", ".join(sorted(analysis.dynamic)))
+        if analysis.recursive:
+            print("    recursion (counted once): " + ", ".join(sorted(analysis.recursive)))
+        if analysis.indirect:
+            callers = sorted(fn.name for title, fn in functions.items()
+                             if INDIRECT_CALL in fn.callees and title in analysis.depth)
+            print("    indirect calls (counted as 0) in: " + ", ".join(callers))
+        if analysis.unknown:
+            print("    unknown frames (counted as 0): " + ", ".join(sorted(analysis.unknown)))
+
+    modules, symbols = load_static_ram(args.roots, args.nm)
+    total_data = sum(m[0] for m in modules.values())
+    total_bss = sum(m[1] for m in modules.values())
+    print()
+    print("Static RAM")
+    print("  %-40s %8s %8s %8s" % ("module", ".data", ".bss", "total"))
+    for module, (data, bss) in sorted(modules.items(), key=lambda m: -sum(m[1])):
+        if data + bss:
+            print("  %-40s %8d %8d %8d" % (module, data, bss, data + bss))
+    over = args.static_budget and total_data + total_bss > args.static_budget
+    failed |= bool(over)
+    print("  %-40s %8d %8d %8d%s" % ("total", total_data, total_bss, total_data + total_bss,
+                                     "  OVER BUDGET of %d" % args.static_budget if over else ""))
+    if args.top:
+        print()
+        print("Largest static symbols")
+        for size, name, module in sorted(symbols, reverse=True)[:args.top]:
+            print("  %-40s %8d  %s" % (name, size, module))
+
+    return 1 if failed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -1,53 +1,100 @@
 #include <admin.h>
 #include <apdu.h>
+#include <apdu_pool.h>
 #include <ctap.h>
 #include <device.h>
+#include <latency.h>
 #include <oath.h>
 #include <openpgp.h>
 #include <piv.h>
+#include <record.h>
 #include <string.h>
 
-enum APPLET {
-  APPLET_NULL,
-  APPLET_PIV,
-  APPLET_FIDO,
-  APPLET_OATH,
-  APPLET_ADMIN,
-  APPLET_OPENPGP,
-  APPLET_ENUM_END,
-};
+#include "applet_table.h"
 
-static const uint8_t PIV_AID[] = {0xA0, 0x00, 0x00, 0x03, 0x08};
-static const uint8_t OATH_AID[] = {0xA0, 0x00, 0x00, 0x05, 0x27, 0x21, 0x01};
-static const uint8_t ADMIN_AID[] = {0xF0, 0x00, 0x00, 0x00, 0x00};
-static const uint8_t OPENPGP_AID[] = {0xD2, 0x76, 0x00, 0x01, 0x24, 0x01};
-static const uint8_t FIDO_AID[] = {0xA0, 0x00, 0x00, 0x06, 0x47, 0x2F, 0x00, 0x01};
+typedef struct {
+  enum APPLET applet;
+  const uint8_t *aid;
+  uint8_t aid_len;
+  // the applet answers in the buffer of the transport and keeps long responses by itself
+  uint8_t in_place;
+} APPLET_ENTRY;
 
-static const uint8_t *const AID[] = {
-    [APPLET_NULL] = NULL,     [APPLET_PIV] = PIV_AID,     [APPLET_FIDO] = FIDO_AID,
-    [APPLET_OATH] = OATH_AID, [APPLET_ADMIN] = ADMIN_AID, [APPLET_OPENPGP] = OPENPGP_AID,
-};
+#define AID(...) .aid = (const uint8_t[]){__VA_ARGS__}, .aid_len = sizeof((const uint8_t[]){__VA_ARGS__})
 
-static const uint8_t AID_Size[] = {
-    [APPLET_NULL] = 0,
-    [APPLET_PIV] = sizeof(PIV_AID),
-    [APPLET_FIDO] = sizeof(FIDO_AID),
-    [APPLET_OATH] = sizeof(OATH_AID),
-    [APPLET_ADMIN] = sizeof(ADMIN_AID),
-    [APPLET_OPENPGP] = sizeof(OPENPGP_AID),
-};
+#if defined(TEST) && defined(CANOKEY_WITH_FIDO)
+static int fido_process_apdu(const CAPDU *capdu, RAPDU *rapdu) {
+  if (CLA == 0x00 && INS == 0xEE && LC == 0x04 && memcmp(DATA, "\x12\x56\xAB\xF0", 4) == 0) {
+    printf("MAGIC REBOOT command received!\r\n");
+    ctap_install(0);
+    SW = 0x9000;
+    LL = 0;
+    return 0;
+  }
+  return ctap_process_apdu(capdu, rapdu);
+}
+#else
+#define fido_process_apdu ctap_process_apdu
+#endif
 
-static uint8_t chaining_buffer[APDU_BUFFER_SIZE];
+#define APPLET_ENTRY_PIV {APPLET_PIV, AID(0xA0, 0x00, 0x00, 0x03, 0x08), 0}
+#define APPLET_ENTRY_FIDO {APPLET_FIDO, AID(0xA0, 0x00, 0x00, 0x06, 0x47, 0x2F, 0x00, 0x01), 0}
+#define APPLET_ENTRY_OATH {APPLET_OATH, AID(0xA0, 0x00, 0x00, 0x05, 0x27, 0x21, 0x01), 1}
+#define APPLET_ENTRY_ADMIN {APPLET_ADMIN, AID(0xF0, 0x00, 0x00, 0x00, 0x00), 0}
+#define APPLET_ENTRY_OPENPGP {APPLET_OPENPGP, AID(0xD2, 0x76, 0x00, 0x01, 0x24, 0x01), 0}
 
-static CAPDU_CHAINING capdu_chaining = {
-    .max_size = sizeof(chaining_buffer),
-    .capdu.data = chaining_buffer,
-};
-static RAPDU_CHAINING rapdu_chaining = {
-    .rapdu.data = chaining_buffer,
-};
+// The applets built in, see CMakeLists.txt
+static const APPLET_ENTRY applets[] = {APPLET_TABLE};
 
-static enum APPLET current_applet;
+// The applets are called directly rather than through the table, so that the call graph (scripts/ram-report.py)
+// reaches their frames
+static void applet_process_apdu(enum APPLET applet, const CAPDU *capdu, RAPDU *rapdu) {
+  switch (applet) {
+#ifdef CANOKEY_WITH_PIV
+  case APPLET_PIV:
+    piv_process_apdu(capdu, rapdu);
+    break;
+#endif
+#ifdef CANOKEY_WITH_FIDO
+  case APPLET_FIDO:
+    fido_process_apdu(capdu, rapdu);
+    break;
+#endif
+#ifdef CANOKEY_WITH_OATH
+  case APPLET_OATH:
+    oath_process_apdu(capdu, rapdu);
+    break;
+#endif
+  case APPLET_ADMIN:
+    admin_process_apdu(capdu, rapdu);
+    break;
+#ifdef CANOKEY_WITH_OPENPGP
+  case APPLET_OPENPGP:
+    openpgp_process_apdu(capdu, rapdu);
+    break;
+#endif
+  default:
+    break;
+  }
+}
+
+typedef struct {
+  enum APPLET applet;
+  uint8_t opened;
+  CAPDU_CHAINING capdu_chaining;
+  RAPDU_CHAINING rapdu_chaining;
+} LOGICAL_CHANNEL;
+
+// The basic channel (0) is always open. All channels share the chaining buffer, whose content belongs to
+// buffer_owner: a pending response of another channel is dropped once a new command arrives.
+// Commands that are neither chained nor answered with more than Le bytes are processed in the buffer of the
+// transport, the chaining buffer is only borrowed from the pool for the others.
+static __card_local LOGICAL_CHANNEL channels[LOGICAL_CHANNEL_NUM] = {
+    [0 ... LOGICAL_CHANNEL_NUM - 1] = {.capdu_chaining.max_size = APDU_BUFFER_SIZE},
+    [0].opened = 1,
+};
+static __card_local uint8_t buffer_owner;
+static __card_local uint8_t *chaining_buffer;
 
 int build_capdu(CAPDU *capdu, const uint8_t *cmd, uint16_t len) {
   if (len < 4) return -1;
@@ -137,101 +184,317 @@ int apdu_output(RAPDU_CHAINING *ex, RAPDU *sh) {
   return 0;
 }
 
-void applet_poweroff(void) {
-  switch (current_applet) {
+static const APPLET_ENTRY *find_applet(enum APPLET applet) {
+  for (size_t i = 0; i < sizeof(applets) / sizeof(applets[0]); ++i)
+    if (applets[i].applet == applet) return &applets[i];
+  return NULL;
+}
+
+static void poweroff_applet(enum APPLET applet) {
+  switch (applet) {
+#ifdef CANOKEY_WITH_PIV
   case APPLET_PIV:
     piv_poweroff();
     break;
+#endif
+#ifdef CANOKEY_WITH_FIDO
+  case APPLET_FIDO:
+    ctap_poweroff();
+    break;
+#endif
+#ifdef CANOKEY_WITH_OATH
   case APPLET_OATH:
     oath_poweroff();
     break;
+#endif
   case APPLET_ADMIN:
     admin_poweroff();
     break;
+#ifdef CANOKEY_WITH_OPENPGP
   case APPLET_OPENPGP:
     openpgp_poweroff();
     break;
+#endif
   default:
     break;
   }
 }
 
-void process_apdu(CAPDU *capdu, RAPDU *rapdu) {
-  int ret = apdu_input(&capdu_chaining, capdu);
-  if (ret == APDU_CHAINING_NOT_LAST_BLOCK) {
+static uint8_t is_applet_selected(enum APPLET applet) {
+  for (uint8_t i = 0; i < LOGICAL_CHANNEL_NUM; ++i)
+    if (channels[i].opened && channels[i].applet == applet) return 1;
+  return 0;
+}
+
+// The applet state, including the security status such as a verified PIN, is kept once for all channels. It is
+// cleared whenever a channel gains or loses the applet, so that no channel inherits the status gained on another.
+static void deselect_applet(uint8_t ch) {
+  enum APPLET applet = channels[ch].applet;
+  channels[ch].applet = APPLET_NULL;
+  poweroff_applet(applet);
+}
+
+static void select_applet(uint8_t ch, enum APPLET applet) {
+  if (applet != APPLET_NULL && is_applet_selected(applet)) poweroff_applet(applet);
+  channels[ch].applet = applet;
+}
+
+static uint8_t *acquire_chaining_buffer(LOGICAL_CHANNEL *channel) {
+  if (chaining_buffer == NULL) chaining_buffer = apdu_pool_acquire();
+  channel->capdu_chaining.capdu.data = chaining_buffer;
+  channel->rapdu_chaining.rapdu.data = chaining_buffer;
+  return chaining_buffer;
+}
+
+static void release_chaining_buffer(void) {
+  apdu_pool_release(chaining_buffer);
+  chaining_buffer = NULL;
+}
+
+static void reset_channel(uint8_t ch) {
+  channels[ch].capdu_chaining.in_chaining = 0;
+  channels[ch].rapdu_chaining.rapdu.len = 0;
+  channels[ch].rapdu_chaining.sent = 0;
+  if (ch == buffer_owner) release_chaining_buffer();
+}
+
+// Sends the first Le bytes of a response in place, the rest is kept in the chaining buffer for GET RESPONSE. The
+// buffer has been reserved by dispatch_apdu whenever the response may not fit in Le.
+static void output_response(LOGICAL_CHANNEL *channel, RAPDU *rapdu, uint16_t le) {
+  RAPDU_CHAINING *ex = &channel->rapdu_chaining;
+  ex->sent = 0;
+  if (LL <= le) {
+    release_chaining_buffer();
+    ex->rapdu.len = 0;
+    ex->rapdu.sw = SW;
+    return;
+  }
+  ex->rapdu.len = LL - le;
+  ex->rapdu.sw = SW;
+  memcpy(ex->rapdu.data, RDATA + le, ex->rapdu.len);
+  LL = le;
+  if (ex->rapdu.len > 0xFF)
+    SW = 0x61FF;
+  else
+    SW = 0x6100 + ex->rapdu.len;
+}
+
+void applet_poweroff(void) {
+  for (uint8_t i = 0; i < LOGICAL_CHANNEL_NUM; ++i) {
+    if (!channels[i].opened) continue;
+    poweroff_applet(channels[i].applet);
+    if (i != 0) {
+      channels[i].applet = APPLET_NULL;
+      channels[i].opened = 0;
+    }
+    reset_channel(i);
+  }
+}
+
+void apdu_reset_channels(void) {
+  applet_poweroff();
+  release_chaining_buffer();
+  for (uint8_t i = 0; i < LOGICAL_CHANNEL_NUM; ++i) {
+    memset(&channels[i], 0, sizeof(channels[i]));
+    channels[i].applet = APPLET_NULL;
+    channels[i].capdu_chaining.max_size = APDU_BUFFER_SIZE;
+  }
+  channels[0].opened = 1;
+  buffer_owner = 0;
+}
+
+// Channel numbers 4-19 (further interindustry class) are not supported, and proprietary classes starting from
+// 0xC0 carry no channel number at all.
+static int get_channel(uint8_t cla) {
+  if ((cla & 0xC0) == 0x40) return -1;
+  if ((cla & 0xC0) == 0xC0) return 0;
+  return cla & CLA_CHANNEL_MASK;
+}
+
+enum APPLET get_current_applet(uint8_t cla) {
+  int ch = get_channel(cla);
+  if (ch < 0 || !channels[ch].opened) return APPLET_NULL;
+  return channels[ch].applet;
+}
+
+static int manage_channel(uint8_t ch, const CAPDU *capdu, RAPDU *rapdu) {
+  LL = 0;
+  SW = SW_NO_ERROR;
+  uint8_t target = P2;
+  if (P1 == 0x00) { // open
+    if (target == 0) {
+      for (target = 1; target < LOGICAL_CHANNEL_NUM; ++target)
+        if (!channels[target].opened) break;
+      if (target == LOGICAL_CHANNEL_NUM) EXCEPT(SW_FUNCTION_NOT_SUPPORTED);
+      RDATA[0] = target;
+      LL = 1;
+    } else if (target >= LOGICAL_CHANNEL_NUM) {
+      EXCEPT(SW_WRONG_P1P2);
+    } else if (channels[target].opened) {
+      EXCEPT(SW_FUNCTION_NOT_SUPPORTED);
+    }
+    channels[target].opened = 1;
+    channels[target].applet = APPLET_NULL;
+    // opened from a channel other than the basic one, the new channel inherits its selected applet
+    if (ch != 0) select_applet(target, channels[ch].applet);
+    reset_channel(target);
+    DBG_MSG("channel %d opened\n", target);
+  } else if (P1 == 0x80) { // close
+    if (target == 0) target = ch;
+    if (target == 0) EXCEPT(SW_FUNCTION_NOT_SUPPORTED); // the basic channel cannot be closed
+    if (target >= LOGICAL_CHANNEL_NUM || !channels[target].opened) EXCEPT(SW_WRONG_P1P2);
+    deselect_applet(target);
+    channels[target].opened = 0;
+    reset_channel(target);
+    DBG_MSG("channel %d closed\n", target);
+  } else
+    EXCEPT(SW_WRONG_P1P2);
+  return 0;
+}
+
+static void dispatch_apdu(CAPDU *capdu, RAPDU *rapdu) {
+  int ch = get_channel(CLA);
+  if (ch < 0 || !channels[ch].opened) {
     LL = 0;
-    SW = SW_NO_ERROR;
-  } else if (ret == APDU_CHAINING_LAST_BLOCK) {
-    capdu = &capdu_chaining.capdu;
-    LE = MIN(LE, APDU_BUFFER_SIZE);
-    if ((CLA == 0x80 || CLA == 0x00) && INS == 0xC0) { // GET RESPONSE
-      rapdu->len = LE;
-      apdu_output(&rapdu_chaining, rapdu);
+    SW = SW_LOGICAL_CHANNEL_NOT_SUPPORTED;
+    return;
+  }
+  LOGICAL_CHANNEL *channel = &channels[ch];
+  if (buffer_owner != ch) {
+    if (channels[buffer_owner].capdu_chaining.in_chaining) {
+      LL = 0;
+      SW = SW_LAST_COMMAND_EXPECTED;
       return;
     }
-    rapdu_chaining.sent = 0;
-    if (CLA == 0x00 && INS == 0xA4 && P1 == 0x04 && P2 == 0x00) {
-      uint8_t i, end = APPLET_ENUM_END;
-      for (i = APPLET_NULL + 1; i != end; ++i) {
-        if (LC >= AID_Size[i] && memcmp(DATA, AID[i], AID_Size[i]) == 0) {
-#ifndef TEST
-          if (i == APPLET_FIDO && !is_nfc()) {
-            LL = 0;
-            SW = SW_CONDITIONS_NOT_SATISFIED;
-            DBG_MSG("should not use FIDO via CCID\n");
-            return;
-          }
-#endif
-          if (i != current_applet) applet_poweroff();
-          current_applet = i;
-          DBG_MSG("applet switched to: %d\n", current_applet);
-          break;
-        }
-      }
-      if (i == end) {
-        LL = 0;
-        SW = SW_FILE_NOT_FOUND;
-        DBG_MSG("applet not found\n");
-        return;
-      }
+    reset_channel(buffer_owner);
+    channels[buffer_owner].rapdu_chaining.rapdu.sw = SW_CONDITIONS_NOT_SATISFIED;
+    buffer_owner = ch;
+  }
+  CAPDU command;
+  uint8_t chained = channel->capdu_chaining.in_chaining || (CLA & 0x10);
+  if (!chained) {
+    // zero-copy, only the header is copied so that the command of the caller is left untouched
+    command = *capdu;
+    command.cla &= 0xEF;
+  } else {
+    if (!channel->capdu_chaining.in_chaining) {
+      // the first block overwrites a pending response
+      channel->rapdu_chaining.rapdu.len = 0;
+      channel->rapdu_chaining.sent = 0;
+    }
+    if (acquire_chaining_buffer(channel) == NULL) {
+      channel->capdu_chaining.in_chaining = 0;
+      LL = 0;
+      SW = SW_UNABLE_TO_PROCESS;
+      return;
+    }
+    int ret = apdu_input(&channel->capdu_chaining, capdu);
+    if (ret == APDU_CHAINING_NOT_LAST_BLOCK) {
+      LL = 0;
+      SW = SW_NO_ERROR;
+      return;
     }
-    switch (current_applet) {
-    case APPLET_OPENPGP:
-      openpgp_process_apdu(capdu, &rapdu_chaining.rapdu);
-      rapdu->len = LE;
-      apdu_output(&rapdu_chaining, rapdu);
-      break;
-    case APPLET_PIV:
-      piv_process_apdu(capdu, &rapdu_chaining.rapdu);
-      rapdu->len = LE;
-      apdu_output(&rapdu_chaining, rapdu);
-      break;
-    case APPLET_FIDO:
-#ifdef TEST
-      if (CLA == 0x00 && INS == 0xEE && LC == 0x04 && memcmp(DATA, "\x12\x56\xAB\xF0", 4) == 0) {
-        printf("MAGIC REBOOT command received!\r\n");
-        ctap_install(0);
-        SW = 0x9000;
-        LL = 0;
+    if (ret != APDU_CHAINING_LAST_BLOCK) {
+      channel->capdu_chaining.in_chaining = 0;
+      release_chaining_buffer();
+      LL = 0;
+      SW = SW_CHECKING_ERROR;
+      return;
+    }
+    command = channel->capdu_chaining.capdu;
+  }
+  capdu = &command;
+  if ((CLA & 0xC0) != 0xC0) CLA &= ~CLA_CHANNEL_MASK;
+  LE = MIN(LE, APDU_BUFFER_SIZE);
+  if ((CLA == 0x80 || CLA == 0x00) && INS == 0xC0) { // GET RESPONSE
+    rapdu->len = LE;
+    if (chaining_buffer == NULL) {
+      // nothing pending, only the status of the last command is left
+      LL = 0;
+      SW = channel->rapdu_chaining.rapdu.sw;
+      return;
+    }
+    apdu_output(&channel->rapdu_chaining, rapdu);
+    if (channel->rapdu_chaining.sent == channel->rapdu_chaining.rapdu.len) release_chaining_buffer();
+    return;
+  }
+  // the chaining buffer holds the assembled command, or a response that is no longer wanted
+  if (!chained) release_chaining_buffer();
+  channel->rapdu_chaining.rapdu.len = 0;
+  channel->rapdu_chaining.sent = 0;
+  if (CLA == 0x00 && INS == INS_MANAGE_CHANNEL) {
+    manage_channel(ch, capdu, rapdu);
+    if (chained) release_chaining_buffer();
+    return;
+  }
+  const APPLET_ENTRY *entry = find_applet(channel->applet);
+  if (CLA == 0x00 && INS == 0xA4 && P1 == 0x04 && P2 == 0x00) {
+    entry = NULL;
+    for (size_t i = 0; i < sizeof(applets) / sizeof(applets[0]); ++i) {
+      if (LC >= applets[i].aid_len && memcmp(DATA, applets[i].aid, applets[i].aid_len) == 0) {
+        entry = &applets[i];
         break;
       }
-#endif
-      ctap_process_apdu(capdu, &rapdu_chaining.rapdu);
-      rapdu->len = LE;
-      apdu_output(&rapdu_chaining, rapdu);
-      break;
-    case APPLET_OATH:
-      oath_process_apdu(capdu, rapdu);
-      break;
-    case APPLET_ADMIN:
-      admin_process_apdu(capdu, rapdu);
-      break;
-    default:
+    }
+    if (entry == NULL) {
+      if (chained) release_chaining_buffer();
       LL = 0;
       SW = SW_FILE_NOT_FOUND;
+      DBG_MSG("applet not found\n");
+      return;
     }
-  } else {
+#ifndef TEST
+    if (entry->applet == APPLET_FIDO && !is_nfc()) {
+      if (chained) release_chaining_buffer();
+      LL = 0;
+      SW = SW_CONDITIONS_NOT_SATISFIED;
+      DBG_MSG("should not use FIDO via CCID\n");
+      return;
+    }
+#endif
+  }
+  if (entry == NULL) {
+    if (chained) release_chaining_buffer();
+    LL = 0;
+    SW = SW_FILE_NOT_FOUND;
+    return;
+  }
+  // a response longer than Le is kept for GET RESPONSE, so the buffer is reserved before anything is executed: when
+  // the pool is empty the command is refused instead of losing the response of a command that has changed the card
+  if (!chained && !entry->in_place && LE < APDU_BUFFER_SIZE && acquire_chaining_buffer(channel) == NULL) {
     LL = 0;
-    SW = SW_CHECKING_ERROR;
+    SW = SW_UNABLE_TO_PROCESS;
+    return;
   }
+  if (entry->applet != channel->applet) {
+    deselect_applet(ch);
+    select_applet(ch, entry->applet);
+    DBG_MSG("applet switched to: %d on channel %d\n", channel->applet, ch);
+  }
+  if (entry->in_place) {
+    applet_process_apdu(entry->applet, capdu, rapdu);
+    if (chained) release_chaining_buffer();
+    return;
+  }
+  // a chained command is answered from the chaining buffer, it is released once the response has been sent
+  RAPDU *response = chained ? &channel->rapdu_chaining.rapdu : rapdu;
+  applet_process_apdu(entry->applet, capdu, response);
+  if (chained) {
+    rapdu->len = LE;
+    apdu_output(&channel->rapdu_chaining, rapdu);
+    if (channel->rapdu_chaining.sent == channel->rapdu_chaining.rapdu.len) release_chaining_buffer();
+  } else {
+    output_response(channel, rapdu, LE);
+  }
+}
+
+// The buffers of capdu and rapdu may be the same one and hold at least APDU_BUFFER_SIZE bytes. They are lent to
+// process_apdu until it returns.
+void process_apdu(CAPDU *capdu, RAPDU *rapdu) {
+  uint8_t cla = CLA, ins = INS;
+  record_apdu(capdu);
+  uint32_t start = device_get_tick();
+  dispatch_apdu(capdu, rapdu);
+  // a block of command chaining says nothing about the command, a SELECT is accounted to the selected applet
+  if (!(cla & 0x10)) latency_record(get_current_applet(cla), ins, device_get_tick() - start);
 }
@@ -0,0 +1,40 @@
+#include <apdu_pool.h>
+#include <device.h>
+
+// each buffer starts at a word boundary
+static __card_local alignas(4) uint8_t pool[APDU_POOL_SIZE][(APDU_POOL_BUFFER_SIZE + 3) & ~3];
+static __card_local volatile uint8_t in_use[APDU_POOL_SIZE];
+static __card_local volatile uint32_t pool_spinlock;
+
+uint8_t *apdu_pool_acquire(void) {
+  // an interrupt handler must not wait for the thread it has interrupted, so contention is reported as exhaustion
+  if (device_spinlock_lock(&pool_spinlock, 0) != 0) return NULL;
+  uint8_t *buf = NULL;
+  for (uint8_t i = 0; i < APDU_POOL_SIZE; ++i) {
+    if (!in_use[i]) {
+      in_use[i] = 1;
+      buf = pool[i];
+      break;
+    }
+  }
+  device_spinlock_unlock(&pool_spinlock);
+  if (buf == NULL) ERR_MSG("APDU pool exhausted\n");
+  return buf;
+}
+
+void apdu_pool_release(uint8_t *buf) {
+  if (buf == NULL) return;
+  for (uint8_t i = 0; i < APDU_POOL_SIZE; ++i) {
+    if (buf == pool[i]) {
+      in_use[i] = 0;
+      return;
+    }
+  }
+}
+
+uint8_t apdu_pool_available(void) {
+  uint8_t cnt = 0;
+  for (uint8_t i = 0; i < APDU_POOL_SIZE; ++i)
+    if (!in_use[i]) ++cnt;
+  return cnt;
+}
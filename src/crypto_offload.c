@@ -0,0 +1,122 @@
+#include <common.h>
+#include <crypto_offload.h>
+#include <device.h>
+#include <rand.h>
+#ifdef USE_MBEDCRYPTO
+#include <mbedtls/rsa.h>
+#endif
+
+__weak void crypto_sha256_init(void) { sha256_init(); }
+
+__weak void crypto_sha256_update(const uint8_t *data, uint16_t len) { sha256_update(data, len); }
+
+__weak void crypto_sha256_final(uint8_t digest[SHA256_DIGEST_LENGTH]) { sha256_final(digest); }
+
+__weak void crypto_sha256_raw(const uint8_t *data, size_t len, uint8_t digest[SHA256_DIGEST_LENGTH]) {
+  sha256_raw(data, len, digest);
+}
+
+__weak void crypto_hmac_sha1(const uint8_t *key, uint8_t keylen, const uint8_t *msg, uint32_t msglen, uint8_t *hmac) {
+  hmac_sha1(key, keylen, msg, msglen, hmac);
+}
+
+__weak void crypto_hmac_sha256(const uint8_t *key, uint8_t keylen, const uint8_t *msg, uint32_t msglen,
+                               uint8_t *hmac) {
+  hmac_sha256(key, keylen, msg, msglen, hmac);
+}
+
+__weak int crypto_aes256_enc(const uint8_t *in, uint8_t *out, const uint8_t *key) { return aes256_enc(in, out, key); }
+
+__weak int crypto_aes256_dec(const uint8_t *in, uint8_t *out, const uint8_t *key) { return aes256_dec(in, out, key); }
+
+__weak int crypto_tdes_enc(const uint8_t *in, uint8_t *out, const uint8_t *key) { return tdes_enc(in, out, key); }
+
+__weak int crypto_tdes_dec(const uint8_t *in, uint8_t *out, const uint8_t *key) { return tdes_dec(in, out, key); }
+
+__weak int crypto_ecc_generate(ECC_Curve curve, uint8_t *priv_key, uint8_t *pub_key) {
+  return ecc_generate(curve, priv_key, pub_key);
+}
+
+__weak int crypto_ecc_get_public_key(ECC_Curve curve, const uint8_t *priv_key, uint8_t *pub_key) {
+  return ecc_get_public_key(curve, priv_key, pub_key);
+}
+
+__weak int crypto_ecdsa_sign(ECC_Curve curve, const uint8_t *priv_key, const uint8_t *digest, uint8_t *sig) {
+  return ecdsa_sign(curve, priv_key, digest, sig);
+}
+
+__weak int crypto_ecdh_decrypt(ECC_Curve curve, const uint8_t *priv_key, const uint8_t *receiver_pub_key,
+                               uint8_t *out) {
+  return ecdh_decrypt(curve, priv_key, receiver_pub_key, out);
+}
+
+#ifdef USE_MBEDCRYPTO
+// The prime search draws every candidate and every Miller-Rabin base from here, the background tasks run in between
+static int keygen_random(void *ctx, unsigned char *buf, size_t len) {
+  UNUSED(ctx);
+  device_yield();
+  random_buffer(buf, len);
+  return 0;
+}
+
+// The key generation of canokey-crypto, with the yielding RNG
+__weak int crypto_rsa_generate_key(rsa_key_t *key) {
+  mbedtls_rsa_context rsa;
+  mbedtls_mpi n, p, q, e, dp, dq, qinv;
+  mbedtls_rsa_init(&rsa, MBEDTLS_RSA_PKCS_V15, 0);
+  mbedtls_mpi_init(&n);
+  mbedtls_mpi_init(&p);
+  mbedtls_mpi_init(&q);
+  mbedtls_mpi_init(&e);
+  mbedtls_mpi_init(&dp);
+  mbedtls_mpi_init(&dq);
+  mbedtls_mpi_init(&qinv);
+  int ret = -1;
+  if (mbedtls_rsa_gen_key(&rsa, keygen_random, NULL, RSA_N_BIT, 65537) != 0) goto cleanup;
+  if (mbedtls_rsa_export(&rsa, &n, &p, &q, NULL, &e) != 0) goto cleanup;
+  if (mbedtls_rsa_export_crt(&rsa, &dp, &dq, &qinv) != 0) goto cleanup;
+  if (mbedtls_mpi_write_binary(&e, key->e, E_LENGTH) != 0 || mbedtls_mpi_write_binary(&p, key->p, PQ_LENGTH) != 0 ||
+      mbedtls_mpi_write_binary(&q, key->q, PQ_LENGTH) != 0 || mbedtls_mpi_write_binary(&n, key->n, N_LENGTH) != 0 ||
+      mbedtls_mpi_write_binary(&dp, key->dp, PQ_LENGTH) != 0 ||
+      mbedtls_mpi_write_binary(&dq, key->dq, PQ_LENGTH) != 0 ||
+      mbedtls_mpi_write_binary(&qinv, key->qinv, PQ_LENGTH) != 0)
+    goto cleanup;
+  ret = 0;
+
+cleanup:
+  mbedtls_mpi_free(&n);
+  mbedtls_mpi_free(&p);
+  mbedtls_mpi_free(&q);
+  mbedtls_mpi_free(&e);
+  mbedtls_mpi_free(&dp);
+  mbedtls_mpi_free(&dq);
+  mbedtls_mpi_free(&qinv);
+  mbedtls_rsa_free(&rsa);
+  return ret;
+}
+#else
+__weak int crypto_rsa_generate_key(rsa_key_t *key) { return rsa_generate_key(key); }
+#endif
+
+__weak int crypto_rsa_private(const rsa_key_t *key, const uint8_t *input, uint8_t *output) {
+  return rsa_private(key, input, output);
+}
+
+__weak int crypto_rsa_sign_pkcs_v15(const rsa_key_t *key, const uint8_t *data, size_t len, uint8_t *sig) {
+  return rsa_sign_pkcs_v15(key, data, len, sig);
+}
+
+__weak int crypto_rsa_decrypt_pkcs_v15(const rsa_key_t *key, const uint8_t *in, size_t *olen, uint8_t *out) {
+  return rsa_decrypt_pkcs_v15(key, in, olen, out);
+}
+
+__weak void crypto_ed25519_publickey(const ed25519_secret_key sk, ed25519_public_key pk) { ed25519_publickey(sk, pk); }
+
+__weak void crypto_ed25519_sign(const unsigned char *m, size_t mlen, const ed25519_secret_key sk,
+                                const ed25519_public_key pk, ed25519_signature rs) {
+  ed25519_sign(m, mlen, sk, pk, rs);
+}
+
+__weak void crypto_curve25519_scalarmult(uint8_t *out, const uint8_t *secret, const uint8_t *basepoint) {
+  curve25519_scalarmult(out, secret, basepoint);
+}
@@ -0,0 +1,331 @@
+#include <common.h>
+
+#if defined(DEBUG_OUTPUT) && defined(DEBUG_LOG_RING)
+
+#include <device.h>
+#include <stdarg.h>
+#include <stdint.h>
+
+#define RECORD_MAX 192 // header and arguments of a message, beyond which the arguments are cut
+
+// length modifiers of a conversion
+enum { MOD_NONE, MOD_HH, MOD_H, MOD_L, MOD_LL, MOD_Z, MOD_J, MOD_T, MOD_BIG_L };
+
+typedef struct {
+  char conversion;
+  uint8_t mod;
+  uint8_t stars; // the width and the precision given by '*', recorded as int before the argument
+} conversion_t;
+
+typedef struct {
+  uint8_t level;
+  uint16_t len; // of the payload following the header
+} __packed record_header_t;
+
+typedef struct {
+  const char *func;
+  const char *format;
+  uint16_t line;
+} __packed message_header_t;
+
+static __card_local uint8_t ring[DEBUG_LOG_RING_SIZE];
+static __card_local volatile uint32_t ring_head, ring_tail; // free running, ring_tail - ring_head bytes are in use
+static __card_local volatile uint32_t ring_spinlock;
+static __card_local uint32_t dropped;
+
+static void ring_write(const uint8_t *buf, uint16_t len) {
+  uint32_t off = ring_tail % DEBUG_LOG_RING_SIZE;
+  uint32_t first = MIN(len, DEBUG_LOG_RING_SIZE - off);
+  memcpy(ring + off, buf, first);
+  memcpy(ring, buf + first, len - first);
+  ring_tail += len;
+}
+
+static void ring_read(uint8_t *buf, uint16_t len) {
+  uint32_t off = ring_head % DEBUG_LOG_RING_SIZE;
+  uint32_t first = MIN(len, DEBUG_LOG_RING_SIZE - off);
+  memcpy(buf, ring + off, first);
+  memcpy(buf + first, ring, len - first);
+  ring_head += len;
+}
+
+// Records are dropped rather than waited for, the caller may be an interrupt handler
+static void push_record(uint8_t level, const uint8_t *payload, uint16_t len) {
+  record_header_t header = {.level = level, .len = len};
+  if (device_spinlock_lock(&ring_spinlock, 0) != 0) {
+    ++dropped;
+    return;
+  }
+  if (DEBUG_LOG_RING_SIZE - (ring_tail - ring_head) < sizeof(header) + len) {
+    ++dropped;
+  } else {
+    ring_write((const uint8_t *)&header, sizeof(header));
+    ring_write(payload, len);
+  }
+  device_spinlock_unlock(&ring_spinlock);
+}
+
+// Parses the conversion following a '%', returns the position after it
+static const char *parse_conversion(const char *p, conversion_t *conv) {
+  conv->stars = 0;
+  while (*p && strchr("-+ #0123456789.*", *p))
+    if (*p++ == '*') ++conv->stars;
+  conv->mod = MOD_NONE;
+  if (p[0] == 'h' && p[1] == 'h') {
+    conv->mod = MOD_HH;
+    p += 2;
+  } else if (p[0] == 'l' && p[1] == 'l') {
+    conv->mod = MOD_LL;
+    p += 2;
+  } else if (*p && strchr("hlzjtL", *p)) {
+    static const char mods[] = "hlzjtL";
+    static const uint8_t values[] = {MOD_H, MOD_L, MOD_Z, MOD_J, MOD_T, MOD_BIG_L};
+    conv->mod = values[strchr(mods, *p) - mods];
+    ++p;
+  }
+  conv->conversion = *p;
+  return *p ? p + 1 : p;
+}
+
+static int is_conversion(char conversion, const char *set) { return conversion != '\0' && strchr(set, conversion); }
+
+// %n and the wide characters have no recorded form, a message is cut at them
+static int is_supported(const conversion_t *conv) {
+  if (conv->mod == MOD_L && is_conversion(conv->conversion, "cs")) return 0;
+  return is_conversion(conv->conversion, "diuoxXcfeEgGaAps");
+}
+
+void debug_log_msg(uint8_t level, const char *func, uint16_t line, const char *format, ...) {
+  uint8_t record[RECORD_MAX];
+  message_header_t header = {.func = func, .format = format, .line = line};
+  memcpy(record, &header, sizeof(header));
+  uint16_t len = sizeof(header);
+
+  va_list ap;
+  va_start(ap, format);
+  for (const char *p = format; *p;) {
+    if (*p++ != '%') continue;
+    conversion_t conv;
+    p = parse_conversion(p, &conv);
+    if (conv.conversion == '%') continue;
+    if (!is_supported(&conv)) break;
+    if (len + conv.stars * sizeof(int) > RECORD_MAX) break;
+    for (uint8_t i = 0; i < conv.stars; ++i) {
+      int star = va_arg(ap, int);
+      memcpy(record + len, &star, sizeof(star));
+      len += sizeof(star);
+    }
+    char conversion = conv.conversion;
+    uint8_t mod = conv.mod;
+    union {
+      long long i;
+      unsigned long long u;
+      double d;
+      const void *ptr;
+    } arg;
+    const void *src = &arg;
+    uint16_t size = 8;
+    if (is_conversion(conversion, "dic")) {
+      if (mod == MOD_L)
+        arg.i = va_arg(ap, long);
+      else if (mod == MOD_LL)
+        arg.i = va_arg(ap, long long);
+      else if (mod == MOD_Z)
+        arg.i = va_arg(ap, size_t);
+      else if (mod == MOD_J)
+        arg.i = va_arg(ap, intmax_t);
+      else if (mod == MOD_T)
+        arg.i = va_arg(ap, ptrdiff_t);
+      else
+        arg.i = va_arg(ap, int);
+    } else if (is_conversion(conversion, "uoxX")) {
+      if (mod == MOD_L)
+        arg.u = va_arg(ap, unsigned long);
+      else if (mod == MOD_LL)
+        arg.u = va_arg(ap, unsigned long long);
+      else if (mod == MOD_Z)
+        arg.u = va_arg(ap, size_t);
+      else if (mod == MOD_J)
+        arg.u = va_arg(ap, uintmax_t);
+      else if (mod == MOD_T)
+        arg.u = va_arg(ap, ptrdiff_t);
+      else
+        arg.u = va_arg(ap, unsigned int);
+    } else if (is_conversion(conversion, "feEgGaA")) {
+      arg.d = mod == MOD_BIG_L ? (double)va_arg(ap, long double) : va_arg(ap, double);
+    } else if (conversion == 'p') {
+      arg.ptr = va_arg(ap, void *);
+    } else if (conversion == 's') {
+      // the string may not outlive the call, copy it
+      src = va_arg(ap, const char *);
+      if (src == NULL) src = "(null)";
+      size = strnlen(src, DEBUG_LOG_STR_MAX);
+      if (len + size + 1 > RECORD_MAX) break;
+      memcpy(record + len, src, size);
+      record[len + size] = '\0';
+      len += size + 1;
+      continue;
+    }
+    if (len + size > RECORD_MAX) break;
+    memcpy(record + len, src, size);
+    len += size;
+  }
+  va_end(ap);
+  push_record(level, record, len);
+}
+
+void debug_log_hex(const uint8_t *buf, size_t len) {
+  uint8_t record[sizeof(uint32_t) + DEBUG_LOG_HEX_MAX];
+  uint32_t total = len;
+  uint16_t kept = MIN(len, DEBUG_LOG_HEX_MAX);
+  memcpy(record, &total, sizeof(total));
+  memcpy(record + sizeof(total), buf, kept);
+  push_record(DEBUG_LOG_HEX, record, sizeof(total) + kept);
+}
+
+static void print_argument(const char *spec, char conversion, uint8_t mod, const uint8_t *arg) {
+  long long i;
+  unsigned long long u;
+  double d;
+  const void *ptr;
+  if (is_conversion(conversion, "dic")) {
+    memcpy(&i, arg, sizeof(i));
+    if (mod == MOD_L)
+      printf(spec, (long)i);
+    else if (mod == MOD_LL)
+      printf(spec, i);
+    else if (mod == MOD_Z)
+      printf(spec, (size_t)i);
+    else if (mod == MOD_J)
+      printf(spec, (intmax_t)i);
+    else if (mod == MOD_T)
+      printf(spec, (ptrdiff_t)i);
+    else
+      printf(spec, (int)i);
+  } else if (is_conversion(conversion, "uoxX")) {
+    memcpy(&u, arg, sizeof(u));
+    if (mod == MOD_L)
+      printf(spec, (unsigned long)u);
+    else if (mod == MOD_LL)
+      printf(spec, u);
+    else if (mod == MOD_Z)
+      printf(spec, (size_t)u);
+    else if (mod == MOD_J)
+      printf(spec, (uintmax_t)u);
+    else if (mod == MOD_T)
+      printf(spec, (ptrdiff_t)u);
+    else
+      printf(spec, (unsigned int)u);
+  } else if (is_conversion(conversion, "feEgGaA")) {
+    memcpy(&d, arg, sizeof(d));
+    if (mod == MOD_BIG_L)
+      printf(spec, (long double)d);
+    else
+      printf(spec, d);
+  } else if (conversion == 'p') {
+    memcpy(&ptr, arg, sizeof(ptr));
+    printf(spec, ptr);
+  } else if (conversion == 's') {
+    printf(spec, (const char *)arg);
+  }
+}
+
+// Copies the conversion into spec, with the recorded values in place of the '*'
+static int expand_spec(char *spec, size_t size, const char *begin, const char *end, const int *stars) {
+  size_t n = 0;
+  for (const char *q = begin; q < end; ++q) {
+    if (*q != '*') {
+      if (n + 1 >= size) return 0;
+      spec[n++] = *q;
+      continue;
+    }
+    int value = *stars++;
+    if (q[-1] == '.' && value < 0) {
+      --n; // a negative precision is taken as if it were omitted
+      continue;
+    }
+    int written = snprintf(spec + n, size - n, "%d", value);
+    if (written < 0 || (size_t)written >= size - n) return 0;
+    n += written;
+  }
+  spec[n] = '\0';
+  return 1;
+}
+
+static void print_message(uint8_t level, const uint8_t *record, uint16_t len) {
+  message_header_t header;
+  memcpy(&header, record, sizeof(header));
+  printf(level == DEBUG_LOG_ERR ? "[ERR] %s(%d): " : "[DBG] %s(%d): ", header.func, header.line);
+  uint16_t off = sizeof(header);
+  const char *p = header.format;
+  while (*p) {
+    const char *percent = strchr(p, '%');
+    if (percent == NULL) {
+      printf("%s", p);
+      break;
+    }
+    printf("%.*s", (int)(percent - p), p);
+    char spec[32];
+    conversion_t conv;
+    const char *end = parse_conversion(percent + 1, &conv);
+    p = end;
+    if (conv.conversion == '%') {
+      putchar('%');
+      continue;
+    }
+    int stars[2];
+    uint16_t stars_size = conv.stars * sizeof(int);
+    if (!is_supported(&conv) || conv.stars > 2 || off + stars_size > len) {
+      printf("...\n"); // arguments cut at recording
+      break;
+    }
+    memcpy(stars, record + off, stars_size);
+    off += stars_size;
+    uint16_t size = 8;
+    if (conv.conversion == 's') size = off < len ? strnlen((const char *)record + off, len - off) + 1 : 1;
+    if (off + size > len || !expand_spec(spec, sizeof(spec), percent, end, stars)) {
+      printf("...\n");
+      break;
+    }
+    print_argument(spec, conv.conversion, conv.mod, record + off);
+    off += size;
+  }
+}
+
+static void print_hex_record(const uint8_t *record, uint16_t len) {
+  uint32_t total;
+  memcpy(&total, record, sizeof(total));
+  print_hex(record + sizeof(total), len - sizeof(total));
+  if (total > len - sizeof(total)) printf("... (%u bytes)\n", (unsigned)total);
+}
+
+uint16_t debug_log_flush(uint16_t max_records) {
+  uint8_t record[MAX(RECORD_MAX, sizeof(uint32_t) + DEBUG_LOG_HEX_MAX)];
+  uint16_t printed = 0;
+  while (printed < max_records) {
+    record_header_t header;
+    uint32_t lost = 0;
+    if (device_spinlock_lock(&ring_spinlock, 0) != 0) break;
+    if (ring_tail == ring_head) {
+      device_spinlock_unlock(&ring_spinlock);
+      break;
+    }
+    ring_read((uint8_t *)&header, sizeof(header));
+    ring_read(record, header.len);
+    if (dropped) {
+      lost = dropped;
+      dropped = 0;
+    }
+    device_spinlock_unlock(&ring_spinlock);
+
+    if (lost) printf("[ERR] %u log records dropped\n", (unsigned)lost);
+    if (header.level == DEBUG_LOG_HEX)
+      print_hex_record(record, header.len);
+    else
+      print_message(header.level, record, header.len);
+    ++printed;
+  }
+  return printed;
+}
+
+#endif
@@ -6,16 +6,60 @@
 #include <kbdhid.h>
 #include <webusb.h>
 
-volatile static uint8_t touch_result;
-static uint8_t has_rf, is_blinking;
-static uint32_t last_blink = UINT32_MAX, blink_timeout, blink_interval;
-static enum { ON, OFF } led_status;
+static __card_local volatile uint8_t touch_result;
+static __card_local uint8_t has_rf, is_blinking;
+static __card_local uint32_t last_blink = UINT32_MAX, blink_timeout, blink_interval;
+static __card_local enum { ON, OFF } led_status;
+
+typedef struct {
+  void (*task)(void);
+  uint16_t period;
+  uint32_t last_run;
+} background_task_t;
+
+static __card_local background_task_t background_tasks[MAX_BACKGROUND_TASKS] = {
+    {.task = CTAPHID_Yield},
+    {.task = KBDHID_Yield},
+#ifndef TEST
+    {.task = device_update_led},
+#endif
+};
+static __card_local uint8_t in_yield;
+
+int device_add_background_task(void (*task)(void), uint16_t period) {
+  for (int i = 0; i < MAX_BACKGROUND_TASKS; ++i) {
+    if (background_tasks[i].task == NULL) {
+      background_tasks[i].period = period;
+      background_tasks[i].last_run = device_get_tick();
+      background_tasks[i].task = task;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+void device_yield(void) {
+  if (in_yield) return;
+  in_yield = 1;
+  for (int i = 0; i < MAX_BACKGROUND_TASKS && background_tasks[i].task != NULL; ++i) {
+    uint32_t now = device_get_tick();
+    if (now - background_tasks[i].last_run >= background_tasks[i].period) {
+      background_tasks[i].last_run = now;
+      background_tasks[i].task();
+    }
+  }
+  in_yield = 0;
+}
 
 void device_loop(void) {
   CCID_Loop();
   CTAPHID_Loop(0);
   WebUSB_Loop();
   KBDHID_Loop();
+#if defined(DEBUG_OUTPUT) && defined(DEBUG_LOG_RING)
+  // responses have been sent, print the log before the next command
+  debug_log_flush(DEBUG_LOG_FLUSH_BATCH);
+#endif
 }
 
 uint8_t get_touch_result(void) { return touch_result; }
@@ -40,6 +84,9 @@ uint8_t wait_for_user_presence(void) {
       last = now;
       CTAPHID_SendKeepAlive(KEEPALIVE_STATUS_UPNEEDED);
     }
+#if defined(DEBUG_OUTPUT) && defined(DEBUG_LOG_RING)
+    debug_log_flush(DEBUG_LOG_FLUSH_BATCH);
+#endif
   }
   touch_result = TOUCH_NO;
   return USER_PRESENCE_OK;
@@ -96,14 +143,12 @@ void stop_blinking(void) {
 #else
 
 int device_spinlock_lock(volatile uint32_t *lock, uint32_t blocking) {
-  // Not really working, for test only
-  while (*lock) {
+  while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE)) {
     if (!blocking) return -1;
   }
-  *lock = 1;
   return 0;
 }
-void device_spinlock_unlock(volatile uint32_t *lock) { *lock = 0; }
+void device_spinlock_unlock(volatile uint32_t *lock) { __atomic_store_n(lock, 0, __ATOMIC_RELEASE); }
 
 void led_on(void) {}
 void led_off(void) {}
@@ -1,6 +1,7 @@
+#include <common.h>
 #include <fs.h>
 
-static lfs_t lfs;
+static __card_local lfs_t lfs;
 
 int fs_init(struct lfs_config *cfg) {
   int err = lfs_mount(&lfs, cfg);
@@ -11,7 +12,9 @@ int fs_init(struct lfs_config *cfg) {
   return 0;
 }
 
-int read_file(const char *path, void *buf, lfs_soff_t off, lfs_size_t len) {
+int fs_deinit(void) { return lfs_unmount(&lfs); }
+
+static int do_read_file(const char *path, void *buf, lfs_soff_t off, lfs_size_t len) {
   lfs_file_t f;
   int err = lfs_file_open(&lfs, &f, path, LFS_O_RDONLY);
   if (err < 0) return err;
@@ -24,7 +27,7 @@ int read_file(const char *path, void *buf, lfs_soff_t off, lfs_size_t len) {
   return read_length;
 }
 
-int write_file(const char *path, const void *buf, lfs_soff_t off, lfs_size_t len, uint8_t trunc) {
+static int do_write_file(const char *path, const void *buf, lfs_soff_t off, lfs_size_t len, uint8_t trunc) {
   lfs_file_t f;
   int flags = LFS_O_WRONLY | LFS_O_CREAT;
   if (trunc) flags |= LFS_O_TRUNC;
@@ -41,6 +44,20 @@ int write_file(const char *path, const void *buf, lfs_soff_t off, lfs_size_t len
   return 0;
 }
 
+int read_file(const char *path, void *buf, lfs_soff_t off, lfs_size_t len) {
+  TRACE_BEGIN(READ_FILE);
+  int ret = do_read_file(path, buf, off, len);
+  TRACE_END(READ_FILE);
+  return ret;
+}
+
+int write_file(const char *path, const void *buf, lfs_soff_t off, lfs_size_t len, uint8_t trunc) {
+  TRACE_BEGIN(WRITE_FILE);
+  int ret = do_write_file(path, buf, off, len, trunc);
+  TRACE_END(WRITE_FILE);
+  return ret;
+}
+
 int read_attr(const char *path, uint8_t attr, void *buf, lfs_size_t len) {
   return lfs_getattr(&lfs, path, attr, buf, len);
 }
@@ -0,0 +1,62 @@
+#include <latency.h>
+
+typedef struct {
+  uint8_t applet;
+  uint8_t cmd;
+  uint16_t count[LATENCY_BUCKET_NUM]; // saturates at UINT16_MAX
+} latency_entry_t;
+
+_Static_assert(LATENCY_EXPORT_SIZE <= APDU_BUFFER_SIZE, "latency export does not fit in a response");
+
+static __card_local latency_entry_t entries[LATENCY_ENTRY_NUM];
+static __card_local uint8_t entry_num;
+static __card_local uint16_t dropped; // records that found the table full
+
+static uint8_t latency_bucket(uint32_t duration) {
+  uint8_t bucket = duration == 0 ? 0 : 32 - __builtin_clz(duration);
+  return MIN(bucket, LATENCY_BUCKET_NUM - 1);
+}
+
+void latency_record(uint8_t applet, uint8_t cmd, uint32_t duration) {
+  latency_entry_t *entry = NULL;
+  for (uint8_t i = 0; i < entry_num; ++i) {
+    if (entries[i].applet == applet && entries[i].cmd == cmd) {
+      entry = &entries[i];
+      break;
+    }
+  }
+  if (entry == NULL) {
+    if (entry_num == LATENCY_ENTRY_NUM) {
+      if (dropped != UINT16_MAX) ++dropped;
+      return;
+    }
+    entry = &entries[entry_num++];
+    entry->applet = applet;
+    entry->cmd = cmd;
+  }
+  uint16_t *count = &entry->count[latency_bucket(duration)];
+  if (*count != UINT16_MAX) ++*count;
+}
+
+uint16_t latency_export(uint8_t *buf) {
+  uint16_t off = 0;
+  buf[off++] = LATENCY_FORMAT_VERSION;
+  buf[off++] = LATENCY_BUCKET_NUM;
+  buf[off++] = HI(dropped);
+  buf[off++] = LO(dropped);
+  for (uint8_t i = 0; i < entry_num; ++i) {
+    buf[off++] = entries[i].applet;
+    buf[off++] = entries[i].cmd;
+    for (uint8_t j = 0; j < LATENCY_BUCKET_NUM; ++j) {
+      buf[off++] = HI(entries[i].count[j]);
+      buf[off++] = LO(entries[i].count[j]);
+    }
+  }
+  return off;
+}
+
+void latency_reset(void) {
+  memset(entries, 0, sizeof(entries));
+  entry_num = 0;
+  dropped = 0;
+}
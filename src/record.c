@@ -0,0 +1,50 @@
+#include <common.h>
+
+#ifdef ENABLE_RECORD
+
+#include <device.h>
+#include <record.h>
+
+__weak uint32_t record_timestamp(void) { return device_get_tick() * 1000; }
+
+__weak void record_write(const void *buf, uint16_t len) {
+  UNUSED(buf);
+  UNUSED(len);
+}
+
+static void record_header(uint8_t interface, uint16_t len) {
+  record_header_t header = {.timestamp = record_timestamp(), .interface = interface, .len = len};
+  record_write(&header, sizeof(header));
+}
+
+void record_command(uint8_t interface, const uint8_t *data, uint16_t len) {
+  record_header(interface, len);
+  record_write(data, len);
+}
+
+// The short form is used whenever Lc and Le fit, build_capdu reads both forms back
+void record_apdu(const CAPDU *capdu) {
+  uint8_t head[7] = {CLA, INS, P1, P2}, tail[3];
+  uint8_t head_len = 4, tail_len = 0;
+  uint8_t extended = LC > 0xFF || LE > 0x100;
+  if (LC > 0) {
+    if (extended) {
+      head[head_len++] = 0x00;
+      head[head_len++] = HI(LC);
+    }
+    head[head_len++] = LO(LC);
+  }
+  if (LE > 0) {
+    if (extended) {
+      if (LC == 0) tail[tail_len++] = 0x00;
+      tail[tail_len++] = HI(LE); // 65536 is encoded as 0000
+    }
+    tail[tail_len++] = LO(LE); // and 256 as 00
+  }
+  record_header(RECORD_APDU, head_len + LC + tail_len);
+  record_write(head, head_len);
+  if (LC > 0) record_write(DATA, LC);
+  if (tail_len > 0) record_write(tail, tail_len);
+}
+
+#endif
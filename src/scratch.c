@@ -0,0 +1,67 @@
+#include <memzero.h>
+#include <scratch.h>
+
+#define SCRATCH_ALIGN 8
+#define NO_OWNER 0xFF
+
+// The frames grow up from the bottom, the persistent region lies at the top
+static __card_local alignas(SCRATCH_ALIGN) uint8_t scratch[SCRATCH_SIZE];
+static __card_local size_t top, persist_start = SCRATCH_SIZE, peak;
+static __card_local uint8_t persist_owner = NO_OWNER;
+
+static void update_peak(void) {
+  size_t used = top + SCRATCH_SIZE - persist_start;
+  if (used > peak) peak = used;
+}
+
+size_t scratch_begin(void) { return top; }
+
+void scratch_end(size_t mark) {
+  if (mark >= top) return;
+  memzero(scratch + mark, top - mark);
+  top = mark;
+}
+
+void *scratch_alloc(size_t size) {
+  size = (size + SCRATCH_ALIGN - 1) & ~(size_t)(SCRATCH_ALIGN - 1);
+  if (size > persist_start - top) {
+    ERR_MSG("Scratch exhausted, %u bytes wanted\n", (unsigned)size);
+    return NULL;
+  }
+  void *p = scratch + top;
+  top += size;
+  update_peak();
+  return p;
+}
+
+void *scratch_persist(uint8_t owner, size_t size) {
+  scratch_release(persist_owner);
+  size = (size + SCRATCH_ALIGN - 1) & ~(size_t)(SCRATCH_ALIGN - 1);
+  if (size > SCRATCH_SIZE - top) {
+    ERR_MSG("Scratch exhausted, %u bytes wanted\n", (unsigned)size);
+    return NULL;
+  }
+  persist_start = SCRATCH_SIZE - size;
+  persist_owner = owner;
+  update_peak();
+  return scratch + persist_start;
+}
+
+void *scratch_persisted(uint8_t owner) {
+  if (owner != persist_owner) return NULL;
+  return scratch + persist_start;
+}
+
+void scratch_release(uint8_t owner) {
+  if (owner != persist_owner || owner == NO_OWNER) return;
+  memzero(scratch + persist_start, SCRATCH_SIZE - persist_start);
+  persist_start = SCRATCH_SIZE;
+  persist_owner = NO_OWNER;
+}
+
+void scratch_reset(void) {
+  scratch_release(persist_owner);
+  scratch_end(0);
+}
+
+size_t scratch_peak(void) { return peak; }
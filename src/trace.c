@@ -0,0 +1,46 @@
+#include <common.h>
+
+#ifdef ENABLE_TRACE
+
+#include <device.h>
+
+static __card_local trace_event_t ring[TRACE_RING_SIZE];
+static __card_local uint32_t recorded; // total number of events, including the overwritten ones
+
+static const char *const names[] = {
+    [TRACE_READ_FILE] = "read_file",
+    [TRACE_WRITE_FILE] = "write_file",
+    [TRACE_SHA256] = "sha256",
+    [TRACE_HMAC_SHA256] = "hmac_sha256",
+    [TRACE_ECC_PUBKEY] = "ecc_get_public_key",
+    [TRACE_ECDSA_SIGN] = "ecdsa_sign",
+    [TRACE_CTAP_PARSE] = "ctap_parse",
+    [TRACE_CTAP_CBOR] = "ctap_process_cbor",
+    [TRACE_CTAP_ENCODE] = "ctap_encode",
+};
+
+__weak uint32_t trace_timestamp(void) { return device_get_tick() * 1000; }
+
+// The events of the card and those of its interrupt handlers, e.g. a timer, each take a slot of their own
+void trace_record(uint8_t id, uint8_t phase) {
+  trace_event_t *event = &ring[__atomic_fetch_add(&recorded, 1, __ATOMIC_RELAXED) % TRACE_RING_SIZE];
+  event->timestamp = trace_timestamp();
+  event->id = id;
+  event->phase = phase;
+}
+
+uint32_t trace_count(void) {
+  uint32_t cnt = __atomic_load_n(&recorded, __ATOMIC_RELAXED);
+  return MIN(cnt, TRACE_RING_SIZE);
+}
+
+const trace_event_t *trace_get(uint32_t idx) {
+  uint32_t oldest = recorded > TRACE_RING_SIZE ? recorded - TRACE_RING_SIZE : 0;
+  return &ring[(oldest + idx) % TRACE_RING_SIZE];
+}
+
+const char *trace_name(uint8_t id) { return id < TRACE_ID_END ? names[id] : "unknown"; }
+
+void trace_clear(void) { recorded = 0; }
+
+#endif
@@ -127,6 +127,30 @@ func commandTests(verified bool, app *AdminApplet) func(C) {
 				}
 			}
 		})
+		Convey("Latency statistics", func(ctx C) {
+			res, code, err := app.Send([]byte{0x00, 0x42, 0x00, 0x00})
+			So(err, ShouldBeNil)
+			So(code, ShouldEqual, 0x9000)
+			So(res[0], ShouldEqual, 1)
+			So(res[1], ShouldEqual, 16)
+			So((len(res)-4)%34, ShouldEqual, 0)
+			_, code, err = app.Send([]byte{0x00, 0x42, 0x02, 0x00})
+			So(err, ShouldBeNil)
+			So(code, ShouldEqual, 0x6A86)
+			_, code, err = app.Send([]byte{0x00, 0x42, 0x01, 0x00})
+			So(err, ShouldBeNil)
+			if !verified {
+				So(code, ShouldEqual, 0x6982)
+				return
+			}
+			So(code, ShouldEqual, 0x9000)
+			// only the reset itself has been recorded since
+			res, code, err = app.Send([]byte{0x00, 0x42, 0x00, 0x00})
+			So(err, ShouldBeNil)
+			So(code, ShouldEqual, 0x9000)
+			So(len(res), ShouldEqual, 4+34)
+			So(res[4:6], ShouldResemble, []byte{0x04, 0x42})
+		})
 		Convey("Write SN", func(ctx C) {
 			apdu := []byte{0x00, 0x30, 0x00, 0x00, 0x04, 0xA1, 0xB2, 0xC3, 0xD4}
 			_, code, err := app.Send(apdu)
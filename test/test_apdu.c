@@ -3,7 +3,12 @@
 #include <stddef.h>
 #include <cmocka.h>
 
+#include <admin.h>
 #include <apdu.h>
+#include <apdu_pool.h>
+#include <bd/lfs_filebd.h>
+#include <fs.h>
+#include <lfs.h>
 #include <string.h>
 
 static void test_input_chaining(void **state) {
@@ -90,13 +95,285 @@ static void test_output_chaining(void **state) {
   assert_int_equal(R.sw, 0x9000);
 }
 
+static void test_logical_channels(void **state) {
+  (void)state;
+
+  uint8_t c_buf[1024], r_buf[1024];
+  uint8_t oath_aid[] = {0xA0, 0x00, 0x00, 0x05, 0x27, 0x21, 0x01};
+  CAPDU C = {.data = c_buf};
+  RAPDU R = {.data = r_buf};
+  CAPDU *capdu = &C;
+  RAPDU *rapdu = &R;
+
+  // a closed channel
+  CLA = 0x01;
+  INS = 0xA4;
+  P1 = 0x04;
+  P2 = 0x00;
+  LC = sizeof(oath_aid);
+  memcpy(DATA, oath_aid, LC);
+  process_apdu(capdu, rapdu);
+  assert_int_equal(SW, SW_LOGICAL_CHANNEL_NOT_SUPPORTED);
+
+  // open channel 1 with the number assigned by the card
+  CLA = 0x00;
+  INS = INS_MANAGE_CHANNEL;
+  P1 = 0x00;
+  P2 = 0x00;
+  LC = 0;
+  LE = 1;
+  process_apdu(capdu, rapdu);
+  assert_int_equal(SW, SW_NO_ERROR);
+  assert_int_equal(LL, 1);
+  assert_int_equal(RDATA[0], 1);
+
+  // select on channel 1
+  CLA = 0x01;
+  INS = 0xA4;
+  P1 = 0x04;
+  P2 = 0x00;
+  LC = sizeof(oath_aid);
+  memcpy(DATA, oath_aid, LC);
+  process_apdu(capdu, rapdu);
+  assert_int_equal(SW, SW_NO_ERROR);
+
+  // open channel 3 explicitly, twice
+  CLA = 0x00;
+  INS = INS_MANAGE_CHANNEL;
+  P1 = 0x00;
+  P2 = 0x03;
+  LC = 0;
+  process_apdu(capdu, rapdu);
+  assert_int_equal(SW, SW_NO_ERROR);
+  assert_int_equal(LL, 0);
+  process_apdu(capdu, rapdu);
+  assert_int_equal(SW, SW_FUNCTION_NOT_SUPPORTED);
+
+  // channel 2 is the last one
+  P2 = 0x00;
+  process_apdu(capdu, rapdu);
+  assert_int_equal(SW, SW_NO_ERROR);
+  assert_int_equal(RDATA[0], 2);
+  process_apdu(capdu, rapdu);
+  assert_int_equal(SW, SW_FUNCTION_NOT_SUPPORTED);
+
+  // the basic channel cannot be closed
+  P1 = 0x80;
+  process_apdu(capdu, rapdu);
+  assert_int_equal(SW, SW_FUNCTION_NOT_SUPPORTED);
+
+  // close channel 1 from itself
+  CLA = 0x01;
+  process_apdu(capdu, rapdu);
+  assert_int_equal(SW, SW_NO_ERROR);
+  process_apdu(capdu, rapdu);
+  assert_int_equal(SW, SW_LOGICAL_CHANNEL_NOT_SUPPORTED);
+
+  // close channel 3 from the basic channel, and channel 2 on power off
+  CLA = 0x00;
+  P2 = 0x03;
+  process_apdu(capdu, rapdu);
+  assert_int_equal(SW, SW_NO_ERROR);
+  applet_poweroff();
+  CLA = 0x02;
+  P2 = 0x00;
+  process_apdu(capdu, rapdu);
+  assert_int_equal(SW, SW_LOGICAL_CHANNEL_NOT_SUPPORTED);
+}
+
+static void test_reset_channels(void **state) {
+  (void)state;
+
+  uint8_t c_buf[1024], r_buf[1024];
+  uint8_t oath_aid[] = {0xA0, 0x00, 0x00, 0x05, 0x27, 0x21, 0x01};
+  CAPDU C = {.data = c_buf};
+  RAPDU R = {.data = r_buf};
+  CAPDU *capdu = &C;
+  RAPDU *rapdu = &R;
+
+  // select on the basic channel and on channel 1
+  CLA = 0x00;
+  INS = INS_MANAGE_CHANNEL;
+  P1 = 0x00;
+  P2 = 0x01;
+  LC = 0;
+  process_apdu(capdu, rapdu);
+  assert_int_equal(SW, SW_NO_ERROR);
+  for (uint8_t cla = 0x00; cla <= 0x01; ++cla) {
+    CLA = cla;
+    INS = 0xA4;
+    P1 = 0x04;
+    P2 = 0x00;
+    LC = sizeof(oath_aid);
+    memcpy(DATA, oath_aid, LC);
+    process_apdu(capdu, rapdu);
+    assert_int_equal(SW, SW_NO_ERROR);
+  }
+
+  // the basic channel keeps its applet on power off
+  applet_poweroff();
+  assert_int_equal(get_current_applet(0x00), APPLET_OATH);
+
+  CLA = 0x00;
+  INS = INS_MANAGE_CHANNEL;
+  P1 = 0x00;
+  P2 = 0x01;
+  LC = 0;
+  process_apdu(capdu, rapdu);
+  assert_int_equal(SW, SW_NO_ERROR);
+  apdu_reset_channels();
+  assert_int_equal(get_current_applet(0x00), APPLET_NULL);
+  assert_int_equal(get_current_applet(0x01), APPLET_NULL);
+  CLA = 0x01;
+  INS = 0xA4;
+  P1 = 0x04;
+  P2 = 0x00;
+  LC = sizeof(oath_aid);
+  memcpy(DATA, oath_aid, LC);
+  process_apdu(capdu, rapdu);
+  assert_int_equal(SW, SW_LOGICAL_CHANNEL_NOT_SUPPORTED);
+}
+
+static void test_pool_exhausted(void **state) {
+  (void)state;
+
+  uint8_t c_buf[1024], r_buf[1024];
+  uint8_t piv_aid[] = {0xA0, 0x00, 0x00, 0x03, 0x08};
+  uint8_t oath_aid[] = {0xA0, 0x00, 0x00, 0x05, 0x27, 0x21, 0x01};
+  uint8_t *taken[APDU_POOL_SIZE];
+  CAPDU C = {.data = c_buf};
+  RAPDU R = {.data = r_buf};
+  CAPDU *capdu = &C;
+  RAPDU *rapdu = &R;
+
+  apdu_reset_channels();
+  for (uint8_t i = 0; i < APDU_POOL_SIZE; ++i) {
+    taken[i] = apdu_pool_acquire();
+    assert_non_null(taken[i]);
+  }
+
+  // no buffer is left for a response longer than Le, the command is refused before the applet is switched
+  CLA = 0x00;
+  INS = 0xA4;
+  P1 = 0x04;
+  P2 = 0x00;
+  LC = sizeof(piv_aid);
+  LE = 0x10;
+  memcpy(DATA, piv_aid, LC);
+  process_apdu(capdu, rapdu);
+  assert_int_equal(SW, SW_UNABLE_TO_PROCESS);
+  assert_int_equal(LL, 0);
+  assert_int_equal(get_current_applet(0x00), APPLET_NULL);
+
+  // an applet keeping its long responses by itself needs no buffer
+  LC = sizeof(oath_aid);
+  LE = 0x10;
+  memcpy(DATA, oath_aid, LC);
+  process_apdu(capdu, rapdu);
+  assert_int_equal(SW, SW_NO_ERROR);
+  assert_int_equal(get_current_applet(0x00), APPLET_OATH);
+
+  for (uint8_t i = 0; i < APDU_POOL_SIZE; ++i)
+    apdu_pool_release(taken[i]);
+  assert_int_equal(apdu_pool_available(), APDU_POOL_SIZE);
+}
+
+static void admin_command(CAPDU *capdu, RAPDU *rapdu, uint8_t cla, uint8_t ins, const void *data, uint8_t len) {
+  CLA = cla;
+  INS = ins;
+  P1 = ins == 0xA4 ? 0x04 : 0x00;
+  P2 = 0x00;
+  LC = len;
+  LE = 0x100;
+  memcpy(DATA, data, len);
+  process_apdu(capdu, rapdu);
+}
+
+static void test_channel_security(void **state) {
+  (void)state;
+
+  uint8_t c_buf[1024], r_buf[1024];
+  uint8_t admin_aid[] = {0xF0, 0x00, 0x00, 0x00, 0x00};
+  CAPDU C = {.data = c_buf};
+  RAPDU R = {.data = r_buf};
+  CAPDU *capdu = &C;
+  RAPDU *rapdu = &R;
+
+  apdu_reset_channels();
+  admin_command(capdu, rapdu, 0x00, 0xA4, admin_aid, sizeof(admin_aid));
+  assert_int_equal(SW, SW_NO_ERROR);
+  admin_command(capdu, rapdu, 0x00, ADMIN_INS_VERIFY, "123456", 6);
+  assert_int_equal(SW, SW_NO_ERROR);
+
+  // the verification on the basic channel is not inherited by a channel opened from it
+  admin_command(capdu, rapdu, 0x00, INS_MANAGE_CHANNEL, NULL, 0);
+  assert_int_equal(SW, SW_NO_ERROR);
+  admin_command(capdu, rapdu, 0x01, 0xA4, admin_aid, sizeof(admin_aid));
+  assert_int_equal(SW, SW_NO_ERROR);
+  admin_command(capdu, rapdu, 0x01, ADMIN_INS_VERIFY, NULL, 0);
+  assert_int_equal(SW & 0xFFF0, SW_PIN_RETRIES);
+  admin_command(capdu, rapdu, 0x00, ADMIN_INS_VERIFY, NULL, 0);
+  assert_int_equal(SW & 0xFFF0, SW_PIN_RETRIES);
+
+  // nor by a channel opened from a channel where it has been gained
+  admin_command(capdu, rapdu, 0x01, ADMIN_INS_VERIFY, "123456", 6);
+  assert_int_equal(SW, SW_NO_ERROR);
+  admin_command(capdu, rapdu, 0x01, INS_MANAGE_CHANNEL, NULL, 0);
+  assert_int_equal(SW, SW_NO_ERROR);
+  assert_int_equal(RDATA[0], 2);
+  assert_int_equal(get_current_applet(0x02), APPLET_ADMIN);
+  admin_command(capdu, rapdu, 0x02, ADMIN_INS_VERIFY, NULL, 0);
+  assert_int_equal(SW & 0xFFF0, SW_PIN_RETRIES);
+
+  // and it does not outlive a channel being closed
+  admin_command(capdu, rapdu, 0x02, ADMIN_INS_VERIFY, "123456", 6);
+  assert_int_equal(SW, SW_NO_ERROR);
+  CLA = 0x02;
+  INS = INS_MANAGE_CHANNEL;
+  P1 = 0x80;
+  P2 = 0x00;
+  LC = 0;
+  process_apdu(capdu, rapdu);
+  assert_int_equal(SW, SW_NO_ERROR);
+  admin_command(capdu, rapdu, 0x01, ADMIN_INS_VERIFY, NULL, 0);
+  assert_int_equal(SW & 0xFFF0, SW_PIN_RETRIES);
+
+  apdu_reset_channels();
+}
+
 int main() {
+  struct lfs_config cfg;
+  lfs_filebd_t bd;
+  memset(&cfg, 0, sizeof(cfg));
+  cfg.context = &bd;
+  cfg.read = &lfs_filebd_read;
+  cfg.prog = &lfs_filebd_prog;
+  cfg.erase = &lfs_filebd_erase;
+  cfg.sync = &lfs_filebd_sync;
+  cfg.read_size = 16;
+  cfg.prog_size = 16;
+  cfg.block_size = 512;
+  cfg.block_count = 400;
+  cfg.block_cycles = 50000;
+  cfg.cache_size = 128;
+  cfg.lookahead_size = 16;
+  lfs_filebd_create(&cfg, "lfs-root");
+
+  fs_init(&cfg);
+  admin_install();
+
   const struct CMUnitTest tests[] = {
       cmocka_unit_test(test_input_chaining),
       cmocka_unit_test(test_output_chaining),
+      cmocka_unit_test(test_logical_channels),
+      cmocka_unit_test(test_reset_channels),
+      cmocka_unit_test(test_pool_exhausted),
+      cmocka_unit_test(test_channel_security),
   };
 
   int ret = cmocka_run_group_tests(tests, NULL, NULL);
 
+  lfs_filebd_destroy(&cfg);
+
   return ret;
 }
@@ -0,0 +1,101 @@
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <cmocka.h>
+
+#include <apdu.h>
+#include <ccid.h>
+#include <string.h>
+#include <usb_device.h>
+#include <usbd_ccid.h>
+
+static uint8_t response[sizeof(ccid_bulkin_data_t)];
+static uint16_t response_len;
+static int transmitted;
+
+USBD_StatusTypeDef USBD_LL_Transmit(USBD_HandleTypeDef *pdev, uint8_t ep_num, const uint8_t *pbuf, uint16_t size) {
+  (void)pdev;
+  (void)ep_num;
+  if (size > 0) memcpy(response, pbuf, size);
+  response_len = size;
+  ++transmitted;
+  return USBD_OK;
+}
+
+// PC_to_RDR_XfrBlock carrying a SELECT of an applet that does not exist
+static void send_select(uint8_t seq) {
+  uint8_t msg[] = {PC_TO_RDR_XFRBLOCK, 9, 0, 0, 0, 0, seq, 0, 0, 0, 0x00, 0xA4, 0x04, 0x00, 0x04, 0xF0, 0x01, 0x02, 0x03};
+  CCID_OutEvent(msg, sizeof(msg));
+}
+
+static void assert_response(uint8_t message_type, uint8_t seq, uint8_t error) {
+  assert_int_equal(response[0], message_type);
+  assert_int_equal(response[6], seq);
+  assert_int_equal(response[8], error);
+  if (message_type == RDR_TO_PC_DATABLOCK) {
+    assert_int_equal(response_len, CCID_CMD_HEADER_SIZE + 2);
+    assert_int_equal(response[CCID_CMD_HEADER_SIZE], 0x6A);
+    assert_int_equal(response[CCID_CMD_HEADER_SIZE + 1], 0x82);
+  } else {
+    assert_int_equal(response_len, CCID_CMD_HEADER_SIZE);
+  }
+}
+
+static void test_setup(void **state) {
+  (void)state;
+  USBD_CCID_Init(&usb_device);
+  transmitted = 0;
+}
+
+static void test_back_to_back(void **state) {
+  test_setup(state);
+
+  // one command at a time, each response is collected before the next command
+  for (uint8_t seq = 0; seq < 5; ++seq) {
+    send_select(seq);
+    CCID_Loop();
+    assert_int_equal(transmitted, seq + 1);
+    assert_response(RDR_TO_PC_DATABLOCK, seq, SLOT_NO_ERROR);
+    USBD_CCID_DataIn(&usb_device);
+  }
+
+  // the next command is received while the previous one is executed or its response is being sent
+  for (uint8_t seq = 5; seq < 10; seq += 2) {
+    send_select(seq);
+    send_select(seq + 1);
+    CCID_Loop();
+    assert_response(RDR_TO_PC_DATABLOCK, seq, SLOT_NO_ERROR);
+    USBD_CCID_DataIn(&usb_device);
+    CCID_Loop();
+    assert_response(RDR_TO_PC_DATABLOCK, seq + 1, SLOT_NO_ERROR);
+    USBD_CCID_DataIn(&usb_device);
+  }
+  assert_int_equal(transmitted, 11);
+}
+
+static void test_not_collected(void **state) {
+  test_setup(state);
+
+  // the responses are never collected, the buffers stay in use
+  send_select(0);
+  CCID_Loop();
+  send_select(1);
+  CCID_Loop();
+  assert_response(RDR_TO_PC_DATABLOCK, 1, SLOT_NO_ERROR);
+  send_select(2);
+  CCID_Loop();
+  assert_response(RDR_TO_PC_SLOTSTATUS, 2, SLOTERROR_CMD_SLOT_BUSY);
+  assert_int_equal(transmitted, 3);
+}
+
+int main() {
+  usb_device.dev_state = USBD_STATE_CONFIGURED;
+  EP_SIZE_TABLE.ccid = 64;
+
+  const struct CMUnitTest tests[] = {
+      cmocka_unit_test(test_back_to_back),
+      cmocka_unit_test(test_not_collected),
+  };
+
+  return cmocka_run_group_tests(tests, NULL, NULL);
+}
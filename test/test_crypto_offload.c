@@ -0,0 +1,215 @@
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <cmocka.h>
+
+#include <apdu.h>
+#include <bd/lfs_filebd.h>
+#include <crypto_offload.h>
+#include <device.h>
+#include <fs.h>
+#include <lfs.h>
+#include <oath.h>
+#include <rand.h>
+
+// A fake engine overriding some of the weak primitives, as a port would. The SHA-256 engine hashes a whole message
+// at once, like a DMA engine without a context to save, and the HMAC is built on top of it. The ECDSA engine falls
+// back to the software implementation and only counts the calls.
+
+#define ENGINE_BUFFER_SIZE 1024
+
+static uint8_t engine_buffer[ENGINE_BUFFER_SIZE];
+static size_t engine_len;
+static int engine_sha256_calls, engine_hmac_calls, engine_ecdsa_calls;
+
+void crypto_sha256_init(void) { engine_len = 0; }
+
+void crypto_sha256_update(const uint8_t *data, uint16_t len) {
+  assert_true(engine_len + len <= ENGINE_BUFFER_SIZE);
+  memcpy(engine_buffer + engine_len, data, len);
+  engine_len += len;
+}
+
+void crypto_sha256_final(uint8_t digest[SHA256_DIGEST_LENGTH]) {
+  ++engine_sha256_calls;
+  sha256_raw(engine_buffer, engine_len, digest);
+}
+
+void crypto_hmac_sha256(const uint8_t *key, uint8_t keylen, const uint8_t *msg, uint32_t msglen, uint8_t *hmac) {
+  uint8_t pad[SHA256_BLOCK_LENGTH] = {0}, inner[SHA256_DIGEST_LENGTH];
+  ++engine_hmac_calls;
+  if (keylen > SHA256_BLOCK_LENGTH) {
+    crypto_sha256_init();
+    crypto_sha256_update(key, keylen);
+    crypto_sha256_final(pad);
+  } else {
+    memcpy(pad, key, keylen);
+  }
+  for (int i = 0; i < SHA256_BLOCK_LENGTH; ++i)
+    pad[i] ^= 0x36;
+  crypto_sha256_init();
+  crypto_sha256_update(pad, SHA256_BLOCK_LENGTH);
+  crypto_sha256_update(msg, msglen);
+  crypto_sha256_final(inner);
+  for (int i = 0; i < SHA256_BLOCK_LENGTH; ++i)
+    pad[i] ^= 0x36 ^ 0x5C;
+  crypto_sha256_init();
+  crypto_sha256_update(pad, SHA256_BLOCK_LENGTH);
+  crypto_sha256_update(inner, SHA256_DIGEST_LENGTH);
+  crypto_sha256_final(hmac);
+}
+
+int crypto_ecdsa_sign(ECC_Curve curve, const uint8_t *priv_key, const uint8_t *digest, uint8_t *sig) {
+  ++engine_ecdsa_calls;
+  return ecdsa_sign(curve, priv_key, digest, sig);
+}
+
+static void test_sha256(void **state) {
+  (void)state;
+
+  uint8_t msg[600], expected[SHA256_DIGEST_LENGTH], digest[SHA256_DIGEST_LENGTH];
+  random_buffer(msg, sizeof(msg));
+  int calls = engine_sha256_calls;
+  for (size_t len = 0; len <= sizeof(msg); len += 37) {
+    sha256_raw(msg, len, expected);
+    // split the message to exercise the updates
+    crypto_sha256_init();
+    crypto_sha256_update(msg, len / 3);
+    crypto_sha256_update(msg + len / 3, len - len / 3);
+    crypto_sha256_final(digest);
+    assert_int_equal(engine_sha256_calls, ++calls);
+    assert_memory_equal(digest, expected, sizeof(expected));
+  }
+}
+
+static void test_hmac_sha256(void **state) {
+  (void)state;
+
+  uint8_t key[100], msg[300], expected[SHA256_DIGEST_LENGTH], hmac[SHA256_DIGEST_LENGTH];
+  random_buffer(key, sizeof(key));
+  random_buffer(msg, sizeof(msg));
+  // keys longer than a block are hashed first
+  for (uint8_t keylen = 0; keylen <= sizeof(key); keylen += 10) {
+    for (uint32_t msglen = 0; msglen <= sizeof(msg); msglen += 50) {
+      hmac_sha256(key, keylen, msg, msglen, expected);
+      crypto_hmac_sha256(key, keylen, msg, msglen, hmac);
+      assert_memory_equal(hmac, expected, sizeof(expected));
+    }
+  }
+
+  // the applets derive keys in place
+  memcpy(hmac, key, sizeof(hmac));
+  hmac_sha256(key, sizeof(hmac), msg, sizeof(msg), expected);
+  crypto_hmac_sha256(hmac, sizeof(hmac), msg, sizeof(msg), hmac);
+  assert_memory_equal(hmac, expected, sizeof(expected));
+}
+
+static void test_ecdsa_sign(void **state) {
+  (void)state;
+
+  uint8_t priv_key[ECC_KEY_SIZE], pub_key[ECC_PUB_KEY_SIZE], digest[SHA256_DIGEST_LENGTH], sig[ECC_PUB_KEY_SIZE];
+  assert_int_equal(crypto_ecc_generate(ECC_SECP256R1, priv_key, pub_key), 0);
+  random_buffer(digest, sizeof(digest));
+  int calls = engine_ecdsa_calls;
+  assert_int_equal(crypto_ecdsa_sign(ECC_SECP256R1, priv_key, digest, sig), 0);
+  assert_int_equal(engine_ecdsa_calls, calls + 1);
+  assert_int_equal(ecdsa_verify(ECC_SECP256R1, pub_key, sig, digest), 0);
+}
+
+static int yields;
+
+static void count_yield(void) { ++yields; }
+
+static void test_rsa_generate_key(void **state) {
+  (void)state;
+
+  // the background tasks run during the prime search, not only around it
+  assert_int_equal(device_add_background_task(count_yield, 0), 0);
+  rsa_key_t key, completed;
+  assert_int_equal(crypto_rsa_generate_key(&key), 0);
+#ifdef USE_MBEDCRYPTO
+  assert_true(yields > 2);
+#endif
+
+  // the key is consistent
+  memset(&completed, 0, sizeof(completed));
+  memcpy(completed.e, key.e, E_LENGTH);
+  memcpy(completed.p, key.p, PQ_LENGTH);
+  memcpy(completed.q, key.q, PQ_LENGTH);
+  assert_int_equal(rsa_complete_key(&completed), 0);
+  assert_memory_equal(completed.n, key.n, N_LENGTH);
+  assert_memory_equal(completed.dp, key.dp, PQ_LENGTH);
+  assert_memory_equal(completed.dq, key.dq, PQ_LENGTH);
+  assert_memory_equal(completed.qinv, key.qinv, PQ_LENGTH);
+}
+
+// the applets go through the hooks
+static void test_oath_calculate(void **state) {
+  (void)state;
+
+  uint8_t c_buf[1024], r_buf[1024];
+  CAPDU C = {.data = c_buf};
+  RAPDU R = {.data = r_buf};
+  CAPDU *capdu = &C;
+  RAPDU *rapdu = &R;
+
+  // name: abc, algo: TOTP+SHA256, digit: 6, key: 0x00 0x01 0x02
+  uint8_t put[] = {OATH_TAG_NAME, 0x03, 'a', 'b', 'c', OATH_TAG_KEY, 0x05, 0x22, 0x06, 0x00, 0x01, 0x02};
+  capdu->ins = OATH_INS_PUT;
+  capdu->lc = sizeof(put);
+  memcpy(c_buf, put, sizeof(put));
+  oath_process_apdu(capdu, rapdu);
+  assert_int_equal(rapdu->sw, SW_NO_ERROR);
+
+  uint8_t calc[] = {OATH_TAG_NAME, 0x03, 'a', 'b', 'c', OATH_TAG_CHALLENGE, 0x04, 0x01, 0x02, 0x03, 0x04};
+  capdu->ins = OATH_INS_CALCULATE;
+  capdu->lc = sizeof(calc);
+  memcpy(c_buf, calc, sizeof(calc));
+  int calls = engine_hmac_calls;
+  oath_process_apdu(capdu, rapdu);
+  assert_int_equal(rapdu->sw, SW_NO_ERROR);
+  assert_int_equal(engine_hmac_calls, calls + 1);
+
+  uint8_t hmac[SHA256_DIGEST_LENGTH];
+  hmac_sha256(put + 9, 3, calc + 7, 4, hmac);
+  uint8_t *truncated = hmac + (hmac[SHA256_DIGEST_LENGTH - 1] & 0xF);
+  uint8_t expected[] = {OATH_TAG_RESPONSE, 0x05, 0x06, truncated[0] & 0x7F, truncated[1], truncated[2], truncated[3]};
+  assert_int_equal(LL, sizeof(expected));
+  assert_memory_equal(RDATA, expected, sizeof(expected));
+}
+
+int main() {
+  struct lfs_config cfg;
+  lfs_filebd_t bd;
+  memset(&cfg, 0, sizeof(cfg));
+  cfg.context = &bd;
+  cfg.read = &lfs_filebd_read;
+  cfg.prog = &lfs_filebd_prog;
+  cfg.erase = &lfs_filebd_erase;
+  cfg.sync = &lfs_filebd_sync;
+  cfg.read_size = 16;
+  cfg.prog_size = 16;
+  cfg.block_size = 512;
+  cfg.block_count = 400;
+  cfg.block_cycles = 50000;
+  cfg.cache_size = 128;
+  cfg.lookahead_size = 16;
+  lfs_filebd_create(&cfg, "lfs-root");
+
+  fs_init(&cfg);
+  oath_install(1);
+
+  const struct CMUnitTest tests[] = {
+      cmocka_unit_test(test_sha256),
+      cmocka_unit_test(test_hmac_sha256),
+      cmocka_unit_test(test_ecdsa_sign),
+      cmocka_unit_test(test_rsa_generate_key),
+      cmocka_unit_test(test_oath_calculate),
+  };
+
+  int ret = cmocka_run_group_tests(tests, NULL, NULL);
+
+  lfs_filebd_destroy(&cfg);
+
+  return ret;
+}
@@ -0,0 +1,377 @@
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <cmocka.h>
+
+#include <apdu.h>
+#include <bd/lfs_filebd.h>
+#include <cbor.h>
+#include <cose-key.h>
+#include <ctap-errors.h>
+#include <ctap-internal.h>
+#include <ctap.h>
+#include <ctaphid.h>
+#include <fs.h>
+#include <lfs.h>
+#include <scratch.h>
+
+static const uint8_t aaguid[] = {0x24, 0x4e, 0xb2, 0x9e, 0xe0, 0x90, 0x4e, 0x49,
+                                 0x81, 0xfe, 0x1f, 0x20, 0xf8, 0xd3, 0xb8, 0xf4};
+
+// the response of getInfo encoded item by item, to check the template
+static size_t encode_info(uint8_t *buf, size_t size, bool client_pin) {
+  CborEncoder encoder, map, array;
+  cbor_encoder_init(&encoder, buf, size, 0);
+  assert_int_equal(cbor_encoder_create_map(&encoder, &map, 6), CborNoError);
+  cbor_encode_int(&map, RESP_versions);
+  cbor_encoder_create_array(&map, &array, 2);
+  cbor_encode_text_stringz(&array, "FIDO_2_0");
+  cbor_encode_text_stringz(&array, "U2F_V2");
+  cbor_encoder_close_container(&map, &array);
+  cbor_encode_int(&map, RESP_extensions);
+  cbor_encoder_create_array(&map, &array, 1);
+  cbor_encode_text_stringz(&array, "hmac-secret");
+  cbor_encoder_close_container(&map, &array);
+  cbor_encode_int(&map, RESP_aaguid);
+  cbor_encode_byte_string(&map, aaguid, sizeof(aaguid));
+  cbor_encode_int(&map, RESP_options);
+  cbor_encoder_create_map(&map, &array, 1);
+  cbor_encode_text_stringz(&array, "clientPin");
+  cbor_encode_boolean(&array, client_pin);
+  cbor_encoder_close_container(&map, &array);
+  cbor_encode_int(&map, RESP_maxMsgSize);
+  cbor_encode_int(&map, MAX_CTAP_BUFSIZE);
+  cbor_encode_int(&map, RESP_pinProtocols);
+  cbor_encoder_create_array(&map, &array, 1);
+  cbor_encode_int(&array, 1);
+  cbor_encoder_close_container(&map, &array);
+  assert_int_equal(cbor_encoder_close_container(&encoder, &map), CborNoError);
+  return cbor_encoder_get_buffer_size(&encoder, buf);
+}
+
+static void test_get_info(void **state) {
+  (void)state;
+
+  uint8_t req = CTAP_GET_INFO, resp[MAX_CTAP_BUFSIZE], expected[MAX_CTAP_BUFSIZE];
+  size_t len = sizeof(resp);
+  assert_int_equal(ctap_process_cbor(&req, 1, resp, &len), 0);
+  assert_int_equal(resp[0], 0);
+  size_t expected_len = encode_info(expected, sizeof(expected), false);
+  assert_int_equal(len, 1 + expected_len);
+  assert_memory_equal(resp + 1, expected, expected_len);
+
+  // the slot of clientPin
+  uint8_t pin[] = {'1', '2', '3', '4'};
+  assert_int_equal(write_attr(CTAP_CERT_FILE, PIN_ATTR, pin, sizeof(pin)), 0);
+  len = sizeof(resp);
+  assert_int_equal(ctap_process_cbor(&req, 1, resp, &len), 0);
+  assert_int_equal(resp[0], 0);
+  expected_len = encode_info(expected, sizeof(expected), true);
+  assert_int_equal(len, 1 + expected_len);
+  assert_memory_equal(resp + 1, expected, expected_len);
+
+  // a response buffer too short
+  len = expected_len;
+  assert_int_equal(ctap_process_cbor(&req, 1, resp, &len), 0);
+  assert_int_equal(resp[0], CTAP2_ERR_INVALID_CBOR);
+  assert_int_equal(len, 1);
+
+  assert_int_equal(write_attr(CTAP_CERT_FILE, PIN_ATTR, NULL, 0), 0);
+}
+
+#define RP_ID "example.com"
+
+// longer than 255 bytes, like real ones, so that its length takes the 2 bytes of the slot in the template
+static uint8_t cert[300];
+
+// the attestation key and a certificate, which only has to be copied into the response
+static void install_attestation(void) {
+  uint8_t key[ECC_KEY_SIZE];
+  memset(key, 0x42, sizeof(key));
+  memset(cert, 0x30, sizeof(cert));
+  RAPDU R;
+  CAPDU C = {.data = key, .lc = sizeof(key)};
+  assert_int_equal(ctap_install_private_key(&C, &R), 0);
+  C.data = cert;
+  C.lc = sizeof(cert);
+  assert_int_equal(ctap_install_cert(&C, &R), 0);
+}
+
+// a resident credential of RP_ID for the user with this id
+static size_t make_credential_request(uint8_t *req, size_t size, uint8_t user_id) {
+  uint8_t client_data_hash[CLIENT_DATA_HASH_SIZE];
+  memset(client_data_hash, 0x11, sizeof(client_data_hash));
+  CborEncoder encoder, map, sub, params;
+  req[0] = CTAP_MAKE_CREDENTIAL;
+  cbor_encoder_init(&encoder, req + 1, size - 1, 0);
+  cbor_encoder_create_map(&encoder, &map, 5);
+  cbor_encode_int(&map, MC_clientDataHash);
+  cbor_encode_byte_string(&map, client_data_hash, sizeof(client_data_hash));
+  cbor_encode_int(&map, MC_rp);
+  cbor_encoder_create_map(&map, &sub, 1);
+  cbor_encode_text_stringz(&sub, "id");
+  cbor_encode_text_stringz(&sub, RP_ID);
+  cbor_encoder_close_container(&map, &sub);
+  cbor_encode_int(&map, MC_user);
+  cbor_encoder_create_map(&map, &sub, 2);
+  cbor_encode_text_stringz(&sub, "id");
+  cbor_encode_byte_string(&sub, &user_id, 1);
+  cbor_encode_text_stringz(&sub, "name");
+  cbor_encode_text_stringz(&sub, "user");
+  cbor_encoder_close_container(&map, &sub);
+  cbor_encode_int(&map, MC_pubKeyCredParams);
+  cbor_encoder_create_array(&map, &params, 1);
+  cbor_encoder_create_map(&params, &sub, 2);
+  cbor_encode_text_stringz(&sub, "alg");
+  cbor_encode_int(&sub, COSE_ALG_ES256);
+  cbor_encode_text_stringz(&sub, "type");
+  cbor_encode_text_stringz(&sub, "public-key");
+  cbor_encoder_close_container(&params, &sub);
+  cbor_encoder_close_container(&map, &params);
+  cbor_encode_int(&map, MC_options);
+  cbor_encoder_create_map(&map, &sub, 1);
+  cbor_encode_text_stringz(&sub, "rk");
+  cbor_encode_boolean(&sub, true);
+  cbor_encoder_close_container(&map, &sub);
+  assert_int_equal(cbor_encoder_close_container(&encoder, &map), CborNoError);
+  return 1 + cbor_encoder_get_buffer_size(&encoder, req + 1);
+}
+
+// an assertion of the resident credentials of RP_ID
+static size_t get_assertion_request(uint8_t *req, size_t size) {
+  uint8_t client_data_hash[CLIENT_DATA_HASH_SIZE];
+  memset(client_data_hash, 0x22, sizeof(client_data_hash));
+  CborEncoder encoder, map;
+  req[0] = CTAP_GET_ASSERTION;
+  cbor_encoder_init(&encoder, req + 1, size - 1, 0);
+  cbor_encoder_create_map(&encoder, &map, 2);
+  cbor_encode_int(&map, GA_rpId);
+  cbor_encode_text_stringz(&map, RP_ID);
+  cbor_encode_int(&map, GA_clientDataHash);
+  cbor_encode_byte_string(&map, client_data_hash, sizeof(client_data_hash));
+  assert_int_equal(cbor_encoder_close_container(&encoder, &map), CborNoError);
+  return 1 + cbor_encoder_get_buffer_size(&encoder, req + 1);
+}
+
+static void make_resident_credentials(uint8_t users) {
+  uint8_t req[256], resp[MAX_CTAP_BUFSIZE];
+  for (uint8_t user_id = 1; user_id <= users; ++user_id) {
+    size_t len = sizeof(resp);
+    assert_int_equal(ctap_process_cbor(req, make_credential_request(req, sizeof(req), user_id), resp, &len), 0);
+    assert_int_equal(resp[0], 0);
+  }
+}
+
+// the byte string of a response at this key, or at field in the map at this key
+static size_t find_bytes(const uint8_t *resp, size_t len, int key, const char *field, uint8_t *buf, size_t size) {
+  CborParser parser;
+  CborValue it, map, value;
+  assert_int_equal(cbor_parser_init(resp, len, 0, &parser, &it), CborNoError);
+  assert_int_equal(cbor_value_enter_container(&it, &map), CborNoError);
+  for (;;) {
+    assert_false(cbor_value_at_end(&map));
+    int k;
+    assert_int_equal(cbor_value_get_int(&map, &k), CborNoError);
+    assert_int_equal(cbor_value_advance(&map), CborNoError);
+    if (k == key) break;
+    assert_int_equal(cbor_value_advance(&map), CborNoError);
+  }
+  if (field != NULL)
+    assert_int_equal(cbor_value_map_find_value(&map, field, &value), CborNoError);
+  else
+    value = map;
+  assert_int_equal(cbor_value_copy_byte_string(&value, buf, &size, NULL), CborNoError);
+  return size;
+}
+
+// the response of makeCredential encoded item by item, to check the templates
+static size_t encode_attestation(uint8_t *buf, size_t size, const uint8_t *auth_data, size_t auth_data_len,
+                                 const uint8_t *sig, size_t sig_len) {
+  CborEncoder encoder, map, att_stmt, x5c;
+  cbor_encoder_init(&encoder, buf, size, 0);
+  assert_int_equal(cbor_encoder_create_map(&encoder, &map, 3), CborNoError);
+  cbor_encode_int(&map, RESP_fmt);
+  cbor_encode_text_stringz(&map, "packed");
+  cbor_encode_int(&map, RESP_authData);
+  cbor_encode_byte_string(&map, auth_data, auth_data_len);
+  cbor_encode_int(&map, RESP_attStmt);
+  cbor_encoder_create_map(&map, &att_stmt, 3);
+  cbor_encode_text_stringz(&att_stmt, "alg");
+  cbor_encode_int(&att_stmt, COSE_ALG_ES256);
+  cbor_encode_text_stringz(&att_stmt, "sig");
+  cbor_encode_byte_string(&att_stmt, sig, sig_len);
+  cbor_encode_text_stringz(&att_stmt, "x5c");
+  cbor_encoder_create_array(&att_stmt, &x5c, 1);
+  cbor_encode_byte_string(&x5c, cert, sizeof(cert));
+  cbor_encoder_close_container(&att_stmt, &x5c);
+  cbor_encoder_close_container(&map, &att_stmt);
+  assert_int_equal(cbor_encoder_close_container(&encoder, &map), CborNoError);
+  return cbor_encoder_get_buffer_size(&encoder, buf);
+}
+
+// the response of getAssertion for a resident credential, with numberOfCredentials unless credentials is 0
+static size_t encode_assertion(uint8_t *buf, size_t size, const uint8_t *id, size_t id_len, const uint8_t *auth_data,
+                               size_t auth_data_len, const uint8_t *sig, size_t sig_len, uint8_t user_id,
+                               uint8_t credentials) {
+  CborEncoder encoder, map, sub_map;
+  cbor_encoder_init(&encoder, buf, size, 0);
+  assert_int_equal(cbor_encoder_create_map(&encoder, &map, credentials > 0 ? 5 : 4), CborNoError);
+  cbor_encode_int(&map, RESP_credential);
+  cbor_encoder_create_map(&map, &sub_map, 2);
+  cbor_encode_text_stringz(&sub_map, "id");
+  cbor_encode_byte_string(&sub_map, id, id_len);
+  cbor_encode_text_stringz(&sub_map, "type");
+  cbor_encode_text_stringz(&sub_map, "public-key");
+  cbor_encoder_close_container(&map, &sub_map);
+  cbor_encode_int(&map, RESP_authData);
+  cbor_encode_byte_string(&map, auth_data, auth_data_len);
+  cbor_encode_int(&map, RESP_signature);
+  cbor_encode_byte_string(&map, sig, sig_len);
+  cbor_encode_int(&map, RESP_publicKeyCredentialUserEntity);
+  // several credentials match, the user is described in full
+  cbor_encoder_create_map(&map, &sub_map, 4);
+  cbor_encode_text_stringz(&sub_map, "id");
+  cbor_encode_byte_string(&sub_map, &user_id, 1);
+  cbor_encode_text_stringz(&sub_map, "icon");
+  cbor_encode_text_stringz(&sub_map, "");
+  cbor_encode_text_stringz(&sub_map, "name");
+  cbor_encode_text_stringz(&sub_map, "user");
+  cbor_encode_text_stringz(&sub_map, "displayName");
+  cbor_encode_text_stringz(&sub_map, "");
+  cbor_encoder_close_container(&map, &sub_map);
+  if (credentials > 0) {
+    cbor_encode_int(&map, RESP_numberOfCredentials);
+    cbor_encode_int(&map, credentials);
+  }
+  assert_int_equal(cbor_encoder_close_container(&encoder, &map), CborNoError);
+  return cbor_encoder_get_buffer_size(&encoder, buf);
+}
+
+static void test_make_credential(void **state) {
+  (void)state;
+
+  ctap_install(1);
+  install_attestation();
+
+  uint8_t req[256], resp[MAX_CTAP_BUFSIZE], expected[MAX_CTAP_BUFSIZE];
+  uint8_t auth_data[sizeof(CTAP_authData)], sig[72];
+  size_t req_len = make_credential_request(req, sizeof(req), 1), len = sizeof(resp);
+  assert_int_equal(ctap_process_cbor(req, req_len, resp, &len), 0);
+  assert_int_equal(resp[0], 0);
+  size_t auth_data_len = find_bytes(resp + 1, len - 1, RESP_authData, NULL, auth_data, sizeof(auth_data));
+  size_t sig_len = find_bytes(resp + 1, len - 1, RESP_attStmt, "sig", sig, sizeof(sig));
+  assert_int_equal(auth_data[SHA256_DIGEST_LENGTH], FLAGS_AT | FLAGS_UP);
+  size_t expected_len = encode_attestation(expected, sizeof(expected), auth_data, auth_data_len, sig, sig_len);
+  assert_int_equal(len, 1 + expected_len);
+  assert_memory_equal(resp + 1, expected, expected_len);
+
+  // no room for the certificate
+  len = expected_len;
+  assert_int_equal(ctap_process_cbor(req, req_len, resp, &len), 0);
+  assert_int_equal(resp[0], CTAP2_ERR_INVALID_CBOR);
+  assert_int_equal(len, 1);
+}
+
+static void test_get_assertion(void **state) {
+  (void)state;
+
+  ctap_install(1);
+  install_attestation();
+  make_resident_credentials(2);
+
+  uint8_t req[256], next = CTAP_GET_NEXT_ASSERTION, resp[MAX_CTAP_BUFSIZE], expected[MAX_CTAP_BUFSIZE];
+  uint8_t id[2][sizeof(CredentialId)], auth_data[sizeof(CTAP_authData)], sig[72];
+  size_t len = sizeof(resp);
+  assert_int_equal(ctap_process_cbor(req, get_assertion_request(req, sizeof(req)), resp, &len), 0);
+  // the first response announces the second credential
+  for (uint8_t user_id = 1; user_id <= 2; ++user_id) {
+    assert_int_equal(resp[0], 0);
+    size_t id_len = find_bytes(resp + 1, len - 1, RESP_credential, "id", id[user_id - 1], sizeof(id[0]));
+    assert_int_equal(id_len, sizeof(CredentialId));
+    size_t auth_data_len = find_bytes(resp + 1, len - 1, RESP_authData, NULL, auth_data, sizeof(auth_data));
+    size_t sig_len = find_bytes(resp + 1, len - 1, RESP_signature, NULL, sig, sizeof(sig));
+    assert_int_equal(auth_data_len, SHA256_DIGEST_LENGTH + 5);
+    assert_int_equal(auth_data[SHA256_DIGEST_LENGTH], FLAGS_UP);
+    size_t expected_len = encode_assertion(expected, sizeof(expected), id[user_id - 1], id_len, auth_data,
+                                           auth_data_len, sig, sig_len, user_id, user_id == 1 ? 2 : 0);
+    assert_int_equal(len, 1 + expected_len);
+    assert_memory_equal(resp + 1, expected, expected_len);
+    len = sizeof(resp);
+    if (user_id == 1) assert_int_equal(ctap_process_cbor(&next, 1, resp, &len), 0);
+  }
+  assert_memory_not_equal(id[0], id[1], sizeof(CredentialId));
+}
+
+static void test_power_off_between_assertions(void **state) {
+  (void)state;
+
+  ctap_install(1);
+  install_attestation();
+  make_resident_credentials(2);
+
+  // the applet is selected on the basic channel, so that the power off reaches it
+  uint8_t c_buf[APDU_BUFFER_SIZE], r_buf[APDU_BUFFER_SIZE];
+  uint8_t fido_aid[] = {0xA0, 0x00, 0x00, 0x06, 0x47, 0x2F, 0x00, 0x01};
+  CAPDU C = {.data = c_buf, .cla = 0x00, .ins = 0xA4, .p1 = 0x04, .p2 = 0x00, .lc = sizeof(fido_aid), .le = 256};
+  RAPDU R = {.data = r_buf};
+  memcpy(c_buf, fido_aid, sizeof(fido_aid));
+  process_apdu(&C, &R);
+  assert_int_equal(R.sw, SW_NO_ERROR);
+
+  uint8_t req[256], next = CTAP_GET_NEXT_ASSERTION, resp[MAX_CTAP_BUFSIZE];
+  size_t req_len = get_assertion_request(req, sizeof(req)), len = sizeof(resp);
+  assert_int_equal(ctap_process_cbor(req, req_len, resp, &len), 0);
+  assert_int_equal(resp[0], 0);
+  assert_non_null(scratch_persisted(APPLET_FIDO));
+  len = sizeof(resp);
+  assert_int_equal(ctap_process_cbor(&next, 1, resp, &len), 0);
+  assert_int_equal(resp[0], 0);
+  // the last assertion releases the state
+  assert_null(scratch_persisted(APPLET_FIDO));
+
+  len = sizeof(resp);
+  assert_int_equal(ctap_process_cbor(req, req_len, resp, &len), 0);
+  assert_int_equal(resp[0], 0);
+  assert_non_null(scratch_persisted(APPLET_FIDO));
+  applet_poweroff();
+  assert_null(scratch_persisted(APPLET_FIDO));
+  len = sizeof(resp);
+  assert_int_equal(ctap_process_cbor(&next, 1, resp, &len), 0);
+  assert_int_equal(resp[0], CTAP2_ERR_NOT_ALLOWED);
+  assert_int_equal(len, 1);
+}
+
+int main() {
+  struct lfs_config cfg;
+  lfs_filebd_t bd;
+  memset(&cfg, 0, sizeof(cfg));
+  cfg.context = &bd;
+  cfg.read = &lfs_filebd_read;
+  cfg.prog = &lfs_filebd_prog;
+  cfg.erase = &lfs_filebd_erase;
+  cfg.sync = &lfs_filebd_sync;
+  cfg.read_size = 16;
+  cfg.prog_size = 16;
+  cfg.block_size = 512;
+  cfg.block_count = 400;
+  cfg.block_cycles = 50000;
+  cfg.cache_size = 128;
+  cfg.lookahead_size = 16;
+  lfs_filebd_create(&cfg, "lfs-root");
+
+  fs_init(&cfg);
+  ctap_install(1);
+
+  const struct CMUnitTest tests[] = {
+      cmocka_unit_test(test_get_info),
+      cmocka_unit_test(test_make_credential),
+      cmocka_unit_test(test_get_assertion),
+      cmocka_unit_test(test_power_off_between_assertions),
+  };
+
+  int ret = cmocka_run_group_tests(tests, NULL, NULL);
+
+  lfs_filebd_destroy(&cfg);
+
+  return ret;
+}
@@ -0,0 +1,138 @@
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <cmocka.h>
+
+#include <debug_log.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+
+static char *output;
+static size_t output_size;
+
+// the records printed by debug_log_flush, valid until the next call
+static const char *flush(uint16_t max_records, uint16_t *printed) {
+  free(output);
+  fflush(stdout);
+  FILE *saved = stdout;
+  stdout = open_memstream(&output, &output_size);
+  uint16_t n = debug_log_flush(max_records);
+  fclose(stdout);
+  stdout = saved;
+  if (printed != NULL) *printed = n;
+  return output;
+}
+
+#define CHECK_MESSAGE(format, ...)                                                                                     \
+  do {                                                                                                                 \
+    char expected[256];                                                                                                \
+    snprintf(expected, sizeof(expected), "[DBG] test(%d): " format, __LINE__, ##__VA_ARGS__);                          \
+    debug_log_msg(DEBUG_LOG_DBG, "test", __LINE__, format, ##__VA_ARGS__);                                             \
+    assert_string_equal(flush(UINT16_MAX, NULL), expected);                                                            \
+  } while (0)
+
+static void test_format(void **state) {
+  (void)state;
+
+  CHECK_MESSAGE("plain\n");
+  CHECK_MESSAGE("%d %i %u %o %x %X %#x %02X\n", -1, 2, 3u, 8u, 0xabu, 0xabu, 0x10u, 5u);
+  CHECK_MESSAGE("%c%c %hhu %hd %lu %ld %lld %llu %zu %jd %td\n", 'o', 'k', (unsigned char)200, (short)-3, 1ul << 40,
+                -5l, -(1ll << 50), 1ull << 63, (size_t)42, (intmax_t)-7, (ptrdiff_t)9);
+  CHECK_MESSAGE("%s|%-6s|%6s|%.2s\n", "abc", "left", "right", "cut");
+  CHECK_MESSAGE("%5.2f %e %g %%\n", 3.14159, 1e-9, 0.5);
+  CHECK_MESSAGE("%p\n", (void *)&output);
+  CHECK_MESSAGE("%*d|%-*d|%.*s|%*.*f|%.*d\n", 5, 42, 4, 7, 3, "abcdef", 8, 3, 2.5, -1, 12);
+  CHECK_MESSAGE("%*d|%s\n", -4, 1, "after");
+
+  // strings are copied up to DEBUG_LOG_STR_MAX bytes
+  char long_string[DEBUG_LOG_STR_MAX + 8];
+  memset(long_string, 'a', sizeof(long_string) - 1);
+  long_string[sizeof(long_string) - 1] = '\0';
+  debug_log_msg(DEBUG_LOG_ERR, "test", 1, "%s %d\n", long_string, 1);
+  char expected[128];
+  snprintf(expected, sizeof(expected), "[ERR] test(1): %.*s 1\n", DEBUG_LOG_STR_MAX, long_string);
+  assert_string_equal(flush(UINT16_MAX, NULL), expected);
+
+  // the arguments following a conversion that cannot be recorded are not printed
+  int n;
+  debug_log_msg(DEBUG_LOG_DBG, "test", 2, "%d%n %d\n", 1, &n, 2);
+  assert_string_equal(flush(UINT16_MAX, NULL), "[DBG] test(2): 1...\n");
+  debug_log_msg(DEBUG_LOG_DBG, "test", 3, "%d %lc %d\n", 1, (wint_t)L'x', 2);
+  assert_string_equal(flush(UINT16_MAX, NULL), "[DBG] test(3): 1 ...\n");
+  // nor those that do not fit in a record
+  debug_log_msg(DEBUG_LOG_DBG, "test", 4,
+                "%s %s %s %s %s %s %s %s %s|%d\n", long_string, long_string, long_string, long_string, long_string,
+                long_string, long_string, long_string, long_string, 1);
+  assert_non_null(strstr(flush(UINT16_MAX, NULL), "...\n"));
+
+  uint8_t hex[DEBUG_LOG_HEX_MAX + 16];
+  memset(hex, 0x5A, sizeof(hex));
+  debug_log_hex(hex, sizeof(hex));
+  char tail[32];
+  snprintf(tail, sizeof(tail), "... (%u bytes)\n", (unsigned)sizeof(hex));
+  const char *printed = flush(UINT16_MAX, NULL);
+  assert_int_equal(strcmp(printed + strlen(printed) - strlen(tail), tail), 0);
+}
+
+static void test_wraparound(void **state) {
+  (void)state;
+
+  // the records are read one at a time, so that they straddle the end of the ring over and over
+  for (int i = 0; i < 1000; ++i) {
+    debug_log_msg(DEBUG_LOG_DBG, "test", 1, "%d %s\n", i, i % 2 ? "odd" : "even");
+    debug_log_msg(DEBUG_LOG_DBG, "test", 2, "%x\n", (unsigned)i);
+    char expected[64];
+    snprintf(expected, sizeof(expected), "[DBG] test(1): %d %s\n", i, i % 2 ? "odd" : "even");
+    uint16_t printed;
+    assert_string_equal(flush(1, &printed), expected);
+    assert_int_equal(printed, 1);
+    snprintf(expected, sizeof(expected), "[DBG] test(2): %x\n", (unsigned)i);
+    assert_string_equal(flush(1, &printed), expected);
+    assert_int_equal(printed, 1);
+  }
+  uint16_t printed;
+  assert_string_equal(flush(UINT16_MAX, &printed), "");
+  assert_int_equal(printed, 0);
+}
+
+static void test_overflow(void **state) {
+  (void)state;
+
+  // more records than the ring holds, the latest ones are dropped
+  const int total = DEBUG_LOG_RING_SIZE / 16;
+  for (int i = 0; i < total; ++i)
+    debug_log_msg(DEBUG_LOG_DBG, "test", 1, "%d\n", i);
+  uint16_t printed;
+  const char *out = flush(UINT16_MAX, &printed);
+  assert_true(printed > 0 && printed < total);
+
+  char expected[64];
+  snprintf(expected, sizeof(expected), "[ERR] %d log records dropped\n", total - printed);
+  assert_int_equal(strncmp(out, expected, strlen(expected)), 0);
+  out += strlen(expected);
+  for (int i = 0; i < printed; ++i) {
+    snprintf(expected, sizeof(expected), "[DBG] test(1): %d\n", i);
+    assert_int_equal(strncmp(out, expected, strlen(expected)), 0);
+    out += strlen(expected);
+  }
+  assert_string_equal(out, "");
+
+  // the ring is usable again
+  CHECK_MESSAGE("%d\n", total);
+}
+
+int main() {
+  flush(UINT16_MAX, NULL);
+
+  const struct CMUnitTest tests[] = {
+      cmocka_unit_test(test_format),
+      cmocka_unit_test(test_wraparound),
+      cmocka_unit_test(test_overflow),
+  };
+
+  int ret = cmocka_run_group_tests(tests, NULL, NULL);
+  free(output);
+  return ret;
+}
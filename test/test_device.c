@@ -0,0 +1,263 @@
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <cmocka.h>
+
+#include <apdu_pool.h>
+#include <ctaphid.h>
+#include <device.h>
+#include <dummy.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <usb_device.h>
+#include <usbd_ctaphid.h>
+#ifdef HOST_THREADS
+#include <host-platform.h>
+#endif
+
+static int task_runs, nested_runs;
+
+static void task(void) { ++task_runs; }
+
+static void nested_task(void) {
+  ++nested_runs;
+  // a task yielding again must not recurse
+  device_yield();
+}
+
+static void test_background_tasks(void **state) {
+  (void)state;
+
+  virt_clock_simulate(1000);
+  assert_int_equal(device_add_background_task(task, 100), 0);
+
+  // not due yet
+  device_yield();
+  assert_int_equal(task_runs, 0);
+  virt_clock_advance(99);
+  device_yield();
+  assert_int_equal(task_runs, 0);
+
+  virt_clock_advance(1);
+  device_yield();
+  assert_int_equal(task_runs, 1);
+  device_yield();
+  assert_int_equal(task_runs, 1);
+
+  // device_delay advances the simulated clock
+  device_delay(250);
+  device_yield();
+  assert_int_equal(task_runs, 2);
+
+  assert_int_equal(device_add_background_task(nested_task, 0), 0);
+  device_yield();
+  assert_int_equal(nested_runs, 1);
+
+  // fill up the table
+  while (device_add_background_task(task, 1000) == 0)
+    ;
+  assert_int_equal(device_add_background_task(task, 1000), -1);
+}
+
+#define MAX_SENT_REPORTS 16
+
+static CTAPHID_FRAME sent_reports[MAX_SENT_REPORTS];
+static int reports_sent;
+static uint8_t *prepared_buffer;
+static int receives_prepared;
+
+USBD_StatusTypeDef USBD_LL_PrepareReceive(USBD_HandleTypeDef *pdev, uint8_t ep_addr, uint8_t *pbuf, uint16_t size) {
+  (void)pdev;
+  (void)ep_addr;
+  (void)size;
+  prepared_buffer = pbuf;
+  ++receives_prepared;
+  return USBD_OK;
+}
+
+static uint8_t capture_report(USBD_HandleTypeDef *pdev, uint8_t *report, uint16_t len) {
+  (void)pdev;
+  if (reports_sent < MAX_SENT_REPORTS) memcpy(&sent_reports[reports_sent], report, len);
+  ++reports_sent;
+  CTAPHID_InEvent();
+  return 0;
+}
+
+static void ping(CTAPHID_FRAME *frame, uint32_t cid, uint8_t payload) {
+  memset(frame, 0, sizeof(*frame));
+  frame->cid = cid;
+  frame->init.cmd = CTAPHID_PING;
+  frame->init.bcntl = 1;
+  frame->init.data[0] = payload;
+}
+
+static void test_ctaphid_queue(void **state) {
+  (void)state;
+
+  CTAPHID_Init(capture_report);
+  CTAPHID_FRAME frame;
+
+  // reports received while no CTAPHID command runs wait for the loop, in order
+  ping(&frame, 0x01020304, 0x11);
+  CTAPHID_OutEvent((uint8_t *)&frame);
+  ping(&frame, 0x05060708, 0x22);
+  CTAPHID_OutEvent((uint8_t *)&frame);
+  device_yield();
+  assert_int_equal(reports_sent, 0);
+  assert_int_equal(CTAPHID_Loop(0), LOOP_SUCCESS);
+  assert_int_equal(CTAPHID_Loop(0), LOOP_SUCCESS);
+  assert_int_equal(reports_sent, 2);
+  assert_int_equal(sent_reports[0].cid, 0x01020304);
+  assert_int_equal(sent_reports[0].init.cmd, CTAPHID_PING);
+  assert_int_equal(sent_reports[0].init.data[0], 0x11);
+  assert_int_equal(sent_reports[1].cid, 0x05060708);
+  assert_int_equal(sent_reports[1].init.data[0], 0x22);
+
+  // the queue is full, the report is not taken
+  for (int i = 0; i < CTAPHID_RX_RING_SIZE; i++) {
+    ping(&frame, 0x01020304, i);
+    assert_int_equal(CTAPHID_OutEvent((uint8_t *)&frame), 0);
+  }
+  assert_int_equal(CTAPHID_OutEvent((uint8_t *)&frame), 1);
+  for (int i = 0; i < CTAPHID_RX_RING_SIZE; i++)
+    CTAPHID_Loop(0);
+  assert_int_equal(reports_sent, 2 + CTAPHID_RX_RING_SIZE);
+
+  // through the endpoint, which NAKs the report it cannot hand over, and nothing is lost
+  usb_device.dev_state = USBD_STATE_CONFIGURED;
+  USBD_CTAPHID_Init(&usb_device);
+  CTAPHID_Init(capture_report);
+  reports_sent = 0;
+  for (int i = 0; i <= CTAPHID_RX_RING_SIZE; i++) {
+    int prepared = receives_prepared;
+    ping((CTAPHID_FRAME *)prepared_buffer, 0x01020304, i);
+    USBD_CTAPHID_DataOut(&usb_device);
+    assert_int_equal(receives_prepared, i < CTAPHID_RX_RING_SIZE ? prepared + 1 : prepared);
+  }
+  int prepared = receives_prepared;
+  assert_int_equal(CTAPHID_Loop(0), LOOP_SUCCESS);
+  assert_int_equal(receives_prepared, prepared + 1);
+  for (int i = 0; i < CTAPHID_RX_RING_SIZE; i++)
+    CTAPHID_Loop(0);
+  assert_int_equal(reports_sent, CTAPHID_RX_RING_SIZE + 1);
+  for (int i = 0; i <= CTAPHID_RX_RING_SIZE; i++)
+    assert_int_equal(sent_reports[i].init.data[0], i);
+}
+
+#define SPINLOCK_ROUNDS 100000
+
+static volatile uint32_t counter_lock;
+static uint32_t counter;
+
+static void *count_up(void *arg) {
+  (void)arg;
+  for (int i = 0; i < SPINLOCK_ROUNDS; i++) {
+    device_spinlock_lock(&counter_lock, 1);
+    ++counter;
+    device_spinlock_unlock(&counter_lock);
+  }
+  return NULL;
+}
+
+static void test_spinlock(void **state) {
+  (void)state;
+
+  assert_int_equal(device_spinlock_lock(&counter_lock, 0), 0);
+  assert_int_equal(device_spinlock_lock(&counter_lock, 0), -1);
+  device_spinlock_unlock(&counter_lock);
+
+  // no increment is lost when the lock is contended
+  pthread_t threads[4];
+  for (int i = 0; i < 4; i++)
+    assert_int_equal(pthread_create(&threads[i], NULL, count_up, NULL), 0);
+  for (int i = 0; i < 4; i++)
+    assert_int_equal(pthread_join(threads[i], NULL), 0);
+  assert_int_equal(counter, 4 * SPINLOCK_ROUNDS);
+}
+
+#ifdef HOST_THREADS
+
+static volatile int timer_fired, cancelled_fired;
+
+static void on_timer(void) { ++timer_fired; }
+
+static void on_cancelled_timer(void) { ++cancelled_fired; }
+
+static void test_timer_thread(void **state) {
+  (void)state;
+
+  device_set_timeout(on_timer, 20);
+  for (int i = 0; i < 100 && !timer_fired; i++)
+    usleep(10000);
+  assert_int_equal(timer_fired, 1);
+
+  // a cancelled or replaced timer does not fire
+  device_set_timeout(on_cancelled_timer, 20);
+  device_set_timeout(NULL, 0);
+  device_set_timeout(on_cancelled_timer, 20);
+  device_set_timeout(on_timer, 40);
+  usleep(200000);
+  assert_int_equal(cancelled_fired, 0);
+  assert_int_equal(timer_fired, 2);
+
+  // the callback preempts a command of the main context, but waits while the IRQs are disabled
+  host_main_lock();
+  host_irq_lock();
+  device_set_timeout(on_timer, 10);
+  usleep(100000);
+  assert_int_equal(timer_fired, 2);
+  host_irq_unlock();
+  for (int i = 0; i < 100 && timer_fired == 2; i++)
+    usleep(10000);
+  assert_int_equal(timer_fired, 3);
+  host_main_unlock();
+}
+
+#else
+
+static void *another_card(void *arg) {
+  int *fresh = arg;
+  // nothing borrowed or scheduled by the card of the main thread is visible here
+  *fresh = apdu_pool_available() == APDU_POOL_SIZE && device_add_background_task(task, 1000) == 0;
+  return NULL;
+}
+
+static void test_card_instances(void **state) {
+  (void)state;
+
+  uint8_t *buffers[APDU_POOL_SIZE];
+  for (int i = 0; i < APDU_POOL_SIZE; i++)
+    buffers[i] = apdu_pool_acquire();
+  assert_null(apdu_pool_acquire());
+  while (device_add_background_task(task, 1000) == 0)
+    ;
+
+  pthread_t thread;
+  int fresh = 0;
+  assert_int_equal(pthread_create(&thread, NULL, another_card, &fresh), 0);
+  assert_int_equal(pthread_join(thread, NULL), 0);
+  assert_int_equal(fresh, 1);
+
+  assert_int_equal(apdu_pool_available(), 0);
+  for (int i = 0; i < APDU_POOL_SIZE; i++)
+    apdu_pool_release(buffers[i]);
+}
+
+#endif
+
+int main() {
+  const struct CMUnitTest tests[] = {
+      cmocka_unit_test(test_background_tasks),
+      cmocka_unit_test(test_ctaphid_queue),
+      cmocka_unit_test(test_spinlock),
+#ifdef HOST_THREADS
+      cmocka_unit_test(test_timer_thread),
+#else
+      cmocka_unit_test(test_card_instances),
+#endif
+  };
+
+  int ret = cmocka_run_group_tests(tests, NULL, NULL);
+
+  return ret;
+}
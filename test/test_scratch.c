@@ -0,0 +1,142 @@
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <cmocka.h>
+
+#include <apdu.h>
+#include <scratch.h>
+#include <string.h>
+
+static int is_zero(const uint8_t *p, size_t len) {
+  for (size_t i = 0; i < len; ++i)
+    if (p[i]) return 0;
+  return 1;
+}
+
+static void test_frames(void **state) {
+  (void)state;
+
+  size_t outer = scratch_begin();
+  uint8_t *a = scratch_alloc(3);
+  uint8_t *b = scratch_alloc(16);
+  assert_non_null(a);
+  assert_non_null(b);
+  // aligned for any type
+  assert_int_equal((uintptr_t)b % 8, 0);
+  assert_true(b >= a + 3);
+  memset(a, 0xAA, 3);
+  memset(b, 0xBB, 16);
+
+  // a nested command, e.g. an APDU processed while CTAP waits for the user
+  size_t inner = scratch_begin();
+  uint8_t *c = scratch_alloc(32);
+  assert_non_null(c);
+  assert_true(c >= b + 16);
+  memset(c, 0xCC, 32);
+  scratch_end(inner);
+  assert_true(is_zero(c, 32));
+  assert_int_equal(b[15], 0xBB);
+
+  // the memory is reused and cleared
+  uint8_t *d = scratch_alloc(32);
+  assert_ptr_equal(d, c);
+  scratch_end(outer);
+  assert_true(is_zero(a, 3));
+  assert_true(is_zero(b, 16));
+  assert_ptr_equal(scratch_alloc(1), a);
+  scratch_end(outer);
+}
+
+static void test_exhausted(void **state) {
+  (void)state;
+
+  size_t mark = scratch_begin();
+  assert_null(scratch_alloc(SCRATCH_SIZE + 1));
+  uint8_t *p = scratch_alloc(SCRATCH_SIZE);
+  assert_non_null(p);
+  assert_null(scratch_alloc(1));
+  assert_int_equal(scratch_peak(), SCRATCH_SIZE);
+  scratch_end(mark);
+  assert_non_null(scratch_alloc(1));
+  scratch_end(mark);
+}
+
+static void test_persist(void **state) {
+  (void)state;
+
+  uint8_t *p = scratch_persist(APPLET_FIDO, 100);
+  assert_non_null(p);
+  assert_int_equal((uintptr_t)p % 8, 0);
+  memset(p, 0x55, 100);
+  assert_ptr_equal(scratch_persisted(APPLET_FIDO), p);
+  assert_null(scratch_persisted(APPLET_PIV));
+  // another owner does not release it
+  scratch_release(APPLET_PIV);
+  assert_ptr_equal(scratch_persisted(APPLET_FIDO), p);
+
+  // the region survives the frames of the following commands, which cannot overlap it
+  size_t mark = scratch_begin();
+  assert_null(scratch_alloc(SCRATCH_SIZE - 100));
+  uint8_t *q = scratch_alloc(SCRATCH_SIZE - 104);
+  assert_non_null(q);
+  assert_true(q + SCRATCH_SIZE - 104 <= p);
+  // nor can a new region overlap the frames
+  assert_null(scratch_persist(APPLET_FIDO, 200));
+  assert_null(scratch_persisted(APPLET_FIDO));
+  scratch_end(mark);
+
+  p = scratch_persist(APPLET_FIDO, 100);
+  assert_non_null(p);
+  memset(p, 0x55, 100);
+  mark = scratch_begin();
+  scratch_alloc(64);
+  scratch_end(mark);
+  assert_int_equal(p[0], 0x55);
+  assert_int_equal(p[99], 0x55);
+
+  // claiming the region releases the previous one
+  uint8_t *r = scratch_persist(APPLET_OPENPGP, 8);
+  assert_non_null(r);
+  assert_null(scratch_persisted(APPLET_FIDO));
+  assert_ptr_equal(scratch_persisted(APPLET_OPENPGP), r);
+  assert_true(is_zero(p, 100 - 8));
+
+  scratch_release(APPLET_OPENPGP);
+  assert_null(scratch_persisted(APPLET_OPENPGP));
+  assert_true(is_zero(r, 8));
+  assert_non_null(scratch_alloc(SCRATCH_SIZE));
+  scratch_end(mark);
+}
+
+static void test_reset(void **state) {
+  (void)state;
+
+  // a command that never closed its frame, and a persistent region
+  scratch_begin();
+  uint8_t *p = scratch_alloc(64);
+  uint8_t *q = scratch_persist(APPLET_FIDO, 64);
+  assert_non_null(p);
+  assert_non_null(q);
+  memset(p, 0xAA, 64);
+  memset(q, 0xBB, 64);
+
+  scratch_reset();
+  assert_true(is_zero(p, 64));
+  assert_true(is_zero(q, 64));
+  assert_null(scratch_persisted(APPLET_FIDO));
+  size_t mark = scratch_begin();
+  assert_int_equal(mark, 0);
+  assert_non_null(scratch_alloc(SCRATCH_SIZE));
+  scratch_end(mark);
+}
+
+int main() {
+  const struct CMUnitTest tests[] = {
+      cmocka_unit_test(test_frames),
+      cmocka_unit_test(test_exhausted),
+      cmocka_unit_test(test_persist),
+      cmocka_unit_test(test_reset),
+  };
+
+  return cmocka_run_group_tests(tests, NULL, NULL);
+}
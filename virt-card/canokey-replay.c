@@ -0,0 +1,260 @@
+// Replays a command record (see record.h) against a fabricated card and reports the latency of every command
+#include "ctaphid.h"
+#include "fabrication.h"
+#include <apdu.h>
+#include <record.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_LFS_PATH "/tmp/canokey-replay-lfs"
+#define MAX_COMMAND_KINDS 256
+
+typedef struct {
+  char name[16];
+  uint32_t count, capacity;
+  uint64_t *samples; // in ns
+} command_stats_t;
+
+static command_stats_t stats[MAX_COMMAND_KINDS];
+static int stats_used;
+static uint32_t reports_sent;
+static FILE *results;
+
+static uint64_t now_ns(void) {
+  struct timespec spec;
+  clock_gettime(CLOCK_MONOTONIC, &spec);
+  return (uint64_t)spec.tv_sec * 1000000000ull + spec.tv_nsec;
+}
+
+static void sleep_until(uint64_t deadline) {
+  uint64_t now = now_ns();
+  if (now >= deadline) return;
+  struct timespec spec = {.tv_sec = (deadline - now) / 1000000000ull, .tv_nsec = (deadline - now) % 1000000000ull};
+  nanosleep(&spec, NULL);
+}
+
+static uint8_t replay_send_report(USBD_HandleTypeDef *pdev, uint8_t *report, uint16_t len) {
+  UNUSED(pdev);
+  UNUSED(report);
+  UNUSED(len);
+  ++reports_sent;
+  // nobody reads the reports, release the slot in the tx ring at once
+  CTAPHID_InEvent();
+  return 0;
+}
+
+static void add_sample(const char *name, uint64_t ns) {
+  int i;
+  for (i = 0; i < stats_used; ++i)
+    if (strcmp(stats[i].name, name) == 0) break;
+  if (i == stats_used) {
+    if (stats_used == MAX_COMMAND_KINDS) return;
+    snprintf(stats[i].name, sizeof(stats[i].name), "%s", name);
+    ++stats_used;
+  }
+  command_stats_t *s = &stats[i];
+  if (s->count == s->capacity) {
+    s->capacity = s->capacity ? s->capacity * 2 : 64;
+    s->samples = realloc(s->samples, s->capacity * sizeof(s->samples[0]));
+  }
+  s->samples[s->count++] = ns;
+}
+
+static int compare_samples(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+static void print_summary(uint64_t wall_ns) {
+  uint64_t all = 0;
+  uint32_t commands = 0;
+  for (int i = 0; i < stats_used; ++i) {
+    command_stats_t *s = &stats[i];
+    uint64_t total = 0;
+    qsort(s->samples, s->count, sizeof(s->samples[0]), compare_samples);
+    for (uint32_t j = 0; j < s->count; ++j)
+      total += s->samples[j];
+    fprintf(results,
+            "{\"command\":\"%s\",\"count\":%u,\"total_us\":%.1f,\"p50_us\":%.1f,\"p90_us\":%.1f,\"p99_us\":%.1f,"
+            "\"max_us\":%.1f}\n",
+            s->name, s->count, total / 1e3, s->samples[(s->count - 1) * 50 / 100] / 1e3,
+            s->samples[(s->count - 1) * 90 / 100] / 1e3, s->samples[(s->count - 1) * 99 / 100] / 1e3,
+            s->samples[s->count - 1] / 1e3);
+    all += total;
+    commands += s->count;
+    free(s->samples);
+  }
+  fprintf(results, "{\"command\":\"all\",\"count\":%u,\"total_us\":%.1f,\"wall_us\":%.1f}\n", commands, all / 1e3,
+          wall_ns / 1e3);
+}
+
+static int copy_file(const char *from, const char *to) {
+  uint8_t buf[4096];
+  size_t n;
+  FILE *in = fopen(from, "rb"), *out = fopen(to, "wb");
+  if (in == NULL || out == NULL) {
+    perror("copy image");
+    if (in) fclose(in);
+    if (out) fclose(out);
+    return -1;
+  }
+  while ((n = fread(buf, 1, sizeof(buf), in)) > 0)
+    fwrite(buf, 1, n, out);
+  fclose(in);
+  return fclose(out);
+}
+
+static void usage(const char *argv0) {
+  fprintf(stderr,
+          "Usage: %s [-t] [-q] [-v] [-i image] [-f lfs file] [-o output] record\n"
+          "  -t  keep the original timing, commands are sent as fast as possible by default\n"
+          "  -q  print the summary only, not every command\n"
+          "  -v  keep the debug messages of the card on stdout\n"
+          "  -i  start from a copy of this littlefs image instead of a freshly fabricated card\n"
+          "  -f  littlefs file of the card, " DEFAULT_LFS_PATH " by default\n"
+          "  -o  write the results to a file instead of stdout\n",
+          argv0);
+}
+
+int main(int argc, char *argv[]) {
+  const char *image = NULL, *lfs_path = DEFAULT_LFS_PATH, *output = NULL;
+  int original_timing = 0, quiet = 0, verbose = 0, opt;
+  while ((opt = getopt(argc, argv, "tqvi:f:o:h")) != -1) {
+    switch (opt) {
+    case 't':
+      original_timing = 1;
+      break;
+    case 'q':
+      quiet = 1;
+      break;
+    case 'v':
+      verbose = 1;
+      break;
+    case 'i':
+      image = optarg;
+      break;
+    case 'f':
+      lfs_path = optarg;
+      break;
+    case 'o':
+      output = optarg;
+      break;
+    default:
+      usage(argv[0]);
+      return opt == 'h' ? 0 : 1;
+    }
+  }
+  if (optind + 1 != argc) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  FILE *fp = fopen(argv[optind], "rb");
+  if (fp == NULL) {
+    perror("open record");
+    return 1;
+  }
+  uint8_t magic[5];
+  if (fread(magic, 1, sizeof(magic), fp) != sizeof(magic) || memcmp(magic, RECORD_MAGIC, 4) != 0 ||
+      magic[4] != RECORD_VERSION) {
+    fprintf(stderr, "%s is not a command record of version %d\n", argv[optind], RECORD_VERSION);
+    return 1;
+  }
+
+  results = output ? fopen(output, "w") : fdopen(dup(STDOUT_FILENO), "w");
+  if (results == NULL) {
+    perror("output");
+    return 1;
+  }
+  // debug messages of the card go to stdout, keep them out of the results unless asked for
+  if (!verbose) freopen("/dev/null", "w", stdout);
+
+  if (image != NULL) {
+    if (copy_file(image, lfs_path) < 0) return 1;
+  } else {
+    unlink(lfs_path);
+  }
+  card_fabrication_procedure(lfs_path);
+  CTAPHID_Init(replay_send_report);
+
+  static uint8_t command[APDU_BUFFER_SIZE + 9], apdu_buffer[APDU_BUFFER_SIZE];
+  CAPDU capdu = {.data = apdu_buffer};
+  RAPDU rapdu = {.data = apdu_buffer};
+  record_header_t header;
+  uint32_t index = 0, first_timestamp = 0;
+  struct {
+    char name[16];
+    uint32_t index, timestamp, reports;
+    uint64_t start;
+    uint8_t pending;
+  } message = {0};
+  uint64_t replay_start = now_ns();
+  int ret = 0;
+  while (fread(&header, sizeof(header), 1, fp) == 1) {
+    if (header.len > sizeof(command) || fread(command, 1, header.len, fp) != header.len) {
+      fprintf(stderr, "record %u is truncated\n", index);
+      ret = 1;
+      break;
+    }
+    if (index == 0) first_timestamp = header.timestamp;
+    if (original_timing) sleep_until(replay_start + (uint64_t)(header.timestamp - first_timestamp) * 1000);
+
+    char name[16];
+    uint64_t start, elapsed;
+    if (header.interface == RECORD_APDU) {
+      if (build_capdu(&capdu, command, header.len) < 0) {
+        fprintf(stderr, "record %u is not a valid APDU\n", index++);
+        continue;
+      }
+      snprintf(name, sizeof(name), "apdu %02X%02X", command[0], command[1]);
+      start = now_ns();
+      process_apdu(&capdu, &rapdu);
+      elapsed = now_ns() - start;
+      if (!quiet)
+        fprintf(results,
+                "{\"index\":%u,\"timestamp_us\":%u,\"command\":\"%s\",\"latency_us\":%.1f,\"sw\":\"%04X\"}\n",
+                index, header.timestamp - first_timestamp, name, elapsed / 1e3, rapdu.sw);
+    } else if (header.interface == RECORD_CTAPHID && header.len == HID_RPT_SIZE) {
+      // a message is timed from its init frame until the card has answered it, the continuation frames belong to it
+      CTAPHID_FRAME *frame = (CTAPHID_FRAME *)command;
+      if (FRAME_TYPE(*frame) == TYPE_INIT) {
+        snprintf(message.name, sizeof(message.name), "ctaphid %02X", frame->init.cmd);
+        message.index = index;
+        message.timestamp = header.timestamp - first_timestamp;
+        message.reports = reports_sent;
+        message.start = now_ns();
+        message.pending = 1;
+      }
+      CTAPHID_OutEvent(command);
+      CTAPHID_Loop(0);
+      if (!message.pending || reports_sent == message.reports) {
+        ++index;
+        continue;
+      }
+      message.pending = 0;
+      memcpy(name, message.name, sizeof(name));
+      elapsed = now_ns() - message.start;
+      if (!quiet)
+        fprintf(results,
+                "{\"index\":%u,\"timestamp_us\":%u,\"command\":\"%s\",\"latency_us\":%.1f,\"reports\":%u}\n",
+                message.index, message.timestamp, name, elapsed / 1e3, reports_sent - message.reports);
+    } else {
+      fprintf(stderr, "record %u has an unknown interface %u\n", index++, header.interface);
+      continue;
+    }
+    add_sample(name, elapsed);
+    ++index;
+  }
+  // message timeouts
+  CTAPHID_Loop(0);
+  fclose(fp);
+
+  print_summary(now_ns() - replay_start);
+  fclose(results);
+  return ret;
+}
@@ -1,3 +1,4 @@
+#include "dummy.h"
 #include "device.h"
 #include "usbd_core.h"
 #include <time.h>
@@ -17,14 +18,32 @@ USBD_StatusTypeDef USBD_LL_StallEP(USBD_HandleTypeDef *pdev, uint8_t ep_addr) {
 USBD_StatusTypeDef USBD_LL_ClearStallEP(USBD_HandleTypeDef *pdev, uint8_t ep_addr) { return USBD_OK; }
 uint8_t USBD_LL_IsStallEP(USBD_HandleTypeDef *pdev, uint8_t ep_addr) { return 0; }
 USBD_StatusTypeDef USBD_LL_SetUSBAddress(USBD_HandleTypeDef *pdev, uint8_t dev_addr) { return USBD_OK; }
-USBD_StatusTypeDef USBD_LL_PrepareReceive(USBD_HandleTypeDef *pdev, uint8_t ep_addr, uint8_t *pbuf, uint16_t size) {
+// Targets feeding the OUT endpoints provide their own
+__weak USBD_StatusTypeDef USBD_LL_PrepareReceive(USBD_HandleTypeDef *pdev, uint8_t ep_addr, uint8_t *pbuf,
+                                                 uint16_t size) {
   return USBD_OK;
 }
-USBD_StatusTypeDef USBD_LL_Transmit(USBD_HandleTypeDef *pdev, uint8_t ep_num, const uint8_t *pbuf, uint16_t size) {
+// Targets reading the IN endpoints provide their own
+__weak USBD_StatusTypeDef USBD_LL_Transmit(USBD_HandleTypeDef *pdev, uint8_t ep_num, const uint8_t *pbuf,
+                                           uint16_t size) {
   return USBD_OK;
 }
 uint32_t USBD_LL_GetRxDataSize(USBD_HandleTypeDef *pdev, uint8_t ep_addr) { return 0; }
+
+static __card_local uint8_t clock_simulated;
+static __card_local uint32_t simulated_tick;
+
+void virt_clock_simulate(uint32_t start) {
+  clock_simulated = 1;
+  simulated_tick = start;
+}
+void virt_clock_advance(uint32_t ms) { simulated_tick += ms; }
+
 void device_delay(int ms) {
+  if (clock_simulated) {
+    simulated_tick += ms;
+    return;
+  }
   struct timespec spec = {.tv_sec = ms / 1000, .tv_nsec = ms % 1000 * 1000000ll};
   nanosleep(&spec, NULL);
 }
@@ -32,13 +51,17 @@ uint32_t device_get_tick(void) {
   uint64_t ms, s;
   struct timespec spec;
 
+  if (clock_simulated) return simulated_tick;
+
   clock_gettime(CLOCK_MONOTONIC, &spec);
 
   s = spec.tv_sec;
   ms = spec.tv_nsec / 1000000;
   return (uint32_t)(s * 1000 + ms);
 }
-void device_disable_irq(void) {}
-void device_enable_irq(void) {}
-void device_set_timeout(void (*callback)(void), uint16_t timeout) {}
-void fm_write_eeprom(uint16_t addr, uint8_t *buf, uint8_t len) { return ; }
+// host-platform.c provides real ones
+__weak void device_disable_irq(void) {}
+__weak void device_enable_irq(void) {}
+// Targets emulating the timer or the NFC chip provide their own
+__weak void device_set_timeout(void (*callback)(void), uint16_t timeout) {}
+__weak void fm_write_eeprom(uint16_t addr, uint8_t *buf, uint8_t len) { return ; }
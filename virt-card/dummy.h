@@ -0,0 +1,10 @@
+#pragma once
+
+#include <stdint.h>
+
+/**
+ * Switch device_get_tick to a simulated clock starting from start (in ms).
+ * device_delay then advances the clock instead of sleeping.
+ */
+void virt_clock_simulate(uint32_t start);
+void virt_clock_advance(uint32_t ms);
@@ -1,3 +1,4 @@
+#include "fabrication.h"
 #include "oath.h"
 #include "openpgp.h"
 #include "piv.h"
@@ -9,8 +10,8 @@
 #include <fs.h>
 #include <lfs.h>
 
-static struct lfs_config cfg;
-static lfs_filebd_t bd;
+static __card_local struct lfs_config cfg;
+static __card_local lfs_filebd_t bd;
 
 uint8_t private_key[] = {0xD9, 0x5C, 0x12, 0x15, 0xD1, 0x0A, 0xBB, 0x57, 0x91, 0xB6, 0x47,
                          0x52, 0xDF, 0x9D, 0x25, 0x3C, 0xA4, 0x17, 0x31, 0x37, 0x5D, 0x41,
@@ -87,7 +88,11 @@ int card_fabrication_procedure(const char * lfs_root) {
   cfg.lookahead_size = 16;
   lfs_filebd_create(&cfg, lfs_root);
 
-  fs_init(&cfg);
+  return card_fabrication_procedure_with_config(&cfg);
+}
+
+int card_fabrication_procedure_with_config(struct lfs_config *lfs_cfg) {
+  fs_init(lfs_cfg);
   admin_install();
   oath_install(0);
 
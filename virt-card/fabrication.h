@@ -1,3 +1,7 @@
 #pragma once
 
-int card_fabrication_procedure(const char *lfs_root);
\ No newline at end of file
+#include <lfs.h>
+
+int card_fabrication_procedure(const char *lfs_root);
+// Same as above on a block device set up by the caller, cfg has to outlive the card
+int card_fabrication_procedure_with_config(struct lfs_config *cfg);
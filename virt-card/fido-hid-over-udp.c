@@ -5,8 +5,19 @@
 // http://opensource.org/licenses/MIT>, at your option. This file may not be
 // copied, modified, or distributed except according to those terms.
 
+#define _GNU_SOURCE // recvmmsg
+// project headers first, the byte order macros of the system headers then replace those of common.h silently
+#include "ctaphid.h"
+#include "device.h"
+#include "fabrication.h"
+#include "host-platform.h"
+#include "trace-json.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdint.h>
@@ -19,8 +30,10 @@
 #include <time.h>
 #include <unistd.h>
 
-#include "ctaphid.h"
-#include "fabrication.h"
+#define RECV_BATCH 16 // datagrams taken by one recvmmsg
+
+static struct in_addr bind_addr = {.s_addr = INADDR_ANY};
+static uint16_t bind_port = 8111, reply_port = 7112;
 
 static int udp_server() {
   static bool run_already = false;
@@ -37,14 +50,6 @@ static int udp_server() {
   flags |= FD_CLOEXEC;
   fcntl(fd, F_SETFD, flags);
 
-  struct timeval read_timeout;
-  read_timeout.tv_sec = 0;
-  read_timeout.tv_usec = 10;
-  if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &read_timeout, sizeof(struct timeval)) != 0) {
-    perror("setsockopt");
-    exit(1);
-  }
-
   int reuseaddr = 1;
   if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuseaddr, sizeof(reuseaddr)) != 0) {
     perror("setsockopt");
@@ -54,8 +59,8 @@ static int udp_server() {
   struct sockaddr_in serveraddr;
   memset(&serveraddr, 0, sizeof(serveraddr));
   serveraddr.sin_family = AF_INET;
-  serveraddr.sin_port = htons(8111);
-  serveraddr.sin_addr.s_addr = htonl(INADDR_ANY);
+  serveraddr.sin_port = htons(bind_port);
+  serveraddr.sin_addr = bind_addr;
 
   if (bind(fd, (struct sockaddr *)&serveraddr, sizeof(serveraddr)) < 0) {
     perror("bind failed");
@@ -64,35 +69,51 @@ static int udp_server() {
   return fd;
 }
 
-static int udp_recv(int fd, uint8_t *buf, int size) {
+// SIGINT and SIGTERM are only delivered while waiting for a datagram, see quit
+static sigset_t wait_mask;
 
-  fd_set input;
-  FD_ZERO(&input);
-  FD_SET(fd, &input);
-  struct timeval timeout;
-  timeout.tv_sec = 0;
-  timeout.tv_usec = 100;
-  int n = select(fd + 1, &input, NULL, NULL, &timeout);
+// Waits until a datagram arrives or the deadline of CTAPHID passes, then takes every datagram ready in one call
+static int udp_recv(int fd, uint8_t buf[][HID_RPT_SIZE], int *length, uint32_t deadline) {
+  struct timespec timeout, *timeout_ptr = NULL;
+  if (deadline != UINT32_MAX) {
+    uint32_t now = device_get_tick(), ms = (int32_t)(deadline - now) > 0 ? deadline - now : 0;
+    timeout.tv_sec = ms / 1000;
+    timeout.tv_nsec = (ms % 1000) * 1000000;
+    timeout_ptr = &timeout;
+  }
+  struct pollfd pfd = {.fd = fd, .events = POLLIN};
+  int n = ppoll(&pfd, 1, timeout_ptr, &wait_mask);
+  if (n == -1 && errno == EINTR) return 0;
   if (n == -1) {
-    perror("select\n");
+    perror("poll");
     exit(1);
   } else if (n == 0)
     return 0;
-  if (!FD_ISSET(fd, &input)) {
+
+  struct mmsghdr msgs[RECV_BATCH];
+  struct iovec iovecs[RECV_BATCH];
+  memset(msgs, 0, sizeof(msgs));
+  for (int i = 0; i < RECV_BATCH; i++) {
+    iovecs[i].iov_base = buf[i];
+    iovecs[i].iov_len = HID_RPT_SIZE;
+    msgs[i].msg_hdr.msg_iov = &iovecs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
   }
-  int length = recvfrom(fd, buf, size, 0, NULL, 0);
-  if (length < 0) {
-    perror("recvfrom failed");
+  n = recvmmsg(fd, msgs, RECV_BATCH, MSG_DONTWAIT, NULL);
+  if (n < 0) {
+    perror("recvmmsg failed");
     exit(1);
   }
-  return length;
+  for (int i = 0; i < n; i++)
+    length[i] = msgs[i].msg_len;
+  return n;
 }
 
 static void udp_send(int fd, uint8_t *buf, int size) {
   struct sockaddr_in serveraddr;
   memset(&serveraddr, 0, sizeof(serveraddr));
   serveraddr.sin_family = AF_INET;
-  serveraddr.sin_port = htons(7112);
+  serveraddr.sin_port = htons(reply_port);
   serveraddr.sin_addr.s_addr = htonl(0x7f000001); // (127.0.0.1)
 
   if (sendto(fd, buf, size, 0, (struct sockaddr *)&serveraddr, sizeof(serveraddr)) < 0) {
@@ -104,36 +125,93 @@ static void udp_send(int fd, uint8_t *buf, int size) {
 static int current_fd;
 static uint8_t udp_send_current_fd(USBD_HandleTypeDef *pdev, uint8_t *report, uint16_t len) {
   // printf("udp_send_current_fd %hu\n", len);
+  host_irq_lock();
   udp_send(current_fd, report, len);
+  // the datagram has left, release the slot in the tx ring
+  CTAPHID_InEvent();
+  host_irq_unlock();
   return 0;
 }
 
-int main() {
+// The main loop returns once the card is idle, so that the handlers registered with atexit run outside the signal
+// handler. The signals are blocked elsewhere, so the flag cannot be set between its check and the wait.
+static volatile sig_atomic_t quitting;
+static void quit(int sig) {
+  UNUSED(sig);
+  quitting = 1;
+}
+
+int main(int argc, char **argv) {
+  int opt;
+  while ((opt = getopt(argc, argv, "b:p:r:")) != -1) {
+    if (opt == 'b' && inet_pton(AF_INET, optarg, &bind_addr) == 1) {
+      continue;
+    } else if (opt == 'p' && atoi(optarg) > 0 && atoi(optarg) < 65536) {
+      bind_port = atoi(optarg);
+    } else if (opt == 'r' && atoi(optarg) > 0 && atoi(optarg) < 65536) {
+      reply_port = atoi(optarg);
+    } else {
+      fprintf(stderr,
+              "Usage: %s [-b address] [-p port] [-r port]\n"
+              "  -b  address to listen on, 0.0.0.0 by default\n"
+              "  -p  port to listen on, 8111 by default\n"
+              "  -r  port on 127.0.0.1 the reports are sent to, 7112 by default\n",
+              argv[0]);
+      return 1;
+    }
+  }
+
+  signal(SIGINT, quit);
+  signal(SIGTERM, quit);
+  sigset_t quit_signals;
+  sigemptyset(&quit_signals);
+  sigaddset(&quit_signals, SIGINT);
+  sigaddset(&quit_signals, SIGTERM);
+  // the mask survives the exec of MAGIC REBOOT, so the signals are removed from it rather than restored
+  sigprocmask(SIG_BLOCK, &quit_signals, &wait_mask);
+  sigdelset(&wait_mask, SIGINT);
+  sigdelset(&wait_mask, SIGTERM);
+  trace_dump_on_exit();
   current_fd = udp_server();
+  host_main_lock();
   card_fabrication_procedure("/tmp/lfs-root");
   CTAPHID_Init(udp_send_current_fd);
-  for (;;) {
-    uint8_t buf[HID_RPT_SIZE];
-    int length = udp_recv(current_fd, buf, sizeof(buf));
-    if (length > 0) {
-      // printf("udp_recv %d\n", length);
+  host_main_unlock();
+  while (!quitting) {
+    uint8_t buf[RECV_BATCH][HID_RPT_SIZE];
+    int length[RECV_BATCH];
+    host_main_lock();
+    uint32_t deadline = CTAPHID_NextDeadline();
+    host_main_unlock();
+    int n = udp_recv(current_fd, buf, length, deadline);
+    for (int i = 0; i < n; i++) {
+      if (length[i] <= 0) continue;
+      // printf("udp_recv %d\n", length[i]);
       uint8_t magic_cmd[] = "\xac\x10\x52\xca\x95\xe5\x69\xde\x69\xe0\x2e\xbf"
                             "\xf3\x33\x48\x5f\x13\xf9\xb2\xda\x34\xc5\xa8\xa3"
                             "\x40\x52\x66\x97\xa9\xab\x2e\x0b\x39\x4d\x8d\x04"
                             "\x97\x3c\x13\x40\x05\xbe\x1a\x01\x40\xbf\xf6\x04"
                             "\x5b\xb2\x6e\xb7\x7a\x73\xea\xa4\x78\x13\xf6\xb4"
                             "\x9a\x72\x50\xdc";
-      if (memcmp(magic_cmd, buf, 64) == 0) {
+      if (memcmp(magic_cmd, buf[i], 64) == 0) {
         printf("MAGIC REBOOT command recieved!\r\n");
         // exit(0);
-        char *const argv[] = {"fido-hid-over-udp", NULL};
         int ret = execv("/proc/self/exe", argv);
         printf("ERROR exec %d", ret);
         return 0;
       }
-      CTAPHID_OutEvent(buf);
+      // one frame at a time, so that the receive queue of CTAPHID never fills up
+      host_irq_lock();
+      CTAPHID_OutEvent(buf[i]);
+      host_irq_unlock();
+      host_main_lock();
+      CTAPHID_Loop(0);
+      host_main_unlock();
     }
+    // message timeouts
+    host_main_lock();
     CTAPHID_Loop(0);
+    host_main_unlock();
   }
   return 0;
 }
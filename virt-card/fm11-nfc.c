@@ -0,0 +1,489 @@
+/*
+ * Host-side emulation of the FM11NC08 NFC front-end, driven by a scripted PCD (the reader).
+ *
+ * The SPI register and FIFO protocol used by interfaces/NFC/fm.c is decoded against an emulated chip, so that
+ * nfc_handler and nfc_loop run unmodified. The PCD speaks ISO 14443-4: I-block chaining in both directions,
+ * R(ACK), R(NAK) and S(WTX). device_set_timeout is backed by SIGALRM, whose handler only marks the timer expired.
+ * The callback runs like a timer IRQ at the next device_yield of the command being executed, so the long commands
+ * that yield are the ones extended with S(WTX).
+ *
+ * Usage: fm11-nfc [-f FSDI] [-b KBPS] [-n N] [-r LFS_ROOT] [-v] [TRACE]
+ *   -f FSDI      FSDI sent in RATS, 8 (256 bytes) by default
+ *   -b KBPS      bit rate used to estimate the time on air, 106 by default
+ *   -n N         pretend every Nth I-block from the card is corrupted and ask for it again with R(NAK)
+ *   -v           print the APDUs
+ * TRACE contains one C-APDU in hex per line, '#' starts a comment. It is read from stdin if omitted.
+ * The block counts and the estimated latency are printed for every APDU.
+ */
+#include "apdu.h"
+#include "device.h"
+#include "fabrication.h"
+#include "nfc.h"
+#include <ctype.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#define EEPROM_SIZE 1024
+#define CRC_SIZE 2
+// Frame delay time between two frames, 1172 / fc
+#define FDT_US 86
+#define CARRIER_KHZ 13560
+
+enum { SPI_NONE, SPI_REG_READ, SPI_REG_WRITE, SPI_FIFO_READ, SPI_FIFO_WRITE, SPI_EEPROM_READ, SPI_EEPROM_WRITE };
+
+typedef struct {
+  uint32_t i_blocks, r_blocks, s_blocks, naks;
+  uint32_t bytes;
+  uint64_t air_us, card_us;
+} stats_t;
+
+static uint8_t regs[0x20], eeprom[EEPROM_SIZE];
+static uint8_t fifo[NFC_FIFO_SIZE], fifo_cnt;
+static uint8_t spi_mode, spi_first, spi_addr_bytes;
+static uint16_t spi_addr;
+static uint8_t tx_requested;
+
+static void (*timeout_callback)(void);
+static volatile sig_atomic_t timer_expired;
+
+static uint8_t card_frame[NFC_MAX_FRAME_SIZE];
+static uint16_t card_frame_len;
+static uint16_t card_fsc, pcd_fsd;
+static uint8_t pcd_block_number;
+static uint32_t bit_rate = 106, nak_period, i_blocks_received;
+static stats_t stats;
+static int verbose;
+
+uint8_t is_nfc(void) { return 1; }
+void set_nfc_state(uint8_t state) { UNUSED(state); }
+
+/* ---------------------------------------------------------------- */
+/* FM11 chip                                                        */
+/* ---------------------------------------------------------------- */
+
+static uint8_t reg_read(uint8_t reg) {
+  uint8_t val;
+  switch (reg) {
+  case REG_FIFO_WORDCNT:
+    return fifo_cnt;
+  case REG_MAIN_IRQ:
+  case REG_FIFO_IRQ:
+  case REG_AUX_IRQ:
+    // interrupt flags are cleared on read
+    val = regs[reg];
+    regs[reg] = 0;
+    return val;
+  default:
+    return regs[reg & 0x1F];
+  }
+}
+
+static void reg_write(uint8_t reg, uint8_t val) {
+  switch (reg) {
+  case REG_FIFO_FLUSH:
+    fifo_cnt = 0;
+    break;
+  case REG_RF_TXEN:
+    if (val == 0x55) tx_requested = 1;
+    break;
+  default:
+    regs[reg & 0x1F] = val;
+  }
+}
+
+static uint8_t fifo_pop(void) {
+  if (fifo_cnt == 0) {
+    regs[REG_FIFO_IRQ] |= FIFO_IRQ_OVERFLOW;
+    return 0;
+  }
+  uint8_t val = fifo[0];
+  memmove(fifo, fifo + 1, --fifo_cnt);
+  return val;
+}
+
+static void fifo_push(uint8_t val) {
+  if (fifo_cnt == NFC_FIFO_SIZE) {
+    regs[REG_FIFO_IRQ] |= FIFO_IRQ_OVERFLOW;
+    return;
+  }
+  fifo[fifo_cnt++] = val;
+}
+
+void fm_nss_low(void) {
+  spi_mode = SPI_NONE;
+  spi_first = 1;
+}
+
+void fm_nss_high(void) { spi_mode = SPI_NONE; }
+
+static void spi_command(uint8_t cmd) {
+  spi_addr_bytes = 0;
+  if (cmd == 0x80) {
+    spi_mode = SPI_FIFO_WRITE;
+  } else if (cmd == 0xA0) {
+    spi_mode = SPI_FIFO_READ;
+  } else if (cmd == 0xCE) {
+    spi_mode = SPI_NONE; // EEPROM write unlock, followed by 0x55
+  } else if ((cmd & 0xE0) == 0x00) {
+    spi_mode = SPI_REG_WRITE;
+    spi_addr = cmd;
+  } else if ((cmd & 0xE0) == 0x20) {
+    spi_mode = SPI_REG_READ;
+    spi_addr = cmd & 0x1F;
+  } else if ((cmd & 0xE0) == 0x40 || (cmd & 0xE0) == 0x60) {
+    spi_mode = (cmd & 0xE0) == 0x40 ? SPI_EEPROM_WRITE : SPI_EEPROM_READ;
+    spi_addr = (cmd & 0x03) << 8;
+    spi_addr_bytes = 1; // the low byte of the address follows
+  } else {
+    spi_mode = SPI_NONE;
+  }
+}
+
+void fm_transmit(uint8_t *buf, uint8_t len) {
+  for (int i = 0; i < len; ++i) {
+    if (spi_first) {
+      spi_first = 0;
+      spi_command(buf[i]);
+      continue;
+    }
+    if (spi_addr_bytes) {
+      spi_addr |= buf[i];
+      spi_addr_bytes = 0;
+      continue;
+    }
+    switch (spi_mode) {
+    case SPI_REG_WRITE:
+      reg_write(spi_addr++, buf[i]);
+      break;
+    case SPI_FIFO_WRITE:
+      fifo_push(buf[i]);
+      break;
+    case SPI_EEPROM_WRITE:
+      eeprom[spi_addr++ % EEPROM_SIZE] = buf[i];
+      break;
+    }
+  }
+}
+
+void fm_receive(uint8_t *buf, uint8_t len) {
+  for (int i = 0; i < len; ++i) {
+    switch (spi_mode) {
+    case SPI_REG_READ:
+      buf[i] = reg_read(spi_addr++);
+      break;
+    case SPI_FIFO_READ:
+      buf[i] = fifo_pop();
+      break;
+    case SPI_EEPROM_READ:
+      buf[i] = eeprom[spi_addr++ % EEPROM_SIZE];
+      break;
+    default:
+      buf[i] = 0xFF;
+    }
+  }
+}
+
+// Every event is latched, only the ones left unmasked interrupt the MCU
+static void raise_irq(uint8_t main_irq, uint8_t fifo_irq, uint8_t aux_irq) {
+  regs[REG_FIFO_IRQ] |= fifo_irq;
+  regs[REG_AUX_IRQ] |= aux_irq;
+  if (fifo_irq & ~regs[REG_FIFO_IRQ_MASK]) main_irq |= MAIN_IRQ_FIFO;
+  if (aux_irq & ~regs[REG_AUX_IRQ_MASK]) main_irq |= MAIN_IRQ_AUX;
+  regs[REG_MAIN_IRQ] |= main_irq;
+  if (main_irq & ~regs[REG_MAIN_IRQ_MASK]) nfc_handler();
+}
+
+/* ---------------------------------------------------------------- */
+/* RF link                                                          */
+/* ---------------------------------------------------------------- */
+
+static uint16_t crc_a(const uint8_t *data, uint16_t len) {
+  uint16_t crc = 0x6363;
+  for (uint16_t i = 0; i < len; ++i) {
+    uint8_t b = data[i] ^ (uint8_t)crc;
+    b ^= b << 4;
+    crc = (crc >> 8) ^ ((uint16_t)b << 8) ^ ((uint16_t)b << 3) ^ (b >> 4);
+  }
+  return crc;
+}
+
+// 9 bits (with parity) per byte, start and end of frame, each bit takes 128 / fc at 106 kbps
+static void account_frame(const uint8_t *frame, uint16_t len) {
+  uint64_t bits = (uint64_t)(len + CRC_SIZE) * 9 + 2;
+  stats.air_us += bits * 128 * 1000 * 106 / bit_rate / CARRIER_KHZ + FDT_US;
+  stats.bytes += len + CRC_SIZE;
+  switch (frame[0] & PCB_MASK) {
+  case PCB_I_BLOCK:
+    ++stats.i_blocks;
+    break;
+  case PCB_R_BLOCK:
+    ++stats.r_blocks;
+    if ((frame[0] & R_BLOCK_MASK) == R_NAK) ++stats.naks;
+    break;
+  default:
+    ++stats.s_blocks;
+  }
+}
+
+// PCD -> card: the frame goes through the FIFO, which is drained by the card when the water level is reached
+static void send_to_card(const uint8_t *frame, uint16_t len) {
+  uint8_t air[NFC_MAX_FRAME_SIZE + CRC_SIZE];
+  memcpy(air, frame, len);
+  uint16_t crc = crc_a(frame, len);
+  air[len] = LO(crc);
+  air[len + 1] = HI(crc);
+  account_frame(frame, len);
+
+  for (uint16_t pos = 0; pos < len + CRC_SIZE; ++pos) {
+    if (fifo_cnt == NFC_FIFO_SIZE) {
+      raise_irq(0, FIFO_IRQ_OVERFLOW, 0);
+      return;
+    }
+    fifo_push(air[pos]);
+    if (fifo_cnt == NFC_FIFO_SIZE - NFC_FIFO_WATER_LEVEL + 1) raise_irq(0, FIFO_IRQ_WATER_LEVEL, 0);
+  }
+  raise_irq(MAIN_IRQ_RX_DONE, 0, 0);
+}
+
+// card -> PCD: the FIFO is emptied on air until the card stops refilling it
+static int receive_from_card(void) {
+  if (!tx_requested) return 0;
+  tx_requested = 0;
+  card_frame_len = 0;
+  while (fifo_cnt > 0) {
+    uint8_t val = fifo_pop();
+    if (card_frame_len < sizeof(card_frame)) card_frame[card_frame_len++] = val;
+    if (fifo_cnt == NFC_FIFO_WATER_LEVEL - 1) raise_irq(0, FIFO_IRQ_WATER_LEVEL, 0);
+  }
+  raise_irq(MAIN_IRQ_TX_DONE, 0, 0);
+  if (card_frame_len == 0) return 0;
+  account_frame(card_frame, card_frame_len);
+  if (card_frame_len > pcd_fsd - CRC_SIZE) fprintf(stderr, "card frame of %u bytes exceeds FSD\n", card_frame_len);
+  return 1;
+}
+
+static int is_wtx_request(void) { return card_frame_len == 2 && card_frame[0] == S_WTX; }
+
+/* ---------------------------------------------------------------- */
+/* Timer                                                            */
+/* ---------------------------------------------------------------- */
+
+void device_set_timeout(void (*callback)(void), uint16_t timeout) {
+  struct itimerval timer = {0};
+  timeout_callback = callback;
+  if (callback != NULL) {
+    timer.it_value.tv_sec = timeout / 1000;
+    timer.it_value.tv_usec = timeout % 1000 * 1000;
+  }
+  setitimer(ITIMER_REAL, &timer, NULL);
+  // an expiry of the previous timer is stale
+  timer_expired = 0;
+}
+
+static void alarm_handler(int sig) {
+  UNUSED(sig);
+  timer_expired = 1;
+}
+
+// a background task, see device_yield
+static void run_timer(void) {
+  if (!timer_expired) return;
+  timer_expired = 0;
+  void (*callback)(void) = timeout_callback;
+  if (callback == NULL) return;
+  timeout_callback = NULL;
+  callback();
+  // the PCD confirms S(WTX) right away
+  if (receive_from_card() && is_wtx_request()) {
+    if (verbose) printf("  S(WTX) WTXM=%u\n", card_frame[1]);
+    send_to_card(card_frame, card_frame_len);
+  }
+}
+
+/* ---------------------------------------------------------------- */
+/* PCD                                                              */
+/* ---------------------------------------------------------------- */
+
+static uint64_t now_us(void) {
+  struct timespec spec;
+  clock_gettime(CLOCK_MONOTONIC, &spec);
+  return (uint64_t)spec.tv_sec * 1000000 + spec.tv_nsec / 1000;
+}
+
+static uint16_t frame_size(uint8_t fsi) {
+  static const uint16_t table[] = {16, 24, 32, 40, 48, 64, 96, 128, 256};
+  return fsi < sizeof(table) / sizeof(table[0]) ? table[fsi] : 256;
+}
+
+static int transceive(const uint8_t *frame, uint16_t len) {
+  send_to_card(frame, len);
+  uint64_t start = now_us();
+  nfc_loop();
+  stats.card_us += now_us() - start;
+  if (!receive_from_card()) {
+    fprintf(stderr, "card is mute after PCB %02X\n", frame[0]);
+    return -1;
+  }
+  return 0;
+}
+
+// Receive an I-block from the card, asking for it again with R(NAK) from time to time
+static int receive_i_block(void) {
+  while ((card_frame[0] & PCB_MASK) == PCB_I_BLOCK && nak_period != 0 && ++i_blocks_received % nak_period == 0) {
+    uint8_t nak = R_NAK | pcd_block_number;
+    if (transceive(&nak, 1) < 0) return -1;
+  }
+  if ((card_frame[0] & PCB_MASK) != PCB_I_BLOCK || (card_frame[0] & 1) != pcd_block_number) {
+    fprintf(stderr, "unexpected PCB %02X\n", card_frame[0]);
+    return -1;
+  }
+  pcd_block_number ^= 1;
+  return 0;
+}
+
+static int pcd_exchange(const uint8_t *capdu, uint16_t len, uint8_t *rapdu, uint16_t *rapdu_len) {
+  uint8_t frame[NFC_MAX_FRAME_SIZE];
+  uint16_t max_inf = card_fsc - NFC_FRAME_OVERHEAD, sent = 0;
+
+  for (;;) {
+    uint16_t n = MIN(len - sent, max_inf);
+    frame[0] = PCB_I_BLOCK | 0x02 | pcd_block_number;
+    if (sent + n < len) frame[0] |= PCB_I_CHAINING;
+    memcpy(frame + 1, capdu + sent, n);
+    if (transceive(frame, n + 1) < 0) return -1;
+    sent += n;
+    if (sent == len) break;
+    if ((card_frame[0] & R_BLOCK_MASK) != R_ACK || (card_frame[0] & 1) != pcd_block_number) {
+      fprintf(stderr, "expect R(ACK), got PCB %02X\n", card_frame[0]);
+      return -1;
+    }
+    pcd_block_number ^= 1;
+  }
+
+  *rapdu_len = 0;
+  for (;;) {
+    if (receive_i_block() < 0) return -1;
+    uint16_t n = card_frame_len - 1;
+    if (*rapdu_len + n > APDU_BUFFER_SIZE + 2) return -1;
+    memcpy(rapdu + *rapdu_len, card_frame + 1, n);
+    *rapdu_len += n;
+    if (!(card_frame[0] & PCB_I_CHAINING)) break;
+    frame[0] = R_ACK | pcd_block_number;
+    if (transceive(frame, 1) < 0) return -1;
+  }
+  return 0;
+}
+
+static int parse_hex(const char *line, uint8_t *buf, uint16_t size) {
+  uint16_t len = 0;
+  int nibble = -1;
+  for (const char *p = line; *p && *p != '#'; ++p) {
+    if (isspace((unsigned char)*p)) continue;
+    if (!isxdigit((unsigned char)*p) || len == size) return -1;
+    int v = isdigit((unsigned char)*p) ? *p - '0' : tolower((unsigned char)*p) - 'a' + 10;
+    if (nibble < 0) {
+      nibble = v;
+    } else {
+      buf[len++] = nibble << 4 | v;
+      nibble = -1;
+    }
+  }
+  return nibble < 0 ? len : -1;
+}
+
+static void print_hex_line(const char *prefix, const uint8_t *buf, uint16_t len) {
+  printf("%s", prefix);
+  for (uint16_t i = 0; i < len; ++i)
+    printf("%02X", buf[i]);
+  printf("\n");
+}
+
+int main(int argc, char *argv[]) {
+  const char *lfs_root = "/tmp/lfs-root";
+  uint8_t fsdi = 8;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "f:b:n:r:v")) != -1) {
+    switch (opt) {
+    case 'f':
+      fsdi = atoi(optarg);
+      break;
+    case 'b':
+      bit_rate = atoi(optarg);
+      break;
+    case 'n':
+      nak_period = atoi(optarg);
+      break;
+    case 'r':
+      lfs_root = optarg;
+      break;
+    case 'v':
+      verbose = 1;
+      break;
+    default:
+      fprintf(stderr, "Usage: %s [-f FSDI] [-b KBPS] [-n N] [-r LFS_ROOT] [-v] [TRACE]\n", argv[0]);
+      return 1;
+    }
+  }
+  if (bit_rate == 0) bit_rate = 106;
+  FILE *trace = stdin;
+  if (optind < argc && (trace = fopen(argv[optind], "r")) == NULL) {
+    perror("fopen");
+    return 1;
+  }
+
+  struct sigaction action = {.sa_handler = alarm_handler};
+  sigaction(SIGALRM, &action, NULL);
+  device_add_background_task(run_timer, 0);
+
+  card_fabrication_procedure(lfs_root);
+  nfc_init();
+
+  // activation: the chip answers REQA/anticollision/RATS on its own and reports the RATS parameter
+  pcd_fsd = frame_size(fsdi);
+  card_fsc = frame_size(NFC_FSCI);
+  regs[REG_RF_RATS] = fsdi << 4;
+  raise_irq(MAIN_IRQ_RF_ON | MAIN_IRQ_ACTIVE, 0, 0);
+
+  char line[APDU_BUFFER_SIZE * 3];
+  uint8_t capdu[APDU_BUFFER_SIZE + 5], rapdu[APDU_BUFFER_SIZE + 2];
+  stats_t total = {0};
+  int count = 0, failed = 0;
+
+  while (fgets(line, sizeof(line), trace)) {
+    int len = parse_hex(line, capdu, sizeof(capdu));
+    if (len <= 0) continue;
+    memset(&stats, 0, sizeof(stats));
+    uint16_t rapdu_len;
+    if (pcd_exchange(capdu, len, rapdu, &rapdu_len) < 0) {
+      printf("#%d failed\n", count++);
+      ++failed;
+      continue;
+    }
+    if (verbose) {
+      print_hex_line("  C: ", capdu, len);
+      print_hex_line("  R: ", rapdu, rapdu_len);
+    }
+    printf("#%d Lc+hdr=%d Lr=%u SW=%02X%02X I=%u R=%u S=%u NAK=%u bytes=%u air=%.2fms card=%.2fms total=%.2fms\n",
+           count++, len, rapdu_len, rapdu_len >= 2 ? rapdu[rapdu_len - 2] : 0, rapdu_len >= 2 ? rapdu[rapdu_len - 1] : 0,
+           stats.i_blocks, stats.r_blocks, stats.s_blocks, stats.naks, stats.bytes, stats.air_us / 1000.0,
+           stats.card_us / 1000.0, (stats.air_us + stats.card_us) / 1000.0);
+    total.i_blocks += stats.i_blocks;
+    total.r_blocks += stats.r_blocks;
+    total.s_blocks += stats.s_blocks;
+    total.naks += stats.naks;
+    total.bytes += stats.bytes;
+    total.air_us += stats.air_us;
+    total.card_us += stats.card_us;
+  }
+
+  printf("total: %d APDUs (%d failed) FSD=%u FSC=%u I=%u R=%u S=%u NAK=%u bytes=%u air=%.2fms card=%.2fms "
+         "total=%.2fms\n",
+         count, failed, pcd_fsd, card_fsc, total.i_blocks, total.r_blocks, total.s_blocks, total.naks, total.bytes,
+         total.air_us / 1000.0, total.card_us / 1000.0, (total.air_us + total.card_us) / 1000.0);
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,117 @@
+#include "host-platform.h"
+#include <device.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#ifndef HOST_THREADS
+#error "the card state has to be shared by the threads, configure with -DENABLE_HOST_THREADS=ON"
+#endif
+
+static pthread_mutex_t main_mutex, irq_mutex;
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+// the single timer of device_set_timeout, protected by timer_mutex
+static pthread_mutex_t timer_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t timer_cond;
+static void (*timer_callback)(void);
+static struct timespec timer_deadline;
+static unsigned timer_generation; // changes whenever the timer is set or cancelled
+
+static void *timer_thread(void *arg) {
+  UNUSED(arg);
+  pthread_mutex_lock(&timer_mutex);
+  for (;;) {
+    if (timer_callback == NULL) {
+      pthread_cond_wait(&timer_cond, &timer_mutex);
+      continue;
+    }
+    unsigned generation = timer_generation;
+    if (pthread_cond_timedwait(&timer_cond, &timer_mutex, &timer_deadline) != ETIMEDOUT ||
+        generation != timer_generation)
+      continue; // set again or cancelled meanwhile
+    void (*callback)(void) = timer_callback;
+    pthread_mutex_unlock(&timer_mutex);
+    // the callback runs like a timer IRQ, preempting the main context, e.g. to send a time extension while a command
+    // is processed, and may set the timer again
+    host_irq_lock();
+    pthread_mutex_lock(&timer_mutex);
+    int expired = generation == timer_generation;
+    if (expired) timer_callback = NULL;
+    pthread_mutex_unlock(&timer_mutex);
+    if (expired) callback();
+    host_irq_unlock();
+    pthread_mutex_lock(&timer_mutex);
+  }
+  return NULL;
+}
+
+static void init_recursive_mutex(pthread_mutex_t *mutex) {
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(mutex, &attr);
+  pthread_mutexattr_destroy(&attr);
+}
+
+static void host_platform_init(void) {
+  init_recursive_mutex(&main_mutex);
+  init_recursive_mutex(&irq_mutex);
+
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&timer_cond, &attr);
+  pthread_condattr_destroy(&attr);
+
+  // the timer thread starts with every signal blocked, they are left to the host, which waits for them, e.g. in poll
+  sigset_t all, saved;
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &saved);
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, timer_thread, NULL) != 0) {
+    perror("pthread_create");
+    exit(1);
+  }
+  pthread_sigmask(SIG_SETMASK, &saved, NULL);
+  pthread_detach(thread);
+}
+
+void host_main_lock(void) {
+  pthread_once(&init_once, host_platform_init);
+  pthread_mutex_lock(&main_mutex);
+}
+
+void host_main_unlock(void) { pthread_mutex_unlock(&main_mutex); }
+
+void host_irq_lock(void) {
+  pthread_once(&init_once, host_platform_init);
+  pthread_mutex_lock(&irq_mutex);
+}
+
+void host_irq_unlock(void) { pthread_mutex_unlock(&irq_mutex); }
+
+void device_disable_irq(void) { host_irq_lock(); }
+
+void device_enable_irq(void) { host_irq_unlock(); }
+
+void device_set_timeout(void (*callback)(void), uint16_t timeout) {
+  pthread_once(&init_once, host_platform_init);
+  pthread_mutex_lock(&timer_mutex);
+  timer_callback = callback;
+  if (callback != NULL) {
+    clock_gettime(CLOCK_MONOTONIC, &timer_deadline);
+    timer_deadline.tv_sec += timeout / 1000;
+    timer_deadline.tv_nsec += timeout % 1000 * 1000000l;
+    if (timer_deadline.tv_nsec >= 1000000000l) {
+      ++timer_deadline.tv_sec;
+      timer_deadline.tv_nsec -= 1000000000l;
+    }
+  }
+  ++timer_generation;
+  pthread_cond_signal(&timer_cond);
+  pthread_mutex_unlock(&timer_mutex);
+}
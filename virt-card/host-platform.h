@@ -0,0 +1,26 @@
+#pragma once
+
+/**
+ * Platform layer for host builds driving one card from several threads, see "Threading" in README.md.
+ * Configure with -DENABLE_HOST_THREADS=ON, which makes the card state shared by all the threads of the process.
+ *
+ * Entry points of the main context (device_loop and the loops it runs, nfc_loop, process_apdu) are called with
+ * host_main_lock held. Entry points of the interrupt context (the USB endpoint events, nfc_handler) are called with
+ * host_irq_lock held, which device_disable_irq takes as well. The timer thread of device_set_timeout holds
+ * host_irq_lock while it runs a callback, so a callback preempts a command like a timer IRQ, and is dropped when the
+ * timer has been set again or cancelled while the thread waited for the lock. The transports take host_irq_lock
+ * around their TX path, which both contexts use. Both locks are recursive.
+ *
+ * Without HOST_THREADS, the card lives on a single thread and the locks do nothing.
+ */
+#ifdef HOST_THREADS
+void host_main_lock(void);
+void host_main_unlock(void);
+void host_irq_lock(void);
+void host_irq_unlock(void);
+#else
+static inline void host_main_lock(void) {}
+static inline void host_main_unlock(void) {}
+static inline void host_irq_lock(void) {}
+static inline void host_irq_unlock(void) {}
+#endif
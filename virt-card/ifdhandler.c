@@ -12,6 +12,7 @@
 #include "ccid.h"
 #include "fabrication.h"
 #include <ifdhandler.h>
+#include <pthread.h>
 #include <reader.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -23,14 +24,75 @@ const static UCHAR ATR[] = {0x3B, 0xF7, 0x11, 0x00, 0x00, 0x81, 0x31, 0xFE, 0x65
                             0x43, 0x61, 0x6E, 0x6F, 0x6B, 0x65, 0x79, 0x99};
 static int applet_init = 0;
 
-RESPONSECODE IFDHCreateChannel ( DWORD Lun, DWORD Channel )
+/*
+ * The card state is local to the thread touching it (__card_local), while pcscd calls the handler from its
+ * hotplug and client threads. A thread of our own owns the card, the IFDH entries hand their work over to it
+ * one at a time.
+ */
+static pthread_once_t card_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t card_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t card_cond = PTHREAD_COND_INITIALIZER;
+static void (*card_work)(void *);
+static void *card_work_arg;
+static unsigned card_submitted, card_completed;
+
+static void *card_thread(void *arg)
+{
+    pthread_mutex_lock(&card_mutex);
+    for(;;) {
+        while(card_work == NULL)
+            pthread_cond_wait(&card_cond, &card_mutex);
+        void (*work)(void *) = card_work;
+        void *work_arg = card_work_arg;
+        pthread_mutex_unlock(&card_mutex);
+        work(work_arg);
+        pthread_mutex_lock(&card_mutex);
+        card_work = NULL;
+        card_completed = card_submitted;
+        pthread_cond_broadcast(&card_cond);
+    }
+    return NULL;
+}
+
+static void start_card_thread(void)
+{
+    pthread_t thread;
+    if(pthread_create(&thread, NULL, card_thread, NULL) != 0) {
+        perror("pthread_create");
+        exit(1);
+    }
+    pthread_detach(thread);
+}
+
+static void run_on_card(void (*work)(void *), void *arg)
+{
+    pthread_once(&card_once, start_card_thread);
+    pthread_mutex_lock(&card_mutex);
+    while(card_work != NULL)
+        pthread_cond_wait(&card_cond, &card_mutex);
+    card_work = work;
+    card_work_arg = arg;
+    unsigned ticket = ++card_submitted;
+    pthread_cond_broadcast(&card_cond);
+    // the work of the next caller may have been completed as well by the time we wake up
+    while((int)(card_completed - ticket) < 0)
+        pthread_cond_wait(&card_cond, &card_mutex);
+    pthread_mutex_unlock(&card_mutex);
+}
+
+static void init_card(void *arg)
 {
-    printf("IFDHCreateChannel %ld %ld\n", Lun, Channel);
     if(!applet_init) {
         CCID_Init();
         card_fabrication_procedure("/tmp/lfs-root");
         applet_init = 1;
     }
+}
+
+RESPONSECODE IFDHCreateChannel ( DWORD Lun, DWORD Channel )
+{
+    printf("IFDHCreateChannel %ld %ld\n", Lun, Channel);
+    run_on_card(init_card, NULL);
     return IFD_SUCCESS;
 }
 
@@ -114,8 +176,42 @@ RESPONSECODE IFDHPowerICC ( DWORD Lun, DWORD Action,
     return IFD_SUCCESS;
 }
 
-extern ccid_bulkin_data_t bulkin_data[2];
-extern ccid_bulkout_data_t bulkout_data[2];
+extern __card_local ccid_bulkin_data_t bulkin_data[CCID_BUFFER_NUM];
+extern __card_local ccid_bulkout_data_t bulkout_data[CCID_BUFFER_NUM];
+
+struct transmit_work {
+    PUCHAR TxBuffer;
+    DWORD TxLength;
+    PUCHAR RxBuffer;
+    PDWORD RxLength;
+    RESPONSECODE ret;
+};
+
+static void transmit(void *arg)
+{
+    struct transmit_work *work = arg;
+
+    memcpy(bulkout_data[0].abData, work->TxBuffer, work->TxLength);
+    bulkout_data[0].dwLength = work->TxLength;
+
+    uint8_t ret = PC_to_RDR_XfrBlock();
+    if(ret != SLOT_NO_ERROR) {
+        *work->RxLength = 0;
+        printf("warning: PC_to_RDR_XfrBlock returns %#x\n", ret);
+        work->ret = IFD_COMMUNICATION_ERROR;
+        return;
+    }
+    if(bulkin_data[0].dwLength > *work->RxLength) {
+        printf("bulkin_data.dwLength(%u) > *RxLength(%lu)\n",
+            bulkin_data[0].dwLength, *work->RxLength);
+        *work->RxLength = 0;
+        work->ret = IFD_ERROR_INSUFFICIENT_BUFFER;
+        return;
+    }
+    memcpy(work->RxBuffer, bulkin_data[0].abData, bulkin_data[0].dwLength);
+    *work->RxLength = bulkin_data[0].dwLength;
+    work->ret = IFD_SUCCESS;
+}
 
 RESPONSECODE IFDHTransmitToICC ( DWORD Lun, SCARD_IO_HEADER SendPci,
                                  PUCHAR TxBuffer, DWORD TxLength,
@@ -127,30 +223,15 @@ RESPONSECODE IFDHTransmitToICC ( DWORD Lun, SCARD_IO_HEADER SendPci,
     RecvPci->Protocol = SendPci.Protocol;
     //SCARD_IO_HEADER::Length is not used according to document
 
-    if(TxLength > sizeof(bulkin_data[Lun].abData)) {
+    if(TxLength > sizeof(bulkin_data[0].abData)) {
         printf("warning TxLength(%lu) too large\n", TxLength);
         *RxLength = 0;
         return IFD_ERROR_INSUFFICIENT_BUFFER;
     }
-    memcpy(bulkout_data[Lun].abData, TxBuffer, TxLength);
-    bulkout_data[Lun].dwLength = TxLength;
-
-    uint8_t ret = PC_to_RDR_XfrBlock();
-    if(ret != SLOT_NO_ERROR) {
-        *RxLength = 0;
-        printf("warning: PC_to_RDR_XfrBlock returns %#x\n", ret);
-    }else{
-        if(bulkin_data[Lun].dwLength > *RxLength) {
-            printf("bulkin_data[Lun].dwLength(%u) > *RxLength(%lu)\n",
-                bulkin_data[Lun].dwLength, *RxLength);
-            *RxLength = 0;
-            return IFD_ERROR_INSUFFICIENT_BUFFER;
-        }
-        memcpy(RxBuffer, bulkin_data[Lun].abData, bulkin_data[Lun].dwLength);
-        *RxLength = bulkin_data[Lun].dwLength;
-    }
 
-    return ret == SLOT_NO_ERROR ? IFD_SUCCESS : IFD_COMMUNICATION_ERROR;
+    struct transmit_work work = {TxBuffer, TxLength, RxBuffer, RxLength, IFD_COMMUNICATION_ERROR};
+    run_on_card(transmit, &work);
+    return work.ret;
 }
 
 RESPONSECODE IFDHControl (DWORD Lun, DWORD dwControlCode, PUCHAR
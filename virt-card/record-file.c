@@ -0,0 +1,55 @@
+#include <common.h>
+
+#ifdef ENABLE_RECORD
+
+#include <record.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static __card_local FILE *record_file;
+static __card_local uint8_t record_failed;
+static __card_local uint64_t record_start;
+static atomic_int record_files;
+
+// counted from the first command of the card, so that it only wraps after about 71 minutes
+uint32_t record_timestamp(void) {
+  struct timespec spec;
+  clock_gettime(CLOCK_MONOTONIC, &spec);
+  uint64_t now = spec.tv_sec * 1000000ull + spec.tv_nsec / 1000;
+  if (record_start == 0) record_start = now;
+  return (uint32_t)(now - record_start);
+}
+
+// $CANOKEY_RECORD (canokey-record.ckr by default) for the first card of the process, the others append .2, .3, ...
+static FILE *record_open(void) {
+  char numbered[256];
+  const char *path = getenv("CANOKEY_RECORD");
+  if (path == NULL) path = "canokey-record.ckr";
+  int idx = atomic_fetch_add(&record_files, 1) + 1;
+  if (idx > 1) {
+    snprintf(numbered, sizeof(numbered), "%s.%d", path, idx);
+    path = numbered;
+  }
+  FILE *fp = fopen(path, "wb");
+  if (fp == NULL) {
+    perror("fopen record");
+    return NULL;
+  }
+  fwrite(RECORD_MAGIC, 1, 4, fp);
+  fputc(RECORD_VERSION, fp);
+  fprintf(stderr, "recording commands to %s\n", path);
+  return fp;
+}
+
+// stdio flushes the file on exit
+void record_write(const void *buf, uint16_t len) {
+  if (record_file == NULL && !record_failed) {
+    record_file = record_open();
+    record_failed = record_file == NULL;
+  }
+  if (record_file != NULL) fwrite(buf, 1, len, record_file);
+}
+
+#endif
@@ -0,0 +1,46 @@
+#include "trace-json.h"
+#include <common.h>
+
+#ifdef ENABLE_TRACE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// counted from the first event, so that it only wraps after about 71 minutes
+uint32_t trace_timestamp(void) {
+  static uint64_t start;
+  struct timespec spec;
+  clock_gettime(CLOCK_MONOTONIC, &spec);
+  uint64_t now = spec.tv_sec * 1000000ull + spec.tv_nsec / 1000;
+  if (start == 0) start = now;
+  return (uint32_t)(now - start);
+}
+
+static void trace_dump(void) {
+  const char *path = getenv("CANOKEY_TRACE");
+  if (path == NULL) path = "canokey-trace.json";
+  FILE *fp = fopen(path, "w");
+  if (fp == NULL) {
+    perror("fopen trace");
+    return;
+  }
+  fprintf(fp, "{\"traceEvents\":[\n");
+  uint32_t cnt = trace_count();
+  for (uint32_t i = 0; i < cnt; ++i) {
+    const trace_event_t *event = trace_get(i);
+    fprintf(fp, "{\"name\":\"%s\",\"cat\":\"canokey\",\"ph\":\"%c\",\"ts\":%u,\"pid\":1,\"tid\":1}%s\n",
+            trace_name(event->id), event->phase, event->timestamp, i + 1 < cnt ? "," : "");
+  }
+  fprintf(fp, "],\"displayTimeUnit\":\"ms\"}\n");
+  fclose(fp);
+  fprintf(stderr, "%u trace events written to %s\n", cnt, path);
+}
+
+void trace_dump_on_exit(void) { atexit(trace_dump); }
+
+#else
+
+void trace_dump_on_exit(void) {}
+
+#endif
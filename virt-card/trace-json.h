@@ -0,0 +1,5 @@
+#pragma once
+
+// Dump the trace ring as Chrome trace JSON to $CANOKEY_TRACE (canokey-trace.json by default) on exit.
+// Does nothing unless built with ENABLE_TRACE.
+void trace_dump_on_exit(void);
@@ -2,7 +2,9 @@
 #include "ccid.h"
 #include "device.h"
 #include "fabrication.h"
+#include "host-platform.h"
 #include "oath.h"
+#include "trace-json.h"
 #include "usb_device.h"
 #include "usbd_conf.h"
 #include "usbd_core.h"
@@ -13,7 +15,10 @@
 #include <netdb.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -21,9 +26,15 @@
 #include <strings.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <unistd.h>
 
+#define USBIP_CMD_SUBMIT 0x00000001
+#define USBIP_CMD_UNLINK 0x00000002
+#define USBIP_RET_SUBMIT 0x00000003
+#define USBIP_RET_UNLINK 0x00000004
+
 struct CmdSubmitBody {
   uint32_t seq_num;
   uint32_t dev_id;
@@ -50,47 +61,131 @@ struct RetSubmitBody {
   uint8_t setup[8];
 };
 
-#define MAX_TX_BUFFERS 16
+struct CmdUnlinkBody {
+  uint32_t seq_num;
+  uint32_t dev_id;
+  uint32_t direction;
+  uint32_t ep;
+  uint32_t unlink_seq_num;
+  uint8_t padding[24];
+};
+
+struct RetUnlinkBody {
+  uint32_t seq_num;
+  uint32_t dev_id;
+  uint32_t direction;
+  uint32_t ep;
+  uint32_t status;
+  uint8_t padding[24];
+};
+
+#define MAX_ENDPOINTS 16
+#define MAX_TX_BUFFERS 32 // a whole CTAPHID response, its reports are queued before the host polls the endpoint
+// a CCID message and a WebUSB response on ep0, of APDU_BUFFER_SIZE + 2 bytes, are both sent in one piece
+#define MAX_TX_SIZE (CCID_CMD_HEADER_SIZE + ABDATA_SIZE)
 struct Endpoint {
   uint8_t *rx_buffer;
+  uint16_t rx_capacity; // as prepared by the stack
   uint16_t rx_size;
-  // ring buffer as a queue
-  uint8_t *tx_buffer[MAX_TX_BUFFERS];
+  uint8_t rx_armed; // prepared by the stack, otherwise the endpoint NAKs the OUT transfers
+  // ring buffer as a queue, preallocated so that transmitting never allocates
+  uint8_t tx_buffer[MAX_TX_BUFFERS][MAX_TX_SIZE];
   uint16_t tx_size[MAX_TX_BUFFERS];
   uint32_t tx_from;
   uint32_t tx_to;
   uint8_t type;
   uint8_t mps;
+  uint8_t zlp; // a zero length packet has been transmitted, which the URB of the transfer implies
+};
+
+#define RX_STREAM_SIZE 4096
+#define IDLE_LOOP_INTERVAL 10 // in ms, device_loop runs at least this often while the host is quiet
+
+#define MAX_DEVICES 127
+struct Device {
+  char bus_id[32];
+  char path[256];
+  char lfs_root[64];
+  int handover[2]; // pipe passing the attached client socket to the thread of the device
+  atomic_int attached;
+  pthread_t thread;
 };
 
 // global state
-struct CmdSubmitBody current_cmd_submit_body;
-int client_fd = -1;
-struct Endpoint endpoints[256];
+struct Device devices[MAX_DEVICES];
+int num_devices = 1;
+// the fast mode (-f) drops the per-URB logging
+int verbose = 1;
+// bumped on Ctrl-C, each device toggles its touch status when it sees the change
+volatile sig_atomic_t touch_toggles;
+
+// state of the device served by the current thread
+__card_local struct CmdSubmitBody current_cmd_submit_body;
+__card_local int client_fd = -1;
+__card_local struct Endpoint endpoints[MAX_ENDPOINTS];
+// bytes received from the client but not consumed yet
+__card_local uint8_t rx_stream[RX_STREAM_SIZE];
+__card_local size_t rx_stream_pos, rx_stream_len;
+__card_local struct Device *current_device;
+__card_local sig_atomic_t seen_touch_toggles;
+
+#define LOG(...)                                                                                                       \
+  do {                                                                                                                 \
+    if (verbose) printf(__VA_ARGS__);                                                                                  \
+  } while (0)
 
 // utilities
-int write_exact(int fd, const uint8_t *buffer, size_t write_len) {
-  size_t offset = 0;
-  while (offset < write_len) {
-    int res = write(fd, &buffer[offset], write_len - offset);
+void log_hex(const uint8_t *buffer, size_t len) {
+  if (!verbose) return;
+  for (size_t i = 0; i < len; i++) {
+    printf(" %02X", buffer[i]);
+  }
+  printf("\n");
+}
+
+int writev_exact(int fd, struct iovec *iov, int iov_cnt) {
+  while (iov_cnt > 0) {
+    ssize_t res = writev(fd, iov, iov_cnt);
     if (res <= 0) {
-      perror("write");
+      perror("writev");
       return -1;
     }
-    offset += res;
+    // skip what has been written, a partial write leaves the rest for the next round
+    while (iov_cnt > 0 && (size_t)res >= iov->iov_len) {
+      res -= iov->iov_len;
+      ++iov;
+      --iov_cnt;
+    }
+    if (iov_cnt > 0) {
+      iov->iov_base = (uint8_t *)iov->iov_base + res;
+      iov->iov_len -= res;
+    }
   }
   return 0;
 }
 
+int write_exact(int fd, const uint8_t *buffer, size_t write_len) {
+  struct iovec iov = {.iov_base = (void *)buffer, .iov_len = write_len};
+  return writev_exact(fd, &iov, 1);
+}
+
+// Reads through rx_stream, so that a whole URB usually takes a single read syscall
 int read_exact(int fd, uint8_t *buffer, size_t read_len) {
-  size_t offset = 0;
-  while (offset < read_len) {
-    int res = read(fd, &buffer[offset], read_len - offset);
-    if (res <= 0) {
-      perror("read");
-      return -1;
+  while (read_len > 0) {
+    if (rx_stream_pos == rx_stream_len) {
+      int res = read(fd, rx_stream, sizeof(rx_stream));
+      if (res <= 0) {
+        perror("read");
+        return -1;
+      }
+      rx_stream_pos = 0;
+      rx_stream_len = res;
     }
-    offset += res;
+    size_t len = MIN(read_len, rx_stream_len - rx_stream_pos);
+    memcpy(buffer, &rx_stream[rx_stream_pos], len);
+    rx_stream_pos += len;
+    buffer += len;
+    read_len -= len;
   }
   return 0;
 }
@@ -102,8 +197,8 @@ USBD_StatusTypeDef USBD_LL_DeInit(USBD_HandleTypeDef *pdev) { return USBD_OK; }
 USBD_StatusTypeDef USBD_LL_Start(USBD_HandleTypeDef *pdev) { return USBD_OK; }
 USBD_StatusTypeDef USBD_LL_Stop(USBD_HandleTypeDef *pdev) { return USBD_OK; }
 USBD_StatusTypeDef USBD_LL_OpenEP(USBD_HandleTypeDef *pdev, uint8_t ep_addr, uint8_t ep_type, uint16_t ep_mps) {
-  endpoints[ep_addr].type = ep_type;
-  endpoints[ep_addr].mps = ep_mps;
+  endpoints[ep_addr & 0x0F].type = ep_type;
+  endpoints[ep_addr & 0x0F].mps = ep_mps;
   return USBD_OK;
 }
 
@@ -114,58 +209,73 @@ USBD_StatusTypeDef USBD_LL_ClearStallEP(USBD_HandleTypeDef *pdev, uint8_t ep_add
 uint8_t USBD_LL_IsStallEP(USBD_HandleTypeDef *pdev, uint8_t ep_addr) { return 0; }
 USBD_StatusTypeDef USBD_LL_SetUSBAddress(USBD_HandleTypeDef *pdev, uint8_t dev_addr) { return USBD_OK; }
 USBD_StatusTypeDef USBD_LL_PrepareReceive(USBD_HandleTypeDef *pdev, uint8_t ep_addr, uint8_t *pbuf, uint16_t size) {
-  endpoints[ep_addr].rx_buffer = pbuf;
-  endpoints[ep_addr].rx_size = size;
+  endpoints[ep_addr & 0x0F].rx_buffer = pbuf;
+  endpoints[ep_addr & 0x0F].rx_capacity = size;
+  endpoints[ep_addr & 0x0F].rx_size = size;
+  endpoints[ep_addr & 0x0F].rx_armed = 1;
   return USBD_OK;
 }
-void SendRetSubmit(const uint8_t *pbuf, uint16_t size) {
-  if (size == 0 || pbuf != NULL) {
+// header, body and data go out in a single writev
+int SendRetSubmit(const uint8_t *pbuf, uint16_t size) {
+  if (size != 0 && pbuf == NULL) {
     printf("error size=%hu pbuf=%p\n", size, pbuf);
-    return;
+    return -1;
   }
-  printf("<- RET_SUBMIT:\n\t");
-  for (size_t i = 0; i < size; i++) {
-    printf("%02X ", pbuf[i]);
-  }
-  printf("\n");
-
-  // command
-  uint8_t command[4] = {0, 0, 0, 3};
-  write_exact(client_fd, command, sizeof(command));
-
-  struct RetSubmitBody body;
-  body.seq_num = current_cmd_submit_body.seq_num;
-  body.dev_id = current_cmd_submit_body.dev_id;
-  body.direction = current_cmd_submit_body.direction;
-  body.ep = current_cmd_submit_body.ep;
-  body.status = 0;
-  body.actual_length = htonl(size);
-  body.start_frame = 0;
-  body.number_of_packets = 0;
-  body.error_count = 0;
-  memcpy(body.setup, current_cmd_submit_body.setup, 8);
-  write_exact(client_fd, (uint8_t *)&body, sizeof(body));
-
-  // data
-  write_exact(client_fd, pbuf, size);
+  LOG("<- RET_SUBMIT:\n\t");
+  log_hex(pbuf, size);
+
+  struct {
+    uint32_t command;
+    struct RetSubmitBody body;
+  } ret;
+  ret.command = htonl(USBIP_RET_SUBMIT);
+  ret.body.seq_num = current_cmd_submit_body.seq_num;
+  ret.body.dev_id = current_cmd_submit_body.dev_id;
+  ret.body.direction = current_cmd_submit_body.direction;
+  ret.body.ep = current_cmd_submit_body.ep;
+  ret.body.status = 0;
+  ret.body.actual_length = htonl(size);
+  ret.body.start_frame = 0;
+  ret.body.number_of_packets = 0;
+  ret.body.error_count = 0;
+  memcpy(ret.body.setup, current_cmd_submit_body.setup, 8);
+
+  struct iovec iov[] = {
+      {.iov_base = &ret, .iov_len = sizeof(ret)},
+      {.iov_base = (void *)pbuf, .iov_len = size},
+  };
+  return writev_exact(client_fd, iov, size ? 2 : 1);
 }
+// Both contexts transmit, e.g. a response from the main context and a time extension from the timer callback
 USBD_StatusTypeDef USBD_LL_Transmit(USBD_HandleTypeDef *pdev, uint8_t ep_num, const uint8_t *pbuf, uint16_t size) {
+  USBD_StatusTypeDef ret = USBD_OK;
+  host_irq_lock();
   if (client_fd == -1) {
     // ignore
   } else {
     // save to buffer
-    uint32_t ep = ep_num & 0x7F;
-    if (size > 0) {
-      uint8_t *buffer = malloc(size);
-      memcpy(buffer, pbuf, size);
-      endpoints[ep].tx_buffer[endpoints[ep].tx_to] = buffer;
-      endpoints[ep].tx_size[endpoints[ep].tx_to] = size;
-      endpoints[ep].tx_to = (endpoints[ep].tx_to + 1) % MAX_TX_BUFFERS;
+    struct Endpoint *ep = &endpoints[ep_num & 0x0F];
+    if (size == 0) {
+      ep->zlp = 1;
+    } else if (size > MAX_TX_SIZE) {
+      printf("error transmit size=%hu too large\n", size);
+      ret = USBD_FAIL;
+    } else if ((ep->tx_to + 1) % MAX_TX_BUFFERS == ep->tx_from) {
+      printf("error tx ring of ep %hhu full\n", ep_num);
+      ret = USBD_FAIL;
+    } else {
+      memcpy(ep->tx_buffer[ep->tx_to], pbuf, size);
+      ep->tx_size[ep->tx_to] = size;
+      ep->tx_to = (ep->tx_to + 1) % MAX_TX_BUFFERS;
+      // The report has been copied out, complete its transfer now. The host cannot poll the endpoint while the card
+      // runs, and CTAPHID and the keyboard wait for the completion before they send the next report.
+      if (ep->type == USBD_EP_TYPE_INTR) USBD_LL_DataInStage(&usb_device, ep_num & 0x0F, NULL);
     }
   }
-  return USBD_OK;
+  host_irq_unlock();
+  return ret;
 }
-uint32_t USBD_LL_GetRxDataSize(USBD_HandleTypeDef *pdev, uint8_t ep_addr) { return endpoints[ep_addr].rx_size; }
+uint32_t USBD_LL_GetRxDataSize(USBD_HandleTypeDef *pdev, uint8_t ep_addr) { return endpoints[ep_addr & 0x0F].rx_size; }
 void device_delay(int ms) {
   struct timespec spec = {.tv_sec = ms / 1000, .tv_nsec = ms % 1000 * 1000000ll};
   nanosleep(&spec, NULL);
@@ -180,9 +290,12 @@ uint32_t device_get_tick(void) {
   ms = spec.tv_nsec / 1000000;
   return (uint32_t)(s * 1000 + ms);
 }
+#ifndef HOST_THREADS
+// the card lives on the thread serving it, nothing preempts it and there is no timer
 void device_disable_irq(void) {}
 void device_enable_irq(void) {}
 void device_set_timeout(void (*callback)(void), uint16_t timeout) {}
+#endif
 void fm_write_eeprom(uint16_t addr, uint8_t *buf, uint8_t len) { return; }
 
 /* Override the function defined in usb_device.c */
@@ -216,83 +329,501 @@ void sigint_handler() {
     exit(0);
   } else {
     last_time = cur_time;
+    ++touch_toggles;
+    fprintf(stderr, "Toggling touch status, re-type Ctrl-C again quickly to quit\n");
+  }
+}
+
+void apply_touch_toggles(void) {
+  while (seen_touch_toggles != touch_toggles) {
+    ++seen_touch_toggles;
+    host_main_lock();
     set_touch_result(!get_touch_result());
-    fprintf(stderr, "Toggling touch status to %hhu, re-type Ctrl-C again quickly to quit\n", get_touch_result());
+    fprintf(stderr, "Touch status of %s is now %hhu\n", current_device->bus_id, get_touch_result());
+    host_main_unlock();
   }
 }
 
-void endpoint_rx(uint32_t ep) {
+int endpoint_rx(uint32_t ep) {
   uint32_t transfer_buffer_length = ntohl(current_cmd_submit_body.transfer_buffer_length);
   uint8_t *transfer_buffer = endpoints[ep].rx_buffer;
-  printf("\tTransfer buffer: %u bytes\n\t", transfer_buffer_length);
-  if (read_exact(client_fd, transfer_buffer, transfer_buffer_length) < 0) {
-    return;
+  LOG("\tTransfer buffer: %u bytes\n\t", transfer_buffer_length);
+  if (transfer_buffer_length > 0 && (transfer_buffer == NULL || transfer_buffer_length > endpoints[ep].rx_capacity)) {
+    printf("error transfer of %u bytes to ep %u not expected\n", transfer_buffer_length, ep);
+    return -1;
   }
-  for (int i = 0; i < transfer_buffer_length; i++) {
-    printf(" %02X", transfer_buffer[i]);
+  if (read_exact(client_fd, transfer_buffer, transfer_buffer_length) < 0) {
+    return -1;
   }
-  printf("\n");
+  log_hex(transfer_buffer, transfer_buffer_length);
   endpoints[ep].rx_size = transfer_buffer_length;
+  endpoints[ep].rx_armed = 0;
+  return 0;
 }
 
-void endpoint_tx(uint32_t ep) {
+int endpoint_tx(uint32_t ep) {
   if (endpoints[ep].tx_from != endpoints[ep].tx_to) {
     uint32_t tx_from = endpoints[ep].tx_from;
-    SendRetSubmit(endpoints[ep].tx_buffer[tx_from], endpoints[ep].tx_size[tx_from]);
-    free(endpoints[ep].tx_buffer[tx_from]);
+    int ret = SendRetSubmit(endpoints[ep].tx_buffer[tx_from], endpoints[ep].tx_size[tx_from]);
     endpoints[ep].tx_size[tx_from] = 0;
     endpoints[ep].tx_from = (endpoints[ep].tx_from + 1) % MAX_TX_BUFFERS;
+    return ret;
   } else {
-    SendRetSubmit(NULL, 0);
+    return SendRetSubmit(NULL, 0);
   }
 }
 
-int main() {
-  int fd;
-  uint8_t bus_id[32];
-  strcpy((char *)bus_id, "1-1");
-  uint8_t path[256];
-  strcpy((char *)path, "/sys/device/pci0000:00/0000:00:01.2/usb1/1-1");
+int op_req_devlist(void) {
+  LOG("-> OP_REQ_DEVLIST\n");
 
-  signal(SIGINT, sigint_handler);
+  // status
+  uint8_t status[4];
+  if (read_exact(client_fd, status, sizeof(status)) < 0) {
+    return -1;
+  }
 
-  fd = socket(AF_INET, SOCK_STREAM, 0);
-  if (fd < 0) {
-    perror("socket");
-    return 1;
+  LOG("<- OP_RET_DEVLIST\n");
+  // resp
+  uint8_t resp_header[] = {
+      // version 273
+      0x01,
+      0x11,
+      // reply code
+      0x00,
+      0x05,
+      // status
+      0x00,
+      0x00,
+      0x00,
+      0x00,
+      // number of exported devices
+      0x00,
+      0x00,
+      0x00,
+      num_devices,
+  };
+  uint8_t resp_body[] = {
+      // bus num
+      0x00,
+      0x00,
+      0x00,
+      0x01,
+      // dev num
+      0x00,
+      0x00,
+      0x00,
+      0x02,
+      // speed = high
+      0x00,
+      0x00,
+      0x00,
+      0x03,
+      // idVendor
+      LO(USBD_VID),
+      HI(USBD_VID),
+      // idProduct
+      LO(USBD_PID),
+      HI(USBD_PID),
+      // bcdDevice
+      0x00,
+      0x01,
+      // bDeviceClass
+      0x00,
+      // bDeviceSubClass
+      0x00,
+      // bDeviceProtocol
+      0x00,
+      // bConfigurationValue
+      0x01,
+      // bNumConfigurations
+      USBD_MAX_NUM_CONFIGURATION,
+      // bInterfaces
+      USBD_MAX_NUM_INTERFACES,
+      // interface 1
+      // bInterfaceClass
+      0x03,
+      // bInterfaceSubClass
+      0x00,
+      // bInterfaceProtocol
+      0x00,
+      // bPadding
+      0x00,
+      // interface 2
+      // bInterfaceClass
+      0x03,
+      // bInterfaceSubClass
+      0x00,
+      // bInterfaceProtocol
+      0x00,
+      // bPadding
+      0x00,
+      // interface 3
+      // bInterfaceClass
+      0xFF,
+      // bInterfaceSubClass
+      0xFF,
+      // bInterfaceProtocol
+      0xFF,
+      // bPadding
+      0x00,
+      // interface 4
+      // bInterfaceClass
+      0x0B,
+      // bInterfaceSubClass
+      0x00,
+      // bInterfaceProtocol
+      0x00,
+      // bPadding
+      0x00,
+  };
+  // the devices differ in the dev num only
+  uint8_t dev_nums[MAX_DEVICES][sizeof(resp_body)];
+  struct iovec iov[1 + MAX_DEVICES * 3] = {{.iov_base = resp_header, .iov_len = sizeof(resp_header)}};
+  for (int i = 0; i < num_devices; i++) {
+    memcpy(dev_nums[i], resp_body, sizeof(resp_body));
+    dev_nums[i][7] = i + 2;
+    iov[1 + i * 3] = (struct iovec){.iov_base = devices[i].path, .iov_len = sizeof(devices[i].path)};
+    iov[2 + i * 3] = (struct iovec){.iov_base = devices[i].bus_id, .iov_len = sizeof(devices[i].bus_id)};
+    iov[3 + i * 3] = (struct iovec){.iov_base = dev_nums[i], .iov_len = sizeof(resp_body)};
   }
+  return writev_exact(client_fd, iov, 1 + num_devices * 3);
+}
 
-  struct sockaddr_in addr;
-  bzero(&addr, sizeof(addr));
-  addr.sin_family = AF_INET;
-  addr.sin_addr.s_addr = INADDR_ANY;
-  addr.sin_port = htons(3240);
+// Returns the index of the device to attach
+int op_req_import(void) {
+  LOG("-> OP_REQ_IMPORT\n");
 
-  if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int)) < 0) {
-    perror("setsockopt");
-    return 1;
+  // status
+  uint8_t status[4];
+  if (read_exact(client_fd, status, sizeof(status)) < 0) {
+    return -1;
   }
 
-  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-    perror("bind");
-    return 1;
+  // status
+  uint8_t req_bus_id[32];
+  if (read_exact(client_fd, req_bus_id, sizeof(req_bus_id)) < 0) {
+    return -1;
   }
 
-  if (listen(fd, SOMAXCONN) < 0) {
-    perror("listen");
-    return 1;
+  LOG("->\tBus Id: %.*s\n", (int)sizeof(req_bus_id), req_bus_id);
+
+  int index = -1;
+  for (int i = 0; i < num_devices; i++) {
+    if (strncmp((char *)req_bus_id, devices[i].bus_id, sizeof(req_bus_id)) == 0) index = i;
+  }
+  int expected = 0;
+  if (index < 0 || !atomic_compare_exchange_strong(&devices[index].attached, &expected, 1)) {
+    printf("<- OP_RET_IMPORT: no such device or already attached\n");
+    // version 273, reply code, status=1, without the device
+    uint8_t resp_error[] = {0x01, 0x11, 0x00, 0x03, 0x00, 0x00, 0x00, 0x01};
+    write_exact(client_fd, resp_error, sizeof(resp_error));
+    return -1;
+  }
+
+  LOG("<- OP_RET_IMPORT\n");
+  uint8_t resp_header[] = {
+      // version 273
+      0x01,
+      0x11,
+      // reply code
+      0x00,
+      0x03,
+      // status
+      0x00,
+      0x00,
+      0x00,
+      0x00,
+  };
+  uint8_t resp_body[] = {
+      // bus num
+      0x00,
+      0x00,
+      0x00,
+      0x01,
+      // dev num
+      0x00,
+      0x00,
+      0x00,
+      0x02,
+      // speed = high
+      0x00,
+      0x00,
+      0x00,
+      0x03,
+      // idVendor
+      LO(USBD_VID),
+      HI(USBD_VID),
+      // idProduct
+      LO(USBD_PID),
+      HI(USBD_PID),
+      // bcdDevice
+      0x00,
+      0x01,
+      // bDeviceClass
+      0x00,
+      // bDeviceSubClass
+      0x00,
+      // bDeviceProtocol
+      0x00,
+      // bConfigurationValue
+      0x01,
+      // bNumConfigurations
+      USBD_MAX_NUM_CONFIGURATION,
+      // bInterfaces
+      USBD_MAX_NUM_INTERFACES,
+  };
+  // dev num
+  resp_body[7] = index + 2;
+  struct iovec iov[] = {
+      {.iov_base = resp_header, .iov_len = sizeof(resp_header)},
+      {.iov_base = devices[index].path, .iov_len = sizeof(devices[index].path)},
+      {.iov_base = req_bus_id, .iov_len = sizeof(req_bus_id)},
+      {.iov_base = resp_body, .iov_len = sizeof(resp_body)},
+  };
+  if (writev_exact(client_fd, iov, sizeof(iov) / sizeof(iov[0])) < 0) {
+    atomic_store(&devices[index].attached, 0);
+    return -1;
+  }
+  return index;
+}
+
+// Runs the endpoint events of the current URB, called with host_irq_lock held
+static int submit_transfer(uint32_t ep) {
+  int direction_out = ntohl(current_cmd_submit_body.direction) == 0;
+
+  // control
+  if (endpoints[ep].type == USBD_EP_TYPE_CTRL) {
+    // control transfer
+    if (direction_out) {
+      // control out:
+      LOG("->CONTROL OUT\n");
+
+      // setup, out, in
+      LOG("->\tSETUP\n");
+      USBD_LL_SetupStage(&usb_device, current_cmd_submit_body.setup);
+
+      LOG("<-\tOUT\n");
+      if (endpoint_rx(ep) < 0) {
+        return -1;
+      }
+      USBD_LL_DataOutStage(&usb_device, ep, endpoints[ep].rx_buffer);
+
+      LOG("->\tIN\n");
+      USBD_LL_DataInStage(&usb_device, ep, NULL);
+      return endpoint_tx(ep);
+    } else {
+      // control in:
+      LOG("->CONTROL IN\n");
+
+      // setup, in, out
+      LOG("->\tSETUP\n");
+      USBD_LL_SetupStage(&usb_device, current_cmd_submit_body.setup);
+
+      LOG("->\tIN\n");
+      USBD_LL_DataInStage(&usb_device, ep, NULL);
+      int ret = endpoint_tx(ep);
+
+      LOG("<-\tOUT\n");
+      USBD_LL_DataOutStage(&usb_device, ep, endpoints[ep].rx_buffer);
+      return ret;
+    }
+  } else if (endpoints[ep].type == USBD_EP_TYPE_BULK) {
+    // bulk transfer
+    if (direction_out) {
+      // bulk out
+      LOG("->BULK OUT\n");
+
+      LOG("<-\tOUT\n");
+      if (endpoint_rx(ep) < 0) {
+        return -1;
+      }
+      USBD_LL_DataOutStage(&usb_device, ep, endpoints[ep].rx_buffer);
+
+      // zero length packet
+      return SendRetSubmit(NULL, 0);
+    } else {
+      // bulk in
+      LOG("->BULK IN\n");
+
+      LOG("<-\tIN\n");
+      int sent = endpoints[ep].tx_from != endpoints[ep].tx_to;
+      int ret = endpoint_tx(ep);
+      // the data has been copied out, complete the transfer so that the class may release its buffer (CCID_InEvent)
+      while (sent) {
+        endpoints[ep].zlp = 0;
+        USBD_LL_DataInStage(&usb_device, ep, NULL);
+        sent = endpoints[ep].zlp;
+      }
+      return ret;
+    }
+  } else if (endpoints[ep].type == USBD_EP_TYPE_INTR) {
+    // interrupt transfer
+    if (direction_out) {
+      // intr out
+      LOG("->INTR OUT\n");
+
+      LOG("->\tOUT\n");
+      if (endpoint_rx(ep) < 0) {
+        return -1;
+      }
+      USBD_LL_DataOutStage(&usb_device, ep, endpoints[ep].rx_buffer);
+
+      // zero length packet
+      return SendRetSubmit(NULL, 0);
+    } else {
+      // intr in, the transfers have been completed by USBD_LL_Transmit
+      LOG("->INTR IN\n");
+
+      LOG("<-\tIN\n");
+      return endpoint_tx(ep);
+    }
+  }
+  return 0;
+}
+
+int cmd_submit(void) {
+  LOG("-> OP_CMD_SUBMIT\n");
+
+  // body
+  if (read_exact(client_fd, (uint8_t *)&current_cmd_submit_body, sizeof(current_cmd_submit_body)) < 0) {
+    return -1;
+  }
+
+  uint32_t ep = ntohl(current_cmd_submit_body.ep);
+  if (ep >= MAX_ENDPOINTS) {
+    printf("error endpoint %u\n", ep);
+    return -1;
+  }
+  LOG("\tEndpoint: %u with type %hhu\n", ep, endpoints[ep].type);
+  // print setup bytes
+  LOG("\tSetup:");
+  log_hex(current_cmd_submit_body.setup, 8);
+
+  host_main_lock();
+  device_loop();
+  // the host retries an OUT transfer NAKed by an endpoint the class has not prepared, until the card makes room
+  while (ntohl(current_cmd_submit_body.direction) == 0 && endpoints[ep].type != USBD_EP_TYPE_CTRL &&
+         !endpoints[ep].rx_armed)
+    device_loop();
+  host_main_unlock();
+  host_irq_lock();
+  int ret = submit_transfer(ep);
+  host_irq_unlock();
+  return ret;
+}
+
+int cmd_unlink(void) {
+  struct CmdUnlinkBody cmd;
+  if (read_exact(client_fd, (uint8_t *)&cmd, sizeof(cmd)) < 0) {
+    return -1;
+  }
+  LOG("-> OP_CMD_UNLINK %u\n", ntohl(cmd.unlink_seq_num));
+
+  // URBs complete before the next command is read, the one to unlink has already been given back
+  struct {
+    uint32_t command;
+    struct RetUnlinkBody body;
+  } ret;
+  memset(&ret, 0, sizeof(ret));
+  ret.command = htonl(USBIP_RET_UNLINK);
+  ret.body.seq_num = cmd.seq_num;
+  ret.body.status = 0;
+  LOG("<- RET_UNLINK\n");
+  return write_exact(client_fd, (uint8_t *)&ret, sizeof(ret));
+}
+
+// Serves the attached client until it disconnects, running device_loop while the host is quiet
+void serve_client(void) {
+  while (1) {
+    apply_touch_toggles();
+    if (rx_stream_pos == rx_stream_len) {
+      struct pollfd pfd = {.fd = client_fd, .events = POLLIN};
+      int res = poll(&pfd, 1, IDLE_LOOP_INTERVAL);
+      if (res < 0) {
+        perror("poll");
+        return;
+      }
+      if (res == 0) {
+        host_main_lock();
+        device_loop();
+        host_main_unlock();
+        continue;
+      }
+    }
+
+    LOG("reading command\n");
+    uint8_t command[4];
+    if (read_exact(client_fd, command, sizeof(command)) < 0) {
+      return;
+    }
+
+    int ret;
+    if (command[0] == 0x00 && command[1] == 0x00 && command[2] == 0x00 && command[3] == USBIP_CMD_SUBMIT) {
+      ret = cmd_submit();
+    } else if (command[0] == 0x00 && command[1] == 0x00 && command[2] == 0x00 && command[3] == USBIP_CMD_UNLINK) {
+      ret = cmd_unlink();
+    } else {
+      // the stream cannot be resynchronized
+      printf("unknown command\n");
+      ret = -1;
+    }
+    if (ret < 0) return;
   }
+}
+
+// Answers OP_REQ_DEVLIST and OP_REQ_IMPORT, and hands the imported connections to the threads of the devices
+void *accept_clients(void *arg) {
+  int fd = *(int *)arg;
+  while (1) {
+    struct sockaddr_storage client_addr;
+    socklen_t sock_len = sizeof(client_addr);
+    client_fd = accept(fd, (struct sockaddr *)&client_addr, &sock_len);
+    if (client_fd < 0) {
+      perror("accept");
+      exit(1);
+    }
+    if (setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int)) < 0) {
+      perror("setsockopt");
+      exit(1);
+    }
+    printf("got connection\n");
+    rx_stream_pos = rx_stream_len = 0;
 
-  printf("listening on 0.0.0.0:3240\n");
+    int index = -1;
+    uint8_t command[4];
+    while (index < 0 && read_exact(client_fd, command, sizeof(command)) == 0) {
+      if (command[2] == 0x80 && command[3] == 0x05) {
+        // REQ_DEVLIST
+        if (op_req_devlist() < 0) break;
+      } else if (command[2] == 0x80 && command[3] == 0x03) {
+        // REQ_IMPORT
+        index = op_req_import();
+        if (index < 0) break;
+      } else {
+        printf("unknown command\n");
+        break;
+      }
+    }
 
+    // the host waits for OP_RET_IMPORT before submitting, nothing can be left in our stream buffer
+    if (index >= 0 && rx_stream_pos == rx_stream_len) {
+      printf("attaching %s\n", devices[index].bus_id);
+      if (write(devices[index].handover[1], &client_fd, sizeof(client_fd)) == sizeof(client_fd)) continue;
+      atomic_store(&devices[index].attached, 0);
+    }
+    printf("closing connection\n");
+    close(client_fd);
+  }
+  return NULL;
+}
+
+void init_card(const char *lfs_root) {
   // init usb stack
   usb_device_init();
-  card_fabrication_procedure("/tmp/lfs-root");
+  card_fabrication_procedure(lfs_root);
   // set address to 1
   uint8_t set_address[] = {0x00, 0x05, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00};
   USBD_LL_SetupStage(&usb_device, set_address);
-  // disable stdout buffer
-  setvbuf(stdout, NULL, _IONBF, 0);
   // unlimited max packet for ep0
   usb_device.ep_in[0].maxpacket = -1;
   usb_device.ep_out[0].maxpacket = -1;
@@ -312,349 +843,138 @@ int main() {
   capdu->ins = OATH_INS_SET_DEFAULT;
   capdu->lc = sizeof(data2);
   oath_process_apdu(capdu, rapdu);
+}
+
+// Runs one card on the calling thread, the card state is thread-local unless built with HOST_THREADS
+void *run_device(void *arg) {
+  current_device = arg;
+  host_main_lock();
+  init_card(current_device->lfs_root);
+  host_main_unlock();
 
   while (1) {
-    struct sockaddr_storage client_addr;
-    socklen_t sock_len = sizeof(client_addr);
-    client_fd = accept(fd, (struct sockaddr *)&client_addr, &sock_len);
-    if (client_fd < 0) {
-      perror("accept");
-      return 1;
+    apply_touch_toggles();
+    struct pollfd pfd = {.fd = current_device->handover[0], .events = POLLIN};
+    int res = poll(&pfd, 1, IDLE_LOOP_INTERVAL);
+    if (res < 0) {
+      perror("poll");
+      exit(1);
     }
-    if (setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int)) < 0) {
-      perror("setsockopt");
+    if (res == 0) {
+      host_main_lock();
+      device_loop();
+      host_main_unlock();
+      continue;
+    }
+    if (read(current_device->handover[0], &client_fd, sizeof(client_fd)) != sizeof(client_fd)) {
+      perror("read");
+      exit(1);
+    }
+
+    rx_stream_pos = rx_stream_len = 0;
+    serve_client();
+
+    printf("closing connection of %s\n", current_device->bus_id);
+    close(client_fd);
+    client_fd = -1;
+    atomic_store(&current_device->attached, 0);
+  }
+  return NULL;
+}
+
+int main(int argc, char **argv) {
+  int fd, opt;
+
+  while ((opt = getopt(argc, argv, "fn:")) != -1) {
+    if (opt == 'f') {
+      verbose = 0;
+    } else if (opt == 'n' && atoi(optarg) >= 1 && atoi(optarg) <= MAX_DEVICES) {
+      num_devices = atoi(optarg);
+    } else {
+      fprintf(stderr,
+              "Usage: %s [-f] [-n devices]\n"
+              "  -f  fast mode, no per-URB logging\n"
+              "  -n  number of exported devices, 1 to %d, each with its own littlefs image\n",
+              argv[0], MAX_DEVICES);
       return 1;
     }
-    printf("got connection\n");
+  }
 
-    while (1) {
-      printf("reading command\n");
-      uint8_t command[4];
-      if (read_exact(client_fd, command, sizeof(command)) < 0) {
-        break;
-      }
+#ifdef HOST_THREADS
+  // the state of the device is shared by all the threads
+  if (num_devices > 1) {
+    fprintf(stderr, "only one device can be exported when built with ENABLE_HOST_THREADS\n");
+    return 1;
+  }
+#endif
 
-      if (command[2] == 0x80 && command[3] == 0x05) {
-        // REQ_DEVLIST
-        printf("-> OP_REQ_DEVLIST\n");
-
-        // status
-        uint8_t status[4];
-        if (read_exact(client_fd, status, sizeof(status)) < 0) {
-          break;
-        }
-
-        printf("<- OP_RET_DEVLIST\n");
-        // resp
-        uint8_t resp_header[] = {
-            // version 273
-            0x01,
-            0x11,
-            // reply code
-            0x00,
-            0x05,
-            // status
-            0x00,
-            0x00,
-            0x00,
-            0x00,
-            // number of exported devices=1
-            0x00,
-            0x00,
-            0x00,
-            0x01,
-        };
-        if (write_exact(client_fd, resp_header, sizeof(resp_header)) < 0) {
-          break;
-        }
-
-        if (write_exact(client_fd, path, sizeof(path)) < 0) {
-          break;
-        }
-
-        if (write_exact(client_fd, bus_id, sizeof(bus_id)) < 0) {
-          break;
-        }
-
-        uint8_t resp_body[] = {
-            // bus num
-            0x00,
-            0x00,
-            0x00,
-            0x01,
-            // dev num
-            0x00,
-            0x00,
-            0x00,
-            0x02,
-            // speed = high
-            0x00,
-            0x00,
-            0x00,
-            0x03,
-            // idVendor
-            LO(USBD_VID),
-            HI(USBD_VID),
-            // idProduct
-            LO(USBD_PID),
-            HI(USBD_PID),
-            // bcdDevice
-            0x00,
-            0x01,
-            // bDeviceClass
-            0x00,
-            // bDeviceSubClass
-            0x00,
-            // bDeviceProtocol
-            0x00,
-            // bConfigurationValue
-            0x01,
-            // bNumConfigurations
-            USBD_MAX_NUM_CONFIGURATION,
-            // bInterfaces
-            USBD_MAX_NUM_INTERFACES,
-            // interface 1
-            // bInterfaceClass
-            0x03,
-            // bInterfaceSubClass
-            0x00,
-            // bInterfaceProtocol
-            0x00,
-            // bPadding
-            0x00,
-            // interface 2
-            // bInterfaceClass
-            0x03,
-            // bInterfaceSubClass
-            0x00,
-            // bInterfaceProtocol
-            0x00,
-            // bPadding
-            0x00,
-            // interface 3
-            // bInterfaceClass
-            0xFF,
-            // bInterfaceSubClass
-            0xFF,
-            // bInterfaceProtocol
-            0xFF,
-            // bPadding
-            0x00,
-            // interface 4
-            // bInterfaceClass
-            0x0B,
-            // bInterfaceSubClass
-            0x00,
-            // bInterfaceProtocol
-            0x00,
-            // bPadding
-            0x00,
-        };
-        if (write_exact(client_fd, resp_body, sizeof(resp_body)) < 0) {
-          break;
-        }
-      } else if (command[2] == 0x80 && command[3] == 0x03) {
-        // REQ_IMPORT
-        printf("-> OP_REQ_IMPORT\n");
-
-        // status
-        uint8_t status[4];
-        if (read_exact(client_fd, status, sizeof(status)) < 0) {
-          break;
-        }
-
-        // status
-        uint8_t bus_id[32];
-        if (read_exact(client_fd, bus_id, sizeof(bus_id)) < 0) {
-          break;
-        }
-
-        printf("->\tBus Id: %s\n", bus_id);
-
-        printf("<- OP_RET_IMPORT\n");
-        uint8_t resp_header[] = {
-            // version 273
-            0x01,
-            0x11,
-            // reply code
-            0x00,
-            0x03,
-            // status
-            0x00,
-            0x00,
-            0x00,
-            0x00,
-        };
-        if (write_exact(client_fd, resp_header, sizeof(resp_header)) < 0) {
-          break;
-        }
-
-        if (write_exact(client_fd, path, sizeof(path)) < 0) {
-          break;
-        }
-
-        if (write_exact(client_fd, bus_id, sizeof(bus_id)) < 0) {
-          break;
-        }
-
-        uint8_t resp_body[] = {
-            // bus num
-            0x00,
-            0x00,
-            0x00,
-            0x01,
-            // dev num
-            0x00,
-            0x00,
-            0x00,
-            0x02,
-            // speed = high
-            0x00,
-            0x00,
-            0x00,
-            0x03,
-            // idVendor
-            LO(USBD_VID),
-            HI(USBD_VID),
-            // idProduct
-            LO(USBD_PID),
-            HI(USBD_PID),
-            // bcdDevice
-            0x00,
-            0x01,
-            // bDeviceClass
-            0x00,
-            // bDeviceSubClass
-            0x00,
-            // bDeviceProtocol
-            0x00,
-            // bConfigurationValue
-            0x01,
-            // bNumConfigurations
-            USBD_MAX_NUM_CONFIGURATION,
-            // bInterfaces
-            USBD_MAX_NUM_INTERFACES,
-        };
-        if (write_exact(client_fd, resp_body, sizeof(resp_body)) < 0) {
-          break;
-        }
-      } else if (command[0] == 0x00 && command[1] == 0x00 && command[2] == 0x00 && command[3] == 0x01) {
-        // CMD_SUBMIT
-        printf("-> OP_CMD_SUBMIT\n");
-
-        // body
-        if (read_exact(client_fd, (uint8_t *)&current_cmd_submit_body, sizeof(current_cmd_submit_body)) < 0) {
-          break;
-        }
-
-        uint32_t ep = ntohl(current_cmd_submit_body.ep);
-        printf("\tEndpoint: %u with type %hhu\n", ep, endpoints[ep].type);
-        // print setup bytes
-        printf("\tSetup:");
-        for (int i = 0; i < 8; i++) {
-          printf(" %02X", current_cmd_submit_body.setup[i]);
-        }
-        printf("\n");
+  signal(SIGINT, sigint_handler);
+  trace_dump_on_exit();
 
-        device_loop();
+  fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) {
+    perror("socket");
+    return 1;
+  }
 
-        int direction_out = ntohl(current_cmd_submit_body.direction) == 0;
-
-        // control
-        if (endpoints[ep].type == USBD_EP_TYPE_CTRL) {
-          // control transfer
-          if (direction_out) {
-            // control out:
-            printf("->CONTROL OUT\n");
-
-            // setup, out, in
-            printf("->\tSETUP\n");
-            USBD_LL_SetupStage(&usb_device, current_cmd_submit_body.setup);
-
-            printf("<-\tOUT\n");
-            uint32_t transfer_buffer_length = ntohl(current_cmd_submit_body.transfer_buffer_length);
-            uint8_t *transfer_buffer = endpoints[ep].rx_buffer;
-            printf("\tTransfer buffer: %u bytes\n\t", transfer_buffer_length);
-            if (read_exact(client_fd, transfer_buffer, transfer_buffer_length) < 0) {
-              break;
-            }
-            for (int i = 0; i < transfer_buffer_length; i++) {
-              printf(" %02X", transfer_buffer[i]);
-            }
-            printf("\n");
-            endpoints[ep].rx_size = transfer_buffer_length;
-            USBD_LL_DataOutStage(&usb_device, ep, endpoints[ep].rx_buffer);
-
-            printf("->\tIN\n");
-            USBD_LL_DataInStage(&usb_device, ep, NULL);
-            endpoint_tx(ep);
-
-          } else {
-            // control in:
-            printf("->CONTROL IN\n");
-
-            // setup, in, out
-            printf("->\tSETUP\n");
-            USBD_LL_SetupStage(&usb_device, current_cmd_submit_body.setup);
-
-            printf("->\tIN\n");
-            USBD_LL_DataInStage(&usb_device, ep, NULL);
-            endpoint_tx(ep);
-
-            printf("<-\tOUT\n");
-            USBD_LL_DataOutStage(&usb_device, ep, endpoints[ep].rx_buffer);
-          }
-        } else if (endpoints[ep].type == USBD_EP_TYPE_BULK) {
-          // bulk transfer
-          if (direction_out) {
-            // bulk out
-            printf("->BULK OUT\n");
-
-            printf("<-\tOUT\n");
-            endpoint_rx(ep);
-            USBD_LL_DataOutStage(&usb_device, ep, endpoints[ep].rx_buffer);
-
-            // zero length packet
-            SendRetSubmit(NULL, 0);
-          } else {
-            // bulk in
-            printf("->BULK IN\n");
-
-            printf("<-\tIN\n");
-            endpoint_tx(ep);
-          }
-        } else if (endpoints[ep].type == USBD_EP_TYPE_INTR) {
-          // interrupt transfer
-          if (direction_out) {
-            // intr out
-            printf("->INTR OUT\n");
-
-            printf("->\tOUT\n");
-            endpoint_rx(ep);
-            USBD_LL_DataOutStage(&usb_device, ep, endpoints[ep].rx_buffer);
-
-            // zero length packet
-            SendRetSubmit(NULL, 0);
-          } else {
-            // intr in
-            printf("->INTR IN\n");
-
-            printf("<-\tIN\n");
-            USBD_LL_DataInStage(&usb_device, ep, NULL);
-            endpoint_tx(ep);
-          }
-        }
-
-      } else if (command[0] == 0x00 && command[1] == 0x00 && command[2] == 0x00 && command[3] == 0x02) {
-        // CMD_UNLINK
-        printf("-> OP_CMD_UNLINK\n");
-      } else {
-        printf("unknown command\n");
-      }
+  struct sockaddr_in addr;
+  bzero(&addr, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = INADDR_ANY;
+  addr.sin_port = htons(3240);
+
+  if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int)) < 0) {
+    perror("setsockopt");
+    return 1;
+  }
+
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    perror("bind");
+    return 1;
+  }
+
+  if (listen(fd, SOMAXCONN) < 0) {
+    perror("listen");
+    return 1;
+  }
+
+  // disable stdout buffer, unless the output is quiet anyway
+  if (verbose) setvbuf(stdout, NULL, _IONBF, 0);
+
+  // bus ids 1-1, 1-2, ..., the first device keeps the littlefs image of the single device setup
+  for (int i = 0; i < num_devices; i++) {
+    snprintf(devices[i].bus_id, sizeof(devices[i].bus_id), "1-%d", i + 1);
+    snprintf(devices[i].path, sizeof(devices[i].path), "/sys/device/pci0000:00/0000:00:01.2/usb1/1-%d", i + 1);
+    if (i == 0)
+      snprintf(devices[i].lfs_root, sizeof(devices[i].lfs_root), "/tmp/lfs-root");
+    else
+      snprintf(devices[i].lfs_root, sizeof(devices[i].lfs_root), "/tmp/lfs-root-%d", i + 1);
+    if (pipe(devices[i].handover) < 0) {
+      perror("pipe");
+      return 1;
     }
-    printf("closing connection\n");
+  }
 
-    close(client_fd);
+  // Ctrl-C is handled on this thread, which runs the first device, so the trace written at exit is its own
+  sigset_t sigint, old_mask;
+  sigemptyset(&sigint);
+  sigaddset(&sigint, SIGINT);
+  pthread_sigmask(SIG_BLOCK, &sigint, &old_mask);
+  pthread_t acceptor;
+  if (pthread_create(&acceptor, NULL, accept_clients, &fd) != 0) {
+    fprintf(stderr, "failed to start the acceptor\n");
+    return 1;
   }
+  for (int i = 1; i < num_devices; i++) {
+    if (pthread_create(&devices[i].thread, NULL, run_device, &devices[i]) != 0) {
+      fprintf(stderr, "failed to start device %s\n", devices[i].bus_id);
+      return 1;
+    }
+  }
+  pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+  printf("listening on 0.0.0.0:3240 with %d device(s)\n", num_devices);
+
+  run_device(&devices[0]);
   return 0;
-}
\ No newline at end of file
+}